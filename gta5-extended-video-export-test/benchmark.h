@@ -0,0 +1,40 @@
+#pragma once
+
+// Micro benchmarks for the encoder building blocks. They only depend on the
+// standard library and the headers under test, so they also build outside of
+// Visual Studio. Run the test executable with the benchmark name as argument.
+
+#include <cstdint>
+#include <vector>
+
+void benchmarkQueues();
+
+// Runs the BGRA to YUV kernels of every instruction set the CPU supports.
+// Fails when a kernel differs from the scalar one or when the scalar one is
+// further than one step off the exact BT.601 result, and when the CPU reference
+// of the GPU conversion differs from the scalar kernel.
+int benchmarkConversion();
+
+// Accumulates and averages sub-frames with the motion blur kernels of every
+// instruction set the CPU supports, and times them. Fails when an average
+// differs from the integer division the blur stage used to do, or when averaging
+// and converting in one pass loses precision. Also checks the half float averages
+// of the OpenEXR output, the sub-frames adaptive sampling picks, and the vectors
+// and blur of the optical flow motion blur.
+int benchmarkMotionBlur();
+
+// Interpolates frames of a moving pattern and times it at 1080p and 4K. Fails
+// when the frames in between are further than a step off the pattern where it
+// really was, or when the SIMD kernels differ from a plain loop.
+int benchmarkInterpolation();
+
+// Checks the order a Readback::Ring copies and reads frames in on a device that
+// runs on the CPU, and simulates the export frame rate at each ring latency.
+// Fails when a frame is read before it is ready, later than the latency allows,
+// out of order, or not at all.
+int benchmarkReadback();
+
+// BGRA frame of smooth noise with a feature every 8 pixels, sampled at
+// x - shiftX, y - shiftY, so that frames of a moving pattern have no edges
+// coming into view.
+std::vector<uint8_t> createMovingFrame(uint32_t width, uint32_t height, int shiftX, int shiftY);
@@ -0,0 +1,906 @@
+#include "benchmark.h"
+#include "../gta5-extended-video-export/motion-blur.h"
+#include "../gta5-extended-video-export/adaptive-sampling.h"
+#include "../gta5-extended-video-export/optical-flow.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <valarray>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+namespace {
+	std::vector<uint8_t> createFrame(size_t length, uint32_t seed) {
+		std::vector<uint8_t> frame(length);
+		for (auto& value : frame) {
+			seed = seed * 1664525 + 1013904223;
+			value = (uint8_t)(seed >> 24);
+		}
+		// Saturated bytes so that the largest sums are covered too.
+		std::fill(frame.begin(), frame.begin() + length / 8, 255);
+		return frame;
+	}
+
+	// The valarray accumulation the blur stage did before, for sample counts it handles.
+	std::vector<uint8_t> averageWithValarray(const std::vector<std::vector<uint8_t>>& frames, uint32_t samples) {
+		const size_t length = frames[0].size();
+		std::valarray<uint16_t> sum(length);
+		std::valarray<uint16_t> temp(length);
+		for (uint32_t i = 0; i < samples; i++) {
+			const std::vector<uint8_t>& frame = frames[i % frames.size()];
+			std::copy(frame.begin(), frame.end(), std::begin(temp));
+			if (i == 0) {
+				sum = temp;
+			} else {
+				sum += temp;
+			}
+		}
+		sum /= (uint16_t)samples;
+		return std::vector<uint8_t>(std::begin(sum), std::end(sum));
+	}
+
+	// Plain 32 bit sums and divisions, for any sample count.
+	std::vector<uint8_t> averageWithDivision(const std::vector<std::vector<uint8_t>>& frames, uint32_t samples) {
+		const size_t length = frames[0].size();
+		std::vector<uint32_t> sum(length, 0);
+		for (uint32_t i = 0; i < samples; i++) {
+			const std::vector<uint8_t>& frame = frames[i % frames.size()];
+			for (size_t j = 0; j < length; j++) {
+				sum[j] += frame[j];
+			}
+		}
+		std::vector<uint8_t> result(length);
+		for (size_t j = 0; j < length; j++) {
+			result[j] = (uint8_t)(sum[j] / samples);
+		}
+		return result;
+	}
+
+	// Plain 32 bit weighted sums and divisions, for a shutter schedule.
+	std::vector<uint8_t> averageWithWeights(const std::vector<std::vector<uint8_t>>& frames, const MotionBlur::ShutterSchedule& schedule) {
+		const size_t length = frames[0].size();
+		std::vector<uint32_t> sum(length, 0);
+		for (uint32_t i = 0; i < schedule.getSubFrameCount(); i++) {
+			const std::vector<uint8_t>& frame = frames[i % frames.size()];
+			for (size_t j = 0; j < length; j++) {
+				sum[j] += frame[j] * schedule.getWeight(i);
+			}
+		}
+		std::vector<uint8_t> result(length);
+		for (size_t j = 0; j < length; j++) {
+			result[j] = (uint8_t)(sum[j] / schedule.getTotalWeight());
+		}
+		return result;
+	}
+
+	// Weighted shutters against plain weighted averages, and the cost of a weighted sub-frame.
+	int checkShutterProfiles(ColorConversion::Isa bestIsa, const std::vector<std::vector<uint8_t>>& checkFrames, const std::vector<std::vector<uint8_t>>& frames) {
+		const struct {
+			const char* name;
+			MotionBlur::Profile profile;
+			std::vector<float> weights;
+		} shutters[] = {
+			{ "triangle", MotionBlur::PROFILE_TRIANGLE, {} },
+			{ "gaussian", MotionBlur::PROFILE_GAUSSIAN, {} },
+			{ "custom 1,4,1", MotionBlur::PROFILE_CUSTOM, { 1.0f, 4.0f, 1.0f } },
+		};
+		const size_t checkLength = checkFrames[0].size();
+		const size_t length = frames[0].size();
+		int failures = 0;
+
+		for (const auto& shutter : shutters) {
+			MotionBlur::ShutterSchedule schedule;
+			schedule.reset(7, 0.0f, shutter.profile, shutter.weights);
+			std::cout << "Shutter " << shutter.name << ", weights";
+			for (uint32_t i = 0; i < schedule.getSubFrameCount(); i++) {
+				std::cout << " " << schedule.getWeight(i);
+			}
+			std::cout << std::endl;
+			failures += (schedule.getProfile() == shutter.profile) && (schedule.getTotalWeight() == MotionBlur::ShutterSchedule::WEIGHT_SCALE) ? 0 : 1;
+
+			std::vector<uint8_t> expected = averageWithWeights(checkFrames, schedule);
+			for (int isa = ColorConversion::ISA_SCALAR; isa <= bestIsa; isa++) {
+				if (isa == ColorConversion::ISA_SSE41) {
+					continue;
+				}
+
+				MotionBlur::Accumulator accumulator;
+				accumulator.reset(checkLength, schedule.getTotalWeight(), (ColorConversion::Isa)isa);
+				if (accumulator.getIsa() != isa) {
+					continue;
+				}
+				std::vector<uint8_t> actual(checkLength);
+				for (uint32_t i = 0; i < schedule.getSubFrameCount(); i++) {
+					accumulator.add(checkFrames[i % checkFrames.size()].data(), schedule.getWeight(i));
+				}
+				accumulator.resolve(actual.data());
+				const bool isExact = actual == expected;
+				failures += isExact ? 0 : 1;
+
+				// Weighted and unweighted sub-frames, on sums of the same width.
+				std::vector<uint8_t> output(length);
+				accumulator.reset(length, schedule.getTotalWeight(), (ColorConversion::Isa)isa);
+				uint64_t weightedCycles = UINT64_MAX;
+				uint64_t plainCycles = UINT64_MAX;
+				for (int iteration = 0; iteration < 3; iteration++) {
+					uint64_t start = __rdtsc();
+					for (uint32_t i = 0; i < 4; i++) {
+						accumulator.add(frames[i].data(), 3);
+					}
+					weightedCycles = (std::min)(weightedCycles, (uint64_t)(__rdtsc() - start) / 4);
+					start = __rdtsc();
+					for (uint32_t i = 0; i < 4; i++) {
+						accumulator.add(frames[i].data());
+					}
+					plainCycles = (std::min)(plainCycles, (uint64_t)(__rdtsc() - start) / 4);
+					accumulator.resolve(output.data());
+				}
+
+				std::cout << "  " << std::left << std::setw(10) << ColorConversion::getIsaName(accumulator.getIsa()) << std::right
+					<< std::fixed << std::setprecision(2)
+					<< std::setw(8) << weightedCycles / 1e6 << " Mcycles per weighted sub-frame,"
+					<< std::setw(8) << plainCycles / 1e6 << " Mcycles unweighted"
+					<< (isExact ? "" : "  (differs from the division)") << std::endl;
+			}
+		}
+		return failures;
+	}
+
+	// Weighted average in linear light with doubles, rounded back to sRGB.
+	std::vector<uint8_t> averageInLinearLight(const std::vector<std::vector<uint8_t>>& frames, const MotionBlur::ShutterSchedule& schedule) {
+		const size_t length = frames[0].size();
+		std::vector<double> sum(length, 0.0);
+		for (uint32_t i = 0; i < schedule.getSubFrameCount(); i++) {
+			const std::vector<uint8_t>& frame = frames[i % frames.size()];
+			for (size_t j = 0; j < length; j++) {
+				const double value = frame[j] / 255.0;
+				sum[j] += schedule.getWeight(i) * (value <= 0.04045 ? value / 12.92 : std::pow((value + 0.055) / 1.055, 2.4));
+			}
+		}
+		std::vector<uint8_t> result(length);
+		for (size_t j = 0; j < length; j++) {
+			const double value = sum[j] / schedule.getTotalWeight();
+			result[j] = (uint8_t)std::lround(255.0 * (value <= 0.0031308 ? value * 12.92 : 1.055 * std::pow(value, 1 / 2.4) - 0.055));
+		}
+		return result;
+	}
+
+	// Linear light averages against doubles, frames that don't move against themselves, and the
+	// cost of a linear light sub-frame against a plain one.
+	int checkLinearLight(ColorConversion::Isa bestIsa, const std::vector<std::vector<uint8_t>>& checkFrames, const std::vector<std::vector<uint8_t>>& frames) {
+		const size_t checkLength = checkFrames[0].size();
+		const size_t length = frames[0].size();
+		int failures = 0;
+
+		std::cout << "Linear light motion blur" << std::endl;
+		// 16 sub-frames are the most 16 bit sums take, triangle shutters always need 32 bits.
+		for (uint32_t samples : { 3u, 15u, 32u }) {
+			for (MotionBlur::Profile profile : { MotionBlur::PROFILE_BOX, MotionBlur::PROFILE_TRIANGLE }) {
+				MotionBlur::ShutterSchedule schedule;
+				schedule.reset(samples, 0.0f, profile);
+				std::vector<uint8_t> expected = averageInLinearLight(checkFrames, schedule);
+				std::vector<uint8_t> scalarResult;
+				std::cout << std::setw(4) << schedule.getSubFrameCount() << (profile == MotionBlur::PROFILE_BOX ? " box     " : " triangle");
+
+				for (int isa = ColorConversion::ISA_SCALAR; isa <= bestIsa; isa++) {
+					if (isa == ColorConversion::ISA_SSE41) {
+						continue;
+					}
+
+					MotionBlur::Accumulator accumulator;
+					accumulator.reset(checkLength, schedule.getTotalWeight(), (ColorConversion::Isa)isa, 1, true);
+					if (accumulator.getIsa() != isa) {
+						continue;
+					}
+					std::vector<uint8_t> actual(checkLength);
+					for (uint32_t i = 0; i < schedule.getSubFrameCount(); i++) {
+						accumulator.add(checkFrames[i % checkFrames.size()].data(), schedule.getWeight(i));
+					}
+					accumulator.resolve(actual.data());
+
+					std::vector<uint8_t> still(checkLength);
+					for (uint32_t i = 0; i < schedule.getSubFrameCount(); i++) {
+						accumulator.add(checkFrames[0].data(), schedule.getWeight(i));
+					}
+					accumulator.resolve(still.data());
+					failures += still == checkFrames[0] ? 0 : 1;
+
+					if (isa == ColorConversion::ISA_SCALAR) {
+						scalarResult = actual;
+						int largestError = 0;
+						for (size_t j = 0; j < checkLength; j++) {
+							largestError = (std::max)(largestError, std::abs((int)actual[j] - (int)expected[j]));
+						}
+						failures += largestError <= 1 ? 0 : 1;
+						std::cout << (accumulator.isWide() ? ", 32 bit sums" : ", 16 bit sums") << ", max error " << largestError;
+					} else if (actual != scalarResult) {
+						failures++;
+						std::cout << ", " << ColorConversion::getIsaName(accumulator.getIsa()) << " differs from scalar";
+					}
+					if (still != checkFrames[0]) {
+						std::cout << ", " << ColorConversion::getIsaName(accumulator.getIsa()) << " changes still frames";
+					}
+				}
+				std::cout << std::endl;
+			}
+		}
+
+		// Plain and linear light sub-frames, 8 of them so that both use 16 bit sums. AVX2 is
+		// timed too when there is something better. It has no table permutes and keeps the
+		// scalar lookup, which is why the encoder only blends in linear light with AVX-512.
+		std::vector<ColorConversion::Isa> isas = { ColorConversion::ISA_SCALAR };
+		if (bestIsa > ColorConversion::ISA_AVX2) {
+			isas.push_back(ColorConversion::ISA_AVX2);
+		}
+		isas.push_back(bestIsa);
+		for (ColorConversion::Isa isa : isas) {
+			uint64_t cycles[2];
+			bool isWide[2];
+			for (int isLinear = 0; isLinear < 2; isLinear++) {
+				MotionBlur::Accumulator accumulator;
+				accumulator.reset(length, 8, isa, 1, isLinear != 0);
+				std::vector<uint8_t> output(length);
+				cycles[isLinear] = UINT64_MAX;
+				isWide[isLinear] = accumulator.isWide();
+				for (int iteration = 0; iteration < 3; iteration++) {
+					uint64_t start = __rdtsc();
+					for (uint32_t i = 0; i < 8; i++) {
+						accumulator.add(frames[i % frames.size()].data());
+					}
+					cycles[isLinear] = (std::min)(cycles[isLinear], (uint64_t)(__rdtsc() - start) / 8);
+					accumulator.resolve(output.data());
+				}
+			}
+			std::cout << "  " << std::left << std::setw(10) << ColorConversion::getIsaName(isa) << std::right
+				<< std::fixed << std::setprecision(2)
+				<< std::setw(8) << cycles[1] / 1e6 << " Mcycles per linear light sub-frame,"
+				<< std::setw(8) << cycles[0] / 1e6 << " Mcycles plain, "
+				<< (double)cycles[1] / cycles[0] << "x" << (isWide[0] != isWide[1] ? ", not the same sums" : "") << std::endl;
+		}
+		return failures;
+	}
+
+	// Bands on several threads against one thread, and the time of a 4K frame of 16 sub-frames
+	// from 1 thread up to one per core.
+	int checkBlurScaling(ColorConversion::Isa bestIsa, const std::vector<std::vector<uint8_t>>& checkFrames) {
+		const int width = 3840;
+		const int height = 2160;
+		const size_t length = (size_t)width * height * 4;
+		const uint32_t subFrames = 16;
+		const size_t checkLength = checkFrames[0].size();
+		int failures = 0;
+
+		std::vector<uint8_t> expected(checkLength);
+		std::vector<uint8_t> actual(checkLength);
+		MotionBlur::Accumulator accumulator;
+		accumulator.reset(checkLength, subFrames, bestIsa);
+		for (uint32_t i = 0; i < subFrames; i++) {
+			accumulator.add(checkFrames[i % checkFrames.size()].data());
+		}
+		accumulator.resolve(expected.data());
+		for (uint32_t threads : { 2u, 3u, 7u }) {
+			accumulator.reset(checkLength, subFrames, bestIsa, threads);
+			for (uint32_t i = 0; i < subFrames; i++) {
+				accumulator.add(checkFrames[i % checkFrames.size()].data());
+			}
+			accumulator.resolve(actual.data());
+			failures += actual == expected ? 0 : 1;
+		}
+
+		std::vector<std::vector<uint8_t>> frames;
+		for (uint32_t i = 0; i < 4; i++) {
+			frames.push_back(createFrame(length, i + 1));
+		}
+		std::vector<uint8_t> output(length);
+		const uint32_t cores = (std::max)(1u, std::thread::hardware_concurrency());
+		std::cout << "Motion blur at " << width << "x" << height << ", " << subFrames << " sub-frames per frame" << (failures ? ", bands differ from one thread" : "") << std::endl;
+		uint64_t singleCycles = 0;
+		for (uint32_t threads = 1; threads <= (std::min)(cores, 16u); threads++) {
+			accumulator.reset(length, subFrames, bestIsa, threads);
+			uint64_t cycles = UINT64_MAX;
+			for (int iteration = 0; iteration < 3; iteration++) {
+				uint64_t start = __rdtsc();
+				for (uint32_t i = 0; i < subFrames; i++) {
+					accumulator.add(frames[i % frames.size()].data());
+				}
+				accumulator.resolve(output.data());
+				cycles = (std::min)(cycles, (uint64_t)(__rdtsc() - start));
+			}
+			singleCycles = threads == 1 ? cycles : singleCycles;
+			std::cout << "  " << std::setw(2) << threads << " threads"
+				<< std::fixed << std::setprecision(2)
+				<< std::setw(9) << cycles / 1e6 << " Mcycles per frame,"
+				<< std::setw(6) << (double)singleCycles / cycles << "x" << std::endl;
+		}
+		return failures;
+	}
+
+	// Half floats with exponents from 2^-8 to 2^7, the range HDR colours are in, and either sign.
+	std::vector<uint16_t> createHalfFrame(size_t count, uint32_t seed) {
+		std::vector<uint16_t> frame(count);
+		for (auto& value : frame) {
+			seed = seed * 1664525 + 1013904223;
+			const uint32_t exponent = 7 + (seed >> 28);
+			value = (uint16_t)(((seed >> 16) & 0x8000) | (exponent << 10) | ((seed >> 8) & 0x3FF));
+		}
+		return frame;
+	}
+
+	// Only for the normal values createHalfFrame() makes.
+	double halfToDouble(uint16_t value) {
+		const double magnitude = std::ldexp(1.0 + (value & 0x3FF) / 1024.0, ((value >> 10) & 0x1F) - 15);
+		return value & 0x8000 ? -magnitude : magnitude;
+	}
+
+	// Weighted averages of OpenEXR colours against doubles, frames that don't move against
+	// themselves, and the time of a 1080p frame.
+	int checkHalfAccumulation(ColorConversion::Isa bestIsa) {
+		// Odd sizes and a padded row pitch, like the ones of a mapped texture.
+		const size_t width = 4 * 333;
+		const size_t rows = 77;
+		const size_t rowPitch = 2 * width + 64;
+		int failures = 0;
+
+		std::vector<std::vector<uint16_t>> checkFrames;
+		for (uint32_t i = 0; i < 4; i++) {
+			checkFrames.push_back(createHalfFrame(rowPitch / 2 * rows, i + 1));
+		}
+
+		std::cout << "OpenEXR motion blur" << std::endl;
+		for (MotionBlur::Profile profile : { MotionBlur::PROFILE_BOX, MotionBlur::PROFILE_GAUSSIAN }) {
+			MotionBlur::ShutterSchedule schedule;
+			schedule.reset(15, 0.0f, profile);
+			std::vector<uint16_t> scalarResult;
+			std::cout << (profile == MotionBlur::PROFILE_BOX ? "  box     " : "  gaussian");
+
+			for (int isa = ColorConversion::ISA_SCALAR; isa <= bestIsa; isa++) {
+				if (isa == ColorConversion::ISA_SSE41) {
+					continue;
+				}
+
+				MotionBlur::HalfAccumulator accumulator;
+				accumulator.reset(width, rows, (ColorConversion::Isa)isa);
+				if (accumulator.getIsa() != isa) {
+					continue;
+				}
+				std::vector<uint16_t> actual(width * rows);
+				for (uint32_t i = 0; i < schedule.getSubFrameCount(); i++) {
+					accumulator.add(checkFrames[i % checkFrames.size()].data(), rowPitch, schedule.getWeight(i));
+				}
+				accumulator.resolve(actual.data());
+
+				std::vector<uint16_t> still(width * rows);
+				for (uint32_t i = 0; i < schedule.getSubFrameCount(); i++) {
+					accumulator.add(checkFrames[0].data(), rowPitch, schedule.getWeight(i));
+				}
+				accumulator.resolve(still.data());
+				bool isStill = true;
+				for (size_t y = 0; y < rows; y++) {
+					isStill &= std::equal(still.begin() + y * width, still.begin() + (y + 1) * width, checkFrames[0].begin() + y * rowPitch / 2);
+				}
+				failures += isStill ? 0 : 1;
+
+				if (isa == ColorConversion::ISA_SCALAR) {
+					scalarResult = actual;
+					// Relative to the largest input, as sums of both signs can cancel out.
+					double largestError = 0;
+					for (size_t y = 0; y < rows; y++) {
+						for (size_t x = 0; x < width; x++) {
+							double expected = 0;
+							for (uint32_t i = 0; i < schedule.getSubFrameCount(); i++) {
+								expected += halfToDouble(checkFrames[i % checkFrames.size()][y * rowPitch / 2 + x]) * schedule.getWeight(i);
+							}
+							expected /= schedule.getTotalWeight();
+							largestError = (std::max)(largestError, std::abs(halfToDouble(actual[y * width + x]) - expected) / 256);
+						}
+					}
+					// Half an ulp of the largest inputs, plus the float rounding of the sums.
+					failures += largestError <= 1.0 / 1024 ? 0 : 1;
+					std::cout << ", max error " << std::scientific << std::setprecision(2) << largestError << std::defaultfloat;
+				} else if (actual != scalarResult) {
+					failures++;
+					std::cout << ", " << ColorConversion::getIsaName(accumulator.getIsa()) << " differs from scalar";
+				}
+				if (!isStill) {
+					std::cout << ", " << ColorConversion::getIsaName(accumulator.getIsa()) << " changes still frames";
+				}
+			}
+			std::cout << std::endl;
+		}
+
+		const size_t frameWidth = 4 * 1920;
+		const size_t frameRows = 1080;
+		std::vector<std::vector<uint16_t>> frames;
+		for (uint32_t i = 0; i < 4; i++) {
+			frames.push_back(createHalfFrame(frameWidth * frameRows, i + 1));
+		}
+		std::vector<uint16_t> output(frameWidth * frameRows);
+		const ColorConversion::Isa isas[] = { ColorConversion::ISA_SCALAR, bestIsa };
+		for (ColorConversion::Isa isa : isas) {
+			MotionBlur::HalfAccumulator accumulator;
+			accumulator.reset(frameWidth, frameRows, isa);
+			uint64_t addCycles = UINT64_MAX;
+			uint64_t resolveCycles = UINT64_MAX;
+			for (int iteration = 0; iteration < 3; iteration++) {
+				uint64_t start = __rdtsc();
+				for (uint32_t i = 0; i < 8; i++) {
+					accumulator.add(frames[i % frames.size()].data(), 2 * frameWidth);
+				}
+				addCycles = (std::min)(addCycles, (uint64_t)(__rdtsc() - start) / 8);
+				start = __rdtsc();
+				accumulator.resolve(output.data());
+				resolveCycles = (std::min)(resolveCycles, (uint64_t)(__rdtsc() - start));
+			}
+			std::cout << "  " << std::left << std::setw(10) << ColorConversion::getIsaName(accumulator.getIsa()) << std::right
+				<< std::fixed << std::setprecision(2)
+				<< std::setw(8) << addCycles / 1e6 << " Mcycles per 1080p sub-frame,"
+				<< std::setw(8) << resolveCycles / 1e6 << " Mcycles per frame" << std::endl;
+		}
+		return failures;
+	}
+
+	struct NamedFormat {
+		const char* name;
+		ColorConversion::OutputFormat format;
+	};
+
+	const NamedFormat fusedFormats[] = {
+		{ "yuv420p", { 1, 1, false, 8, false, 0 } },
+		{ "nv12", { 1, 1, true, 8, false, 0 } },
+		{ "yuv422p10le", { 1, 0, false, 10, false, 0 } },
+		{ "yuv444p10le", { 0, 0, false, 10, false, 0 } },
+	};
+
+	// Tightly packed planes of one converted picture.
+	struct Picture {
+		Picture(const ColorConversion::OutputFormat& format, int width, int height) {
+			const int sampleSize = format.depth > 8 ? 2 : 1;
+			const int chromaHeight = (height + (1 << format.chromaShiftY) - 1) >> format.chromaShiftY;
+			strides[0] = width * sampleSize;
+			strides[1] = ((width + (1 << format.chromaShiftX) - 1) >> format.chromaShiftX) * sampleSize * (format.isInterleaved ? 2 : 1);
+			strides[2] = format.isInterleaved ? 0 : strides[1];
+			for (int i = 0; i < 3; i++) {
+				planes[i].resize(strides[i] * (i == 0 ? height : chromaHeight));
+				pointers[i] = planes[i].empty() ? NULL : planes[i].data();
+			}
+		}
+
+		int getSample(int plane, int x, int y, int depth) const {
+			const uint8_t* pRow = this->planes[plane].data() + (size_t)y * this->strides[plane];
+			return depth > 8 ? ((const uint16_t*)pRow)[x] : pRow[x];
+		}
+
+		bool operator==(const Picture& other) const {
+			return (this->planes[0] == other.planes[0]) && (this->planes[1] == other.planes[1]) && (this->planes[2] == other.planes[2]);
+		}
+
+		std::vector<uint8_t> planes[3];
+		uint8_t* pointers[3];
+		int strides[3];
+	};
+
+	// Largest difference between a planar picture and the conversion of the exact averages,
+	// done in floating point with the same weights.
+	int getLargestError(const Picture& picture, const ColorConversion::Converter& converter, const std::vector<std::vector<uint8_t>>& frames, uint32_t samples, int width, int height) {
+		const ColorConversion::OutputFormat& format = converter.getFormat();
+		const ColorConversion::Coefficients& c = converter.getCoefficients();
+		const double scale = (double)(1 << (format.depth - 8)) / (32768.0 * samples);
+		std::vector<uint32_t> sum(frames[0].size(), 0);
+		for (uint32_t i = 0; i < samples; i++) {
+			for (size_t j = 0; j < sum.size(); j++) {
+				sum[j] += frames[i % frames.size()][j];
+			}
+		}
+
+		int largestError = 0;
+		for (int plane = 0; plane < 3; plane++) {
+			const int shiftX = plane ? format.chromaShiftX : 0;
+			const int shiftY = plane ? format.chromaShiftY : 0;
+			const int16_t* weights = plane == 0 ? c.y : (plane == 1 ? c.u : c.v);
+			const int32_t offset = plane == 0 ? c.yOffset : c.cOffset;
+			for (int y = 0; y < height >> shiftY; y++) {
+				for (int x = 0; x < width >> shiftX; x++) {
+					double value = 0.0;
+					for (int dy = 0; dy < 1 << shiftY; dy++) {
+						for (int dx = 0; dx < 1 << shiftX; dx++) {
+							const uint32_t* pPixel = sum.data() + 4 * (((size_t)(y << shiftY) + dy) * width + (x << shiftX) + dx);
+							value += (double)weights[0] * pPixel[0] + (double)weights[1] * pPixel[1] + (double)weights[2] * pPixel[2];
+						}
+					}
+					value = value * scale / (1 << (shiftX + shiftY)) + offset;
+					const int expected = (std::min)((int)c.maxValue, (std::max)(0, (int)std::lround(value)));
+					largestError = (std::max)(largestError, std::abs(picture.getSample(plane, x, y, format.depth) - expected));
+				}
+			}
+		}
+		return largestError;
+	}
+
+	std::shared_ptr<MotionBlur::Sum> accumulate(const std::vector<std::vector<uint8_t>>& frames, uint32_t samples, ColorConversion::Isa isa, MotionBlur::Accumulator& accumulator) {
+		accumulator.reset(frames[0].size(), samples, isa);
+		for (uint32_t i = 0; i < samples; i++) {
+			accumulator.add(frames[i % frames.size()].data());
+		}
+		return accumulator.detach();
+	}
+
+	// A grey frame with a white square at x, for adaptive sampling.
+	std::vector<uint8_t> createSquareFrame(uint32_t width, uint32_t height, uint32_t x) {
+		std::vector<uint8_t> frame((size_t)width * height * 4, 96);
+		for (uint32_t y = height / 4; y < height * 3 / 4; y++) {
+			for (uint32_t i = x; i < (std::min)(x + height / 2, width); i++) {
+				std::fill_n(frame.begin() + ((size_t)y * width + i) * 4, 4, 255);
+			}
+		}
+		return frame;
+	}
+
+	// Renders frames of a square moving speed pixels per sub-frame of the shutter, and
+	// returns the span adaptive sampling settles on.
+	uint32_t getSettledSpan(uint32_t speed, const MotionBlur::ShutterSchedule& schedule, uint32_t& totalWeight) {
+		const uint32_t width = 640;
+		const uint32_t height = 360;
+		MotionBlur::AdaptiveSampling sampling;
+		sampling.reset(width, height, schedule.getSubFrameCount(), 2, 2.0f);
+		uint64_t subFrame = 0;
+		uint32_t span = 1;
+		for (uint32_t frame = 0; frame < 12; frame++) {
+			totalWeight = 0;
+			for (uint32_t i = 0; i < schedule.getSubFrameCount(); i += span) {
+				subFrame += span;
+				totalWeight += schedule.getWeight(subFrame - 1, span);
+				if (schedule.isOpen(subFrame - 1, span)) {
+					std::vector<uint8_t> image = createSquareFrame(width, height, (uint32_t)((subFrame * speed) % width));
+					sampling.measure(image.data(), width * 4, subFrame - 1);
+				}
+			}
+			span = sampling.nextSpan();
+		}
+		return span;
+	}
+
+	// The SIMD difference against a plain loop, the span picked for a still, a slow and a
+	// fast square, and the cost of a measure at 1080p.
+	int checkAdaptiveSampling() {
+		int failures = 0;
+		std::vector<uint8_t> first = createFrame(333 * 77 * 4 + 3, 1);
+		std::vector<uint8_t> second = createFrame(first.size(), 2);
+		uint64_t expected = 0;
+		for (size_t i = 0; i < first.size(); i++) {
+			expected += std::abs((int)first[i] - (int)second[i]);
+		}
+		failures += MotionBlur::AdaptiveSampling::sumOfAbsoluteDifferences(first.data(), second.data(), first.size()) == expected ? 0 : 1;
+
+		// 333 pixels per row in rows of 1332 bytes, downsampled to 83 pixels per row.
+		std::vector<uint8_t> thumbnail(83 * 19 * 4);
+		MotionBlur::AdaptiveSampling::downsample(first.data(), 333 * 4, 333, 77, thumbnail.data());
+		for (uint32_t y = 0; y < 19; y++) {
+			for (uint32_t x = 0; x < 83; x++) {
+				failures += std::equal(thumbnail.begin() + (y * 83 + x) * 4, thumbnail.begin() + (y * 83 + x + 1) * 4, first.begin() + (y * 4 * 333 + x * 4) * 4) ? 0 : 1;
+			}
+		}
+
+		std::cout << "Adaptive sampling" << (failures ? ", differences or downsampling differ" : "") << std::endl;
+		for (MotionBlur::Profile profile : { MotionBlur::PROFILE_BOX, MotionBlur::PROFILE_GAUSSIAN }) {
+			MotionBlur::ShutterSchedule schedule;
+			schedule.reset(15, 0.0f, profile);
+			for (uint32_t speed : { 0u, 3u, 8u }) {
+				uint32_t totalWeight = 0;
+				const uint32_t span = getSettledSpan(speed, schedule, totalWeight);
+				// A still square needs the fewest sub-frames allowed, a fast one all of them.
+				const uint32_t expectedSpan = speed == 0 ? 8 : (speed == 8 ? 1 : span);
+				failures += (span == expectedSpan) && (totalWeight == schedule.getTotalWeight()) ? 0 : 1;
+				std::cout << (profile == MotionBlur::PROFILE_BOX ? "  box     " : "  gaussian") << ", " << speed << " pixels per sub-frame: "
+					<< schedule.getSubFrameCount() / span << " of " << schedule.getSubFrameCount() << " sub-frames rendered"
+					<< (totalWeight == schedule.getTotalWeight() ? "" : ", exposure changes") << std::endl;
+			}
+		}
+
+		const uint32_t width = 1920;
+		const uint32_t height = 1080;
+		std::vector<uint8_t> frames[2] = { createFrame((size_t)width * height * 4, 1), createFrame((size_t)width * height * 4, 2) };
+		MotionBlur::AdaptiveSampling sampling;
+		sampling.reset(width, height, 16, 1, 2.0f);
+		uint64_t cycles = UINT64_MAX;
+		for (uint32_t i = 0; i < 8; i++) {
+			uint64_t start = __rdtsc();
+			sampling.measure(frames[i % 2].data(), width * 4, i);
+			cycles = (std::min)(cycles, (uint64_t)(__rdtsc() - start));
+		}
+		std::cout << "  " << std::fixed << std::setprecision(2) << cycles / 1e6 << " Mcycles per 1080p measure" << std::endl;
+		return failures;
+	}
+
+	// The blur written out pixel by pixel from the vectors the SIMD one found.
+	std::vector<uint8_t> blurAlongVectors(const OpticalFlow::VectorBlur& flow, const std::vector<uint8_t>& frame, uint32_t width, uint32_t height, float shutter) {
+		std::vector<uint8_t> blurred(frame.size());
+		const uint32_t columns = flow.getBlockColumns();
+		const uint32_t rows = flow.getBlockRows();
+		for (uint32_t y = 0; y < height; y++) {
+			for (uint32_t x = 0; x < width; x++) {
+				const uint32_t column = (std::min)(x / OpticalFlow::VectorBlur::BLOCK_SIZE, columns - 1);
+				const uint32_t row = (std::min)(y / OpticalFlow::VectorBlur::BLOCK_SIZE, rows - 1);
+				const OpticalFlow::Vector motion = flow.getVectors()[row * columns + column];
+				const uint32_t taps = OpticalFlow::VectorBlur::getTaps(motion, shutter);
+				uint32_t sums[4] = { 0, 0, 0, 0 };
+				for (uint32_t tap = 0; tap < taps; tap++) {
+					const OpticalFlow::Vector offset = OpticalFlow::VectorBlur::getTapOffset(motion, shutter, tap, taps);
+					const int tapX = (std::min)((std::max)((int)x + offset.x, 0), (int)width - 1);
+					const int tapY = (std::min)((std::max)((int)y + offset.y, 0), (int)height - 1);
+					for (int c = 0; c < 4; c++) {
+						sums[c] += frame[((size_t)tapY * width + tapX) * 4 + c];
+					}
+				}
+				for (int c = 0; c < 4; c++) {
+					blurred[((size_t)y * width + x) * 4 + c] = (uint8_t)((sums[c] + taps / 2) / taps);
+				}
+			}
+		}
+		return blurred;
+	}
+
+	// Vectors found for a pattern moving by whole pixels, the blur against a plain loop on a
+	// frame that isn't a multiple of the block size, and the cost of a frame at 1080p and 4K.
+	int checkOpticalFlow() {
+		int failures = 0;
+		const uint32_t width = 333;
+		const uint32_t height = 190;
+		const float shutter = 0.5f;
+		std::cout << "Optical flow motion blur" << std::endl;
+		// Odd motion is found to the nearest step of 2 pixels.
+		const int motions[][2] = { { 0, 0 }, { 6, -4 }, { 5, -3 }, { -24, 10 }, { 30, 28 }, { 27, -31 } };
+		for (const auto& motion : motions) {
+			OpticalFlow::VectorBlur flow;
+			flow.reset(width, height, shutter, 3);
+			std::vector<uint8_t> previous = createMovingFrame(width, height, 0, 0);
+			std::vector<uint8_t> frame = createMovingFrame(width, height, motion[0], motion[1]);
+			std::vector<uint8_t> blurred(frame.size());
+			flow.apply(previous.data(), blurred.data());
+			failures += blurred == previous ? 0 : 1;
+			flow.apply(frame.data(), blurred.data());
+
+			// Blocks next to the edge the pattern comes in from have no match.
+			uint32_t found = 0;
+			uint32_t inside = 0;
+			const int margin = 32 / OpticalFlow::VectorBlur::BLOCK_SIZE + 1;
+			for (int y = margin; y < (int)flow.getBlockRows() - margin; y++) {
+				for (int x = margin; x < (int)flow.getBlockColumns() - margin; x++) {
+					const OpticalFlow::Vector vector = flow.getVectors()[y * flow.getBlockColumns() + x];
+					found += (std::abs(vector.x - motion[0]) <= 1) && (std::abs(vector.y - motion[1]) <= 1) ? 1 : 0;
+					inside++;
+				}
+			}
+			const bool isExact = blurred == blurAlongVectors(flow, frame, width, height, shutter);
+			failures += (found == inside) && isExact ? 0 : 1;
+			failures += (motion[0] != 0) || (blurred == frame) ? 0 : 1;
+			std::cout << "  moving " << std::setw(3) << motion[0] << ", " << std::setw(3) << motion[1] << ": " << found << " of " << inside << " inner blocks found"
+				<< (isExact ? "" : ", differs from blurring pixel by pixel") << std::endl;
+		}
+
+		const uint32_t cores = (std::max)(1u, std::thread::hardware_concurrency());
+		for (const auto& size : { std::make_pair(1920u, 1080u), std::make_pair(3840u, 2160u) }) {
+			std::vector<uint8_t> frames[2] = { createMovingFrame(size.first, size.second, 0, 0), createMovingFrame(size.first, size.second, 12, 6) };
+			std::vector<uint8_t> output(frames[0].size());
+			std::cout << "  " << size.first << "x" << size.second << std::endl;
+			uint64_t singleCycles = 0;
+			for (uint32_t threads = 1; threads <= (std::min)(cores, 16u); threads++) {
+				OpticalFlow::VectorBlur flow;
+				flow.reset(size.first, size.second, 1.0f, threads);
+				flow.apply(frames[0].data(), output.data());
+				uint64_t cycles = UINT64_MAX;
+				for (int iteration = 1; iteration < 5; iteration++) {
+					uint64_t start = __rdtsc();
+					flow.apply(frames[iteration % 2].data(), output.data());
+					cycles = (std::min)(cycles, (uint64_t)(__rdtsc() - start));
+				}
+				singleCycles = threads == 1 ? cycles : singleCycles;
+				std::cout << "  " << std::setw(2) << threads << " threads"
+					<< std::fixed << std::setprecision(2)
+					<< std::setw(9) << cycles / 1e6 << " Mcycles per frame,"
+					<< std::setw(6) << (double)singleCycles / cycles << "x" << std::endl;
+			}
+		}
+		return failures;
+	}
+
+	// Averages and converts blurred frames in one pass and compares that with averaging them to
+	// bytes first. 8 bit formats have to come out the same, 10 bit ones have to be closer to
+	// the exact averages.
+	int checkFusedConversion(ColorConversion::Isa bestIsa) {
+		const int width = 334;
+		const int height = 78;
+		const int benchmarkWidth = 1920;
+		const int benchmarkHeight = 1080;
+		std::vector<std::vector<uint8_t>> frames;
+		std::vector<std::vector<uint8_t>> benchmarkFrames;
+		for (uint32_t i = 0; i < 4; i++) {
+			frames.push_back(createFrame((size_t)width * height * 4, i + 11));
+			benchmarkFrames.push_back(createFrame((size_t)benchmarkWidth * benchmarkHeight * 4, i + 11));
+		}
+
+		std::cout << "Averaging and converting in one pass at " << benchmarkWidth << "x" << benchmarkHeight << std::endl;
+		int failures = 0;
+		for (const NamedFormat& namedFormat : fusedFormats) {
+			for (uint32_t samples : { 9u, 256u, 300u }) {
+				std::cout << std::left << std::setw(12) << namedFormat.name << std::right << std::setw(4) << samples << " samples";
+				std::vector<uint8_t> average(frames[0].size());
+				Picture scalarPicture(namedFormat.format, width, height);
+				for (int isa = ColorConversion::ISA_SCALAR; isa <= bestIsa; isa++) {
+					ColorConversion::Converter converter;
+					if (!converter.init(namedFormat.format, (ColorConversion::Isa)isa) || !converter.hasSplitKernel() || (converter.getIsa() != isa)) {
+						failures++;
+						continue;
+					}
+
+					MotionBlur::Accumulator accumulator;
+					std::shared_ptr<MotionBlur::Sum> sum = accumulate(frames, samples, (ColorConversion::Isa)isa, accumulator);
+					Picture fused(namedFormat.format, width, height);
+					std::vector<uint32_t> split(4 * (size_t)width);
+					sum->convert(converter, width, 0, height, fused.pointers, fused.strides, split.data());
+					Picture separate(namedFormat.format, width, height);
+					sum->resolve(average.data());
+					converter.convert(average.data(), width * 4, width, height, separate.pointers, separate.strides, NULL);
+
+					if (isa == ColorConversion::ISA_SCALAR) {
+						scalarPicture = fused;
+						if (namedFormat.format.depth == 8) {
+							failures += fused == separate ? 0 : 1;
+							std::cout << (fused == separate ? ", same as averaging first" : ", differs from averaging first");
+						} else if (!namedFormat.format.isInterleaved) {
+							const int fusedError = getLargestError(fused, converter, frames, samples, width, height);
+							const int separateError = getLargestError(separate, converter, frames, samples, width, height);
+							failures += fusedError <= 1 ? 0 : 1;
+							std::cout << ", max error " << fusedError << " (" << separateError << " averaging to bytes first)";
+						}
+					} else if (!(fused == scalarPicture)) {
+						failures++;
+						std::cout << ", " << ColorConversion::getIsaName(converter.getIsa()) << " differs from scalar";
+					}
+				}
+				std::cout << std::endl;
+			}
+
+			// Both ways on the best instruction set, for a whole frame.
+			ColorConversion::Converter converter;
+			converter.init(namedFormat.format, bestIsa);
+			MotionBlur::Accumulator accumulator;
+			std::shared_ptr<MotionBlur::Sum> sum = accumulate(benchmarkFrames, 16, bestIsa, accumulator);
+			Picture picture(namedFormat.format, benchmarkWidth, benchmarkHeight);
+			std::vector<uint32_t> split(4 * (size_t)benchmarkWidth);
+			std::vector<uint8_t> average(benchmarkFrames[0].size());
+			uint64_t fusedCycles = UINT64_MAX;
+			uint64_t separateCycles = UINT64_MAX;
+			for (int iteration = 0; iteration < 5; iteration++) {
+				uint64_t start = __rdtsc();
+				sum->convert(converter, benchmarkWidth, 0, benchmarkHeight, picture.pointers, picture.strides, split.data());
+				fusedCycles = (std::min)(fusedCycles, (uint64_t)(__rdtsc() - start));
+				start = __rdtsc();
+				sum->resolve(average.data());
+				converter.convert(average.data(), benchmarkWidth * 4, benchmarkWidth, benchmarkHeight, picture.pointers, picture.strides, NULL);
+				separateCycles = (std::min)(separateCycles, (uint64_t)(__rdtsc() - start));
+			}
+			std::cout << "  " << std::left << std::setw(10) << ColorConversion::getIsaName(converter.getIsa()) << std::right
+				<< std::fixed << std::setprecision(2)
+				<< std::setw(8) << fusedCycles / 1e6 << " Mcycles per frame in one pass,"
+				<< std::setw(8) << separateCycles / 1e6 << " Mcycles averaging first" << std::endl;
+		}
+		return failures;
+	}
+}
+
+std::vector<uint8_t> createMovingFrame(uint32_t width, uint32_t height, int shiftX, int shiftY) {
+	const auto corner = [](int x, int y, int channel) {
+		uint32_t hash = (uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)channel * 83492791u;
+		hash = hash * 1664525 + 1013904223;
+		return (int)(hash >> 24);
+	};
+	std::vector<uint8_t> frame((size_t)width * height * 4);
+	for (uint32_t y = 0; y < height; y++) {
+		for (uint32_t x = 0; x < width; x++) {
+			const int u = (int)x - shiftX + 4096;
+			const int v = (int)y - shiftY + 4096;
+			const int fx = u % 8;
+			const int fy = v % 8;
+			for (int c = 0; c < 4; c++) {
+				const int top = corner(u / 8, v / 8, c) * (8 - fx) + corner(u / 8 + 1, v / 8, c) * fx;
+				const int bottom = corner(u / 8, v / 8 + 1, c) * (8 - fx) + corner(u / 8 + 1, v / 8 + 1, c) * fx;
+				frame[((size_t)y * width + x) * 4 + c] = (uint8_t)((top * (8 - fy) + bottom * fy + 32) / 64);
+			}
+		}
+	}
+	return frame;
+}
+
+int benchmarkMotionBlur() {
+	const int width = 1920;
+	const int height = 1080;
+	const size_t length = (size_t)width * height * 4;
+	// Not a multiple of any vector size, so that the scalar tails are covered too.
+	const size_t checkLength = 333 * 77 * 4 + 3;
+	const ColorConversion::Isa bestIsa = ColorConversion::detectIsa();
+
+	std::vector<std::vector<uint8_t>> checkFrames;
+	std::vector<std::vector<uint8_t>> frames;
+	for (uint32_t i = 0; i < 4; i++) {
+		checkFrames.push_back(createFrame(checkLength, i + 1));
+		frames.push_back(createFrame(length, i + 1));
+	}
+
+	std::cout << "Motion blur accumulation at " << width << "x" << height << ", best instruction set: " << ColorConversion::getIsaName(bestIsa) << std::endl;
+	int failures = 0;
+	// 256 is the most the configuration allows, 300 needs 32 bit sums and 1000 a real division.
+	for (uint32_t samples : { 2u, 9u, 33u, 256u, 300u, 1000u }) {
+		std::vector<uint8_t> expected = samples <= 257 ? averageWithValarray(checkFrames, samples) : averageWithDivision(checkFrames, samples);
+		std::cout << samples << " samples" << std::endl;
+
+		for (int isa = ColorConversion::ISA_SCALAR; isa <= bestIsa; isa++) {
+			if (isa == ColorConversion::ISA_SSE41) {
+				continue;
+			}
+
+			MotionBlur::Accumulator accumulator;
+			accumulator.reset(checkLength, samples, (ColorConversion::Isa)isa);
+			if (accumulator.getIsa() != isa) {
+				continue;
+			}
+			std::vector<uint8_t> actual(checkLength);
+			for (uint32_t i = 0; i < samples; i++) {
+				accumulator.add(checkFrames[i % checkFrames.size()].data());
+			}
+			accumulator.resolve(actual.data());
+			const bool isExact = actual == expected;
+			if (!isExact) {
+				failures++;
+			}
+
+			// Timed over a fixed number of sub-frames, the resolve over every output frame.
+			const uint32_t subFrames = (std::min)(samples, 16u);
+			std::vector<uint8_t> output(length);
+			accumulator.reset(length, samples, (ColorConversion::Isa)isa);
+			uint64_t addCycles = UINT64_MAX;
+			uint64_t resolveCycles = UINT64_MAX;
+			for (int iteration = 0; iteration < 3; iteration++) {
+				uint64_t start = __rdtsc();
+				for (uint32_t i = 0; i < subFrames; i++) {
+					accumulator.add(frames[i % frames.size()].data());
+				}
+				addCycles = (std::min)(addCycles, (uint64_t)(__rdtsc() - start) / subFrames);
+				start = __rdtsc();
+				accumulator.resolve(output.data());
+				resolveCycles = (std::min)(resolveCycles, (uint64_t)(__rdtsc() - start));
+			}
+
+			std::cout << "  " << std::left << std::setw(10) << ColorConversion::getIsaName(accumulator.getIsa())
+				<< (accumulator.isWide() ? " 32 bit" : " 16 bit")
+				<< std::fixed << std::setprecision(2) << std::right
+				<< std::setw(8) << addCycles / 1e6 << " Mcycles per sub-frame,"
+				<< std::setw(8) << resolveCycles / 1e6 << " Mcycles per frame"
+				<< (isExact ? "" : "  (differs from the division)") << std::endl;
+		}
+	}
+
+	// The capture side only reads back the sub-frames the shutter lets through.
+	for (float strength : { 1.0f, 0.5f, 0.1f }) {
+		MotionBlur::ShutterSchedule schedule;
+		schedule.reset(7, 1.0f - strength);
+		uint32_t expected = (std::max)(1u, (uint32_t)std::lround(8 * strength));
+		std::cout << "Shutter open " << strength << " of the frame: " << schedule.getOpenCount() << " of " << schedule.getSubFrameCount() << " sub-frames read back" << std::endl;
+		failures += (schedule.getOpenCount() == expected) && schedule.isOpen(7) && schedule.isLast(15) ? 0 : 1;
+	}
+
+	failures += checkShutterProfiles(bestIsa, checkFrames, frames);
+	failures += checkBlurScaling(bestIsa, checkFrames);
+	failures += checkLinearLight(bestIsa, checkFrames, frames);
+	failures += checkHalfAccumulation(bestIsa);
+	failures += checkAdaptiveSampling();
+	failures += checkOpticalFlow();
+	failures += checkFusedConversion(bestIsa);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,278 @@
+#include "benchmark.h"
+#include "../gta5-extended-video-export/color-conversion.h"
+#include "../gta5-extended-video-export/gpu-conversion.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+namespace {
+	struct NamedFormat {
+		const char* name;
+		ColorConversion::OutputFormat format;
+	};
+
+	const NamedFormat formats[] = {
+		{ "yuv420p", { 1, 1, false, 8, false, 0 } },
+		{ "yuv422p", { 1, 0, false, 8, false, 0 } },
+		{ "yuv444p", { 0, 0, false, 8, false, 0 } },
+		{ "yuvj422p", { 1, 0, false, 8, true, 0 } },
+		{ "nv12", { 1, 1, true, 8, false, 0 } },
+		{ "yuv420p10le", { 1, 1, false, 10, false, 0 } },
+		{ "yuv422p10le", { 1, 0, false, 10, false, 0 } },
+		{ "yuv444p10le", { 0, 0, false, 10, false, 0 } },
+	};
+
+	// Tightly packed planes of one converted picture.
+	struct Picture {
+		Picture(const ColorConversion::OutputFormat& format, int width, int height) {
+			const int sampleSize = format.depth > 8 ? 2 : 1;
+			const int chromaWidth = (width + (1 << format.chromaShiftX) - 1) >> format.chromaShiftX;
+			const int chromaHeight = (height + (1 << format.chromaShiftY) - 1) >> format.chromaShiftY;
+			strides[0] = width * sampleSize;
+			strides[1] = chromaWidth * sampleSize * (format.isInterleaved ? 2 : 1);
+			strides[2] = format.isInterleaved ? 0 : strides[1];
+			planes[0].resize(strides[0] * height);
+			planes[1].resize(strides[1] * chromaHeight);
+			planes[2].resize(strides[2] * chromaHeight);
+			for (int i = 0; i < 3; i++) {
+				pointers[i] = planes[i].empty() ? NULL : planes[i].data();
+			}
+		}
+
+		std::vector<uint8_t> planes[3];
+		uint8_t* pointers[3];
+		int strides[3];
+	};
+
+	std::vector<uint8_t> createPicture(int width, int height) {
+		std::vector<uint8_t> picture(width * height * 4);
+		uint32_t seed = 1;
+		for (auto& value : picture) {
+			seed = seed * 1664525 + 1013904223;
+			value = (uint8_t)(seed >> 24);
+		}
+		return picture;
+	}
+
+	// Box filtered copy of the picture, each block of factor x factor pixels rounded to one.
+	std::vector<uint8_t> downsample(const std::vector<uint8_t>& source, int width, int height, int factor) {
+		std::vector<uint8_t> result((width / factor) * (height / factor) * 4);
+		for (int y = 0; y < height / factor; y++) {
+			for (int x = 0; x < width / factor; x++) {
+				for (int i = 0; i < 4; i++) {
+					int sum = factor * factor / 2;
+					for (int dy = 0; dy < factor; dy++) {
+						for (int dx = 0; dx < factor; dx++) {
+							sum += source[4 * ((y * factor + dy) * width + x * factor + dx) + i];
+						}
+					}
+					result[4 * (y * (width / factor) + x) + i] = (uint8_t)(sum / (factor * factor));
+				}
+			}
+		}
+		return result;
+	}
+
+	bool isSamePicture(const Picture& a, const Picture& b) {
+		bool isSame = true;
+		for (int i = 0; i < 3; i++) {
+			isSame = isSame && (a.planes[i] == b.planes[i]);
+		}
+		return isSame;
+	}
+
+	int getSample(const Picture& picture, const ColorConversion::OutputFormat& format, int plane, int index) {
+		const uint8_t* pData = picture.planes[plane].data();
+		return format.depth > 8 ? pData[2 * index] | (pData[2 * index + 1] << 8) : pData[index];
+	}
+
+	// Largest distance between the converted picture and BT.601 evaluated in double precision
+	// over the same pixels, in units of the output depth.
+	int getMaxError(const std::vector<uint8_t>& source, int width, int height, const ColorConversion::OutputFormat& format, const Picture& picture) {
+		const double kr = 0.299;
+		const double kb = 0.114;
+		const double scale = (double)(1 << (format.depth - 8));
+		const double lumaScale = (format.isFullRange ? 255.0 : 219.0) / 255.0 * scale;
+		const double chromaScale = (format.isFullRange ? 255.0 : 224.0) / 255.0 * scale;
+		const double lumaOffset = (format.isFullRange ? 0.0 : 16.0) * scale;
+		const double maxValue = (double)((1 << format.depth) - 1);
+		auto clamp = [&](double value) { return (std::min)((std::max)(std::floor(value + 0.5), 0.0), maxValue); };
+
+		int maxError = 0;
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				const uint8_t* p = &source[4 * (y * width + x)];
+				double luma = clamp(lumaOffset + lumaScale * (kb * p[0] + (1.0 - kr - kb) * p[1] + kr * p[2]));
+				maxError = (std::max)(maxError, (int)std::abs(luma - getSample(picture, format, 0, y * width + x)));
+			}
+		}
+
+		const int chromaWidth = (width + (1 << format.chromaShiftX) - 1) >> format.chromaShiftX;
+		const int chromaHeight = (height + (1 << format.chromaShiftY) - 1) >> format.chromaShiftY;
+		for (int cy = 0; cy < chromaHeight; cy++) {
+			for (int cx = 0; cx < chromaWidth; cx++) {
+				double sums[3] = { 0.0, 0.0, 0.0 };
+				int count = 0;
+				for (int dy = 0; dy < (1 << format.chromaShiftY); dy++) {
+					for (int dx = 0; dx < (1 << format.chromaShiftX); dx++) {
+						const int x = (std::min)((cx << format.chromaShiftX) + dx, width - 1);
+						const int y = (std::min)((cy << format.chromaShiftY) + dy, height - 1);
+						for (int i = 0; i < 3; i++) {
+							sums[i] += source[4 * (y * width + x) + i];
+						}
+						count++;
+					}
+				}
+				const double b = sums[0] / count;
+				const double g = sums[1] / count;
+				const double r = sums[2] / count;
+				const double luma = kb * b + (1.0 - kr - kb) * g + kr * r;
+				const double u = clamp(128.0 * scale + chromaScale * 0.5 * (b - luma) / (1.0 - kb));
+				const double v = clamp(128.0 * scale + chromaScale * 0.5 * (r - luma) / (1.0 - kr));
+				const int index = cy * chromaWidth + cx;
+				const int actualU = format.isInterleaved ? getSample(picture, format, 1, 2 * index) : getSample(picture, format, 1, index);
+				const int actualV = format.isInterleaved ? getSample(picture, format, 1, 2 * index + 1) : getSample(picture, format, 2, index);
+				maxError = (std::max)(maxError, (int)std::abs(u - actualU));
+				maxError = (std::max)(maxError, (int)std::abs(v - actualV));
+			}
+		}
+		return maxError;
+	}
+
+	// The CPU reference of the GPU conversion has to give the bytes the scalar kernel gives for
+	// the same format, with the planes one after the other. The kernels have no p010, it is
+	// checked against yuv420p10le with U and V interleaved and moved to the high bits.
+	int checkGpuConversion(int width, int height) {
+		const NamedFormat gpuFormats[] = {
+			{ "nv12", { 1, 1, true, 8, false, 0 } },
+			{ "p010le", { 1, 1, false, 10, false, 0 } },
+			{ "yuv444p", { 0, 0, false, 8, false, 0 } },
+		};
+
+		std::cout << "GPU conversion reference at " << width << "x" << height << std::endl;
+		const std::vector<uint8_t> source = createPicture(width, height);
+		int failures = 0;
+		for (const NamedFormat& named : gpuFormats) {
+			GpuConversion::Layout layout;
+			if (!GpuConversion::getLayout(named.name, width, height, layout)) {
+				std::cout << "  " << std::left << std::setw(10) << named.name << " not supported" << std::endl;
+				failures++;
+				continue;
+			}
+			std::vector<uint8_t> packed(layout.getSize());
+			GpuConversion::pack(layout, source.data(), width * 4, packed.data());
+
+			ColorConversion::Converter reference;
+			reference.init(named.format, ColorConversion::ISA_SCALAR);
+			Picture picture(named.format, width, height);
+			reference.convert(source.data(), width * 4, width, height, picture.pointers, picture.strides, NULL);
+			std::vector<uint8_t> expected;
+			if (layout.format == GpuConversion::FORMAT_P010) {
+				auto appendShifted = [&](const std::vector<uint8_t>& plane, size_t i) {
+					const int sample = (plane[i] | (plane[i + 1] << 8)) << 6;
+					expected.push_back((uint8_t)sample);
+					expected.push_back((uint8_t)(sample >> 8));
+				};
+				for (size_t i = 0; i < picture.planes[0].size(); i += 2) {
+					appendShifted(picture.planes[0], i);
+				}
+				for (size_t i = 0; i < picture.planes[1].size(); i += 2) {
+					appendShifted(picture.planes[1], i);
+					appendShifted(picture.planes[2], i);
+				}
+			} else {
+				for (int plane = 0; plane < 3; plane++) {
+					expected.insert(expected.end(), picture.planes[plane].begin(), picture.planes[plane].end());
+				}
+			}
+
+			const bool isExact = packed == expected;
+			if (!isExact) {
+				failures++;
+			}
+			std::cout << "  " << std::left << std::setw(10) << named.name << layout.rows << " rows of " << layout.getRowSize() << " bytes" << (isExact ? "" : "  (differs from scalar)") << std::endl;
+		}
+		return failures;
+	}
+}
+
+int benchmarkConversion() {
+	const int width = 1920;
+	const int height = 1080;
+	// Odd sizes so that the scalar tails and the repeated last row and column are covered too.
+	const int checkWidth = 333;
+	const int checkHeight = 77;
+	const int iterations = 20;
+	const ColorConversion::Isa bestIsa = ColorConversion::detectIsa();
+
+	std::cout << "BGRA to YUV at " << width << "x" << height << ", best instruction set: " << ColorConversion::getIsaName(bestIsa) << std::endl;
+	int failures = 0;
+	for (int downsampleLog2 = 0; downsampleLog2 <= 2; downsampleLog2++) {
+		const int factor = 1 << downsampleLog2;
+		std::vector<uint8_t> source = createPicture(width * factor, height * factor);
+		std::vector<uint8_t> checkSource = createPicture(checkWidth * factor, checkHeight * factor);
+		std::vector<uint8_t> checkDownsampled = downsample(checkSource, checkWidth * factor, checkHeight * factor, factor);
+		if (factor > 1) {
+			std::cout << "Downsampled " << factor << "x" << factor << " from " << width * factor << "x" << height * factor << std::endl;
+		}
+
+		for (const NamedFormat& named : formats) {
+			ColorConversion::OutputFormat format = named.format;
+			ColorConversion::OutputFormat unscaledFormat = named.format;
+			format.downsampleLog2 = downsampleLog2;
+
+			// Unscaled, the scalar kernel is checked against the maths. Downsampled, it has to
+			// give what the unscaled one gives for a picture box filtered beforehand.
+			ColorConversion::Converter reference;
+			reference.init(unscaledFormat, ColorConversion::ISA_SCALAR);
+			Picture expected(format, checkWidth, checkHeight);
+			reference.convert(checkDownsampled.data(), checkWidth * 4, checkWidth, checkHeight, expected.pointers, expected.strides, NULL);
+			if (factor == 1) {
+				int maxError = getMaxError(checkDownsampled, checkWidth, checkHeight, format, expected);
+				if (maxError > 1) {
+					failures++;
+				}
+				std::cout << std::left << std::setw(12) << named.name << " max error " << maxError << (maxError > 1 ? " (too large)" : "") << std::endl;
+			} else {
+				std::cout << named.name << std::endl;
+			}
+
+			for (int isa = ColorConversion::ISA_SCALAR; isa <= bestIsa; isa++) {
+				ColorConversion::Converter converter;
+				if (!converter.init(format, (ColorConversion::Isa)isa) || (converter.getIsa() != isa)) {
+					continue;
+				}
+
+				std::vector<uint8_t> scratch(converter.getScratchSize((std::max)(width, checkWidth)));
+				Picture actual(format, checkWidth, checkHeight);
+				converter.convert(checkSource.data(), checkWidth * factor * 4, checkWidth, checkHeight, actual.pointers, actual.strides, scratch.data());
+				bool isExact = isSamePicture(actual, expected);
+				if (!isExact) {
+					failures++;
+				}
+
+				Picture output(format, width, height);
+				uint64_t best = UINT64_MAX;
+				for (int i = 0; i < iterations; i++) {
+					uint64_t start = __rdtsc();
+					converter.convert(source.data(), width * factor * 4, width, height, output.pointers, output.strides, scratch.data());
+					best = (std::min)(best, (uint64_t)(__rdtsc() - start));
+				}
+				std::cout << "  " << std::left << std::setw(10) << ColorConversion::getIsaName(converter.getIsa())
+					<< std::fixed << std::setprecision(2) << std::right << std::setw(8) << (double)best / (width * height) << " cycles/pixel"
+					<< (isExact ? "" : (factor == 1 ? "  (differs from scalar)" : "  (differs from box filter then scalar)")) << std::endl;
+			}
+		}
+	}
+	failures += checkGpuConversion(checkWidth + 1, checkHeight + 1);
+	return failures ? 1 : 0;
+}
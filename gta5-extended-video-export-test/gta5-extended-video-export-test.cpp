@@ -2,20 +2,276 @@
 //
 
 #include "../gta5-extended-video-export/encoder.h"
+#include "benchmark.h"
 #include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 
-int main()
+// Encodes frameCount frames with libx264 and the B-frame settings of the default
+// preset on its own, receiving one packet per frame sent the way the encoding
+// stage did before it drained the encoder, and returns the peak number of frames
+// the encoder held on to.
+int64_t encodeOnePacketPerFrame(int frameCount) {
+	AVCodec* pCodec = avcodec_find_encoder_by_name("libx264");
+	AVCodecContext* pContext = avcodec_alloc_context3(pCodec);
+	pContext->width = 1280;
+	pContext->height = 720;
+	pContext->pix_fmt = AV_PIX_FMT_YUV420P;
+	pContext->time_base = { 1001, 30000 };
+	AVDictionary* pOptions = NULL;
+	av_dict_set(&pOptions, "preset", "veryfast", 0);
+	av_dict_set(&pOptions, "bf", "2", 0);
+	int64_t peak = 0;
+	if (avcodec_open2(pContext, pCodec, &pOptions) == 0) {
+		Encoder::AVFramePtr frame(av_frame_alloc());
+		frame->format = pContext->pix_fmt;
+		frame->width = pContext->width;
+		frame->height = pContext->height;
+		av_frame_get_buffer(frame.get(), 32);
+		Encoder::AVPacketPtr packet(av_packet_alloc());
+		int64_t held = 0;
+		for (int i = 0; i < frameCount; i++) {
+			av_frame_make_writable(frame.get());
+			for (int plane = 0; plane < 3; plane++) {
+				memset(frame->data[plane], i % 256, frame->linesize[plane] * (plane ? frame->height / 2 : frame->height));
+			}
+			frame->pts = i;
+			avcodec_send_frame(pContext, frame.get());
+			held++;
+			if (avcodec_receive_packet(pContext, packet.get()) == 0) {
+				held--;
+				av_packet_unref(packet.get());
+			}
+			peak = (std::max)(peak, held);
+		}
+	}
+	av_dict_free(&pOptions);
+	avcodec_free_context(&pContext);
+	return peak;
+}
+
+// Encodes a short clip with the B-frame settings of the default preset and
+// reports how many frames the encoder held on to, next to an encoder that only
+// gets one packet received per frame, and how long the encoders waited on the
+// muxer. Fails unless every packet the encoder gave out was written and none
+// was left in the encoder after the flush.
+int testMuxer() {
+	const int frameCount = 300;
+	std::shared_ptr<Encoder::Session> session(new Encoder::Session());
+	session->createContext("mp4", ".\\test.mp4", ".\\", "movflags=+faststart", 1280, 720, "rgb24", 30000, 1001, "yuv420p", "libx264", "preset=veryfast/bf=2", Encoder::VideoOptions(), 2, 48000, 16, "s16", 3, "fltp", "aac", "ar=48000");
+	std::vector<char> x(1280 * 720 * 3);
+	for (int i = 0; i < frameCount; i++) {
+		std::fill(x.begin(), x.end(), i % 256);
+		session->enqueueVideoFrame((BYTE*)x.data(), (int)x.size(), 1280 * 3);
+		session->writeAudioFrame((BYTE*)x.data(), 1024, 0);
+	}
+	session->finishAudio();
+	session->finishVideo();
+	session->endSession();
+
+	std::cout << "Peak frames held by the video encoder: " << session->peakVideoFramesInEncoder << ", " << encodeOnePacketPerFrame(frameCount) << " with one packet per frame" << std::endl;
+	std::cout << "Video packets: " << session->videoPacketsEncoded << " encoded, " << session->videoPacketsWritten << " written, " << session->videoFramesInEncoder << " frames left in the encoder" << std::endl;
+	std::cout << "Time spent waiting on the muxer queue: " << session->muxQueueWaitMicroseconds << " us" << std::endl;
+	return ((session->videoPacketsEncoded > 0) && (session->videoPacketsWritten == session->videoPacketsEncoded) && (session->videoFramesInEncoder == 0)) ? 0 : 1;
+}
+
+// Encodes a clip and checks that neither the captured frame buffers nor the
+// converted frame buffers are allocated anymore once the pipeline is full.
+int testBufferReuse() {
+	const int frameCount = 400;
+	std::shared_ptr<Encoder::Session> session(new Encoder::Session());
+	session->createContext("mp4", ".\\test.mp4", ".\\", "movflags=+faststart", 1280, 720, "rgb24", 30000, 1001, "yuv420p", "libx264", "preset=veryfast/bf=2", Encoder::VideoOptions(), 2, 48000, 16, "s16", 3, "fltp", "aac", "ar=48000");
+	std::vector<char> x(1280 * 720 * 3);
+	uint64_t warmCaptureAllocations = 0;
+	uint64_t warmVideoAllocations = 0;
+	for (int i = 0; i < frameCount; i++) {
+		if (i == frameCount / 2) {
+			warmCaptureAllocations = session->videoFramePool.getAllocationCount();
+			warmVideoAllocations = session->getVideoBufferAllocationCount();
+		}
+		std::fill(x.begin(), x.end(), i % 256);
+		session->enqueueVideoFrame((BYTE*)x.data(), (int)x.size(), 1280 * 3);
+		session->writeAudioFrame((BYTE*)x.data(), 1024, 0);
+	}
+	session->finishAudio();
+	session->finishVideo();
+	session->endSession();
+
+	std::cout << "Captured frame buffers: " << warmCaptureAllocations << " allocated after " << frameCount / 2 << " frames, " << session->videoFramePool.getAllocationCount() << " after " << frameCount << std::endl;
+	std::cout << "Converted frame buffers: " << warmVideoAllocations << " allocated after " << frameCount / 2 << " frames, " << session->getVideoBufferAllocationCount() << " after " << frameCount << std::endl;
+	return (session->videoFramePool.getAllocationCount() == warmCaptureAllocations) && (session->getVideoBufferAllocationCount() == warmVideoAllocations) ? 0 : 1;
+}
+
+// Encodes BGRA frames with an encoder that takes BGRA and no pixel format set,
+// and fails unless the session skips the conversion and recycles the captured
+// buffers the encoder lets go of.
+int testPassthrough() {
+	const int frameCount = 200;
+	std::shared_ptr<Encoder::Session> session(new Encoder::Session());
+	session->createContext("nut", ".\\test-passthrough.nut", ".\\", "", 1280, 720, "bgra", 30, 1, "", "ffv1", "", Encoder::VideoOptions(), 2, 48000, 16, "s16", 4, "fltp", "", "");
+	std::vector<char> x(1280 * 720 * 4);
+	uint64_t warmCaptureAllocations = 0;
+	for (int i = 0; i < frameCount; i++) {
+		if (i == frameCount / 2) {
+			warmCaptureAllocations = session->videoFramePool.getAllocationCount();
+		}
+		std::fill(x.begin(), x.end(), i % 256);
+		session->enqueueVideoFrame((BYTE*)x.data(), (int)x.size(), 1280 * 4);
+	}
+	session->finishVideo();
+	session->endSession();
+
+	std::cout << "Pixel format: " << av_get_pix_fmt_name(session->outputPixelFormat) << (session->isConversionSkipped ? ", conversion skipped" : ", converted") << std::endl;
+	std::cout << "Captured frame buffers: " << warmCaptureAllocations << " allocated after " << frameCount / 2 << " frames, " << session->videoFramePool.getAllocationCount() << " after " << frameCount << std::endl;
+	return session->isConversionSkipped && (session->videoFramePool.getAllocationCount() == warmCaptureAllocations) ? 0 : 1;
+}
+
+// Converts a BGRA picture captured at factor times the given size the way a
+// session does and returns the planes packed one after another.
+std::vector<uint8_t> convertWithSession(std::vector<uint8_t>& picture, int width, int height, std::string format, uint32_t threads, int factor) {
+	std::shared_ptr<Encoder::Session> session(new Encoder::Session());
+	Encoder::VideoOptions options;
+	options.threadBudget = ThreadBudget::split(0, 0, threads, false, false);
+	options.outputWidth = width;
+	options.outputHeight = height;
+	session->createContext("nut", ".\\test-convert.nut", ".\\", "", width * factor, height * factor, "bgra", 30, 1, format, "rawvideo", "", options, 2, 48000, 16, "s16", 4, "fltp", "", "");
+	Encoder::AVFramePtr frame(av_frame_alloc());
+	session->convertVideoFrame(picture.data(), picture.size(), 0, frame.get());
+	std::vector<uint8_t> output(av_image_get_buffer_size((AVPixelFormat)frame->format, width, height, 1));
+	av_image_copy_to_buffer(output.data(), (int)output.size(), frame->data, frame->linesize, (AVPixelFormat)frame->format, width, height, 1);
+	return output;
+}
+
+// Same as convertWithSession, but straight through swscale.
+std::vector<uint8_t> convertWithSwscale(std::vector<uint8_t>& picture, int width, int height, std::string format, int factor) {
+	AVPixelFormat pixelFormat = av_get_pix_fmt(format.c_str());
+	Encoder::AVFramePtr frame(av_frame_alloc());
+	frame->format = pixelFormat;
+	frame->width = width;
+	frame->height = height;
+	av_frame_get_buffer(frame.get(), 32);
+	SwsContext* pContext = sws_getContext(width * factor, height * factor, AV_PIX_FMT_BGRA, width, height, pixelFormat, factor > 1 ? SWS_AREA : SWS_POINT, NULL, NULL, NULL);
+	const uint8_t* src[4] = { picture.data(), NULL, NULL, NULL };
+	const int srcStride[4] = { width * factor * 4, 0, 0, 0 };
+	sws_scale(pContext, src, srcStride, 0, height * factor, frame->data, frame->linesize);
+	sws_freeContext(pContext);
+	std::vector<uint8_t> output(av_image_get_buffer_size(pixelFormat, width, height, 1));
+	av_image_copy_to_buffer(output.data(), (int)output.size(), frame->data, frame->linesize, pixelFormat, width, height, 1);
+	return output;
+}
+
+std::vector<uint8_t> createNoise(int width, int height) {
+	std::vector<uint8_t> noise(width * height * 4);
+	uint32_t seed = 1;
+	for (auto& value : noise) {
+		seed = seed * 1664525 + 1013904223;
+		value = (uint8_t)(seed >> 24);
+	}
+	return noise;
+}
+
+std::vector<uint8_t> createGradient(int width, int height) {
+	std::vector<uint8_t> gradient(width * height * 4);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			uint8_t* pPixel = &gradient[4 * (y * width + x)];
+			pPixel[0] = (uint8_t)(x * 255 / (width - 1));
+			pPixel[1] = (uint8_t)(y * 255 / (height - 1));
+			pPixel[2] = (uint8_t)((x + y) * 255 / (width + height - 2));
+			pPixel[3] = 255;
+		}
+	}
+	return gradient;
+}
+
+// Converts a noisy picture with a single conversion band and with several bands,
+// and fails unless both give identical output for every format tested. Then
+// converts a smooth picture and fails if the result is more than two steps
+// away from swscale's. Both are done at the capture size and downsampled from
+// twice the size.
+int testConversion() {
+	const int width = 1920;
+	const int height = 1080;
+
+	int result = 0;
+	for (int factor = 1; factor <= 2; factor *= 2) {
+		std::vector<uint8_t> noise = createNoise(width * factor, height * factor);
+		std::vector<uint8_t> gradient = createGradient(width * factor, height * factor);
+		for (std::string format : { "yuv420p", "yuvj422p", "nv12", "yuv422p10le", "yuv444p" }) {
+			bool isIdentical = convertWithSession(noise, width, height, format, 1, factor) == convertWithSession(noise, width, height, format, 4, factor);
+
+			int depth = av_pix_fmt_desc_get(av_get_pix_fmt(format.c_str()))->comp[0].depth;
+			std::vector<uint8_t> actual = convertWithSession(gradient, width, height, format, 1, factor);
+			std::vector<uint8_t> expected = convertWithSwscale(gradient, width, height, format, factor);
+			int maxDifference = 0;
+			for (size_t i = 0; i < actual.size(); i += depth > 8 ? 2 : 1) {
+				int a = depth > 8 ? actual[i] | (actual[i + 1] << 8) : actual[i];
+				int e = depth > 8 ? expected[i] | (expected[i + 1] << 8) : expected[i];
+				maxDifference = (std::max)(maxDifference, std::abs(a - e));
+			}
+
+			std::cout << format << (factor > 1 ? " downsampled" : "") << ": bands " << (isIdentical ? "identical" : "different") << ", at most " << maxDifference << " from swscale" << std::endl;
+			if (!isIdentical || (maxDifference > (2 << (depth - 8)))) {
+				result = 1;
+			}
+		}
+	}
+	return result;
+}
+
+int main(int argc, char* argv[])
 {
+	if ((argc > 1) && (std::string(argv[1]) == "bench-queue")) {
+		benchmarkQueues();
+		return 0;
+	}
+
+	if ((argc > 1) && (std::string(argv[1]) == "bench-convert")) {
+		return benchmarkConversion();
+	}
+
+	if ((argc > 1) && (std::string(argv[1]) == "bench-blur")) {
+		return benchmarkMotionBlur();
+	}
+
+	if ((argc > 1) && (std::string(argv[1]) == "bench-interpolate")) {
+		return benchmarkInterpolation();
+	}
+
+	if ((argc > 1) && (std::string(argv[1]) == "bench-readback")) {
+		return benchmarkReadback();
+	}
+
 	av_register_all();
 	avcodec_register_all();
+
+	if ((argc > 1) && (std::string(argv[1]) == "test-mux")) {
+		return testMuxer();
+	}
+
+	if ((argc > 1) && (std::string(argv[1]) == "test-alloc")) {
+		return testBufferReuse();
+	}
+
+	if ((argc > 1) && (std::string(argv[1]) == "test-convert")) {
+		return testConversion();
+	}
+
+	if ((argc > 1) && (std::string(argv[1]) == "test-passthrough")) {
+		return testPassthrough();
+	}
+
 	av_log_set_level(AV_LOG_TRACE);
 	for (int j = 0; j < 10; j++) {
 		std::shared_ptr<Encoder::Session> session(new Encoder::Session());
-		session->createContext("mp4", ".\\test.mp4", ".\\", "movflags=+faststart", 1280, 720, "rgb24", 30000, 1001, 0, 0.0f, "yuv420p", "libx264", "", 2, 48000, 16, "s16", 3, "fltp", "aac", "ar=48000");
+		session->createContext("mp4", ".\\test.mp4", ".\\", "movflags=+faststart", 1280, 720, "rgb24", 30000, 1001, "yuv420p", "libx264", "", Encoder::VideoOptions(), 2, 48000, 16, "s16", 3, "fltp", "aac", "ar=48000");
 		for (int i = 0; i < 100; i++) {
 			char* x = new char[1280 * 720 * 3];
 			std::fill(x, x + (1280 * 720 * 3), i % 256);
-			session->enqueueVideoFrame((BYTE*)x, 1280 * 720 * 3);
+			session->enqueueVideoFrame((BYTE*)x, 1280 * 720 * 3, 1280 * 3);
 			session->writeAudioFrame((BYTE*)x, 1024, 0);
 			delete[] x;
 		}
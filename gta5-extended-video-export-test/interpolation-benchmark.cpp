@@ -0,0 +1,142 @@
+#include "benchmark.h"
+#include "../gta5-extended-video-export/optical-flow.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+namespace {
+	// The fast interpolation written out pixel by pixel from the vectors the SIMD one found.
+	std::vector<uint8_t> interpolateAlongVectors(const OpticalFlow::Interpolator& interpolator, const std::vector<uint8_t>& previous, const std::vector<uint8_t>& next, uint32_t width, uint32_t height, uint32_t step) {
+		std::vector<uint8_t> frame(next.size());
+		const uint32_t columns = interpolator.getBlockColumns();
+		const uint32_t rows = interpolator.getBlockRows();
+		const uint32_t factor = interpolator.getFactor();
+		const uint32_t nextWeight = (256 * step + factor / 2) / factor;
+		for (uint32_t y = 0; y < height; y++) {
+			for (uint32_t x = 0; x < width; x++) {
+				const uint32_t column = (std::min)(x / OpticalFlow::Interpolator::BLOCK_SIZE, columns - 1);
+				const uint32_t row = (std::min)(y / OpticalFlow::Interpolator::BLOCK_SIZE, rows - 1);
+				OpticalFlow::Vector previousOffset, nextOffset;
+				OpticalFlow::Interpolator::getOffsets(interpolator.getVectors()[row * columns + column], step, factor, previousOffset, nextOffset);
+				const int previousX = (std::min)((std::max)((int)x + previousOffset.x, 0), (int)width - 1);
+				const int previousY = (std::min)((std::max)((int)y + previousOffset.y, 0), (int)height - 1);
+				const int nextX = (std::min)((std::max)((int)x + nextOffset.x, 0), (int)width - 1);
+				const int nextY = (std::min)((std::max)((int)y + nextOffset.y, 0), (int)height - 1);
+				for (int c = 0; c < 4; c++) {
+					frame[((size_t)y * width + x) * 4 + c] = (uint8_t)((previous[((size_t)previousY * width + previousX) * 4 + c] * (256 - nextWeight)
+						+ next[((size_t)nextY * width + nextX) * 4 + c] * nextWeight + 128) >> 8);
+				}
+			}
+		}
+		return frame;
+	}
+
+	// Largest difference away from the edges, where the pattern comes into view.
+	int getLargestError(const std::vector<uint8_t>& frame, const std::vector<uint8_t>& expected, uint32_t width, uint32_t height, uint32_t margin) {
+		int error = 0;
+		for (uint32_t y = margin; y < height - margin; y++) {
+			for (uint32_t x = 4 * margin; x < 4 * (width - margin); x++) {
+				error = (std::max)(error, std::abs((int)frame[(size_t)y * width * 4 + x] - (int)expected[(size_t)y * width * 4 + x]));
+			}
+		}
+		return error;
+	}
+
+	// Frames in between a pattern that moves by whole steps, against the pattern rendered
+	// where it was, and against a cross-fade of the two frames.
+	int checkInterpolation() {
+		int failures = 0;
+		const uint32_t width = 333;
+		const uint32_t height = 190;
+		const uint32_t margin = 64;
+		std::cout << "Frame interpolation" << std::endl;
+		// Motions in steps of 2 pixels times the factor land on whole pixels at every step.
+		const int motions[][3] = { { 2, 0, 0 }, { 2, 8, -6 }, { 3, -12, 6 }, { 4, 24, 8 } };
+		for (const auto& motion : motions) {
+			const uint32_t factor = motion[0];
+			const std::vector<uint8_t> previous = createMovingFrame(width, height, 0, 0);
+			const std::vector<uint8_t> next = createMovingFrame(width, height, motion[1], motion[2]);
+			for (OpticalFlow::Interpolator::Quality quality : { OpticalFlow::Interpolator::QUALITY_FAST, OpticalFlow::Interpolator::QUALITY_SMOOTH }) {
+				std::vector<std::vector<uint8_t>> frames(factor - 1, std::vector<uint8_t>(next.size()));
+				std::vector<uint8_t*> pointers;
+				for (auto& frame : frames) {
+					pointers.push_back(frame.data());
+				}
+				OpticalFlow::Interpolator interpolator;
+				interpolator.reset(width, height, factor, quality, 3);
+				interpolator.apply(previous.data(), pointers.data());
+				failures += interpolator.isReady() ? 0 : 1;
+				interpolator.apply(next.data(), pointers.data());
+
+				std::cout << "  " << std::left << std::setw(7) << OpticalFlow::Interpolator::getQualityName(quality) << std::right << factor << "x, moving "
+					<< std::setw(3) << motion[1] << ", " << std::setw(3) << motion[2] << ": max error";
+				for (uint32_t step = 1; step < factor; step++) {
+					const std::vector<uint8_t> expected = createMovingFrame(width, height, motion[1] * (int)step / (int)factor, motion[2] * (int)step / (int)factor);
+					const int error = getLargestError(frames[step - 1], expected, width, height, margin);
+					failures += error <= 1 ? 0 : 1;
+
+					// A cross-fade, to show what the motion is worth.
+					std::vector<uint8_t> fade(next.size());
+					const uint32_t nextWeight = (256 * step + factor / 2) / factor;
+					for (size_t i = 0; i < fade.size(); i++) {
+						fade[i] = (uint8_t)((previous[i] * (256 - nextWeight) + next[i] * nextWeight + 128) >> 8);
+					}
+					std::cout << " " << error << " (" << getLargestError(fade, expected, width, height, margin) << " cross-fading)";
+
+					if ((quality == OpticalFlow::Interpolator::QUALITY_FAST) && (frames[step - 1] != interpolateAlongVectors(interpolator, previous, next, width, height, step))) {
+						failures++;
+						std::cout << ", differs from interpolating pixel by pixel";
+					}
+				}
+				std::cout << std::endl;
+			}
+		}
+		return failures;
+	}
+
+	// Interpolates 2x over moving frames at each thread count and both qualities, in cycles per
+	// rendered frame.
+	void benchmarkSize(uint32_t width, uint32_t height) {
+		const std::vector<uint8_t> frames[2] = { createMovingFrame(width, height, 0, 0), createMovingFrame(width, height, 12, 6) };
+		std::vector<uint8_t> output(frames[0].size());
+		uint8_t* pOutput = output.data();
+		const uint32_t cores = (std::max)(1u, std::thread::hardware_concurrency());
+		std::cout << "Interpolating " << width << "x" << height << " 2x" << std::endl;
+		for (OpticalFlow::Interpolator::Quality quality : { OpticalFlow::Interpolator::QUALITY_FAST, OpticalFlow::Interpolator::QUALITY_SMOOTH }) {
+			uint64_t singleCycles = 0;
+			for (uint32_t threads = 1; threads <= (std::min)(cores, 16u); threads++) {
+				OpticalFlow::Interpolator interpolator;
+				interpolator.reset(width, height, 2, quality, threads);
+				interpolator.apply(frames[0].data(), &pOutput);
+				uint64_t cycles = UINT64_MAX;
+				for (int iteration = 1; iteration < 5; iteration++) {
+					uint64_t start = __rdtsc();
+					interpolator.apply(frames[iteration % 2].data(), &pOutput);
+					cycles = (std::min)(cycles, (uint64_t)(__rdtsc() - start));
+				}
+				singleCycles = threads == 1 ? cycles : singleCycles;
+				std::cout << "  " << std::left << std::setw(7) << OpticalFlow::Interpolator::getQualityName(quality) << std::right
+					<< std::setw(2) << threads << " threads"
+					<< std::fixed << std::setprecision(2)
+					<< std::setw(9) << cycles / 1e6 << " Mcycles per rendered frame,"
+					<< std::setw(6) << (double)singleCycles / cycles << "x" << std::endl;
+			}
+		}
+	}
+}
+
+int benchmarkInterpolation() {
+	const int failures = checkInterpolation();
+	benchmarkSize(1920, 1080);
+	benchmarkSize(3840, 2160);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,90 @@
+#include "benchmark.h"
+#include "../gta5-extended-video-export/SafeQueue.h"
+#include "../gta5-extended-video-export/SpscQueue.h"
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <thread>
+#include <valarray>
+#include <vector>
+#include <algorithm>
+
+namespace {
+	typedef std::chrono::high_resolution_clock Clock;
+
+	// Same shape as the items the capture hook hands to the encoding thread.
+	struct Item {
+		Item() : data(nullptr), timestamp(0) {}
+		Item(std::shared_ptr<std::valarray<uint8_t>> data, int64_t timestamp) : data(std::move(data)), timestamp(timestamp) {}
+		std::shared_ptr<std::valarray<uint8_t>> data;
+		int64_t timestamp;
+	};
+
+	int64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+	}
+
+	void push(SafeQueue<Item>& queue, Item&& item) { queue.enqueue(item); }
+	void push(SpscQueue<Item>& queue, Item&& item) { queue.enqueue(std::move(item)); }
+
+	// Producer pushes as fast as it can, consumer drops the items.
+	template <class Queue>
+	double throughput(uint32_t count) {
+		Queue queue(16);
+		auto payload = std::make_shared<std::valarray<uint8_t>>(64);
+		auto start = Clock::now();
+		std::thread consumer([&]() {
+			for (uint32_t i = 0; i < count; i++) {
+				Item item = queue.dequeue();
+			}
+		});
+		for (uint32_t i = 0; i < count; i++) {
+			push(queue, Item(payload, 0));
+		}
+		consumer.join();
+		double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		return count / seconds;
+	}
+
+	// Producer paces itself so the queue is mostly empty, consumer measures the
+	// time between enqueue and dequeue.
+	template <class Queue>
+	std::vector<int64_t> latency(uint32_t count) {
+		Queue queue(16);
+		auto payload = std::make_shared<std::valarray<uint8_t>>(64);
+		std::vector<int64_t> samples(count);
+		std::thread consumer([&]() {
+			for (uint32_t i = 0; i < count; i++) {
+				Item item = queue.dequeue();
+				samples[i] = now() - item.timestamp;
+			}
+		});
+		for (uint32_t i = 0; i < count; i++) {
+			int64_t until = now() + 20000;
+			while (now() < until) {}
+			push(queue, Item(payload, now()));
+		}
+		consumer.join();
+		std::sort(samples.begin(), samples.end());
+		return samples;
+	}
+
+	template <class Queue>
+	void report(const char* name) {
+		const uint32_t throughputCount = 1000000;
+		const uint32_t latencyCount = 20000;
+		double itemsPerSecond = throughput<Queue>(throughputCount);
+		std::vector<int64_t> samples = latency<Queue>(latencyCount);
+		std::cout << std::left << std::setw(12) << name
+			<< " throughput: " << std::setw(12) << (uint64_t)itemsPerSecond << " items/s"
+			<< "  latency p50: " << samples[samples.size() / 2] << " ns"
+			<< "  p99: " << samples[samples.size() * 99 / 100] << " ns"
+			<< std::endl;
+	}
+}
+
+void benchmarkQueues() {
+	report<SafeQueue<Item>>("SafeQueue");
+	report<SpscQueue<Item>>("SpscQueue");
+}
@@ -0,0 +1,163 @@
+#include "benchmark.h"
+#include "../gta5-extended-video-export/readback.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+
+namespace {
+	// Keeps the frame number in each slot, so that the order of the copies and the reads
+	// the ring asks for can be checked. A copy is done once readyAfter more frames were
+	// copied.
+	class FakeDevice : public Readback::Device {
+	public:
+		FakeDevice(uint32_t slotCount, uint32_t readyAfter) :
+			frames(slotCount, -1),
+			nextFrame(0),
+			readyAfter(readyAfter),
+			isCopyFailing(false),
+			failures(0)
+		{}
+
+		bool copy(uint32_t slot) override {
+			// A slot must have been read before it is copied into again.
+			if ((slot >= this->frames.size()) || (this->frames[slot] >= 0)) {
+				this->failures++;
+				return false;
+			}
+			if (this->isCopyFailing) {
+				return false;
+			}
+			this->frames[slot] = this->nextFrame++;
+			return true;
+		}
+
+		bool isReady(uint32_t slot) override {
+			return (this->frames[slot] >= 0) && (this->frames[slot] + this->readyAfter < this->nextFrame);
+		}
+
+		bool read(uint32_t slot) override {
+			if ((slot >= this->frames.size()) || (this->frames[slot] < 0)) {
+				this->failures++;
+				return false;
+			}
+			this->readFrames.push_back(this->frames[slot]);
+			this->frames[slot] = -1;
+			return true;
+		}
+
+		// Frame in each slot, -1 for a free one.
+		std::vector<int64_t> frames;
+		std::vector<int64_t> readFrames;
+		int64_t nextFrame;
+		int64_t readyAfter;
+		bool isCopyFailing;
+		uint32_t failures;
+	};
+
+	// A frame is read as soon as it is ready, and at the latest right after the one latency
+	// frames later was copied. Frames are read in order, and the frames left come out on
+	// flush.
+	int checkRing(uint32_t latency, uint32_t readyAfter) {
+		const int64_t frameCount = 20;
+		Readback::Ring ring;
+		ring.reset(latency);
+		FakeDevice device(ring.getSlotCount(), readyAfter);
+		const uint32_t lag = (std::min)(latency, readyAfter);
+		uint32_t failures = 0;
+		for (int64_t frame = 0; frame < frameCount; frame++) {
+			// A failed copy takes no slot, the frame is copied again.
+			if (frame == 7) {
+				device.isCopyFailing = true;
+				failures += ring.issue(device) ? 1 : 0;
+				device.isCopyFailing = false;
+			}
+			failures += ring.issue(device) ? 0 : 1;
+
+			const int64_t expectedReads = (std::max)((int64_t)0, frame + 1 - (int64_t)lag);
+			if (((int64_t)device.readFrames.size() != expectedReads) || ((expectedReads > 0) && (device.readFrames.back() != frame - (int64_t)lag))) {
+				failures++;
+			}
+			failures += ring.getPendingCount() == (std::min)((uint32_t)frame + 1, lag) ? 0 : 1;
+		}
+		failures += ring.flush(device) ? 0 : 1;
+		failures += ring.getPendingCount() == 0 ? 0 : 1;
+		for (int64_t frame = 0; frame < frameCount; frame++) {
+			failures += ((frame < (int64_t)device.readFrames.size()) && (device.readFrames[frame] == frame)) ? 0 : 1;
+		}
+		failures += (uint32_t)device.readFrames.size() == frameCount ? 0 : 1;
+		failures += device.failures;
+
+		std::cout << "  latency " << latency << ", " << ring.getSlotCount() << " slots, ready after " << readyAfter << " frames: " << (failures ? "FAILED" : "ok") << std::endl;
+		return failures;
+	}
+
+	// The render thread issues a frame every cpuTime, the GPU renders and copies it in gpuTime
+	// once it is done with the frames before, and reading a slot waits for its copy. Times are
+	// in milliseconds of a simulated clock. A copy is ready once the clock is past its end.
+	class SimulatedDevice : public Readback::Device {
+	public:
+		SimulatedDevice(uint32_t slotCount, double gpuTime) :
+			done(slotCount, 0.0),
+			gpuTime(gpuTime),
+			gpuFree(0.0),
+			now(0.0),
+			stall(0.0)
+		{}
+
+		bool copy(uint32_t slot) override {
+			this->gpuFree = (std::max)(this->gpuFree, this->now) + this->gpuTime;
+			this->done[slot] = this->gpuFree;
+			return true;
+		}
+
+		bool isReady(uint32_t slot) override {
+			return this->done[slot] <= this->now;
+		}
+
+		bool read(uint32_t slot) override {
+			const double wait = (std::max)(0.0, this->done[slot] - this->now);
+			this->stall += wait;
+			this->now += wait;
+			return true;
+		}
+
+		std::vector<double> done;
+		double gpuTime;
+		double gpuFree;
+		double now;
+		double stall;
+	};
+
+	void benchmarkLatency(double cpuTime, double gpuTime) {
+		const uint32_t frameCount = 1000;
+		std::cout << "Simulated export, " << cpuTime << " ms CPU and " << gpuTime << " ms GPU per frame" << std::endl;
+		for (uint32_t latency = 0; latency <= 3; latency++) {
+			Readback::Ring ring;
+			ring.reset(latency);
+			SimulatedDevice device(ring.getSlotCount(), gpuTime);
+			for (uint32_t frame = 0; frame < frameCount; frame++) {
+				device.now += cpuTime;
+				ring.issue(device);
+			}
+			ring.flush(device);
+			std::cout << "  latency " << latency << ": "
+				<< std::fixed << std::setprecision(1)
+				<< std::setw(6) << 1000.0 * frameCount / device.now << " fps, "
+				<< std::setw(5) << device.stall / frameCount << " ms waiting per frame" << std::endl;
+		}
+	}
+}
+
+int benchmarkReadback() {
+	int failures = 0;
+	std::cout << "Readback ring" << std::endl;
+	for (uint32_t latency = 0; latency <= 4; latency++) {
+		for (uint32_t readyAfter : { 0u, 1u, 2u, 100u }) {
+			failures += checkRing(latency, readyAfter);
+		}
+	}
+	benchmarkLatency(10.0, 12.0);
+	benchmarkLatency(16.0, 8.0);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+// Set of equally sized byte buffers that live as long as the pool does.
+// Buffers are checked out with acquire() and handed back with release() once
+// the consumer is done with them. A new buffer is only allocated when every
+// existing one is checked out, so after the first few frames the handoff runs
+// without touching the heap. getAllocationCount() makes that visible.
+//
+// The bytes of a buffer start on an ALIGNMENT boundary and are followed by
+// PADDING zeroed bytes, so that a buffer can be handed to ffmpeg as it is,
+// which expects SIMD aligned data it may read a little past the end of.
+class FramePool {
+public:
+	enum {
+		ALIGNMENT = 64,
+		PADDING = 64,
+	};
+
+	class Bytes {
+	public:
+		explicit Bytes(size_t size)
+			: memory(new uint8_t[size + ALIGNMENT - 1 + PADDING])
+			, length(size)
+			, pLender(NULL)
+		{
+			const size_t offset = (ALIGNMENT - (size_t)this->memory.get() % ALIGNMENT) % ALIGNMENT;
+			this->pData = this->memory.get() + offset;
+			memset(this->pData + size, 0, PADDING);
+		}
+
+		uint8_t* begin() {
+			return this->pData;
+		}
+
+		uint8_t* end() {
+			return this->pData + this->length;
+		}
+
+		size_t size() const {
+			return this->length;
+		}
+
+	private:
+		friend class FramePool;
+
+		std::unique_ptr<uint8_t[]> memory;
+		uint8_t* pData;
+		size_t length;
+		// Set while the buffer is lent, see lend().
+		FramePool* pLender;
+		std::shared_ptr<Bytes> lent;
+	};
+
+	typedef std::shared_ptr<Bytes> Buffer;
+
+	FramePool()
+		: bufferSize(0)
+		, allocations(0)
+		, acquisitions(0)
+	{}
+
+	~FramePool(void) {}
+
+	void reset(size_t bufferSize, uint32_t capacity) {
+		std::lock_guard<std::mutex> lock(m);
+		this->bufferSize = bufferSize;
+		this->freeBuffers.clear();
+		this->freeBuffers.reserve(capacity);
+		for (uint32_t i = 0; i < capacity; i++) {
+			this->freeBuffers.push_back(std::make_shared<Bytes>(bufferSize));
+			this->allocations++;
+		}
+	}
+
+	Buffer acquire() {
+		std::lock_guard<std::mutex> lock(m);
+		this->acquisitions++;
+		if (!this->freeBuffers.empty()) {
+			Buffer buffer = std::move(this->freeBuffers.back());
+			this->freeBuffers.pop_back();
+			return buffer;
+		}
+		this->allocations++;
+		return std::make_shared<Bytes>(this->bufferSize);
+	}
+
+	void release(Buffer buffer) {
+		if (!buffer || buffer->size() != this->bufferSize) {
+			return;
+		}
+		std::lock_guard<std::mutex> lock(m);
+		this->freeBuffers.push_back(std::move(buffer));
+	}
+
+	// Hands the buffer to a consumer that only keeps a raw pointer, such as an AVBufferRef. The
+	// buffer holds on to itself until the pointer comes back through giveBack(), which releases
+	// it to the pool, so lending needs no allocation of its own.
+	Bytes* lend(Buffer buffer) {
+		Bytes* pBytes = buffer.get();
+		pBytes->pLender = this;
+		pBytes->lent = std::move(buffer);
+		return pBytes;
+	}
+
+	static void giveBack(Bytes* pBytes) {
+		FramePool* pLender = pBytes->pLender;
+		Buffer buffer = std::move(pBytes->lent);
+		pBytes->pLender = NULL;
+		pLender->release(std::move(buffer));
+	}
+
+	size_t getBufferSize() {
+		return this->bufferSize;
+	}
+
+	uint64_t getAllocationCount() {
+		return this->allocations;
+	}
+
+	uint64_t getAcquisitionCount() {
+		return this->acquisitions;
+	}
+
+private:
+	size_t bufferSize;
+	std::atomic<uint64_t> allocations;
+	std::atomic<uint64_t> acquisitions;
+	std::vector<Buffer> freeBuffers;
+	std::mutex m;
+};
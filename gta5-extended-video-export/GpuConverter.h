@@ -0,0 +1,219 @@
+#pragma once
+
+#include <d3d11.h>
+#include <d3dcompiler.h>
+#include <wrl.h>
+#include <cstring>
+#include "gpu-conversion.h"
+#include "logger.h"
+
+#pragma comment(lib, "d3dcompiler.lib")
+
+// Runs the GpuConversion shader on captured textures. The capture is copied into a
+// texture the shader can read, and converted into an R8_UINT or R16_UINT texture
+// with a row for every row of every plane, which is then read back like any other
+// capture. The shader is compiled with the first frame, the textures are created
+// with it too and kept; a capture of another format creates them anew.
+//
+// The compute shader state of the game is put back after every dispatch.
+class GpuConverter {
+public:
+	GpuConverter()
+		: viewFormat(DXGI_FORMAT_UNKNOWN)
+	{
+		memset(&this->layout, 0, sizeof(this->layout));
+		memset(&this->sourceDesc, 0, sizeof(this->sourceDesc));
+	}
+
+	void reset(const GpuConversion::Layout& layout) {
+		this->layout = layout;
+		this->release();
+	}
+
+	const GpuConversion::Layout& getLayout() const {
+		return this->layout;
+	}
+
+	// Queues the conversion of pSource into the output texture.
+	HRESULT convert(ID3D11DeviceContext* pDeviceContext, ID3D11Texture2D* pSource) {
+		D3D11_TEXTURE2D_DESC desc;
+		pSource->GetDesc(&desc);
+		if ((desc.Width != this->layout.width) || (desc.Height != this->layout.height)) {
+			return E_INVALIDARG;
+		}
+		if (!this->pOutput || (memcmp(&desc, &this->sourceDesc, sizeof(desc)) != 0)) {
+			HRESULT hr = this->create(pDeviceContext, desc);
+			if (FAILED(hr)) {
+				this->release();
+				return hr;
+			}
+		}
+
+		if (desc.SampleDesc.Count > 1) {
+			pDeviceContext->ResolveSubresource(this->pSourceCopy.Get(), 0, pSource, 0, this->viewFormat);
+		} else {
+			pDeviceContext->CopyResource(this->pSourceCopy.Get(), pSource);
+		}
+
+		Microsoft::WRL::ComPtr<ID3D11ComputeShader> pGameShader;
+		Microsoft::WRL::ComPtr<ID3D11ShaderResourceView> pGameView;
+		Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView> pGameUnorderedView;
+		Microsoft::WRL::ComPtr<ID3D11Buffer> pGameConstants;
+		pDeviceContext->CSGetShader(pGameShader.GetAddressOf(), NULL, NULL);
+		pDeviceContext->CSGetShaderResources(0, 1, pGameView.GetAddressOf());
+		pDeviceContext->CSGetUnorderedAccessViews(0, 1, pGameUnorderedView.GetAddressOf());
+		pDeviceContext->CSGetConstantBuffers(0, 1, pGameConstants.GetAddressOf());
+
+		ID3D11ShaderResourceView* views[] = { this->pSourceView.Get() };
+		ID3D11UnorderedAccessView* unorderedViews[] = { this->pOutputView.Get() };
+		ID3D11Buffer* constants[] = { this->pConstants.Get() };
+		pDeviceContext->CSSetShader(this->pShader.Get(), NULL, 0);
+		pDeviceContext->CSSetShaderResources(0, 1, views);
+		pDeviceContext->CSSetUnorderedAccessViews(0, 1, unorderedViews, NULL);
+		pDeviceContext->CSSetConstantBuffers(0, 1, constants);
+		pDeviceContext->Dispatch((this->layout.width + GpuConversion::GROUP_SIZE - 1) / GpuConversion::GROUP_SIZE,
+			(this->layout.rows + GpuConversion::GROUP_SIZE - 1) / GpuConversion::GROUP_SIZE, 1);
+
+		views[0] = pGameView.Get();
+		unorderedViews[0] = pGameUnorderedView.Get();
+		constants[0] = pGameConstants.Get();
+		pDeviceContext->CSSetShader(pGameShader.Get(), NULL, 0);
+		pDeviceContext->CSSetShaderResources(0, 1, views);
+		pDeviceContext->CSSetUnorderedAccessViews(0, 1, unorderedViews, NULL);
+		pDeviceContext->CSSetConstantBuffers(0, 1, constants);
+		return S_OK;
+	}
+
+	// Texture with the converted picture of the last convert().
+	ID3D11Texture2D* getOutput() {
+		return this->pOutput.Get();
+	}
+
+	// Typeless format a capture is copied into and the UNORM format the shader reads it
+	// with, so that sRGB captures are not decoded on the way. False for captures that are
+	// not 8 bit BGRA or RGBA.
+	static bool getSourceFormats(DXGI_FORMAT format, DXGI_FORMAT& typelessFormat, DXGI_FORMAT& viewFormat) {
+		switch (format) {
+		case DXGI_FORMAT_B8G8R8A8_TYPELESS:
+		case DXGI_FORMAT_B8G8R8A8_UNORM:
+		case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:
+			typelessFormat = DXGI_FORMAT_B8G8R8A8_TYPELESS;
+			viewFormat = DXGI_FORMAT_B8G8R8A8_UNORM;
+			return true;
+		case DXGI_FORMAT_B8G8R8X8_TYPELESS:
+		case DXGI_FORMAT_B8G8R8X8_UNORM:
+		case DXGI_FORMAT_B8G8R8X8_UNORM_SRGB:
+			typelessFormat = DXGI_FORMAT_B8G8R8X8_TYPELESS;
+			viewFormat = DXGI_FORMAT_B8G8R8X8_UNORM;
+			return true;
+		case DXGI_FORMAT_R8G8B8A8_TYPELESS:
+		case DXGI_FORMAT_R8G8B8A8_UNORM:
+		case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+			typelessFormat = DXGI_FORMAT_R8G8B8A8_TYPELESS;
+			viewFormat = DXGI_FORMAT_R8G8B8A8_UNORM;
+			return true;
+		default:
+			return false;
+		}
+	}
+
+private:
+	HRESULT create(ID3D11DeviceContext* pDeviceContext, const D3D11_TEXTURE2D_DESC& desc) {
+		this->release();
+		DXGI_FORMAT typelessFormat;
+		if (!getSourceFormats(desc.Format, typelessFormat, this->viewFormat)) {
+			LOG(LL_ERR, "GPU conversion doesn't support the capture format ", desc.Format);
+			return E_INVALIDARG;
+		}
+
+		Microsoft::WRL::ComPtr<ID3D11Device> pDevice;
+		pDeviceContext->GetDevice(pDevice.GetAddressOf());
+
+		Microsoft::WRL::ComPtr<ID3DBlob> pCode;
+		Microsoft::WRL::ComPtr<ID3DBlob> pErrors;
+		HRESULT hr = D3DCompile(GpuConversion::SHADER_SOURCE, strlen(GpuConversion::SHADER_SOURCE), "gpu-conversion", NULL, NULL, "main", "cs_5_0", D3DCOMPILE_OPTIMIZATION_LEVEL3, 0, pCode.GetAddressOf(), pErrors.GetAddressOf());
+		if (FAILED(hr)) {
+			LOG(LL_ERR, "Could not compile the GPU conversion shader: ", pErrors ? std::string((const char*)pErrors->GetBufferPointer(), pErrors->GetBufferSize()) : std::string());
+			return hr;
+		}
+		hr = pDevice->CreateComputeShader(pCode->GetBufferPointer(), pCode->GetBufferSize(), NULL, this->pShader.GetAddressOf());
+		if (FAILED(hr)) {
+			return hr;
+		}
+
+		D3D11_BUFFER_DESC constantsDesc = { 0 };
+		constantsDesc.ByteWidth = sizeof(GpuConversion::Constants);
+		constantsDesc.Usage = D3D11_USAGE_IMMUTABLE;
+		constantsDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+		D3D11_SUBRESOURCE_DATA constantsData = { &this->layout.constants, 0, 0 };
+		hr = pDevice->CreateBuffer(&constantsDesc, &constantsData, this->pConstants.GetAddressOf());
+		if (FAILED(hr)) {
+			return hr;
+		}
+
+		D3D11_TEXTURE2D_DESC copyDesc = desc;
+		copyDesc.Format = typelessFormat;
+		copyDesc.SampleDesc.Count = 1;
+		copyDesc.SampleDesc.Quality = 0;
+		copyDesc.Usage = D3D11_USAGE_DEFAULT;
+		copyDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+		copyDesc.CPUAccessFlags = 0;
+		copyDesc.MiscFlags = 0;
+		hr = pDevice->CreateTexture2D(&copyDesc, NULL, this->pSourceCopy.GetAddressOf());
+		if (FAILED(hr)) {
+			return hr;
+		}
+		D3D11_SHADER_RESOURCE_VIEW_DESC viewDesc;
+		memset(&viewDesc, 0, sizeof(viewDesc));
+		viewDesc.Format = this->viewFormat;
+		viewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+		viewDesc.Texture2D.MipLevels = 1;
+		hr = pDevice->CreateShaderResourceView(this->pSourceCopy.Get(), &viewDesc, this->pSourceView.GetAddressOf());
+		if (FAILED(hr)) {
+			return hr;
+		}
+
+		D3D11_TEXTURE2D_DESC outputDesc = copyDesc;
+		outputDesc.Width = this->layout.width;
+		outputDesc.Height = this->layout.rows;
+		outputDesc.MipLevels = 1;
+		outputDesc.ArraySize = 1;
+		outputDesc.Format = this->layout.bytesPerSample == 2 ? DXGI_FORMAT_R16_UINT : DXGI_FORMAT_R8_UINT;
+		outputDesc.BindFlags = D3D11_BIND_UNORDERED_ACCESS;
+		hr = pDevice->CreateTexture2D(&outputDesc, NULL, this->pOutput.GetAddressOf());
+		if (FAILED(hr)) {
+			return hr;
+		}
+		D3D11_UNORDERED_ACCESS_VIEW_DESC unorderedViewDesc;
+		memset(&unorderedViewDesc, 0, sizeof(unorderedViewDesc));
+		unorderedViewDesc.Format = outputDesc.Format;
+		unorderedViewDesc.ViewDimension = D3D11_UAV_DIMENSION_TEXTURE2D;
+		hr = pDevice->CreateUnorderedAccessView(this->pOutput.Get(), &unorderedViewDesc, this->pOutputView.GetAddressOf());
+		if (FAILED(hr)) {
+			return hr;
+		}
+
+		this->sourceDesc = desc;
+		return S_OK;
+	}
+
+	void release() {
+		this->pShader = nullptr;
+		this->pConstants = nullptr;
+		this->pSourceCopy = nullptr;
+		this->pSourceView = nullptr;
+		this->pOutput = nullptr;
+		this->pOutputView = nullptr;
+		memset(&this->sourceDesc, 0, sizeof(this->sourceDesc));
+	}
+
+	GpuConversion::Layout layout;
+	D3D11_TEXTURE2D_DESC sourceDesc;
+	DXGI_FORMAT viewFormat;
+	Microsoft::WRL::ComPtr<ID3D11ComputeShader> pShader;
+	Microsoft::WRL::ComPtr<ID3D11Buffer> pConstants;
+	Microsoft::WRL::ComPtr<ID3D11Texture2D> pSourceCopy;
+	Microsoft::WRL::ComPtr<ID3D11ShaderResourceView> pSourceView;
+	Microsoft::WRL::ComPtr<ID3D11Texture2D> pOutput;
+	Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView> pOutputView;
+};
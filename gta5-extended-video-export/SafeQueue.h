@@ -21,7 +21,7 @@ public:
 		while (q.size() >= capacity) {
 			cv_full.wait(lock);
 		}
-		q.push(t);
+		q.push(std::move(t));
 		cv_empty.notify_one();
 	}
 
@@ -30,7 +30,7 @@ public:
 		while (q.empty()) {
 			cv_empty.wait(lock);
 		}
-		T val = q.front();
+		T val = std::move(q.front());
 		q.pop();
 		if (q.size() < capacity) {
 			cv_full.notify_one();
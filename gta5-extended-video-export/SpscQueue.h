@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <immintrin.h>
+
+// Bounded single-producer/single-consumer ring.
+//
+// Items are moved in and moved out, so handing over a shared_ptr or a struct
+// holding ComPtrs does not touch any reference counts. The producer only ever
+// writes the tail index and the consumer only ever writes the head index; both
+// live on their own cache line. A blocked side spins for a short while and only
+// then goes to sleep on a condition variable, so the OS is only involved when
+// the ring is really full or really empty.
+//
+// Exactly one thread may call enqueue() and one thread may call dequeue() at a
+// time. Several producers are fine as long as they are serialized externally.
+template <class T>
+class SpscQueue {
+public:
+	SpscQueue(uint32_t capacity)
+		: capacity(capacity)
+		, slots(capacity)
+		, head(0)
+		, tail(0)
+		, isConsumerWaiting(false)
+		, isProducerWaiting(false)
+	{}
+
+	~SpscQueue(void) {}
+
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator=(const SpscQueue&) = delete;
+
+	void enqueue(T&& t) {
+		uint64_t currentTail = tail.load(std::memory_order_relaxed);
+		if (currentTail - head.load(std::memory_order_acquire) >= capacity) {
+			wait(isProducerWaiting, [&]() { return currentTail - head.load(std::memory_order_acquire) < capacity; });
+		}
+		slots[currentTail % capacity] = std::move(t);
+		tail.store(currentTail + 1, std::memory_order_seq_cst);
+		if (isConsumerWaiting.load(std::memory_order_seq_cst)) {
+			std::lock_guard<std::mutex> lock(m);
+			cv.notify_all();
+		}
+	}
+
+	T dequeue(void) {
+		uint64_t currentHead = head.load(std::memory_order_relaxed);
+		if (tail.load(std::memory_order_acquire) == currentHead) {
+			wait(isConsumerWaiting, [&]() { return tail.load(std::memory_order_acquire) != currentHead; });
+		}
+		T val = std::move(slots[currentHead % capacity]);
+		head.store(currentHead + 1, std::memory_order_seq_cst);
+		if (isProducerWaiting.load(std::memory_order_seq_cst)) {
+			std::lock_guard<std::mutex> lock(m);
+			cv.notify_all();
+		}
+		return val;
+	}
+
+	int getCapacity() {
+		return capacity;
+	}
+
+private:
+	static const uint32_t SPIN_COUNT = 256;
+	static const uint32_t YIELD_COUNT = 64;
+	static const size_t CACHE_LINE_SIZE = 64;
+
+	template <class Predicate>
+	void wait(std::atomic<bool>& isWaiting, Predicate isReady) {
+		// Spinning or yielding on a single core only delays the other side.
+		static const bool isMultiCore = std::thread::hardware_concurrency() > 1;
+		for (uint32_t i = 0; isMultiCore && (i < SPIN_COUNT + YIELD_COUNT); i++) {
+			if (isReady()) {
+				return;
+			}
+			if (i < SPIN_COUNT) {
+				_mm_pause();
+			} else {
+				std::this_thread::yield();
+			}
+		}
+
+		std::unique_lock<std::mutex> lock(m);
+		isWaiting.store(true, std::memory_order_seq_cst);
+		while (!isReady()) {
+			cv.wait(lock);
+		}
+		isWaiting.store(false, std::memory_order_relaxed);
+	}
+
+	uint32_t capacity;
+	std::vector<T> slots;
+
+	char padding0[CACHE_LINE_SIZE];
+	std::atomic<uint64_t> head;
+	char padding1[CACHE_LINE_SIZE - sizeof(std::atomic<uint64_t>)];
+	std::atomic<uint64_t> tail;
+	char padding2[CACHE_LINE_SIZE - sizeof(std::atomic<uint64_t>)];
+
+	std::atomic<bool> isConsumerWaiting;
+	std::atomic<bool> isProducerWaiting;
+	std::mutex m;
+	std::condition_variable cv;
+};
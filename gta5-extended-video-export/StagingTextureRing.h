@@ -0,0 +1,115 @@
+#pragma once
+
+#include <d3d11.h>
+#include <wrl.h>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+// Staging textures that captured textures are copied into to be read back, one
+// for each slot of a Readback::Ring. They are all created with the first copy
+// and kept from then on, so capturing doesn't create resources for every frame.
+// A source of another size or format creates them anew. getCreationCount()
+// makes the reuse visible.
+//
+// An event query is ended after every copy, so isReady() tells without waiting
+// whether the GPU is done with it. A multisampled source is resolved into a
+// texture of its own first.
+class StagingTextureRing {
+public:
+	StagingTextureRing()
+		: slotCount(1)
+		, creations(0)
+	{
+		memset(&this->desc, 0, sizeof(this->desc));
+	}
+
+	void reset(uint32_t slotCount) {
+		this->slotCount = slotCount;
+		this->textures.clear();
+		this->queries.clear();
+		this->pResolved = nullptr;
+		memset(&this->desc, 0, sizeof(this->desc));
+	}
+
+	// Queues a copy of pSource into the staging texture of slot.
+	HRESULT copy(ID3D11DeviceContext* pDeviceContext, ID3D11Texture2D* pSource, uint32_t slot) {
+		D3D11_TEXTURE2D_DESC sourceDesc;
+		pSource->GetDesc(&sourceDesc);
+		D3D11_TEXTURE2D_DESC desc = sourceDesc;
+		desc.SampleDesc.Count = 1;
+		desc.SampleDesc.Quality = 0;
+		desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+		desc.BindFlags = 0;
+		desc.MiscFlags = 0;
+		desc.Usage = D3D11_USAGE_STAGING;
+		if (this->textures.empty() || (memcmp(&desc, &this->desc, sizeof(desc)) != 0)) {
+			HRESULT hr = this->create(pDeviceContext, sourceDesc, desc);
+			if (FAILED(hr)) {
+				this->reset(this->slotCount);
+				return hr;
+			}
+		}
+
+		if (this->pResolved) {
+			pDeviceContext->ResolveSubresource(this->pResolved.Get(), 0, pSource, 0, desc.Format);
+			pDeviceContext->CopyResource(this->textures[slot].Get(), this->pResolved.Get());
+		} else {
+			pDeviceContext->CopyResource(this->textures[slot].Get(), pSource);
+		}
+		pDeviceContext->End(this->queries[slot].Get());
+		return S_OK;
+	}
+
+	// Whether the GPU is done with the last copy into slot, without flushing the context.
+	bool isReady(ID3D11DeviceContext* pDeviceContext, uint32_t slot) {
+		return pDeviceContext->GetData(this->queries[slot].Get(), NULL, 0, D3D11_ASYNC_GETDATA_DONOTFLUSH) == S_OK;
+	}
+
+	ID3D11Texture2D* get(uint32_t slot) {
+		return this->textures[slot].Get();
+	}
+
+	uint64_t getCreationCount() {
+		return this->creations;
+	}
+
+private:
+	HRESULT create(ID3D11DeviceContext* pDeviceContext, D3D11_TEXTURE2D_DESC sourceDesc, const D3D11_TEXTURE2D_DESC& desc) {
+		Microsoft::WRL::ComPtr<ID3D11Device> pDevice;
+		pDeviceContext->GetDevice(pDevice.GetAddressOf());
+		HRESULT hr = S_OK;
+		this->pResolved = nullptr;
+		if (sourceDesc.SampleDesc.Count > 1) {
+			sourceDesc.SampleDesc.Count = 1;
+			sourceDesc.SampleDesc.Quality = 0;
+			hr = pDevice->CreateTexture2D(&sourceDesc, NULL, this->pResolved.GetAddressOf());
+			if (FAILED(hr)) {
+				return hr;
+			}
+		}
+
+		D3D11_QUERY_DESC queryDesc = { D3D11_QUERY_EVENT, 0 };
+		this->textures.assign(this->slotCount, nullptr);
+		this->queries.assign(this->slotCount, nullptr);
+		for (uint32_t slot = 0; slot < this->slotCount; slot++) {
+			hr = pDevice->CreateTexture2D(&desc, NULL, this->textures[slot].GetAddressOf());
+			if (SUCCEEDED(hr)) {
+				hr = pDevice->CreateQuery(&queryDesc, this->queries[slot].GetAddressOf());
+			}
+			if (FAILED(hr)) {
+				return hr;
+			}
+			this->creations++;
+		}
+		this->desc = desc;
+		return S_OK;
+	}
+
+	uint32_t slotCount;
+	uint64_t creations;
+	D3D11_TEXTURE2D_DESC desc;
+	std::vector<Microsoft::WRL::ComPtr<ID3D11Texture2D>> textures;
+	std::vector<Microsoft::WRL::ComPtr<ID3D11Query>> queries;
+	Microsoft::WRL::ComPtr<ID3D11Texture2D> pResolved;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <algorithm>
+#include <thread>
+#include <cstdint>
+
+// Number of worker threads each stage of an export session may use.
+//
+// The stages run at the same time, so together they should not ask for more
+// cores than the game leaves free. split() shares the cores between them: the
+// EXR writers get a quarter, the motion blur accumulation an eighth (it runs for
+// every sub-frame), the conversion another eighth (it is vectorised and rarely
+// the bottleneck) and the video codec whatever is left. Audio encoding
+// gets a single thread and, like the capture and mux threads, spends
+// most of its time waiting, so it is not counted.
+struct ThreadBudget {
+	uint32_t cores;
+	uint32_t reservedCores;
+	uint32_t codecThreads;
+	uint32_t conversionThreads;
+	uint32_t blurThreads;
+	uint32_t exrThreads;
+	uint32_t audioThreads;
+
+	// threads is the number of cores to work with, 0 for all of them. reservedCores of those
+	// are left to the game. A conversionThreads other than 0 is taken as it is.
+	static ThreadBudget split(uint32_t threads, uint32_t reservedCores, uint32_t conversionThreads, bool isExportingOpenExr, bool isMotionBlurred) {
+		ThreadBudget budget;
+		budget.cores = threads ? threads : (std::max)(1u, std::thread::hardware_concurrency());
+		budget.reservedCores = (std::min)(reservedCores, budget.cores - 1);
+		const uint32_t workers = budget.cores - budget.reservedCores;
+
+		budget.audioThreads = 1;
+		budget.exrThreads = isExportingOpenExr ? (std::max)(1u, workers / 4) : 0;
+		budget.conversionThreads = conversionThreads ? conversionThreads : (std::min)(8u, (workers + 7) / 8);
+		budget.blurThreads = isMotionBlurred ? (std::min)(8u, (workers + 7) / 8) : 0;
+		const uint32_t taken = budget.exrThreads + budget.conversionThreads + budget.blurThreads;
+		budget.codecThreads = workers > taken ? workers - taken : 1;
+		return budget;
+	}
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+// Fixed set of worker threads that run one batch of indexed tasks at a time.
+//
+// run() hands task i to worker i % getThreadCount(), where worker 0 is the
+// calling thread itself, and returns once every task of the batch is done. The
+// same index always lands on the same thread, so per-task state such as a band's
+// SwsContext stays warm in that thread's cache from one frame to the next.
+//
+// Only one thread may call run() at a time, and tasks must not throw.
+class ThreadPool {
+public:
+	ThreadPool()
+		: task(nullptr)
+		, taskCount(0)
+		, generation(0)
+		, pending(0)
+		, isStopping(false)
+	{}
+
+	~ThreadPool(void) {
+		stop();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void start(uint32_t threadCount) {
+		stop();
+		std::lock_guard<std::mutex> lock(m);
+		this->isStopping = false;
+		for (uint32_t i = 1; i < threadCount; i++) {
+			this->workers.emplace_back(&ThreadPool::workerThread, this, i, this->generation);
+		}
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(m);
+			this->isStopping = true;
+		}
+		this->cvWork.notify_all();
+		for (auto& worker : this->workers) {
+			worker.join();
+		}
+		this->workers.clear();
+	}
+
+	uint32_t getThreadCount() {
+		return (uint32_t)this->workers.size() + 1;
+	}
+
+	void run(uint32_t taskCount, const std::function<void(uint32_t)>& task) {
+		if (this->workers.empty()) {
+			for (uint32_t i = 0; i < taskCount; i++) {
+				task(i);
+			}
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m);
+			this->task = &task;
+			this->taskCount = taskCount;
+			this->pending = (uint32_t)this->workers.size();
+			this->generation++;
+		}
+		this->cvWork.notify_all();
+
+		runTasks(0);
+
+		std::unique_lock<std::mutex> lock(m);
+		while (this->pending > 0) {
+			this->cvDone.wait(lock);
+		}
+		this->task = nullptr;
+	}
+
+private:
+	void runTasks(uint32_t worker) {
+		uint32_t threadCount = (uint32_t)this->workers.size() + 1;
+		for (uint32_t i = worker; i < this->taskCount; i += threadCount) {
+			(*this->task)(i);
+		}
+	}
+
+	void workerThread(uint32_t index, uint64_t lastGeneration) {
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(m);
+				while (!this->isStopping && (this->generation == lastGeneration)) {
+					this->cvWork.wait(lock);
+				}
+				if (this->isStopping) {
+					return;
+				}
+				lastGeneration = this->generation;
+			}
+
+			runTasks(index);
+
+			std::lock_guard<std::mutex> lock(m);
+			if (--this->pending == 0) {
+				this->cvDone.notify_all();
+			}
+		}
+	}
+
+	const std::function<void(uint32_t)>* task;
+	uint32_t taskCount;
+	uint64_t generation;
+	uint32_t pending;
+	bool isStopping;
+	std::vector<std::thread> workers;
+	std::mutex m;
+	std::condition_variable cvWork;
+	std::condition_variable cvDone;
+};
@@ -0,0 +1,120 @@
+#include "adaptive-sampling.h"
+#include <algorithm>
+#include <cstring>
+// SSE2 is part of x64, no detection needed.
+#include <emmintrin.h>
+
+namespace MotionBlur {
+	AdaptiveSampling::AdaptiveSampling() :
+		spans(1, 1),
+		previousSubFrame(0),
+		hasPrevious(false),
+		hasMotion(false),
+		width(0),
+		height(0),
+		span(1),
+		threshold(0.0f),
+		motion(0.0f),
+		frameMotion(-1.0f)
+	{}
+
+	void AdaptiveSampling::reset(uint32_t width, uint32_t height, uint32_t subFrames, uint32_t minSubFrames, float threshold) {
+		this->width = width;
+		this->height = height;
+		this->threshold = threshold;
+		this->current.assign((size_t)(width / STEP) * (height / STEP) * 4, 0);
+		this->previous.assign(this->current.size(), 0);
+		this->spans.assign(1, 1);
+		if (threshold > 0.0f) {
+			for (uint32_t span = 2; span <= subFrames; span++) {
+				if ((subFrames % span == 0) && (subFrames / span >= minSubFrames)) {
+					this->spans.push_back(span);
+				}
+			}
+		}
+		this->previousSubFrame = 0;
+		this->hasPrevious = false;
+		this->hasMotion = false;
+		this->span = 1;
+		this->motion = 0.0f;
+		this->frameMotion = -1.0f;
+	}
+
+	void AdaptiveSampling::measure(const uint8_t* pFrame, size_t rowPitch, uint64_t subFrame) {
+		if (!this->isEnabled()) {
+			return;
+		}
+
+		downsample(pFrame, rowPitch, this->width, this->height, this->current.data());
+		if (this->hasPrevious && (subFrame > this->previousSubFrame) && !this->current.empty()) {
+			const float difference = (float)sumOfAbsoluteDifferences(this->current.data(), this->previous.data(), this->current.size()) / this->current.size();
+			this->frameMotion = (std::max)(this->frameMotion, difference / (subFrame - this->previousSubFrame));
+		}
+		std::swap(this->current, this->previous);
+		this->previousSubFrame = subFrame;
+		this->hasPrevious = true;
+	}
+
+	uint32_t AdaptiveSampling::nextSpan() {
+		if (!this->isEnabled()) {
+			return this->span;
+		}
+
+		if (this->frameMotion >= 0.0f) {
+			this->motion = this->frameMotion;
+			this->hasMotion = true;
+		}
+		this->frameMotion = -1.0f;
+
+		// Largest span whose sub-frames stay under the threshold.
+		size_t needed = 0;
+		if (this->hasMotion) {
+			while ((needed + 1 < this->spans.size()) && (this->motion * this->spans[needed + 1] <= this->threshold)) {
+				needed++;
+			}
+		}
+
+		size_t index = std::find(this->spans.begin(), this->spans.end(), this->span) - this->spans.begin();
+		if (needed < index) {
+			index = needed;
+		} else if (needed > index) {
+			index++;
+		}
+		this->span = this->spans[index];
+		return this->span;
+	}
+
+	void AdaptiveSampling::downsample(const uint8_t* pFrame, size_t rowPitch, uint32_t width, uint32_t height, uint8_t* pDst) {
+		const uint32_t dstWidth = width / STEP;
+		for (uint32_t y = 0; y < height / STEP; y++) {
+			const uint8_t* pRow = pFrame + (size_t)y * STEP * rowPitch;
+			uint32_t x = 0;
+			// The first pixel of each of 4 loads of 4 pixels.
+			for (; x + 4 <= dstWidth; x += 4) {
+				const uint8_t* pSrc = pRow + (size_t)x * STEP * 4;
+				const __m128i first = _mm_unpacklo_epi32(_mm_loadu_si128((const __m128i*)pSrc), _mm_loadu_si128((const __m128i*)(pSrc + 16)));
+				const __m128i second = _mm_unpacklo_epi32(_mm_loadu_si128((const __m128i*)(pSrc + 32)), _mm_loadu_si128((const __m128i*)(pSrc + 48)));
+				_mm_storeu_si128((__m128i*)(pDst + 4 * x), _mm_unpacklo_epi64(first, second));
+			}
+			for (; x < dstWidth; x++) {
+				std::memcpy(pDst + 4 * x, pRow + (size_t)x * STEP * 4, 4);
+			}
+			pDst += 4 * dstWidth;
+		}
+	}
+
+	uint64_t AdaptiveSampling::sumOfAbsoluteDifferences(const uint8_t* pFirst, const uint8_t* pSecond, size_t length) {
+		__m128i sums = _mm_setzero_si128();
+		size_t i = 0;
+		for (; i + 16 <= length; i += 16) {
+			const __m128i first = _mm_loadu_si128((const __m128i*)(pFirst + i));
+			const __m128i second = _mm_loadu_si128((const __m128i*)(pSecond + i));
+			sums = _mm_add_epi64(sums, _mm_sad_epu8(first, second));
+		}
+		uint64_t sum = (uint64_t)_mm_cvtsi128_si64(sums) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+		for (; i < length; i++) {
+			sum += pFirst[i] > pSecond[i] ? pFirst[i] - pSecond[i] : pSecond[i] - pFirst[i];
+		}
+		return sum;
+	}
+}
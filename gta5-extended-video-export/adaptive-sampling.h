@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Adaptive temporal sampling renders fewer of the sub-frames of a motion blurred
+// frame while the image hardly changes. The sub-frames of the shutter stay the
+// grid everything is measured on: a rendered sub-frame stands for a span of them,
+// the game is stepped over the whole span, and the sub-frame is weighted with the
+// weights of the whole span. The shutter schedule, the total weight and so the
+// exposure stay the same whatever the span.
+//
+// The span only changes between two frames and always divides the number of
+// sub-frames per frame, so frames keep starting on the grid. It is picked from
+// the mean absolute difference between the last two sub-frames that were read
+// back, measured on a copy that keeps one pixel in 4 of every 4th row.
+namespace MotionBlur {
+	class AdaptiveSampling {
+	public:
+		// Every 4th pixel of every 4th row goes into the downsampled copy.
+		enum { STEP = 4 };
+
+		AdaptiveSampling();
+
+		// subFrames is the number of sub-frames per frame of the shutter, at least minSubFrames
+		// of them are rendered. threshold is the mean difference between two rendered
+		// sub-frames, in steps of a byte, that adaptive sampling tries to stay under. A
+		// threshold of 0 renders every sub-frame.
+		void reset(uint32_t width, uint32_t height, uint32_t subFrames, uint32_t minSubFrames, float threshold);
+
+		bool isEnabled() const {
+			return this->spans.size() > 1;
+		}
+
+		// Compares a BGRA frame, captured at sub-frame subFrame of the grid, to the last one.
+		void measure(const uint8_t* pFrame, size_t rowPitch, uint64_t subFrame);
+
+		// Picks the span of the next frame from the motion measured in the last one. More
+		// sub-frames are rendered right away, fewer only one step per frame, so that a
+		// short pause in the motion doesn't drop the sampling rate all at once.
+		uint32_t nextSpan();
+
+		uint32_t getSpan() const {
+			return this->span;
+		}
+
+		// Mean difference per sub-frame of the grid, in steps of a byte.
+		float getMotion() const {
+			return this->motion;
+		}
+
+		// Keeps every STEPth pixel of every STEPth row of a BGRA frame.
+		static void downsample(const uint8_t* pFrame, size_t rowPitch, uint32_t width, uint32_t height, uint8_t* pDst);
+
+		static uint64_t sumOfAbsoluteDifferences(const uint8_t* pFirst, const uint8_t* pSecond, size_t length);
+
+	private:
+		std::vector<uint8_t> current;
+		std::vector<uint8_t> previous;
+		// Spans the sampling can use, the divisors of the sub-frame count, smallest first.
+		std::vector<uint32_t> spans;
+		uint64_t previousSubFrame;
+		bool hasPrevious;
+		// Set once a motion was measured, the first frames render every sub-frame.
+		bool hasMotion;
+		uint32_t width;
+		uint32_t height;
+		uint32_t span;
+		float threshold;
+		float motion;
+		// Largest motion measured since the last nextSpan(), negative when there was none.
+		float frameMotion;
+	};
+}
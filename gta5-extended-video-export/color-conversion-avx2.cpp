@@ -0,0 +1,60 @@
+// Built for AVX2. Visual Studio needs no switch for the intrinsics, GCC and
+// clang get the target from the pragma below. The standard headers are
+// included first so that none of their inline functions pick up the target.
+#include <cstdint>
+
+#if defined(__GNUC__)
+#pragma GCC target("avx2")
+#endif
+
+#include <immintrin.h>
+#include "color-conversion-kernels.h"
+
+namespace ColorConversion {
+	namespace {
+		struct AVX2 {
+			typedef __m256i Vector;
+			enum { LANES = 8 };
+
+			static Vector load(const uint8_t* p) { return _mm256_loadu_si256((const __m256i*)p); }
+			static Vector set1(int32_t value) { return _mm256_set1_epi32(value); }
+			static Vector bitAnd(Vector a, Vector b) { return _mm256_and_si256(a, b); }
+			static Vector bitOr(Vector a, Vector b) { return _mm256_or_si256(a, b); }
+			static Vector add(Vector a, Vector b) { return _mm256_add_epi32(a, b); }
+			static Vector min(Vector a, Vector b) { return _mm256_min_epi32(a, b); }
+			static Vector max(Vector a, Vector b) { return _mm256_max_epi32(a, b); }
+			static Vector madd(Vector a, Vector b) { return _mm256_madd_epi16(a, b); }
+			template <int n> static Vector srli(Vector a) { return _mm256_srli_epi32(a, n); }
+			template <int n> static Vector slli(Vector a) { return _mm256_slli_epi32(a, n); }
+			template <int n> static Vector srai(Vector a) { return _mm256_srai_epi32(a, n); }
+			static Vector addOddLanes(Vector a) { return _mm256_add_epi32(a, _mm256_srli_epi64(a, 32)); }
+
+			// The shuffle works per 128 bit half, the permute puts the halves back in order.
+			static Vector compactEven(Vector a, Vector b) {
+				__m256 even = _mm256_shuffle_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b), _MM_SHUFFLE(2, 0, 2, 0));
+				return _mm256_permute4x64_epi64(_mm256_castps_si256(even), _MM_SHUFFLE(3, 1, 2, 0));
+			}
+
+			static void store(uint8_t* p, Vector a) {
+				__m128i words = _mm_packs_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+				_mm_storel_epi64((__m128i*)p, _mm_packus_epi16(words, words));
+			}
+
+			static void store(uint16_t* p, Vector a) {
+				_mm_storeu_si128((__m128i*)p, _mm_packus_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1)));
+			}
+
+			static void store(uint32_t* p, Vector a) {
+				_mm256_storeu_si256((__m256i*)p, a);
+			}
+		};
+	}
+
+	Kernel getAVX2Kernel(const OutputFormat& format) {
+		return selectKernel<AVX2>(format);
+	}
+
+	SplitKernel getAVX2SplitKernel(const OutputFormat& format) {
+		return selectSplitKernel<AVX2>(format);
+	}
+}
@@ -0,0 +1,73 @@
+// Built for AVX-512 F and BW. Visual Studio only has the intrinsics since
+// 2017 15.3, older compilers get a stub that reports no kernel. GCC and clang
+// get the target from the pragma below. The standard headers are included
+// first so that none of their inline functions pick up the target.
+#include <cstdint>
+
+#if defined(__GNUC__) || (defined(_MSC_VER) && (_MSC_VER >= 1911))
+#define COLOR_CONVERSION_AVX512
+#endif
+
+#if defined(__GNUC__)
+#pragma GCC target("avx512f,avx512bw")
+#endif
+
+#include <immintrin.h>
+#include "color-conversion-kernels.h"
+
+namespace ColorConversion {
+#if defined(COLOR_CONVERSION_AVX512)
+	namespace {
+		struct AVX512 {
+			typedef __m512i Vector;
+			enum { LANES = 16 };
+
+			static Vector load(const uint8_t* p) { return _mm512_loadu_si512((const void*)p); }
+			static Vector set1(int32_t value) { return _mm512_set1_epi32(value); }
+			static Vector bitAnd(Vector a, Vector b) { return _mm512_and_si512(a, b); }
+			static Vector bitOr(Vector a, Vector b) { return _mm512_or_si512(a, b); }
+			static Vector add(Vector a, Vector b) { return _mm512_add_epi32(a, b); }
+			static Vector min(Vector a, Vector b) { return _mm512_min_epi32(a, b); }
+			static Vector max(Vector a, Vector b) { return _mm512_max_epi32(a, b); }
+			static Vector madd(Vector a, Vector b) { return _mm512_madd_epi16(a, b); }
+			template <int n> static Vector srli(Vector a) { return _mm512_srli_epi32(a, n); }
+			template <int n> static Vector slli(Vector a) { return _mm512_slli_epi32(a, n); }
+			template <int n> static Vector srai(Vector a) { return _mm512_srai_epi32(a, n); }
+			static Vector addOddLanes(Vector a) { return _mm512_add_epi32(a, _mm512_srli_epi64(a, 32)); }
+
+			static Vector compactEven(Vector a, Vector b) {
+				const __m512i indices = _mm512_set_epi32(30, 28, 26, 24, 22, 20, 18, 16, 14, 12, 10, 8, 6, 4, 2, 0);
+				return _mm512_permutex2var_epi32(a, indices, b);
+			}
+
+			static void store(uint8_t* p, Vector a) {
+				_mm_storeu_si128((__m128i*)p, _mm512_cvtepi32_epi8(a));
+			}
+
+			static void store(uint16_t* p, Vector a) {
+				_mm256_storeu_si256((__m256i*)p, _mm512_cvtepi32_epi16(a));
+			}
+
+			static void store(uint32_t* p, Vector a) {
+				_mm512_storeu_si512((void*)p, a);
+			}
+		};
+	}
+
+	Kernel getAVX512Kernel(const OutputFormat& format) {
+		return selectKernel<AVX512>(format);
+	}
+
+	SplitKernel getAVX512SplitKernel(const OutputFormat& format) {
+		return selectSplitKernel<AVX512>(format);
+	}
+#else
+	Kernel getAVX512Kernel(const OutputFormat& format) {
+		return NULL;
+	}
+
+	SplitKernel getAVX512SplitKernel(const OutputFormat& format) {
+		return NULL;
+	}
+#endif
+}
@@ -0,0 +1,451 @@
+#pragma once
+
+// Kernel templates shared by color-conversion.cpp and the translation units of
+// each instruction set. Each of those translation units includes this header
+// with an Isa struct wrapping the vector operations:
+//
+//   Vector, LANES                   vector of LANES 32 bit lanes, one pixel per lane
+//   load(p)                         loads LANES BGRA pixels, or LANES 32 bit values
+//   set1, bitAnd, bitOr, add, min, max, srli<n>, slli<n>, srai<n>
+//   madd(a, b)                      pmaddwd: sums the products of the two 16 bit halves
+//   addOddLanes(a)                  adds every odd lane to the even lane before it
+//   compactEven(a, b)               the even lanes of a, followed by the even lanes of b
+//   store(uint8_t*/uint16_t*, v)    stores LANES values that are already clamped
+//   store(uint32_t*, v)             stores LANES values as they are
+//
+// Everything is in an unnamed namespace on purpose: every translation unit is
+// built for a different instruction set and must not share inline functions
+// with the others through the linker.
+
+#include "color-conversion.h"
+#include <cstddef>
+
+namespace ColorConversion {
+	namespace {
+		// The scalar kernel has no vector part at all.
+		struct Scalar {};
+
+		template <int depth>
+		struct Sample {
+			typedef uint16_t Type;
+		};
+
+		template <>
+		struct Sample<8> {
+			typedef uint8_t Type;
+		};
+
+		// Shift that brings a sum of Q15 weights times 2^samplesLog2 pixels of inputDepth bits
+		// to the output depth.
+		template <int depth, int inputDepth, int samplesLog2>
+		struct Shift {
+			enum { VALUE = 15 - (depth - inputDepth) + samplesLog2 };
+		};
+
+		// A row of BGRA bytes.
+		struct PackedRow {
+			enum { DEPTH = 8 };
+
+			const uint8_t* p;
+
+			int get(int x, int channel) const {
+				return this->p[4 * x + channel];
+			}
+		};
+
+		// A row in the split layout of SplitKernel, with samples of depth bits.
+		template <int depth>
+		struct SplitRow {
+			enum { DEPTH = depth };
+
+			const uint32_t* p;
+			int width;
+
+			int get(int x, int channel) const {
+				const uint32_t pair = (channel & 1) ? this->p[this->width + x] : this->p[x];
+				return (channel & 2) ? (int)(pair >> 16) : (int)(pair & 0xFFFF);
+			}
+		};
+
+		// Loads the (B, R) and (G, A) pairs of LANES pixels into the 16 bit halves of the lanes.
+		template <class Isa, class Row>
+		struct Pairs;
+
+		template <class Isa>
+		struct Pairs<Isa, PackedRow> {
+			typedef typename Isa::Vector V;
+
+			static void load(const PackedRow& row, int x, V mask, V& br, V& ga) {
+				V pixels = Isa::load(row.p + 4 * x);
+				br = Isa::bitAnd(pixels, mask);
+				ga = Isa::bitAnd(Isa::template srli<8>(pixels), mask);
+			}
+		};
+
+		template <class Isa, int depth>
+		struct Pairs<Isa, SplitRow<depth> > {
+			typedef typename Isa::Vector V;
+
+			static void load(const SplitRow<depth>& row, int x, V, V& br, V& ga) {
+				br = Isa::load((const uint8_t*)(row.p + x));
+				ga = Isa::load((const uint8_t*)(row.p + row.width + x));
+			}
+		};
+
+		inline int32_t packWeights(int16_t low, int16_t high) {
+			return (int32_t)((uint32_t)(uint16_t)low | ((uint32_t)(uint16_t)high << 16));
+		}
+
+		inline int32_t roundingTerm(int32_t offset, int shift) {
+			return (offset << shift) + (1 << (shift - 1));
+		}
+
+		// Same sum as the vector code: madd of (B, R) and (G, A) with (wB, wR) and (wG, 0).
+		inline int32_t weigh(int32_t b, int32_t g, int32_t r, const int16_t weights[3], int32_t rounding, int shift, int32_t maxValue) {
+			int32_t value = ((weights[0] * b + weights[2] * r) + weights[1] * g + rounding) >> shift;
+			return value < 0 ? 0 : (value > maxValue ? maxValue : value);
+		}
+
+		template <class Isa, class Row, int depth>
+		struct VectorLuma {
+			typedef typename Sample<depth>::Type T;
+			typedef typename Isa::Vector V;
+
+			static int run(const Coefficients& c, const Row& row, int width, T* pDst) {
+				enum { SHIFT = Shift<depth, Row::DEPTH, 0>::VALUE };
+				const V mask = Isa::set1(0x00FF00FF);
+				const V weightsBR = Isa::set1(packWeights(c.y[0], c.y[2]));
+				const V weightsGA = Isa::set1(packWeights(c.y[1], 0));
+				const V rounding = Isa::set1(roundingTerm(c.yOffset, SHIFT));
+				const V zero = Isa::set1(0);
+				const V maxValue = Isa::set1(c.maxValue);
+
+				int x = 0;
+				for (; x + Isa::LANES <= width; x += Isa::LANES) {
+					V br, ga;
+					Pairs<Isa, Row>::load(row, x, mask, br, ga);
+					V value = Isa::add(Isa::add(Isa::madd(br, weightsBR), Isa::madd(ga, weightsGA)), rounding);
+					value = Isa::template srai<SHIFT>(value);
+					Isa::store(pDst + x, Isa::min(Isa::max(value, zero), maxValue));
+				}
+				return x;
+			}
+		};
+
+		template <class Row, int depth>
+		struct VectorLuma<Scalar, Row, depth> {
+			static int run(const Coefficients&, const Row&, int, typename Sample<depth>::Type*) {
+				return 0;
+			}
+		};
+
+		template <class Isa, class Row, int shiftX, int shiftY, bool isInterleaved, int depth>
+		struct VectorChroma {
+			typedef typename Sample<depth>::Type T;
+			typedef typename Isa::Vector V;
+			enum { SHIFT = Shift<depth, Row::DEPTH, shiftX + shiftY>::VALUE };
+
+			// Sums of (B, R) and (G, A) over the pixels that share a chroma sample. With horizontal
+			// subsampling only the even lanes hold a complete sum.
+			static void sum(const Row& row0, const Row& row1, int x, V mask, V& br, V& ga) {
+				Pairs<Isa, Row>::load(row0, x, mask, br, ga);
+				if (shiftY) {
+					V br1, ga1;
+					Pairs<Isa, Row>::load(row1, x, mask, br1, ga1);
+					br = Isa::add(br, br1);
+					ga = Isa::add(ga, ga1);
+				}
+				if (shiftX) {
+					br = Isa::addOddLanes(br);
+					ga = Isa::addOddLanes(ga);
+				}
+			}
+
+			static V weigh(V br, V ga, V weightsBR, V weightsGA, V rounding) {
+				return Isa::template srai<SHIFT>(Isa::add(Isa::add(Isa::madd(br, weightsBR), Isa::madd(ga, weightsGA)), rounding));
+			}
+
+			static int run(const Coefficients& c, const Row& row0, const Row& row1, int width, T* pU, T* pV) {
+				const V mask = Isa::set1(0x00FF00FF);
+				const V weightsUBR = Isa::set1(packWeights(c.u[0], c.u[2]));
+				const V weightsUGA = Isa::set1(packWeights(c.u[1], 0));
+				const V weightsVBR = Isa::set1(packWeights(c.v[0], c.v[2]));
+				const V weightsVGA = Isa::set1(packWeights(c.v[1], 0));
+				const V rounding = Isa::set1(roundingTerm(c.cOffset, SHIFT));
+				const V zero = Isa::set1(0);
+				const V maxValue = Isa::set1(c.maxValue);
+
+				int cx = 0;
+				for (; ((cx + Isa::LANES) << shiftX) <= width; cx += Isa::LANES) {
+					V br, ga, u, v;
+					sum(row0, row1, cx << shiftX, mask, br, ga);
+					u = weigh(br, ga, weightsUBR, weightsUGA, rounding);
+					v = weigh(br, ga, weightsVBR, weightsVGA, rounding);
+					if (shiftX) {
+						sum(row0, row1, (cx << shiftX) + Isa::LANES, mask, br, ga);
+						u = Isa::compactEven(u, weigh(br, ga, weightsUBR, weightsUGA, rounding));
+						v = Isa::compactEven(v, weigh(br, ga, weightsVBR, weightsVGA, rounding));
+					}
+					u = Isa::min(Isa::max(u, zero), maxValue);
+					v = Isa::min(Isa::max(v, zero), maxValue);
+					if (isInterleaved) {
+						Isa::store((uint16_t*)pU + cx, Isa::bitOr(u, Isa::template slli<8>(v)));
+					} else {
+						Isa::store(pU + cx, u);
+						Isa::store(pV + cx, v);
+					}
+				}
+				return cx;
+			}
+		};
+
+		template <class Row, int shiftX, int shiftY, bool isInterleaved, int depth>
+		struct VectorChroma<Scalar, Row, shiftX, shiftY, isInterleaved, depth> {
+			static int run(const Coefficients&, const Row&, const Row&, int, typename Sample<depth>::Type*, typename Sample<depth>::Type*) {
+				return 0;
+			}
+		};
+
+		// Sums over blocks of 1 << log2 source columns and the given number of rows, one block
+		// per lane. B and R, and G and A, are summed as 16 bit halves of the lanes.
+		template <class Isa, int log2>
+		struct BoxSum {
+			typedef typename Isa::Vector V;
+
+			static void run(const uint8_t* pSrc, int srcStride, int rows, int x, V mask, V& br, V& ga) {
+				V br0, ga0, br1, ga1;
+				BoxSum<Isa, log2 - 1>::run(pSrc, srcStride, rows, x, mask, br0, ga0);
+				BoxSum<Isa, log2 - 1>::run(pSrc, srcStride, rows, x + (Isa::LANES << (log2 - 1)), mask, br1, ga1);
+				br = Isa::compactEven(Isa::addOddLanes(br0), Isa::addOddLanes(br1));
+				ga = Isa::compactEven(Isa::addOddLanes(ga0), Isa::addOddLanes(ga1));
+			}
+		};
+
+		template <class Isa>
+		struct BoxSum<Isa, 0> {
+			typedef typename Isa::Vector V;
+
+			static void run(const uint8_t* pSrc, int srcStride, int rows, int x, V mask, V& br, V& ga) {
+				br = Isa::set1(0);
+				ga = Isa::set1(0);
+				for (int dy = 0; dy < rows; dy++) {
+					V pixels = Isa::load(pSrc + (ptrdiff_t)dy * srcStride + 4 * x);
+					br = Isa::add(br, Isa::bitAnd(pixels, mask));
+					ga = Isa::add(ga, Isa::bitAnd(Isa::template srli<8>(pixels), mask));
+				}
+			}
+		};
+
+		// Box filter over blocks of 1 << factorLog2 pixels squared. 16 pixels of 255 still fit
+		// in the 16 bit halves.
+		template <class Isa, int factorLog2>
+		struct VectorBox {
+			typedef typename Isa::Vector V;
+			enum { FACTOR = 1 << factorLog2, SHIFT = 2 * factorLog2 };
+
+			static int run(const uint8_t* pSrc, int srcStride, int width, uint8_t* pDst) {
+				const V mask = Isa::set1(0x00FF00FF);
+				const V rounding = Isa::set1(((FACTOR * FACTOR) / 2) * 0x00010001);
+
+				int x = 0;
+				for (; x + Isa::LANES <= width; x += Isa::LANES) {
+					V br, ga;
+					BoxSum<Isa, factorLog2>::run(pSrc, srcStride, FACTOR, x << factorLog2, mask, br, ga);
+					br = Isa::bitAnd(Isa::template srli<SHIFT>(Isa::add(br, rounding)), mask);
+					ga = Isa::bitAnd(Isa::template srli<SHIFT>(Isa::add(ga, rounding)), mask);
+					Isa::store((uint32_t*)(pDst + 4 * x), Isa::bitOr(br, Isa::template slli<8>(ga)));
+				}
+				return x;
+			}
+		};
+
+		template <int factorLog2>
+		struct VectorBox<Scalar, factorLog2> {
+			static int run(const uint8_t*, int, int, uint8_t*) {
+				return 0;
+			}
+		};
+
+		// Averages one row of blocks of the source into width BGRA pixels.
+		template <class Isa, int factorLog2>
+		void downsampleRow(const uint8_t* pSrc, int srcStride, int width, uint8_t* pDst) {
+			const int factor = 1 << factorLog2;
+			const int rounding = (factor * factor) / 2;
+			for (int x = VectorBox<Isa, factorLog2>::run(pSrc, srcStride, width, pDst); x < width; x++) {
+				for (int i = 0; i < 4; i++) {
+					int sum = rounding;
+					for (int dy = 0; dy < factor; dy++) {
+						const uint8_t* pRow = pSrc + (ptrdiff_t)dy * srcStride + 4 * (x << factorLog2);
+						for (int dx = 0; dx < factor; dx++) {
+							sum += pRow[4 * dx + i];
+						}
+					}
+					pDst[4 * x + i] = (uint8_t)(sum >> (2 * factorLog2));
+				}
+			}
+		}
+
+		template <class Isa, class Row, int depth>
+		void convertLumaRow(const Coefficients& c, const Row& row, int width, typename Sample<depth>::Type* pDst) {
+			const int shift = Shift<depth, Row::DEPTH, 0>::VALUE;
+			const int32_t rounding = roundingTerm(c.yOffset, shift);
+			for (int x = VectorLuma<Isa, Row, depth>::run(c, row, width, pDst); x < width; x++) {
+				pDst[x] = (typename Sample<depth>::Type)weigh(row.get(x, 0), row.get(x, 1), row.get(x, 2), c.y, rounding, shift, c.maxValue);
+			}
+		}
+
+		template <class Isa, class Row, int shiftX, int shiftY, bool isInterleaved, int depth>
+		void convertChromaRow(const Coefficients& c, const Row& row0, const Row& row1, int width, typename Sample<depth>::Type* pU, typename Sample<depth>::Type* pV) {
+			typedef typename Sample<depth>::Type T;
+			const int shift = Shift<depth, Row::DEPTH, shiftX + shiftY>::VALUE;
+			const int32_t rounding = roundingTerm(c.cOffset, shift);
+			const int chromaWidth = (width + (1 << shiftX) - 1) >> shiftX;
+			for (int cx = VectorChroma<Isa, Row, shiftX, shiftY, isInterleaved, depth>::run(c, row0, row1, width, pU, pV); cx < chromaWidth; cx++) {
+				// An odd last column counts its only pixel twice, like an odd last row does.
+				const int x0 = cx << shiftX;
+				const int x1 = (shiftX && (x0 + 1 < width)) ? x0 + 1 : x0;
+				int32_t sums[3];
+				for (int i = 0; i < 3; i++) {
+					sums[i] = row0.get(x0, i);
+					if (shiftX) {
+						sums[i] += row0.get(x1, i);
+					}
+					if (shiftY) {
+						sums[i] += row1.get(x0, i) + (shiftX ? row1.get(x1, i) : 0);
+					}
+				}
+				T u = (T)weigh(sums[0], sums[1], sums[2], c.u, rounding, shift, c.maxValue);
+				T v = (T)weigh(sums[0], sums[1], sums[2], c.v, rounding, shift, c.maxValue);
+				if (isInterleaved) {
+					pU[2 * cx] = u;
+					pU[2 * cx + 1] = v;
+				} else {
+					pU[cx] = u;
+					pV[cx] = v;
+				}
+			}
+		}
+
+		// Converts row y, and row y + 1 if there is one, from a pair of rows that share the chroma
+		// samples. Without a second row, row1 is the first row again.
+		template <class Isa, class Row, int shiftX, int shiftY, bool isInterleaved, int depth>
+		void convertRows(const Coefficients& c, const Row& row0, const Row& row1, bool hasRow1, int y, int width, uint8_t* const pDst[3], const int dstStride[3]) {
+			typedef typename Sample<depth>::Type T;
+			convertLumaRow<Isa, Row, depth>(c, row0, width, (T*)(pDst[0] + (ptrdiff_t)y * dstStride[0]));
+			if (hasRow1) {
+				convertLumaRow<Isa, Row, depth>(c, row1, width, (T*)(pDst[0] + (ptrdiff_t)(y + 1) * dstStride[0]));
+			}
+
+			const int cy = y >> shiftY;
+			T* pU = (T*)(pDst[1] + (ptrdiff_t)cy * dstStride[1]);
+			T* pV = isInterleaved ? NULL : (T*)(pDst[2] + (ptrdiff_t)cy * dstStride[2]);
+			convertChromaRow<Isa, Row, shiftX, shiftY, isInterleaved, depth>(c, row0, row1, width, pU, pV);
+		}
+
+		template <class Isa, int shiftX, int shiftY, bool isInterleaved, int depth, int downsampleLog2>
+		void convert(const Converter& converter, const uint8_t* pSrc, int srcStride, int width, int rows, uint8_t* const pDst[3], const int dstStride[3], uint8_t* pScratch) {
+			const Coefficients& c = converter.getCoefficients();
+			// Downsampled rows go to the scratch and only live as long as it takes to convert them.
+			for (int y = 0; y < rows; y += 1 << shiftY) {
+				const bool hasRow1 = shiftY && (y + 1 < rows);
+				const uint8_t* pRow0 = pSrc + ((ptrdiff_t)y << downsampleLog2) * srcStride;
+				const uint8_t* pRow1 = pRow0 + ((ptrdiff_t)srcStride << downsampleLog2);
+				if (downsampleLog2) {
+					downsampleRow<Isa, downsampleLog2>(pRow0, srcStride, width, pScratch);
+					if (hasRow1) {
+						downsampleRow<Isa, downsampleLog2>(pRow1, srcStride, width, pScratch + 4 * width);
+					}
+					pRow0 = pScratch;
+					pRow1 = pRow0 + 4 * width;
+				}
+				// An odd last row is counted twice.
+				if (!hasRow1) {
+					pRow1 = pRow0;
+				}
+
+				const PackedRow row0 = { pRow0 };
+				const PackedRow row1 = { pRow1 };
+				convertRows<Isa, PackedRow, shiftX, shiftY, isInterleaved, depth>(c, row0, row1, hasRow1, y, width, pDst, dstStride);
+			}
+		}
+
+		// Converts the split rows of SplitKernel, whose samples are already at the output depth.
+		template <class Isa, int shiftX, int shiftY, bool isInterleaved, int depth>
+		void convertSplit(const Converter& converter, const uint32_t* pSrc, int srcStride, int width, int rows, uint8_t* const pDst[3], const int dstStride[3]) {
+			const Coefficients& c = converter.getCoefficients();
+			for (int y = 0; y < rows; y += 1 << shiftY) {
+				const bool hasRow1 = shiftY && (y + 1 < rows);
+				const SplitRow<depth> row0 = { pSrc + (ptrdiff_t)y * srcStride, width };
+				const SplitRow<depth> row1 = { hasRow1 ? row0.p + srcStride : row0.p, width };
+				convertRows<Isa, SplitRow<depth>, shiftX, shiftY, isInterleaved, depth>(c, row0, row1, hasRow1, y, width, pDst, dstStride);
+			}
+		}
+
+		template <class Isa, int depth, int downsampleLog2>
+		Kernel selectPlanarKernel(const OutputFormat& format) {
+			if ((format.chromaShiftX == 0) && (format.chromaShiftY == 0)) {
+				return &convert<Isa, 0, 0, false, depth, downsampleLog2>;
+			} else if ((format.chromaShiftX == 1) && (format.chromaShiftY == 0)) {
+				return &convert<Isa, 1, 0, false, depth, downsampleLog2>;
+			} else if ((format.chromaShiftX == 1) && (format.chromaShiftY == 1)) {
+				return &convert<Isa, 1, 1, false, depth, downsampleLog2>;
+			}
+			return NULL;
+		}
+
+		// Interleaved chroma is only supported as nv12.
+		template <class Isa, int downsampleLog2>
+		Kernel selectDownsampledKernel(const OutputFormat& format) {
+			if (format.isInterleaved) {
+				return ((format.depth == 8) && (format.chromaShiftX == 1) && (format.chromaShiftY == 1)) ? &convert<Isa, 1, 1, true, 8, downsampleLog2> : NULL;
+			} else if (format.depth == 8) {
+				return selectPlanarKernel<Isa, 8, downsampleLog2>(format);
+			} else if (format.depth == 10) {
+				return selectPlanarKernel<Isa, 10, downsampleLog2>(format);
+			}
+			return NULL;
+		}
+
+		// Box filtering is only supported for 2x2 and 4x4 blocks.
+		template <class Isa>
+		Kernel selectKernel(const OutputFormat& format) {
+			switch (format.downsampleLog2) {
+			case 0:
+				return selectDownsampledKernel<Isa, 0>(format);
+			case 1:
+				return selectDownsampledKernel<Isa, 1>(format);
+			case 2:
+				return selectDownsampledKernel<Isa, 2>(format);
+			default:
+				return NULL;
+			}
+		}
+
+		template <class Isa, int depth>
+		SplitKernel selectPlanarSplitKernel(const OutputFormat& format) {
+			if ((format.chromaShiftX == 0) && (format.chromaShiftY == 0)) {
+				return &convertSplit<Isa, 0, 0, false, depth>;
+			} else if ((format.chromaShiftX == 1) && (format.chromaShiftY == 0)) {
+				return &convertSplit<Isa, 1, 0, false, depth>;
+			} else if ((format.chromaShiftX == 1) && (format.chromaShiftY == 1)) {
+				return &convertSplit<Isa, 1, 1, false, depth>;
+			}
+			return NULL;
+		}
+
+		// Split rows come at the size of the picture, so there is nothing to box filter.
+		template <class Isa>
+		SplitKernel selectSplitKernel(const OutputFormat& format) {
+			if (format.downsampleLog2 != 0) {
+				return NULL;
+			} else if (format.isInterleaved) {
+				return ((format.depth == 8) && (format.chromaShiftX == 1) && (format.chromaShiftY == 1)) ? &convertSplit<Isa, 1, 1, true, 8> : NULL;
+			} else if (format.depth == 8) {
+				return selectPlanarSplitKernel<Isa, 8>(format);
+			} else if (format.depth == 10) {
+				return selectPlanarSplitKernel<Isa, 10>(format);
+			}
+			return NULL;
+		}
+	}
+}
@@ -0,0 +1,60 @@
+// Built for SSE4.1. Visual Studio needs no switch for the intrinsics, GCC and
+// clang get the target from the pragma below. The standard headers are
+// included first so that none of their inline functions pick up the target.
+#include <cstring>
+#include <cstdint>
+
+#if defined(__GNUC__)
+#pragma GCC target("sse4.1")
+#endif
+
+#include <immintrin.h>
+#include "color-conversion-kernels.h"
+
+namespace ColorConversion {
+	namespace {
+		struct SSE41 {
+			typedef __m128i Vector;
+			enum { LANES = 4 };
+
+			static Vector load(const uint8_t* p) { return _mm_loadu_si128((const __m128i*)p); }
+			static Vector set1(int32_t value) { return _mm_set1_epi32(value); }
+			static Vector bitAnd(Vector a, Vector b) { return _mm_and_si128(a, b); }
+			static Vector bitOr(Vector a, Vector b) { return _mm_or_si128(a, b); }
+			static Vector add(Vector a, Vector b) { return _mm_add_epi32(a, b); }
+			static Vector min(Vector a, Vector b) { return _mm_min_epi32(a, b); }
+			static Vector max(Vector a, Vector b) { return _mm_max_epi32(a, b); }
+			static Vector madd(Vector a, Vector b) { return _mm_madd_epi16(a, b); }
+			template <int n> static Vector srli(Vector a) { return _mm_srli_epi32(a, n); }
+			template <int n> static Vector slli(Vector a) { return _mm_slli_epi32(a, n); }
+			template <int n> static Vector srai(Vector a) { return _mm_srai_epi32(a, n); }
+			static Vector addOddLanes(Vector a) { return _mm_add_epi32(a, _mm_srli_epi64(a, 32)); }
+
+			static Vector compactEven(Vector a, Vector b) {
+				return _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0)));
+			}
+
+			static void store(uint8_t* p, Vector a) {
+				__m128i words = _mm_packs_epi32(a, a);
+				int32_t bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+				memcpy(p, &bytes, sizeof(bytes));
+			}
+
+			static void store(uint16_t* p, Vector a) {
+				_mm_storel_epi64((__m128i*)p, _mm_packus_epi32(a, a));
+			}
+
+			static void store(uint32_t* p, Vector a) {
+				_mm_storeu_si128((__m128i*)p, a);
+			}
+		};
+	}
+
+	Kernel getSSE41Kernel(const OutputFormat& format) {
+		return selectKernel<SSE41>(format);
+	}
+
+	SplitKernel getSSE41SplitKernel(const OutputFormat& format) {
+		return selectSplitKernel<SSE41>(format);
+	}
+}
@@ -0,0 +1,146 @@
+#include "color-conversion.h"
+#include "color-conversion-kernels.h"
+#include <cmath>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+namespace ColorConversion {
+	namespace {
+		void cpuid(int info[4], int leaf, int subleaf) {
+#if defined(_MSC_VER)
+			__cpuidex(info, leaf, subleaf);
+#else
+			__cpuid_count(leaf, subleaf, info[0], info[1], info[2], info[3]);
+#endif
+		}
+
+		uint64_t xgetbv() {
+#if defined(_MSC_VER)
+			return _xgetbv(0);
+#else
+			uint32_t eax, edx;
+			__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			return ((uint64_t)edx << 32) | eax;
+#endif
+		}
+
+		int16_t toQ15(double value) {
+			return (int16_t)std::lround(value * 32768.0);
+		}
+
+		// BT.601, the matrix swscale uses for RGB input unless told otherwise.
+		Coefficients computeCoefficients(const OutputFormat& format) {
+			const double kr = 0.299;
+			const double kb = 0.114;
+			const double lumaScale = format.isFullRange ? 1.0 : 219.0 / 255.0;
+			const double chromaScale = format.isFullRange ? 1.0 : 224.0 / 255.0;
+
+			// Green takes the rounding error, so that grey maps to exactly the black to white
+			// range on luma and to exactly the middle on chroma.
+			Coefficients c;
+			c.y[0] = toQ15(lumaScale * kb);
+			c.y[2] = toQ15(lumaScale * kr);
+			c.y[1] = (int16_t)(std::lround(lumaScale * 32768.0) - c.y[0] - c.y[2]);
+			c.u[0] = toQ15(chromaScale * 0.5);
+			c.u[2] = toQ15(-chromaScale * 0.5 * kr / (1.0 - kb));
+			c.u[1] = -c.u[0] - c.u[2];
+			c.v[2] = toQ15(chromaScale * 0.5);
+			c.v[0] = toQ15(-chromaScale * 0.5 * kb / (1.0 - kr));
+			c.v[1] = -c.v[0] - c.v[2];
+			c.yOffset = (format.isFullRange ? 0 : 16) << (format.depth - 8);
+			c.cOffset = 128 << (format.depth - 8);
+			c.maxValue = (1 << format.depth) - 1;
+			return c;
+		}
+	}
+
+	Converter::Converter() :
+		kernel(NULL),
+		splitKernel(NULL),
+		isa(ISA_SCALAR)
+	{}
+
+	bool Converter::init(const OutputFormat& format, Isa isa) {
+		typedef Kernel(*KernelGetter)(const OutputFormat&);
+		typedef SplitKernel(*SplitKernelGetter)(const OutputFormat&);
+		static const KernelGetter getters[] = { getScalarKernel, getSSE41Kernel, getAVX2Kernel, getAVX512Kernel };
+		static const SplitKernelGetter splitGetters[] = { getScalarSplitKernel, getSSE41SplitKernel, getAVX2SplitKernel, getAVX512SplitKernel };
+
+		this->kernel = NULL;
+		this->splitKernel = NULL;
+		for (int i = isa; (i >= ISA_SCALAR) && (this->kernel == NULL); i--) {
+			this->kernel = getters[i](format);
+			this->splitKernel = this->kernel ? splitGetters[i](format) : NULL;
+			this->isa = (Isa)i;
+		}
+		this->coefficients = computeCoefficients(format);
+		this->format = format;
+		return this->kernel != NULL;
+	}
+
+	Isa detectIsa() {
+		int info[4];
+		cpuid(info, 0, 0);
+		const int maxLeaf = info[0];
+
+		cpuid(info, 1, 0);
+		const bool hasSSE41 = (info[2] & (1 << 19)) != 0;
+		const bool hasOSXSave = (info[2] & (1 << 27)) != 0;
+		const bool hasAVX = (info[2] & (1 << 28)) != 0;
+		const bool hasF16C = (info[2] & (1 << 29)) != 0;
+		if (!hasSSE41) {
+			return ISA_SCALAR;
+		}
+
+		// The OS has to save the YMM (and ZMM) registers on context switches too.
+		const uint64_t xcr0 = (hasOSXSave && hasAVX) ? xgetbv() : 0;
+		if (((xcr0 & 0x6) != 0x6) || (maxLeaf < 7)) {
+			return ISA_SSE41;
+		}
+
+		cpuid(info, 7, 0);
+		const bool hasAVX2 = (info[1] & (1 << 5)) != 0;
+		const bool hasAVX512F = (info[1] & (1 << 16)) != 0;
+		const bool hasAVX512BW = (info[1] & (1 << 30)) != 0;
+		if (hasAVX512F && hasAVX512BW && ((xcr0 & 0xE6) == 0xE6)) {
+			return ISA_AVX512;
+		}
+		// Every CPU with AVX2 has F16C too, the motion blur kernels count on it.
+		return hasAVX2 && hasF16C ? ISA_AVX2 : ISA_SSE41;
+	}
+
+	bool hasAVX512VBMI() {
+		if (detectIsa() != ISA_AVX512) {
+			return false;
+		}
+
+		int info[4];
+		cpuid(info, 7, 0);
+		return (info[2] & (1 << 1)) != 0;
+	}
+
+	const char* getIsaName(Isa isa) {
+		switch (isa) {
+		case ISA_SSE41:
+			return "SSE4.1";
+		case ISA_AVX2:
+			return "AVX2";
+		case ISA_AVX512:
+			return "AVX-512";
+		default:
+			return "scalar";
+		}
+	}
+
+	Kernel getScalarKernel(const OutputFormat& format) {
+		return selectKernel<Scalar>(format);
+	}
+
+	SplitKernel getScalarSplitKernel(const OutputFormat& format) {
+		return selectSplitKernel<Scalar>(format);
+	}
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Conversion of the captured BGRA frames to the YUV layouts the presets ask for
+// most, without going through swscale. Captures two or four times larger than
+// the output can be box filtered down in the same pass. The kernels are written once as
+// templates over a small set of vector operations and instantiated for every
+// instruction set; detectIsa() tells which one the CPU can run.
+//
+// The maths is plain BT.601 in fixed point. Every instruction set produces
+// exactly the same output as the scalar kernel, and the output stays within
+// rounding distance of what swscale gives for the same format.
+namespace ColorConversion {
+	enum Isa {
+		ISA_SCALAR,
+		ISA_SSE41,
+		ISA_AVX2,
+		ISA_AVX512,
+	};
+
+	// Layout of the converted picture. Chroma planes are subsampled by 1 << chromaShiftX
+	// horizontally and by 1 << chromaShiftY vertically. Interleaved chroma (nv12) keeps
+	// U and V in one plane. Samples deeper than 8 bits are stored as 16 bit little endian.
+	// The source is 1 << downsampleLog2 times larger than the picture in both directions,
+	// every block of source pixels is averaged to one pixel before the conversion.
+	struct OutputFormat {
+		int chromaShiftX;
+		int chromaShiftY;
+		bool isInterleaved;
+		int depth;
+		bool isFullRange;
+		int downsampleLog2;
+	};
+
+	// Weights in B, G, R order as Q15 fixed point at 8 bit scale. The offsets and the
+	// maximum value are at the output bit depth.
+	struct Coefficients {
+		int16_t y[3];
+		int16_t u[3];
+		int16_t v[3];
+		int32_t yOffset;
+		int32_t cOffset;
+		int32_t maxValue;
+	};
+
+	class Converter;
+
+	// Converts the given number of rows starting at pSrc. pDst holds the Y, U and V planes,
+	// or the Y and UV planes for interleaved chroma, already offset to the first row. The
+	// width and the number of rows are those of the converted picture. pScratch holds
+	// Converter::getScratchSize() bytes for the rows the kernel downsamples.
+	typedef void (*Kernel)(const Converter& converter, const uint8_t* pSrc, int srcStride, int width, int rows, uint8_t* const pDst[3], const int dstStride[3], uint8_t* pScratch);
+
+	// Same for a source split in pairs of samples at the output bit depth, which is how pictures
+	// that are already deeper than 8 bits (averaged motion blur frames) come in. Every row holds
+	// width values of B | R << 16 followed by width values of G | A << 16. srcStride counts
+	// those 32 bit values.
+	typedef void (*SplitKernel)(const Converter& converter, const uint32_t* pSrc, int srcStride, int width, int rows, uint8_t* const pDst[3], const int dstStride[3]);
+
+	class Converter {
+	public:
+		Converter();
+
+		// Picks the kernel for the format, using the given instruction set or the best one
+		// below it that has a kernel. Returns false when the format is not supported at all.
+		// The split kernel comes from the same instruction set, if the format has one.
+		bool init(const OutputFormat& format, Isa isa);
+
+		void convert(const uint8_t* pSrc, int srcStride, int width, int rows, uint8_t* const pDst[3], const int dstStride[3], uint8_t* pScratch) const {
+			this->kernel(*this, pSrc, srcStride, width, rows, pDst, dstStride, pScratch);
+		}
+
+		// Bytes of scratch convert() needs for pictures width pixels wide, two downsampled rows.
+		// Callers keep it from one call to the next, so that no row is allocated per frame.
+		size_t getScratchSize(int width) const {
+			return this->format.downsampleLog2 ? 2 * 4 * (size_t)width : 0;
+		}
+
+		void convertSplit(const uint32_t* pSrc, int srcStride, int width, int rows, uint8_t* const pDst[3], const int dstStride[3]) const {
+			this->splitKernel(*this, pSrc, srcStride, width, rows, pDst, dstStride);
+		}
+
+		bool hasSplitKernel() const {
+			return this->splitKernel != NULL;
+		}
+
+		Isa getIsa() const {
+			return this->isa;
+		}
+
+		const Coefficients& getCoefficients() const {
+			return this->coefficients;
+		}
+
+		const OutputFormat& getFormat() const {
+			return this->format;
+		}
+
+	private:
+		Kernel kernel;
+		SplitKernel splitKernel;
+		Isa isa;
+		Coefficients coefficients;
+		OutputFormat format;
+	};
+
+	// Best instruction set supported by both the CPU and the operating system.
+	Isa detectIsa();
+	// Whether the CPU also has the byte permutes of AVX-512 VBMI, on top of ISA_AVX512.
+	bool hasAVX512VBMI();
+	const char* getIsaName(Isa isa);
+
+	// Kernel for the format on one instruction set, or NULL when there is none.
+	Kernel getScalarKernel(const OutputFormat& format);
+	Kernel getSSE41Kernel(const OutputFormat& format);
+	Kernel getAVX2Kernel(const OutputFormat& format);
+	Kernel getAVX512Kernel(const OutputFormat& format);
+	SplitKernel getScalarSplitKernel(const OutputFormat& format);
+	SplitKernel getSSE41SplitKernel(const OutputFormat& format);
+	SplitKernel getAVX2SplitKernel(const OutputFormat& format);
+	SplitKernel getAVX512SplitKernel(const OutputFormat& format);
+}
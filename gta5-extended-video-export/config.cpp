@@ -13,6 +13,11 @@ std::string                     config::format_ext;
 std::string                     config::video_enc;
 std::string                     config::video_fmt;
 std::string                     config::video_cfg;
+uint32_t                        config::video_conversion_threads;
+uint32_t                        config::video_output_width;
+uint32_t                        config::video_output_height;
+std::string                     config::video_scaler;
+bool                            config::video_gpu_conversion;
 std::string                     config::audio_enc;
 std::string                     config::audio_cfg;
 std::string                     config::audio_fmt;
@@ -20,5 +25,16 @@ LogLevel                        config::log_level;
 std::pair<uint32_t, uint32_t>   config::fps;
 uint8_t                         config::motion_blur_samples;
 float							config::motion_blur_strength;
+std::string                     config::motion_blur_shutter;
+std::vector<float>              config::motion_blur_weights;
+bool                            config::motion_blur_linear_light;
+float                           config::motion_blur_adaptive_threshold;
+uint8_t                         config::motion_blur_min_samples;
+bool                            config::motion_blur_optical_flow;
+uint8_t                         config::interpolation_factor;
+std::string                     config::interpolation_quality;
 std::string                     config::container_format;
-bool                            config::export_openexr;
\ No newline at end of file
+bool                            config::export_openexr;
+std::string                     config::openexr_depth_sub_frame;
+uint32_t                        config::export_threads;
+uint32_t                        config::export_reserved_cores;
\ No newline at end of file
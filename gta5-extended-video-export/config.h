@@ -5,6 +5,7 @@
 
 #include "ini.hpp"
 #include <string>
+#include <vector>
 #include <algorithm>
 #include <sstream>
 #include <ShlObj.h>
@@ -19,8 +20,19 @@
 #define CFG_EXPORT_SECTION "EXPORT"
 #define CFG_EXPORT_MB_SAMPLES "motion_blur_samples"
 #define CFG_EXPORT_MB_STRENGTH "motion_blur_strength"
+#define CFG_EXPORT_MB_SHUTTER "motion_blur_shutter"
+#define CFG_EXPORT_MB_WEIGHTS "motion_blur_weights"
+#define CFG_EXPORT_MB_LINEAR "motion_blur_linear_light"
+#define CFG_EXPORT_MB_ADAPTIVE "motion_blur_adaptive_threshold"
+#define CFG_EXPORT_MB_MIN_SAMPLES "motion_blur_min_samples"
+#define CFG_EXPORT_MB_OPTICAL_FLOW "motion_blur_optical_flow"
+#define CFG_EXPORT_INTERPOLATION "interpolation_factor"
+#define CFG_EXPORT_INTERPOLATION_QUALITY "interpolation_quality"
 #define CFG_EXPORT_FPS "fps"
 #define CFG_EXPORT_OPENEXR "export_openexr"
+#define CFG_EXPORT_OPENEXR_DEPTH "openexr_depth_sub_frame"
+#define CFG_EXPORT_THREADS "threads"
+#define CFG_EXPORT_RESERVED_CORES "reserved_cores"
 
 #define CFG_FORMAT_SECTION "FORMAT"
 #define CFG_EXPORT_FORMAT "format"
@@ -32,6 +44,11 @@
 #define CFG_VIDEO_ENC "encoder"
 #define CFG_VIDEO_FMT "pixel_format"
 #define CFG_VIDEO_CFG "options"
+#define CFG_VIDEO_CONVERSION_THREADS "conversion_threads"
+#define CFG_VIDEO_OUTPUT_WIDTH "output_width"
+#define CFG_VIDEO_OUTPUT_HEIGHT "output_height"
+#define CFG_VIDEO_SCALER "scaler"
+#define CFG_VIDEO_GPU_CONVERSION "gpu_conversion"
 
 #define CFG_AUDIO_SECTION "AUDIO"
 #define CFG_AUDIO_ENC "encoder"
@@ -47,6 +64,7 @@ public:
 	static bool                            is_mod_enabled;
 	static bool							   auto_reload_config;
 	static bool                            export_openexr;
+	static std::string                     openexr_depth_sub_frame;
 	static std::pair<uint32_t, uint32_t>   resolution;
 	static std::string                     output_dir;
 	static std::string                     format_cfg;
@@ -54,6 +72,11 @@ public:
 	static std::string                     video_enc;
 	static std::string                     video_fmt;
 	static std::string                     video_cfg;
+	static uint32_t                        video_conversion_threads;
+	static uint32_t                        video_output_width;
+	static uint32_t                        video_output_height;
+	static std::string                     video_scaler;
+	static bool                            video_gpu_conversion;
 	static std::string                     audio_enc;
 	static std::string                     audio_cfg;
 	static std::string                     audio_fmt;
@@ -61,6 +84,16 @@ public:
 	static std::pair<uint32_t, uint32_t>   fps;
 	static uint8_t                         motion_blur_samples;
 	static float                           motion_blur_strength;
+	static std::string                     motion_blur_shutter;
+	static std::vector<float>              motion_blur_weights;
+	static bool                            motion_blur_linear_light;
+	static float                           motion_blur_adaptive_threshold;
+	static uint8_t                         motion_blur_min_samples;
+	static bool                            motion_blur_optical_flow;
+	static uint8_t                         interpolation_factor;
+	static std::string                     interpolation_quality;
+	static uint32_t                        export_threads;
+	static uint32_t                        export_reserved_cores;
 	static std::string                     container_format;
 
 	static void reload() {
@@ -75,15 +108,31 @@ public:
 		video_enc = parse_video_enc();
 		video_fmt = parse_video_fmt();
 		video_cfg = parse_video_cfg();
+		video_conversion_threads = parse_video_conversion_threads();
+		video_output_width = parse_video_output_size(CFG_VIDEO_OUTPUT_WIDTH);
+		video_output_height = parse_video_output_size(CFG_VIDEO_OUTPUT_HEIGHT);
+		video_scaler = parse_video_scaler();
+		video_gpu_conversion = parse_video_gpu_conversion();
 		audio_enc = parse_audio_enc();
 		audio_cfg = parse_audio_cfg();
 		audio_fmt = parse_audio_fmt();
 		container_format = parse_container_format();
 		log_level = parse_log_level();
 		fps = parse_fps();
-		motion_blur_samples = parse_motion_blur_samples();
+		motion_blur_samples = parse_motion_blur_samples(CFG_EXPORT_MB_SAMPLES, 0);
 		motion_blur_strength = parse_motion_blur_strength();
+		motion_blur_shutter = parse_motion_blur_shutter();
+		motion_blur_weights = parse_motion_blur_weights();
+		motion_blur_linear_light = parse_motion_blur_linear_light();
+		motion_blur_adaptive_threshold = parse_motion_blur_adaptive_threshold();
+		motion_blur_min_samples = parse_motion_blur_samples(CFG_EXPORT_MB_MIN_SAMPLES, 0);
+		motion_blur_optical_flow = parse_motion_blur_optical_flow();
+		interpolation_factor = parse_interpolation_factor();
+		interpolation_quality = parse_interpolation_quality();
 		export_openexr = parse_export_openexr();
+		openexr_depth_sub_frame = parse_openexr_depth_sub_frame();
+		export_threads = parse_export_threads(CFG_EXPORT_THREADS, 0);
+		export_reserved_cores = parse_export_threads(CFG_EXPORT_RESERVED_CORES, 1);
 	}
 
 private:
@@ -267,7 +316,8 @@ private:
 			LOG(LL_ERR, ex.what());
 		}
 
-		return failed(CFG_VIDEO_FMT, string, "yuv420p");
+		LOG(LL_NFO, "No video pixel format specified. The encoder's preferred format will be used.");
+		return "";
 	}
 
 	static std::string parse_video_cfg() {
@@ -283,6 +333,61 @@ private:
 		return failed(CFG_VIDEO_CFG, string, "");
 	}
 
+	static uint32_t parse_video_conversion_threads() {
+		std::string string = getTrimmed(preset_parser, CFG_VIDEO_CONVERSION_THREADS, CFG_VIDEO_SECTION);
+		try {
+			if (!string.empty()) {
+				return succeeded(CFG_VIDEO_CONVERSION_THREADS, (uint32_t)std::stoul(string));
+			}
+		} catch (std::exception& ex) {
+			LOG(LL_ERR, ex.what());
+		}
+
+		// 0 picks the number of threads from the number of cores.
+		return failed(CFG_VIDEO_CONVERSION_THREADS, string, (uint32_t)0);
+	}
+
+	static uint32_t parse_video_output_size(std::string config_name) {
+		std::string string = getTrimmed(preset_parser, config_name, CFG_VIDEO_SECTION);
+		try {
+			if (!string.empty()) {
+				return succeeded(config_name, (uint32_t)std::stoul(string));
+			}
+		} catch (std::exception& ex) {
+			LOG(LL_ERR, ex.what());
+		}
+
+		// 0 keeps the capture size, or the capture aspect ratio when the other side is set.
+		return failed(config_name, string, (uint32_t)0);
+	}
+
+	static std::string parse_video_scaler() {
+		std::string string = toLower(getTrimmed(preset_parser, CFG_VIDEO_SCALER, CFG_VIDEO_SECTION));
+		try {
+			if (std::regex_match(string, std::regex("^(auto|point|fast_bilinear|bilinear|bicubic|area|lanczos)$"))) {
+				return succeeded(CFG_VIDEO_SCALER, string);
+			}
+		} catch (std::exception& ex) {
+			LOG(LL_ERR, ex.what());
+		}
+
+		return failed(CFG_VIDEO_SCALER, string, "auto");
+	}
+
+	// Converts the frames to the output pixel format on the GPU before they are read back.
+	static bool parse_video_gpu_conversion() {
+		std::string string = getTrimmed(preset_parser, CFG_VIDEO_GPU_CONVERSION, CFG_VIDEO_SECTION);
+		try {
+			if (!string.empty()) {
+				return succeeded(CFG_VIDEO_GPU_CONVERSION, stringToBoolean(string));
+			}
+		} catch (std::exception& ex) {
+			LOG(LL_ERR, ex.what());
+		}
+
+		return failed(CFG_VIDEO_GPU_CONVERSION, string, false);
+	}
+
 	static std::string parse_audio_enc() {
 		std::string string = getTrimmed(preset_parser, CFG_AUDIO_ENC, CFG_AUDIO_SECTION);
 		try {
@@ -345,26 +450,40 @@ private:
 		return failed(CFG_LOG_LEVEL, string, LL_ERR);
 	}
 
-	static uint8_t parse_motion_blur_samples() {
-		std::string string = config_parser->top()(CFG_EXPORT_SECTION)[CFG_EXPORT_MB_SAMPLES];;
+	static uint8_t parse_motion_blur_samples(const char* name, uint8_t defaultValue) {
+		std::string string = config_parser->top()(CFG_EXPORT_SECTION)[name];;
 		string = std::regex_replace(string, std::regex("\\s+"), "");
 		try {
 			uint64_t value = std::stoul(string);
 			if (value > 255) {
-				LOG(LL_NON, "Specified motion blur samples exceed 255");
+				LOG(LL_NON, "Specified ", name, " exceeds 255");
 				LOG(LL_NON, "Using maximum value of 255");
 				return 255;
 			} else {
-				return (uint8_t)succeeded(CFG_EXPORT_MB_SAMPLES, value);
+				return (uint8_t)succeeded(name, value);
 			}
 		} catch (std::exception& ex) {
 			LOG(LL_NON, ex.what());
 		}
 
-		return failed(CFG_EXPORT_MB_SAMPLES, string, 0);
+		return (uint8_t)failed(name, string, (uint32_t)defaultValue);
 
 	}
 
+	static uint32_t parse_export_threads(std::string config_name, uint32_t default_value) {
+		std::string string = config_parser->top()(CFG_EXPORT_SECTION)[config_name];
+		string = std::regex_replace(string, std::regex("\\s+"), "");
+		try {
+			if (!string.empty()) {
+				return succeeded(config_name, (uint32_t)std::stoul(string));
+			}
+		} catch (std::exception& ex) {
+			LOG(LL_ERR, ex.what());
+		}
+
+		return failed(config_name, string, default_value);
+	}
+
 	static std::string parse_container_format() {
 		std::string string = preset_parser->top()(CFG_FORMAT_SECTION)[CFG_EXPORT_FORMAT];
 		string = std::regex_replace(string, std::regex("\\s+"), "");
@@ -418,6 +537,128 @@ private:
 		}
 		return failed(CFG_EXPORT_MB_STRENGTH, string, 0.5);
 	}
+
+	// Largest mean difference between two rendered sub-frames before adaptive sampling renders
+	// more of them, 0 to render all of them.
+	static float parse_motion_blur_adaptive_threshold() {
+		std::string string = config_parser->top()(CFG_EXPORT_SECTION)[CFG_EXPORT_MB_ADAPTIVE];
+		try {
+			float value = std::stof(string);
+			if (value < 0) {
+				value = 0;
+			}
+			return succeeded(CFG_EXPORT_MB_ADAPTIVE, value);
+		} catch (std::exception& ex) {
+			LOG(LL_ERR, ex.what());
+		}
+		return failed(CFG_EXPORT_MB_ADAPTIVE, string, 0.0f);
+	}
+
+	static bool parse_motion_blur_linear_light() {
+		std::string string = config_parser->top()(CFG_EXPORT_SECTION)[CFG_EXPORT_MB_LINEAR];
+
+		try {
+			return succeeded(CFG_EXPORT_MB_LINEAR, stringToBoolean(string));
+		} catch (std::exception& ex) {
+			LOG(LL_ERR, ex.what());
+		}
+
+		return failed(CFG_EXPORT_MB_LINEAR, string, false);
+	}
+
+	// Blurs single rendered frames along the motion between them when motion_blur_samples is 0.
+	static bool parse_motion_blur_optical_flow() {
+		std::string string = config_parser->top()(CFG_EXPORT_SECTION)[CFG_EXPORT_MB_OPTICAL_FLOW];
+
+		try {
+			return succeeded(CFG_EXPORT_MB_OPTICAL_FLOW, stringToBoolean(string));
+		} catch (std::exception& ex) {
+			LOG(LL_ERR, ex.what());
+		}
+
+		return failed(CFG_EXPORT_MB_OPTICAL_FLOW, string, false);
+	}
+
+	// Output frames per rendered frame, the ones in between are interpolated.
+	static uint8_t parse_interpolation_factor() {
+		std::string string = config_parser->top()(CFG_EXPORT_SECTION)[CFG_EXPORT_INTERPOLATION];
+		string = std::regex_replace(string, std::regex("\\s+"), "");
+		try {
+			uint64_t value = std::stoul(string);
+			if (value > 8) {
+				LOG(LL_NON, "Specified ", CFG_EXPORT_INTERPOLATION, " exceeds 8");
+				LOG(LL_NON, "Using maximum value of 8");
+				return 8;
+			} else if (value > 0) {
+				return (uint8_t)succeeded(CFG_EXPORT_INTERPOLATION, value);
+			}
+		} catch (std::exception& ex) {
+			LOG(LL_NON, ex.what());
+		}
+
+		return (uint8_t)failed(CFG_EXPORT_INTERPOLATION, string, 1u);
+	}
+
+	static std::string parse_interpolation_quality() {
+		std::string string = toLower(getTrimmed(config_parser, CFG_EXPORT_INTERPOLATION_QUALITY, CFG_EXPORT_SECTION));
+		try {
+			if (std::regex_match(string, std::regex("^(fast|smooth)$"))) {
+				return succeeded(CFG_EXPORT_INTERPOLATION_QUALITY, string);
+			}
+		} catch (std::exception& ex) {
+			LOG(LL_ERR, ex.what());
+		}
+
+		return failed(CFG_EXPORT_INTERPOLATION_QUALITY, string, "fast");
+	}
+
+	// Sub-frame of a motion blurred frame whose depth and object IDs go into the OpenEXR output.
+	static std::string parse_openexr_depth_sub_frame() {
+		std::string string = toLower(getTrimmed(config_parser, CFG_EXPORT_OPENEXR_DEPTH, CFG_EXPORT_SECTION));
+		try {
+			if (std::regex_match(string, std::regex("^(first|middle|last)$"))) {
+				return succeeded(CFG_EXPORT_OPENEXR_DEPTH, string);
+			}
+		} catch (std::exception& ex) {
+			LOG(LL_ERR, ex.what());
+		}
+
+		return failed(CFG_EXPORT_OPENEXR_DEPTH, string, "middle");
+	}
+
+	static std::string parse_motion_blur_shutter() {
+		std::string string = toLower(getTrimmed(config_parser, CFG_EXPORT_MB_SHUTTER, CFG_EXPORT_SECTION));
+		try {
+			if (std::regex_match(string, std::regex("^(box|triangle|gaussian|custom)$"))) {
+				return succeeded(CFG_EXPORT_MB_SHUTTER, string);
+			}
+		} catch (std::exception& ex) {
+			LOG(LL_ERR, ex.what());
+		}
+
+		return failed(CFG_EXPORT_MB_SHUTTER, string, "box");
+	}
+
+	// Comma separated weights of the custom shutter, from where it opens to where it closes.
+	static std::vector<float> parse_motion_blur_weights() {
+		std::string string = config_parser->top()(CFG_EXPORT_SECTION)[CFG_EXPORT_MB_WEIGHTS];
+		string = std::regex_replace(string, std::regex("\\s+"), "");
+		std::vector<float> weights;
+		try {
+			std::stringstream stream(string);
+			std::string weight;
+			while (std::getline(stream, weight, ',')) {
+				weights.push_back((std::max)(0.0f, std::stof(weight)));
+			}
+			succeeded(CFG_EXPORT_MB_WEIGHTS, string);
+			return weights;
+		} catch (std::exception& ex) {
+			LOG(LL_ERR, ex.what());
+		}
+
+		failed(CFG_EXPORT_MB_WEIGHTS, string, "");
+		return std::vector<float>();
+	}
 };
 
 #endif _MY_CONFIG_H_
\ No newline at end of file
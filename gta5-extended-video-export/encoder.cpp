@@ -8,16 +8,198 @@
 #include <ImfRgbaFile.h>
 #include <ImfRgba.h>
 #include <fstream>
+#include <algorithm>
 
 
 namespace Encoder {
 	
 	const AVRational MF_TIME_BASE = { 1, 10000000 };
 
+	// Linesize alignment of the converted frames handed to the encoder.
+	const int VIDEO_FRAME_ALIGNMENT = 32;
+
+	// Captured frames that skip the conversion go to the encoder in the pool buffers themselves.
+	static_assert(FramePool::PADDING >= AV_INPUT_BUFFER_PADDING_SIZE, "Frame pool buffers need the padding ffmpeg reads past the end of a buffer");
+
+	// Band heights are kept a multiple of this many rows, which covers the vertical chroma
+	// subsampling of every format and the 8 row dither pattern of swscale. That way each band
+	// converts exactly like the same rows of a full frame would.
+	const int CONVERSION_BAND_ALIGNMENT = 8;
+
+	// Gives the plane pointers of an image starting at the given row.
+	static void offsetPlanes(AVPixelFormat format, uint8_t* const data[4], const int linesize[4], int row, uint8_t* result[4]) {
+		const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(format);
+		bool isYUV = !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+		for (int plane = 0; plane < 4; plane++) {
+			bool isChroma = isYUV && ((plane == 1) || (plane == 2));
+			result[plane] = data[plane] ? data[plane] + (ptrdiff_t)(isChroma ? row >> desc->log2_chroma_h : row) * linesize[plane] : NULL;
+		}
+	}
+
+	// Describes the conversion from the captured format to the output format for the built-in
+	// kernels. Returns false when they don't handle that pair and swscale has to be used.
+	static bool getConversionFormat(AVPixelFormat inputFormat, AVPixelFormat outputFormat, ColorConversion::OutputFormat& result) {
+		if ((inputFormat != AV_PIX_FMT_BGRA) && (inputFormat != AV_PIX_FMT_BGR0)) {
+			return false;
+		}
+
+		switch (outputFormat) {
+		case AV_PIX_FMT_YUV420P:
+			result = { 1, 1, false, 8, false };
+			return true;
+		case AV_PIX_FMT_YUVJ420P:
+			result = { 1, 1, false, 8, true };
+			return true;
+		case AV_PIX_FMT_YUV422P:
+			result = { 1, 0, false, 8, false };
+			return true;
+		case AV_PIX_FMT_YUVJ422P:
+			result = { 1, 0, false, 8, true };
+			return true;
+		case AV_PIX_FMT_YUV444P:
+			result = { 0, 0, false, 8, false };
+			return true;
+		case AV_PIX_FMT_YUVJ444P:
+			result = { 0, 0, false, 8, true };
+			return true;
+		case AV_PIX_FMT_NV12:
+			result = { 1, 1, true, 8, false };
+			return true;
+		case AV_PIX_FMT_YUV420P10LE:
+			result = { 1, 1, false, 10, false };
+			return true;
+		case AV_PIX_FMT_YUV422P10LE:
+			result = { 1, 0, false, 10, false };
+			return true;
+		case AV_PIX_FMT_YUV444P10LE:
+			result = { 0, 0, false, 10, false };
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// swscale flags for the scaler preset option. 0 stands for "auto", which box filters 2x2 and
+	// 4x4 downsampling in the built-in kernels and scales bicubic otherwise.
+	static bool getScalerFlags(const std::string& scaler, int& result) {
+		static const std::pair<const char*, int> scalers[] = {
+			{ "auto", 0 },
+			{ "point", SWS_POINT },
+			{ "fast_bilinear", SWS_FAST_BILINEAR },
+			{ "bilinear", SWS_BILINEAR },
+			{ "bicubic", SWS_BICUBIC },
+			{ "area", SWS_AREA },
+			{ "lanczos", SWS_LANCZOS },
+		};
+
+		if (scaler.empty()) {
+			result = 0;
+			return true;
+		}
+		for (const auto& entry : scalers) {
+			if (scaler == entry.first) {
+				result = entry.second;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Shape of the shutter for the motion_blur_shutter option, box when it is not set.
+	static bool getShutterProfile(const std::string& shutter, MotionBlur::Profile& result) {
+		static const std::pair<const char*, MotionBlur::Profile> profiles[] = {
+			{ "box", MotionBlur::PROFILE_BOX },
+			{ "triangle", MotionBlur::PROFILE_TRIANGLE },
+			{ "gaussian", MotionBlur::PROFILE_GAUSSIAN },
+			{ "custom", MotionBlur::PROFILE_CUSTOM },
+		};
+
+		if (shutter.empty()) {
+			result = MotionBlur::PROFILE_BOX;
+			return true;
+		}
+		for (const auto& entry : profiles) {
+			if (shutter == entry.first) {
+				result = entry.second;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Sub-frame of the open part of the shutter that the OpenEXR depth and object IDs are taken from.
+	static bool getEXRReferenceSubFrame(const std::string& subFrame, const MotionBlur::ShutterSchedule& schedule, uint32_t& result) {
+		const uint32_t first = schedule.getFirstOpen();
+		const uint32_t last = schedule.getSubFrameCount() - 1;
+		if (subFrame.empty() || (subFrame == "middle")) {
+			result = (first + last) / 2;
+		} else if (subFrame == "first") {
+			result = first;
+		} else if (subFrame == "last") {
+			result = last;
+		} else {
+			return false;
+		}
+		return true;
+	}
+
+	// Ratio of the captured size to the output size as a power of two, when it is one the
+	// built-in kernels handle. -1 otherwise.
+	static int getDownsampleLog2(uint32_t srcWidth, uint32_t srcHeight, uint32_t dstWidth, uint32_t dstHeight) {
+		for (int log2 = 0; log2 <= 2; log2++) {
+			if ((srcWidth == (dstWidth << log2)) && (srcHeight == (dstHeight << log2))) {
+				return log2;
+			}
+		}
+		return -1;
+	}
+
+	// Pixel format for presets that leave it empty: the captured format if the encoder takes it,
+	// otherwise the format supported by the encoder that loses the least.
+	static AVPixelFormat getDefaultPixelFormat(const AVCodec *pCodec, AVPixelFormat inputFormat) {
+		if (pCodec->pix_fmts == NULL) {
+			return inputFormat;
+		}
+		for (const AVPixelFormat *pFormat = pCodec->pix_fmts; *pFormat != AV_PIX_FMT_NONE; pFormat++) {
+			if (*pFormat == inputFormat) {
+				return inputFormat;
+			}
+		}
+		// Same memory layout, the alpha channel is ignored.
+		if (inputFormat == AV_PIX_FMT_BGRA) {
+			for (const AVPixelFormat *pFormat = pCodec->pix_fmts; *pFormat != AV_PIX_FMT_NONE; pFormat++) {
+				if (*pFormat == AV_PIX_FMT_BGR0) {
+					return AV_PIX_FMT_BGR0;
+				}
+			}
+		}
+		return avcodec_find_best_pix_fmt_of_list(pCodec->pix_fmts, inputFormat, 0, NULL);
+	}
+
+	// Gives a captured buffer that was lent to a frame skipping the conversion back to its pool.
+	static void releasePooledBuffer(void *opaque, uint8_t *data) {
+		FramePool::giveBack((FramePool::Bytes*)opaque);
+	}
+
+	std::atomic<uint32_t> Session::renderTimeScale(1);
+
 	Session::Session() :
+		videoBufferAllocations(0),
+		subFrameSpan(1),
 		thread_video_encoder(),
 		videoFrameQueue(16),
-		exrImageQueue(16)
+		videoConversionQueue(4),
+		videoEncodingQueue(4),
+		videoFreeFrameQueue(4 + 2),
+		muxQueue(64),
+		exrImageQueue(16),
+		exrWriteQueue(4),
+		exrReadback(*this),
+		videoReadback(*this),
+		muxQueueWaitMicroseconds(0),
+		videoPacketsWritten(0),
+		isVideoPipelineFailed(false),
+		isMuxFailed(false)
 	{
 		PRE();
 		LOG(LL_NFO, "Opening session: ", (uint64_t)this);
@@ -28,8 +210,17 @@ namespace Encoder {
 		PRE();
 		LOG(LL_NFO, "Closing session: ", (uint64_t)this);
 		this->isCapturing = false;
+		renderTimeScale = 1;
 		LOG_CALL(LL_DBG, this->videoFrameQueue.enqueue(Encoder::Session::frameQueueItem(nullptr)));
 
+		if (thread_video_blur.joinable()) {
+			thread_video_blur.join();
+		}
+
+		if (thread_video_converter.joinable()) {
+			thread_video_converter.join();
+		}
+
 		if (thread_video_encoder.joinable()) {
 			thread_video_encoder.join();
 		}
@@ -45,14 +236,25 @@ namespace Encoder {
 		LOG_CALL(LL_DBG, this->endSession());
 		this->isBeingDeleted = true;
 
+		if (thread_muxer.joinable()) {
+			thread_muxer.join();
+		}
+
 
 		LOG_CALL(LL_DBG, av_free(this->oformat));
 		LOG_CALL(LL_DBG, av_free(this->fmtContext));
 		LOG_CALL(LL_DBG, avcodec_close(this->videoCodecContext));
 		LOG_CALL(LL_DBG, av_free(this->videoCodecContext));
-		LOG_CALL(LL_DBG, av_free(this->inputFrame));
-		LOG_CALL(LL_DBG, av_free(this->outputFrame));
-		LOG_CALL(LL_DBG, sws_freeContext(this->pSwsContext));
+		LOG_CALL(LL_DBG, av_frame_free(&this->inputFrame));
+		// Buffers still referenced somewhere keep the pool alive until they are released.
+		LOG_CALL(LL_DBG, av_buffer_pool_uninit(&this->videoBufferPool));
+		LOG_CALL(LL_DBG, this->conversionThreadPool.stop());
+		LOG_CALL(LL_DBG, this->motionBlurAccumulator.stop());
+		LOG_CALL(LL_DBG, this->flowBlur.stop());
+		LOG_CALL(LL_DBG, this->interpolator.stop());
+		for (auto& band : this->conversionBands) {
+			LOG_CALL(LL_DBG, sws_freeContext(band.pSwsContext));
+		}
 		LOG_CALL(LL_DBG, swr_free(&this->pSwrContext));
 		if (this->videoOptions) {
 			LOG_CALL(LL_DBG, av_dict_free(&this->videoOptions));
@@ -71,18 +273,22 @@ namespace Encoder {
 		POST();
 	}
 
-	HRESULT Session::createContext(std::string format, std::string filename, std::string exrOutputPath, std::string fmtOptions, uint64_t width, uint64_t height, std::string inputPixelFmt, uint32_t fps_num, uint32_t fps_den, uint8_t motionBlurSamples, float shutterPosition, std::string outputPixelFmt, std::string vcodec_str, std::string voptions, uint32_t inputChannels, uint32_t inputSampleRate, uint32_t inputBitsPerSample, std::string inputSampleFmt, uint32_t inputAlign, std::string outputSampleFmt, std::string acodec_str, std::string aoptions)
+	HRESULT Session::createContext(std::string format, std::string filename, std::string exrOutputPath, std::string fmtOptions, uint64_t width, uint64_t height, std::string inputPixelFmt, uint32_t fps_num, uint32_t fps_den, std::string outputPixelFmt, std::string vcodec_str, std::string voptions, const VideoOptions& options, uint32_t inputChannels, uint32_t inputSampleRate, uint32_t inputBitsPerSample, std::string inputSampleFmt, uint32_t inputAlign, std::string outputSampleFmt, std::string acodec_str, std::string aoptions)
 	{
 		this->oformat = av_guess_format(format.c_str(), NULL, NULL);
 		RET_IF_NULL(this->oformat, "Could find format: " + format, E_FAIL);
 
-		REQUIRE(this->createVideoContext(width, height, inputPixelFmt, fps_num, fps_den, motionBlurSamples, shutterPosition, outputPixelFmt, vcodec_str, voptions), "Failed to create video codec context.");
-		REQUIRE(this->createAudioContext(inputChannels, inputSampleRate, inputBitsPerSample, inputSampleFmt, inputAlign, outputSampleFmt, acodec_str, aoptions), "Failed to create audio codec context.");
+		LOG(LL_NFO, "Thread budget: ", options.threadBudget.cores, " cores, ", options.threadBudget.reservedCores, " kept for the game");
+		LOG(LL_NFO, "  video codec: ", options.threadBudget.codecThreads, ", conversion: ", options.threadBudget.conversionThreads, ", motion blur: ", options.threadBudget.blurThreads, ", EXR: ", options.threadBudget.exrThreads, ", audio: ", options.threadBudget.audioThreads);
+		this->exrThreads = options.threadBudget.exrThreads;
+
+		REQUIRE(this->createVideoContext(width, height, inputPixelFmt, fps_num, fps_den, outputPixelFmt, vcodec_str, voptions, options), "Failed to create video codec context.");
+		REQUIRE(this->createAudioContext(inputChannels, inputSampleRate, inputBitsPerSample, inputSampleFmt, inputAlign, outputSampleFmt, acodec_str, aoptions, options.threadBudget.audioThreads), "Failed to create audio codec context.");
 		REQUIRE(this->createFormatContext(format, filename, exrOutputPath, fmtOptions), "Failed to create format context.");
 		return S_OK;
 	}
 
-	HRESULT Session::createVideoContext(UINT width, UINT height, std::string inputPixelFormatString, UINT fps_num, UINT fps_den, uint8_t motionBlurSamples, float shutterPosition, std::string outputPixelFormatString, std::string vcodec, std::string preset)
+	HRESULT Session::createVideoContext(UINT width, UINT height, std::string inputPixelFormatString, UINT fps_num, UINT fps_den, std::string outputPixelFormatString, std::string vcodec, std::string preset, VideoOptions options)
 	{
 		PRE();
 		if (this->isBeingDeleted) {
@@ -108,20 +314,120 @@ namespace Encoder {
 			return E_FAIL;
 		}
 
-		this->outputPixelFormat = av_get_pix_fmt(outputPixelFormatString.c_str());
-		if (this->outputPixelFormat == AV_PIX_FMT_NONE) {
-			LOG(LL_ERR, "Unknown output pixel format specified: ", outputPixelFormatString);
+		// An empty pixel format is picked once the encoder is known.
+		this->outputPixelFormat = AV_PIX_FMT_NONE;
+		if (!outputPixelFormatString.empty()) {
+			this->outputPixelFormat = av_get_pix_fmt(outputPixelFormatString.c_str());
+			if (this->outputPixelFormat == AV_PIX_FMT_NONE) {
+				LOG(LL_ERR, "Unknown output pixel format specified: ", outputPixelFormatString);
+				POST();
+				return E_FAIL;
+			}
+		}
+
+		int scalerFlags = 0;
+		if (!getScalerFlags(options.scaler, scalerFlags)) {
+			LOG(LL_ERR, "Unknown scaler specified: ", options.scaler);
 			POST();
 			return E_FAIL;
 		}
 
+		MotionBlur::Profile profile = MotionBlur::PROFILE_BOX;
+		if (!getShutterProfile(options.shutterProfile, profile)) {
+			LOG(LL_ERR, "Unknown shutter profile specified: ", options.shutterProfile);
+			POST();
+			return E_FAIL;
+		}
+
+		// A missing side of the output size follows the aspect ratio of the capture, rounded to
+		// an even number so that subsampled chroma stays whole.
+		if ((options.outputWidth == 0) && (options.outputHeight == 0)) {
+			options.outputWidth = width;
+			options.outputHeight = height;
+		} else if (options.outputWidth == 0) {
+			options.outputWidth = (std::max)(2u, (uint32_t)(((uint64_t)width * options.outputHeight + height) / (2 * height) * 2));
+		} else if (options.outputHeight == 0) {
+			options.outputHeight = (std::max)(2u, (uint32_t)(((uint64_t)height * options.outputWidth + width) / (2 * width) * 2));
+		}
+		LOG(LL_NFO, "  size: ", width, "x", height, " captured, ", options.outputWidth, "x", options.outputHeight, " encoded");
+
 		this->width = width;
 		this->height = height;
-		this->motionBlurSamples = motionBlurSamples;
-		this->motionBlurAccBuffer = std::valarray<uint16_t>(width * height * 4);
-		this->motionBlurTempBuffer = std::valarray<uint16_t>(width * height * 4);
-		this->motionBlurDestBuffer = std::valarray<uint8_t>(width * height * 4);
-		this->shutterPosition = shutterPosition;
+		this->outputWidth = options.outputWidth;
+		this->outputHeight = options.outputHeight;
+		this->motionBlurSamples = options.motionBlurSamples;
+		this->shutterSchedule.reset(options.motionBlurSamples, options.shutterPosition, profile, options.shutterWeights);
+		if (this->shutterSchedule.getProfile() != profile) {
+			LOG(LL_WRN, "Custom shutter weights are empty or zero, using a box shutter.");
+		}
+		if (!getEXRReferenceSubFrame(options.exrDepthSubFrame, this->shutterSchedule, this->exrReferenceSubFrame)) {
+			LOG(LL_ERR, "Unknown OpenEXR depth sub-frame specified: ", options.exrDepthSubFrame);
+			POST();
+			return E_FAIL;
+		}
+		// Packed copies of the OpenEXR textures, allocated once frames come in.
+		this->exrRGBPool.reset(4 * sizeof(uint16_t) * width * height, 0);
+		this->exrDepthPool.reset(sizeof(float) * width * height, 0);
+		this->exrStencilPool.reset(width * height, 0);
+		this->exrReadbackRing.reset(EXR_READBACK_LATENCY);
+		this->exrReadback.reset(this->exrReadbackRing.getSlotCount());
+		this->videoReadbackRing.reset(VIDEO_READBACK_LATENCY);
+		this->videoReadback.reset(this->videoReadbackRing.getSlotCount());
+		if (options.motionBlurSamples > 0) {
+			// Only the AVX-512 kernels look the linear values up in registers. Anywhere else a linear
+			// light sub-frame costs about three times a plain one, so it's left out.
+			if (options.isMotionBlurLinear && (ColorConversion::detectIsa() < ColorConversion::ISA_AVX512)) {
+				LOG(LL_WRN, "Linear light motion blur needs AVX-512, blending the sub-frames as sRGB values.");
+				options.isMotionBlurLinear = false;
+			}
+			// Sized for the total weight of the shutter, so the accumulator knows whether 16 bit sums can overflow.
+			this->motionBlurAccumulator.reset(av_image_get_buffer_size(this->inputPixelFormat, width, height, 1), this->shutterSchedule.getTotalWeight(), ColorConversion::detectIsa(), options.threadBudget.blurThreads, options.isMotionBlurLinear);
+			// R, G, B and SSS halves per pixel.
+			this->exrAccumulator.reset(4 * width, height, ColorConversion::detectIsa());
+			// The motion is measured on the captured frames, which needs four bytes per pixel.
+			if ((options.adaptiveThreshold > 0.0f) && (av_image_get_linesize(this->inputPixelFormat, width, 0) != 4 * (int)width)) {
+				LOG(LL_WRN, "Adaptive sampling needs four bytes per pixel, rendering every sub-frame.");
+				options.adaptiveThreshold = 0.0f;
+			}
+			this->adaptiveSampling.reset(width, height, this->shutterSchedule.getSubFrameCount(), (uint32_t)options.adaptiveMinSamples + 1, options.adaptiveThreshold);
+			if (this->adaptiveSampling.isEnabled()) {
+				LOG(LL_NFO, "  adaptive sampling: ", (std::min)((uint32_t)options.adaptiveMinSamples + 1, this->shutterSchedule.getSubFrameCount()), " to ", this->shutterSchedule.getSubFrameCount(), " sub-frames, threshold ", options.adaptiveThreshold);
+			}
+			LOG(LL_NFO, "  motion blur: ", this->shutterSchedule.getOpenCount(), " of ", this->shutterSchedule.getSubFrameCount(), " sub-frames, ", options.shutterProfile.empty() ? "box" : options.shutterProfile, " shutter, ", this->motionBlurAccumulator.isLinear() ? "linear light, " : "", this->motionBlurAccumulator.isWide() ? 32 : 16, " bit sums, ", ColorConversion::getIsaName(this->motionBlurAccumulator.getIsa()), ", ", this->motionBlurAccumulator.getThreadCount(), " threads");
+		}
+
+		// The shutter of the optical flow blur is open for the strength part of the frame.
+		this->isFlowBlurred = false;
+		if ((options.motionBlurSamples == 0) && options.isMotionBlurFlow) {
+			if (av_image_get_linesize(this->inputPixelFormat, width, 0) != 4 * (int)width) {
+				LOG(LL_WRN, "Optical flow motion blur needs four bytes per pixel, frames are not blurred.");
+			} else if (options.shutterPosition < 1.0f) {
+				this->flowBlur.reset(width, height, 1.0f - options.shutterPosition, options.threadBudget.blurThreads);
+				this->isFlowBlurred = true;
+				LOG(LL_NFO, "  motion blur: optical flow, shutter open ", 1.0f - options.shutterPosition, " of the frame, ", this->flowBlur.getThreadCount(), " threads");
+			}
+		}
+
+		// Sub-frames already are frames the game renders in between, so interpolating them would
+		// stretch the shutter over several frames.
+		this->interpolationFactor = 1;
+		if (options.interpolationFactor > 1) {
+			OpticalFlow::Interpolator::Quality quality;
+			if (!OpticalFlow::Interpolator::getQuality(options.interpolationQuality, quality)) {
+				LOG(LL_ERR, "Unknown interpolation quality specified: ", options.interpolationQuality);
+				POST();
+				return E_FAIL;
+			}
+			if (options.motionBlurSamples > 0) {
+				LOG(LL_WRN, "Frame interpolation doesn't work with motion blur sub-frames, rendering every frame.");
+			} else if (av_image_get_linesize(this->inputPixelFormat, width, 0) != 4 * (int)width) {
+				LOG(LL_WRN, "Frame interpolation needs four bytes per pixel, rendering every frame.");
+			} else {
+				this->interpolator.reset(width, height, options.interpolationFactor, quality, options.threadBudget.blurThreads);
+				this->interpolationFactor = options.interpolationFactor;
+				LOG(LL_NFO, "  interpolation: 1 of ", this->interpolationFactor, " frames rendered, ", OpticalFlow::Interpolator::getQualityName(quality), ", ", this->interpolator.getThreadCount(), " threads");
+			}
+		}
 
 		//this->audioSampleRateMultiplier = ((float)fps_num * ((float)motionBlurSamples + 1)) / ((float)fps_den * 60.0f);
 
@@ -129,22 +435,64 @@ namespace Encoder {
 		this->videoCodec = avcodec_find_encoder_by_name(vcodec.c_str());
 		RET_IF_NULL(this->videoCodec, "Could not find video codec:" + vcodec, E_FAIL);
 
+		if (this->outputPixelFormat == AV_PIX_FMT_NONE) {
+			this->outputPixelFormat = getDefaultPixelFormat(this->videoCodec, this->inputPixelFormat);
+			if (this->outputPixelFormat == AV_PIX_FMT_NONE) {
+				LOG(LL_ERR, "Could not find a pixel format for the video codec: ", vcodec);
+				POST();
+				return E_FAIL;
+			}
+			LOG(LL_NFO, "  pixel format: ", av_get_pix_fmt_name(this->outputPixelFormat), " (picked for the encoder)");
+		}
+
+		// Frames converted on the GPU come in already in the output format, which only works
+		// when no stage before the encoder needs them in BGRA.
+		if (options.isGpuConversion) {
+			GpuConversion::Layout layout;
+			if ((options.motionBlurSamples > 0) || this->isFlowBlurred || (this->interpolationFactor > 1)) {
+				LOG(LL_WRN, "GPU conversion doesn't work with motion blur or interpolation, converting on the CPU.");
+			} else if ((options.outputWidth != width) || (options.outputHeight != height)) {
+				LOG(LL_WRN, "GPU conversion doesn't scale, converting on the CPU.");
+			} else if (!GpuConversion::getLayout(av_get_pix_fmt_name(this->outputPixelFormat), width, height, layout)) {
+				LOG(LL_WRN, "GPU conversion only writes nv12, p010le and yuv444p at even sizes, converting on the CPU.");
+			} else {
+				this->inputPixelFormat = this->outputPixelFormat;
+				this->videoReadback.enableConversion(layout);
+				LOG(LL_NFO, "  conversion: GPU, ", layout.rows, " rows of ", layout.getRowSize(), " bytes per frame");
+			}
+		}
+
+		// One buffer per queue slot, plus the ones held by the capture hook, the blur stage and the conversion stage,
+		// the one the optical flow blur writes to and the frames interpolated at once.
+		this->videoFramePool.reset(av_image_get_buffer_size(this->inputPixelFormat, width, height, 1),
+			this->videoFrameQueue.getCapacity() + this->videoConversionQueue.getCapacity() + (this->isFlowBlurred ? 4 : 3) + this->interpolationFactor - 1);
+
+		this->isConversionSkipped = ((this->outputPixelFormat == this->inputPixelFormat)
+			|| ((this->inputPixelFormat == AV_PIX_FMT_BGRA) && (this->outputPixelFormat == AV_PIX_FMT_BGR0)))
+			&& (options.outputWidth == width) && (options.outputHeight == height);
+
 		this->videoCodecContext = avcodec_alloc_context3(this->videoCodec);
 		RET_IF_NULL(this->videoCodecContext, "Could not allocate context for the video codec", E_FAIL);
 
 		av_dict_parse_string(&this->videoOptions, preset.c_str(), "=", "/", 0);
 		//av_set_options_string(this->videoCodecContext, preset.c_str(), "=", "/");
 		
-		RET_IF_FAILED(this->createVideoFrames(width, height, this->inputPixelFormat, width, height, this->outputPixelFormat), "Could not create video frames", E_FAIL);
+		RET_IF_FAILED(this->createVideoFrames(width, height, this->inputPixelFormat, options.outputWidth, options.outputHeight, this->outputPixelFormat, scalerFlags, options.threadBudget.conversionThreads), "Could not create video frames", E_FAIL);
 
 		this->videoCodecContext->codec_id = this->videoCodec->id;
 		this->videoCodecContext->pix_fmt = this->outputPixelFormat;
-		this->videoCodecContext->width = width;
-		this->videoCodecContext->height = height;
+		this->videoCodecContext->width = options.outputWidth;
+		this->videoCodecContext->height = options.outputHeight;
 		this->videoCodecContext->time_base = av_make_q(fps_den, fps_num);
 		this->videoCodecContext->framerate = av_make_q(fps_num, fps_den);
 		this->videoCodecContext->codec_type = AVMEDIA_TYPE_VIDEO;
 
+		// A threads option in the preset wins over the budget.
+		if (av_dict_get(this->videoOptions, "threads", NULL, 0) == NULL) {
+			this->videoCodecContext->thread_count = options.threadBudget.codecThreads;
+			this->videoCodecContext->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+		}
+
 		if (this->oformat->flags & AVFMT_GLOBALHEADER)
 		{
 			this->videoCodecContext->flags |= CODEC_FLAG_GLOBAL_HEADER;
@@ -152,6 +500,8 @@ namespace Encoder {
 		
 		RET_IF_FAILED_AV(avcodec_open2(this->videoCodecContext, this->videoCodec, &this->videoOptions), "Could not open video codec", E_FAIL);
 		
+		this->thread_video_blur = std::thread(&Session::videoBlurThread, this);
+		this->thread_video_converter = std::thread(&Session::videoConversionThread, this);
 		this->thread_video_encoder = std::thread(&Session::videoEncodingThread, this);
 		this->thread_exr_encoder = std::thread(&Session::exrEncodingThread, this);
 
@@ -161,7 +511,7 @@ namespace Encoder {
 		return S_OK;
 	}
 
-	HRESULT Session::createAudioContext(uint32_t inputChannels, uint32_t inputSampleRate, uint32_t inputBitsPerSample, std::string inputSampleFormat, uint32_t inputAlignment, std::string outputSampleFormatString, std::string acodec, std::string preset) {
+	HRESULT Session::createAudioContext(uint32_t inputChannels, uint32_t inputSampleRate, uint32_t inputBitsPerSample, std::string inputSampleFormat, uint32_t inputAlignment, std::string outputSampleFormatString, std::string acodec, std::string preset, uint32_t audioThreads) {
 		PRE();
 		if (this->isBeingDeleted) {
 			POST();
@@ -213,6 +563,7 @@ namespace Encoder {
 		this->audioCodecContext->time_base = { 1, (int)inputSampleRate };
 		//this->audioCodecContext->frame_size = 256;
 		this->audioCodecContext->channel_layout = AV_CH_LAYOUT_STEREO;
+		this->audioCodecContext->thread_count = audioThreads;
 		
 		if (this->oformat->flags & AVFMT_GLOBALHEADER)
 		{
@@ -246,6 +597,21 @@ namespace Encoder {
 
 		std::lock_guard<std::mutex> guard(this->mxFormatContext);
 
+		HRESULT result = this->openFormatContext(format, filename, exrOutputPath, fmtPreset);
+		// The mux thread runs after a failure too and drops the packets, so that the encoders
+		// never block on a full queue.
+		if (FAILED(result)) {
+			this->isMuxFailed = true;
+		}
+		this->thread_muxer = std::thread(&Session::muxThread, this);
+
+		POST();
+		return result;
+	}
+
+	HRESULT Session::openFormatContext(std::string format, std::string filename, std::string exrOutputPath, std::string fmtPreset)
+	{
+		PRE();
 		this->exrOutputPath = exrOutputPath;
 
 		this->filename = filename;
@@ -319,7 +685,9 @@ namespace Encoder {
 		RET_IF_FAILED_AV(avio_open(&this->fmtContext->pb, filename.c_str(), AVIO_FLAG_WRITE), "Could not open output file", E_FAIL);
 		RET_IF_NULL(this->fmtContext->pb, "Could not open output file", E_FAIL);
 		RET_IF_FAILED_AV(avformat_write_header(this->fmtContext, &this->fmtOptions), "Could not write header", E_FAIL);
+		this->isHeaderWritten = true;
 		LOG(LL_NFO, "Format context was created successfully.");
+		renderTimeScale = this->subFrameSpan * this->interpolationFactor;
 		this->isCapturing = true;
 		this->isFormatContextCreated = true;
 		this->cvFormatContext.notify_all();
@@ -336,29 +704,220 @@ namespace Encoder {
 			return E_FAIL;
 		}
 
-		D3D11_MAPPED_SUBRESOURCE mHDR = { 0 };
-		D3D11_MAPPED_SUBRESOURCE mDepth = { 0 };
-		D3D11_MAPPED_SUBRESOURCE mStencil = { 0 };
+		this->protectDeviceContext(pDeviceContext);
+		this->exrReadback.setSources(pDeviceContext, cRGB, cDepth, cStencil);
+		if (!this->exrReadbackRing.issue(this->exrReadback)) {
+			LOG(LL_ERR, "Failed to read back OpenEXR textures");
+			POST();
+			return E_FAIL;
+		}
+
+		POST();
+		return S_OK;
+	}
 
-		if (cRGB) {
-			REQUIRE(pDeviceContext->Map(cRGB.Get(), 0, D3D11_MAP::D3D11_MAP_READ, 0, &mHDR), "Failed to map HDR texture");
+	// Copies the rows of a staging texture into a packed buffer of rowSize bytes per row and
+	// unmaps it right away, so the texture can be reused for the next capture.
+	HRESULT Session::copyEXRTexture(ComPtr<ID3D11DeviceContext> pDeviceContext, ID3D11Texture2D* pTexture, FramePool& pool, size_t rowSize, FramePool::Buffer& buffer) {
+		PRE();
+		D3D11_MAPPED_SUBRESOURCE mapped = { 0 };
+		RET_IF_FAILED(pDeviceContext->Map(pTexture, 0, D3D11_MAP::D3D11_MAP_READ, 0, &mapped), "Failed to map OpenEXR staging texture", E_FAIL);
+
+		buffer = pool.acquire();
+		uint8_t* pDst = std::begin(*buffer);
+		const size_t copied = (std::min)(rowSize, (size_t)mapped.RowPitch);
+		for (uint32_t y = 0; y < this->height; y++) {
+			memcpy(pDst + y * rowSize, (const uint8_t*)mapped.pData + (size_t)y * mapped.RowPitch, copied);
 		}
+		pDeviceContext->Unmap(pTexture, 0);
+		POST();
+		return S_OK;
+	}
 
-		if (cDepth) { 
-			REQUIRE(pDeviceContext->Map(cDepth.Get(), 0, D3D11_MAP::D3D11_MAP_READ, 0, &mDepth), "Failed to map depth texture");
+	Session::EXRReadback::EXRReadback(Session& session) :
+		session(session)
+	{ }
+
+	void Session::EXRReadback::reset(uint32_t slotCount) {
+		this->rgbTextures.reset(slotCount);
+		this->depthTextures.reset(slotCount);
+		this->stencilTextures.reset(slotCount);
+		this->slots.assign(slotCount, Slot());
+	}
+
+	void Session::EXRReadback::setSources(ComPtr<ID3D11DeviceContext> pDeviceContext, ComPtr<ID3D11Texture2D> cRGB, ComPtr<ID3D11Texture2D> cDepth, ComPtr<ID3D11Texture2D> cStencil) {
+		this->pDeviceContext = pDeviceContext;
+		this->cRGB = cRGB;
+		this->cDepth = cDepth;
+		this->cStencil = cStencil;
+	}
+
+	bool Session::EXRReadback::copy(uint32_t slot) {
+		Slot& frame = this->slots[slot];
+		frame.hasRGB = this->cRGB != nullptr;
+		frame.hasDepth = this->cDepth != nullptr;
+		frame.hasStencil = this->cStencil != nullptr;
+		frame.pts = this->session.getSubFrame();
+		frame.span = this->session.subFrameSpan;
+
+		HRESULT hr = S_OK;
+		if (frame.hasRGB) {
+			hr = this->rgbTextures.copy(this->pDeviceContext.Get(), this->cRGB.Get(), slot);
+		}
+		if (SUCCEEDED(hr) && frame.hasDepth) {
+			hr = this->depthTextures.copy(this->pDeviceContext.Get(), this->cDepth.Get(), slot);
+		}
+		if (SUCCEEDED(hr) && frame.hasStencil) {
+			hr = this->stencilTextures.copy(this->pDeviceContext.Get(), this->cStencil.Get(), slot);
+		}
+		if (FAILED(hr)) {
+			LOG(LL_ERR, "Failed to create OpenEXR staging textures ### error code: ", hr);
+			return false;
+		}
+		return true;
+	}
+
+	bool Session::EXRReadback::isReady(uint32_t slot) {
+		const Slot& frame = this->slots[slot];
+		return (!frame.hasRGB || this->rgbTextures.isReady(this->pDeviceContext.Get(), slot))
+			&& (!frame.hasDepth || this->depthTextures.isReady(this->pDeviceContext.Get(), slot))
+			&& (!frame.hasStencil || this->stencilTextures.isReady(this->pDeviceContext.Get(), slot));
+	}
+
+	bool Session::EXRReadback::read(uint32_t slot) {
+		const Slot& frame = this->slots[slot];
+		FramePool::Buffer rgb;
+		FramePool::Buffer depth;
+		FramePool::Buffer stencil;
+		if (frame.hasRGB && FAILED(this->session.copyEXRTexture(this->pDeviceContext, this->rgbTextures.get(slot), this->session.exrRGBPool, 4 * sizeof(uint16_t) * this->session.width, rgb))) {
+			return false;
+		}
+		if (frame.hasDepth && FAILED(this->session.copyEXRTexture(this->pDeviceContext, this->depthTextures.get(slot), this->session.exrDepthPool, sizeof(float) * this->session.width, depth))) {
+			return false;
+		}
+		if (frame.hasStencil && FAILED(this->session.copyEXRTexture(this->pDeviceContext, this->stencilTextures.get(slot), this->session.exrStencilPool, this->session.width, stencil))) {
+			return false;
+		}
+
+		this->session.exrImageQueue.enqueue(exr_queue_item(std::move(rgb), std::move(depth), std::move(stencil), frame.pts, frame.span));
+		return true;
+	}
+
+	Session::VideoReadback::VideoReadback(Session& session) :
+		session(session),
+		isConverting(false)
+	{ }
+
+	void Session::VideoReadback::reset(uint32_t slotCount) {
+		this->textures.reset(slotCount);
+		this->slots.assign(slotCount, Slot());
+		this->isConverting = false;
+	}
+
+	void Session::VideoReadback::enableConversion(const GpuConversion::Layout& layout) {
+		this->converter.reset(layout);
+		this->isConverting = true;
+	}
+
+	void Session::VideoReadback::setSource(ComPtr<ID3D11DeviceContext> pDeviceContext, ComPtr<ID3D11Texture2D> pTexture) {
+		this->pDeviceContext = pDeviceContext;
+		this->pTexture = pTexture;
+	}
+
+	bool Session::VideoReadback::copy(uint32_t slot) {
+		this->slots[slot].pts = this->session.getSubFrame();
+		this->slots[slot].span = this->session.subFrameSpan;
+		ID3D11Texture2D* pSource = this->pTexture.Get();
+		if (this->isConverting) {
+			HRESULT hr = this->converter.convert(this->pDeviceContext.Get(), pSource);
+			if (FAILED(hr)) {
+				LOG(LL_ERR, "Failed to convert video frame on the GPU ### error code: ", hr);
+				return false;
+			}
+			pSource = this->converter.getOutput();
 		}
+		HRESULT hr = this->textures.copy(this->pDeviceContext.Get(), pSource, slot);
+		if (FAILED(hr)) {
+			LOG(LL_ERR, "Failed to create video staging textures ### error code: ", hr);
+			return false;
+		}
+		return true;
+	}
+
+	bool Session::VideoReadback::isReady(uint32_t slot) {
+		return this->textures.isReady(this->pDeviceContext.Get(), slot);
+	}
+
+	bool Session::VideoReadback::read(uint32_t slot) {
+		D3D11_MAPPED_SUBRESOURCE mapped = { 0 };
+		ID3D11Texture2D* pStaging = this->textures.get(slot);
+		HRESULT hr = this->pDeviceContext->Map(pStaging, 0, D3D11_MAP::D3D11_MAP_READ, 0, &mapped);
+		if (FAILED(hr)) {
+			LOG(LL_ERR, "Failed to map video staging texture ### error code: ", hr);
+			return false;
+		}
+		const UINT rows = this->isConverting ? this->converter.getLayout().rows : this->session.height;
+		hr = this->session.writeVideoFrame((BYTE*)mapped.pData, (int)(mapped.RowPitch * rows), (int)mapped.RowPitch, this->slots[slot].pts, this->slots[slot].span);
+		this->pDeviceContext->Unmap(pStaging, 0);
+		return SUCCEEDED(hr);
+	}
+
+	bool Session::isEXRColorNeeded() {
+		return this->shutterSchedule.isOpen(this->getSubFrame(), this->subFrameSpan);
+	}
+
+	bool Session::isEXRDepthNeeded() {
+		// The reference sub-frame may be one that adaptive sampling skips, the rendered one
+		// that stands for it is taken instead.
+		const uint64_t subFrame = this->getSubFrame() % this->shutterSchedule.getSubFrameCount();
+		return (subFrame >= this->exrReferenceSubFrame) && (subFrame < this->exrReferenceSubFrame + this->subFrameSpan);
+	}
+
+	bool Session::isVideoFrameNeeded() {
+		return (this->videoCodecContext != NULL) && this->shutterSchedule.isOpen(this->getSubFrame(), this->subFrameSpan);
+	}
+
+	void Session::skipVideoFrame() {
+		this->nextSubFrame();
+	}
+
+	uint64_t Session::getSubFrame() {
+		return this->subFramePTS + this->subFrameSpan - 1;
+	}
+
+	void Session::nextSubFrame() {
+		this->subFramePTS += this->subFrameSpan;
+		this->renderedSubFrames++;
+		if (this->subFramePTS % this->shutterSchedule.getSubFrameCount() == 0) {
+			const uint32_t span = this->adaptiveSampling.nextSpan();
+			if (span != this->subFrameSpan) {
+				LOG(LL_DBG, "Rendering ", this->shutterSchedule.getSubFrameCount() / span, " sub-frames per frame, motion ", this->adaptiveSampling.getMotion());
+				this->subFrameSpan = span;
+				renderTimeScale = span * this->interpolationFactor;
+			}
+		}
+	}
+
+	HRESULT Session::enqueueVideoFrame(BYTE *pData, int length, int rowPitch) {
+		PRE();
 
-		if (cStencil) {
-			REQUIRE(pDeviceContext->Map(cStencil.Get(), 0, D3D11_MAP::D3D11_MAP_READ, 0, &mStencil), "Failed to map stencil texture");
+		if (!this->videoCodecContext) {
+			POST();
+			return S_OK;
 		}
 
-		this->exrImageQueue.enqueue(exr_queue_item(cRGB, mHDR.pData, cDepth, mDepth.pData, cStencil, mStencil));
+		if (this->isBeingDeleted) {
+			POST();
+			return E_FAIL;
+		}
 
+		RET_IF_FAILED(this->writeVideoFrame(pData, length, rowPitch, this->getSubFrame(), this->subFrameSpan), "Could not write video frame", E_FAIL);
+		this->nextSubFrame();
 		POST();
 		return S_OK;
 	}
 
-	HRESULT Session::enqueueVideoFrame(BYTE *pData, int length) {
+	HRESULT Session::enqueueVideoTexture(ComPtr<ID3D11DeviceContext> pDeviceContext, ComPtr<ID3D11Texture2D> pTexture) {
 		PRE();
 
 		if (!this->videoCodecContext) {
@@ -370,193 +929,485 @@ namespace Encoder {
 			POST();
 			return E_FAIL;
 		}
-		auto pVector = std::shared_ptr<std::valarray<uint8_t>>(new std::valarray<uint8_t>(length));
 
-		std::copy(pData, pData + length, std::begin(*pVector));
+		this->protectDeviceContext(pDeviceContext);
+		this->videoReadback.setSource(pDeviceContext, pTexture);
+		if (!this->videoReadbackRing.issue(this->videoReadback)) {
+			LOG(LL_ERR, "Failed to read back video frame");
+			POST();
+			return E_FAIL;
+		}
+		this->nextSubFrame();
+		POST();
+		return S_OK;
+	}
+
+	void Session::protectDeviceContext(ComPtr<ID3D11DeviceContext> pDeviceContext) {
+		if (this->pMultithread) {
+			return;
+		}
+		// Every call of the game then takes the lock of the context too. Needs the Direct3D
+		// 11.4 runtime of Windows 10.
+		if (SUCCEEDED(pDeviceContext.As(&this->pMultithread))) {
+			this->wasMultithreadProtected = this->pMultithread->SetMultithreadProtected(TRUE);
+		} else {
+			LOG(LL_WRN, "The device context can't be made thread safe, the last frames are read back without its lock.");
+		}
+	}
+
+	void Session::flushReadback() {
+		if (this->pMultithread) {
+			this->pMultithread->Enter();
+		}
+		// The frames still in the readback rings go in before the end of the streams.
+		if (!this->videoReadbackRing.flush(this->videoReadback)) {
+			LOG(LL_ERR, "Failed to read back the last video frames");
+		}
+		if (!this->exrReadbackRing.flush(this->exrReadback)) {
+			LOG(LL_ERR, "Failed to read back the last OpenEXR textures");
+		}
+		if (this->pMultithread) {
+			this->pMultithread->Leave();
+			this->pMultithread->SetMultithreadProtected(this->wasMultithreadProtected);
+			this->pMultithread = nullptr;
+		}
+	}
+
+	HRESULT Session::writeVideoFrame(BYTE *pData, int length, int rowPitch, uint64_t pts, uint32_t span) {
+		PRE();
+		auto pVector = this->videoFramePool.acquire();
+		BYTE* pDest = std::begin(*pVector);
+		int rowLength = av_image_get_linesize(this->inputPixelFormat, this->width, 0);
+		// Frames converted on the GPU have more rows than the picture, all as long as the first.
+		const size_t rows = pVector->size() / rowLength;
+
+		if ((rowPitch == rowLength) && (pVector->size() <= (size_t)length)) {
+			memcpy(pDest, pData, pVector->size());
+		} else {
+			if ((size_t)rowPitch * (rows - 1) + rowLength > (size_t)length) {
+				LOG(LL_ERR, "Video frame is smaller than expected: ", length, " bytes with row pitch ", rowPitch);
+				this->videoFramePool.release(pVector);
+				POST();
+				return E_FAIL;
+			}
+			for (size_t y = 0; y < rows; y++) {
+				memcpy(pDest + y * rowLength, pData + y * rowPitch, rowLength);
+			}
+		}
+
+		// Measured on the copy, which is still in the cache. Frames read back from the GPU come
+		// in a few sub-frames late, the span of the next frame is picked from the motion known
+		// by then.
+		this->adaptiveSampling.measure(pDest, rowLength, pts);
 
-		frameQueueItem item(pVector);
-		this->videoFrameQueue.enqueue(item);
+		// The blur stage finds the place of the frame in the shutter from its sub-frame index.
+		this->videoFrameQueue.enqueue(frameQueueItem(std::move(pVector), pts, span));
 		POST();
 		return S_OK;
 	}
 
-	void Session::videoEncodingThread() {
+	Session::frameQueueItem Session::createOutputFrame(FramePool::Buffer frame) {
+		LOG(LL_NFO, "Encoding frame: ", this->videoPTS);
+		if (this->isFlowBlurred) {
+			FramePool::Buffer blurred = this->videoFramePool.acquire();
+			this->flowBlur.apply(std::begin(*frame), std::begin(*blurred));
+			this->videoFramePool.release(std::move(frame));
+			frame = std::move(blurred);
+		}
+		return frameQueueItem(std::move(frame), this->videoPTS++);
+	}
+
+	void Session::dropVideoFrame(frameQueueItem item) {
+		if (item.data != nullptr) {
+			this->videoFramePool.release(std::move(item.data));
+		}
+		if (item.blurSum != nullptr) {
+			this->motionBlurAccumulator.release(std::move(item.blurSum));
+		}
+	}
+
+	void Session::videoBlurThread() {
 		PRE();
-		std::lock_guard<std::mutex> lock(this->mxEncodingThread);
-		int k=0;
-		bool firstFrame;
+		bool isEndOfStream = false;
 		try {
+			// More than one output frame per rendered frame when frames are interpolated.
+			std::vector<frameQueueItem> outputs;
+			std::vector<FramePool::Buffer> interpolated(this->interpolationFactor - 1);
+			std::vector<uint8_t*> pInterpolated(interpolated.size());
 			frameQueueItem item = this->videoFrameQueue.dequeue();
-			while (item.data != nullptr) {
-				auto& data = *(item.data);
+			while ((item.data != nullptr) && !this->isVideoPipelineFailed) {
+				this->blurStageTimer.begin();
 				if (this->motionBlurSamples == 0) {
+					// The frames in between the last rendered frame and this one come first.
+					const bool isInterpolating = this->interpolator.isReady();
+					for (size_t i = 0; isInterpolating && (i < interpolated.size()); i++) {
+						interpolated[i] = this->videoFramePool.acquire();
+						pInterpolated[i] = std::begin(*interpolated[i]);
+					}
+					if (this->interpolationFactor > 1) {
+						this->interpolator.apply(std::begin(*item.data), pInterpolated.data());
+					}
+					for (size_t i = 0; isInterpolating && (i < interpolated.size()); i++) {
+						outputs.push_back(this->createOutputFrame(std::move(interpolated[i])));
+					}
+					outputs.push_back(this->createOutputFrame(std::move(item.data)));
+				} else if (this->shutterSchedule.isLast(item.pts)) {
+					// Flush motion blur buffer, as a sum for the conversion stage to average or
+					// averaged into the last sample's frame
+					this->motionBlurAccumulator.add(std::begin(*item.data), this->shutterSchedule.getWeight(item.pts, item.span));
 					LOG(LL_NFO, "Encoding frame: ", this->videoPTS);
-					REQUIRE(this->writeVideoFrame(std::begin(data), item.data->size(), this->videoPTS++), "Failed to write video frame.");
-				} else {
-					int frameRemainder = this->motionBlurPTS++ % (this->motionBlurSamples + 1);
-					float currentShutterPosition = (float)frameRemainder / ((float)this->motionBlurSamples + 1);
-					std::copy(std::begin(data), std::end(data), std::begin(this->motionBlurTempBuffer));
-					if (frameRemainder == this->motionBlurSamples) {
-						// Flush motion blur buffer
-						this->motionBlurAccBuffer += this->motionBlurTempBuffer;
-						this->motionBlurAccBuffer /= ++k;
-						std::copy(std::begin(this->motionBlurAccBuffer), std::end(this->motionBlurAccBuffer), std::begin(this->motionBlurDestBuffer));
-						REQUIRE(this->writeVideoFrame(std::begin(this->motionBlurDestBuffer), this->motionBlurDestBuffer.size(), this->videoPTS++), "Failed to write video frame");
-						k = 0;
-						firstFrame = true;
-					} else if (currentShutterPosition >= this->shutterPosition) {
-						if (firstFrame) {
-							// Reset accumulation buffer
-							this->motionBlurAccBuffer = this->motionBlurTempBuffer;
-							firstFrame = false;
-						} else {
-							this->motionBlurAccBuffer += this->motionBlurTempBuffer;
-						}
-						k++;
+					if (this->isMotionBlurFused) {
+						outputs.push_back(frameQueueItem(this->motionBlurAccumulator.detach(), this->videoPTS++));
+					} else {
+						this->motionBlurAccumulator.resolve(std::begin(*item.data));
+						outputs.push_back(frameQueueItem(std::move(item.data), this->videoPTS++));
 					}
+				} else if (this->shutterSchedule.isOpen(item.pts, item.span)) {
+					this->motionBlurAccumulator.add(std::begin(*item.data), this->shutterSchedule.getWeight(item.pts, item.span));
+				}
+				this->videoFramePool.release(std::move(item.data));
+				this->blurStageTimer.end();
+				for (frameQueueItem& output : outputs) {
+					this->videoConversionQueue.enqueue(std::move(output));
 				}
+				outputs.clear();
 				item = this->videoFrameQueue.dequeue();
 			}
+			isEndOfStream = item.isEndOfStream();
+			this->dropVideoFrame(std::move(item));
+
+			// The last rendered frame stands for as many frames of the output as the others, so
+			// that the video keeps the length of the audio.
+			for (size_t i = 0; isEndOfStream && this->interpolator.isReady() && (i < interpolated.size()); i++) {
+				FramePool::Buffer frame = this->videoFramePool.acquire();
+				std::copy(this->interpolator.getLastFrame().begin(), this->interpolator.getLastFrame().end(), std::begin(*frame));
+				this->videoConversionQueue.enqueue(this->createOutputFrame(std::move(frame)));
+			}
+		} catch (...) {
+			this->isVideoPipelineFailed = true;
+		}
+		while (!isEndOfStream) {
+			frameQueueItem item = this->videoFrameQueue.dequeue();
+			isEndOfStream = item.isEndOfStream();
+			this->dropVideoFrame(std::move(item));
+		}
+		LOG(LL_NFO, "Frame buffer pool: ", this->videoFramePool.getAllocationCount(), " buffers allocated for ", this->videoFramePool.getAcquisitionCount(), " captured frames");
+		this->videoConversionQueue.enqueue(frameQueueItem(nullptr));
+		POST();
+	}
+
+	void Session::videoConversionThread() {
+		PRE();
+		bool isEndOfStream = false;
+		try {
+			frameQueueItem item = this->videoConversionQueue.dequeue();
+			while (!item.isEndOfStream() && !this->isVideoPipelineFailed) {
+				encodeQueueItem output = this->videoFreeFrameQueue.dequeue();
+				this->conversionStageTimer.begin();
+				HRESULT result;
+				if (item.blurSum != nullptr) {
+					result = this->convertBlurredFrame(*item.blurSum, item.pts, output.frame.get());
+					this->motionBlurAccumulator.release(std::move(item.blurSum));
+				} else if (this->isConversionSkipped) {
+					result = this->wrapVideoFrame(std::move(item.data), item.pts, output.frame.get());
+				} else {
+					result = this->convertVideoFrame(std::begin(*item.data), item.data->size(), item.pts, output.frame.get());
+					this->videoFramePool.release(std::move(item.data));
+				}
+				REQUIRE(result, "Failed to convert video frame.");
+				this->conversionStageTimer.end();
+				this->videoEncodingQueue.enqueue(std::move(output));
+				item = this->videoConversionQueue.dequeue();
+			}
+			isEndOfStream = item.isEndOfStream();
+			this->dropVideoFrame(std::move(item));
+		} catch (...) {
+			this->isVideoPipelineFailed = true;
+		}
+		while (!isEndOfStream) {
+			frameQueueItem item = this->videoConversionQueue.dequeue();
+			isEndOfStream = item.isEndOfStream();
+			this->dropVideoFrame(std::move(item));
+		}
+		this->videoEncodingQueue.enqueue(encodeQueueItem());
+		POST();
+	}
+
+	void Session::videoEncodingThread() {
+		PRE();
+		std::lock_guard<std::mutex> lock(this->mxEncodingThread);
+		encodeQueueItem item;
+		try {
+			item = this->videoEncodingQueue.dequeue();
+			while (item.frame != nullptr) {
+				this->encodingStageTimer.begin();
+				REQUIRE(this->encodeVideoFrame(item.frame.get()), "Failed to encode video frame.");
+				// The encoder keeps its own reference to the picture buffer for as long as it
+				// needs it, so the buffer only goes back to the pool once that one is gone too.
+				av_frame_unref(item.frame.get());
+				this->encodingStageTimer.end();
+				this->videoFreeFrameQueue.enqueue(std::move(item));
+				item = this->videoEncodingQueue.dequeue();
+			}
+
+			// Write delayed frames
+			REQUIRE(this->encodeVideoFrame(NULL), "Failed to flush the video encoder.");
 		} catch (...) {
-			// Do nothing
+			this->isVideoPipelineFailed = true;
+		}
+		// The frames go back to the conversion stage unencoded, so that it never waits for a
+		// free one.
+		while (item.frame != nullptr) {
+			av_frame_unref(item.frame.get());
+			this->videoFreeFrameQueue.enqueue(std::move(item));
+			item = this->videoEncodingQueue.dequeue();
 		}
+		this->muxQueue.enqueue(muxQueueItem(AVMEDIA_TYPE_VIDEO, nullptr));
 		this->isEncodingThreadFinished = true;
 		this->cvEncodingThreadFinished.notify_all();
 		POST();
 	}
 
+	void Session::muxThread() {
+		PRE();
+		// Every encoder that was opened sends an end of stream marker when it is done.
+		int openStreams = (this->videoCodecContext ? 1 : 0) + (this->audioCodecContext ? 1 : 0);
+		while (openStreams > 0) {
+			muxQueueItem item = this->muxQueue.dequeue();
+			if (item.packet == nullptr) {
+				openStreams--;
+				continue;
+			}
+			// The encoders and writeAudioFrame block while the queue is full, the packets are
+			// still taken off it after a failed write.
+			if (this->isMuxFailed) {
+				continue;
+			}
+			this->muxStageTimer.begin();
+			HRESULT hr = E_FAIL;
+			try {
+				hr = this->muxPacket(item.type, item.packet.get());
+			} catch (std::exception& ex) {
+				LOG(LL_ERR, ex.what());
+			}
+			if (FAILED(hr)) {
+				LOG(LL_ERR, "Failed to write packet, dropping the rest of the packets.");
+				this->isMuxFailed = true;
+			} else if (item.type == AVMEDIA_TYPE_VIDEO) {
+				this->videoPacketsWritten++;
+			}
+			item.packet.reset();
+			this->muxStageTimer.end();
+		}
+		POST();
+	}
+
 	void Session::exrEncodingThread()
 	{
 		PRE();
 		std::lock_guard<std::mutex> lock(this->mxEXREncodingThread);
-		Imf::setGlobalThreadCount(8);
+		// Each writer compresses whole files on its own, which scales better than the threads
+		// OpenEXR uses within a file.
+		Imf::setGlobalThreadCount(0);
+		for (uint32_t i = 0; i < (std::max)(1u, this->exrThreads); i++) {
+			this->exrWriterThreads.emplace_back(&Session::exrWriterThread, this);
+		}
 		try {
+			// With motion blur, the colours of the open sub-frames are averaged and written along
+			// with the depth and object IDs of the reference sub-frame once the last one is in.
+			exr_queue_item reference;
 			exr_queue_item item = this->exrImageQueue.dequeue();
 			while (!item.isEndOfStream) {
-				struct RGBA {
-					half R;
-					half G;
-					half B;
-					half A;
-				};
-
-				struct Depth {
-					float depth;
-				};
-
-				Imf::Header header(this->width, this->height);
-				Imf::FrameBuffer framebuffer;
-
-				if (item.cRGB != nullptr) {
-					LOG_CALL(LL_DBG, header.channels().insert("R", Imf::Channel(Imf::HALF)));
-					LOG_CALL(LL_DBG, header.channels().insert("G", Imf::Channel(Imf::HALF)));
-					LOG_CALL(LL_DBG, header.channels().insert("B", Imf::Channel(Imf::HALF)));
-					LOG_CALL(LL_DBG, header.channels().insert("SSS", Imf::Channel(Imf::HALF)));
-					RGBA* mHDRArray = (RGBA*)item.pRGBData;
-
-					LOG_CALL(LL_DBG, framebuffer.insert("R",
-						Imf::Slice(
-							Imf::HALF,
-							(char*)&mHDRArray[0].R,
-							sizeof(RGBA),
-							sizeof(RGBA) * this->width
-							)));
-
-					LOG_CALL(LL_DBG, framebuffer.insert("G",
-						Imf::Slice(
-							Imf::HALF,
-							(char*)&mHDRArray[0].G,
-							sizeof(RGBA),
-							sizeof(RGBA) * this->width
-							)));
-
-					LOG_CALL(LL_DBG, framebuffer.insert("B",
-						Imf::Slice(
-							Imf::HALF,
-							(char*)&mHDRArray[0].B,
-							sizeof(RGBA),
-							sizeof(RGBA) * this->width
-							)));
-
-					LOG_CALL(LL_DBG, framebuffer.insert("SSS",
-						Imf::Slice(
-							Imf::HALF,
-							(char*)&mHDRArray[0].A,
-							sizeof(RGBA),
-							sizeof(RGBA) * this->width
-							)));
-				}
-				
-				if (item.cDepth != nullptr) {
-					LOG_CALL(LL_DBG, header.channels().insert("depth.Z", Imf::Channel(Imf::FLOAT)));
-					//header.channels().insert("objectID", Imf::Channel(Imf::UINT));
-					Depth* mDSArray = (Depth*)item.pDepthData;
-
-					LOG_CALL(LL_DBG, framebuffer.insert("depth.Z",
-						Imf::Slice(
-							Imf::FLOAT,
-							(char*)&mDSArray[0].depth,
-							sizeof(Depth),
-							sizeof(Depth) * this->width
-							)));
-				}
-
-				std::vector<uint32_t> stencilBuffer;
-				if (item.cStencil != nullptr) {
-					stencilBuffer = std::vector<uint32_t>(item.mStencilData.RowPitch * this->height);
-					uint8_t* mSArray = (uint8_t*)item.mStencilData.pData;
-
-					for (uint32_t i = 0; i < item.mStencilData.RowPitch * this->height; i++) {
-						stencilBuffer[i] = static_cast<uint32_t>(mSArray[i]);
+				if (this->motionBlurSamples == 0) {
+					this->queueEXRImage(std::move(item.rgb), std::move(item.depth), std::move(item.stencil));
+				} else {
+					const bool isLast = this->shutterSchedule.isLast(item.pts);
+					if (item.rgb != nullptr) {
+						this->exrAccumulator.add((const uint16_t*)std::begin(*item.rgb), 4 * sizeof(uint16_t) * this->width, this->shutterSchedule.getWeight(item.pts, item.span));
+						this->exrRGBPool.release(std::move(item.rgb));
+					}
+					if ((item.depth != nullptr) || (item.stencil != nullptr)) {
+						reference = std::move(item);
+					}
+					if (isLast) {
+						FramePool::Buffer rgb;
+						if (this->exrAccumulator.getWeight() > 0) {
+							rgb = this->exrRGBPool.acquire();
+							this->exrAccumulator.resolve((uint16_t*)std::begin(*rgb));
+						}
+						this->queueEXRImage(std::move(rgb), std::move(reference.depth), std::move(reference.stencil));
+						reference = exr_queue_item();
 					}
-
-					LOG_CALL(LL_DBG, header.channels().insert("objectID", Imf::Channel(Imf::UINT)));
-
-					LOG_CALL(LL_DBG, framebuffer.insert("objectID",
-						Imf::Slice(
-							Imf::UINT,
-							(char*)stencilBuffer.data(),
-							sizeof(uint32_t),
-							item.mStencilData.RowPitch * 4
-							)));
-				}
-
-				if (CreateDirectoryA(this->exrOutputPath.c_str(), NULL) || ERROR_ALREADY_EXISTS == GetLastError()) {
-
-
-					std::stringstream sstream;
-					sstream << std::setw(5) << std::setfill('0') << this->exrPTS++;
-					Imf::OutputFile file((this->exrOutputPath + "\\frame" +  sstream.str() + ".exr").c_str(), header);
-					LOG_CALL(LL_DBG, file.setFrameBuffer(framebuffer));
-					LOG_CALL(LL_DBG, file.writePixels(this->height));
 				}
 
-
 				item = this->exrImageQueue.dequeue();
 			}
 		} catch (std::exception& ex) {
 			LOG(LL_ERR, ex.what());
 		}
+		for (size_t i = 0; i < this->exrWriterThreads.size(); i++) {
+			this->exrWriteQueue.enqueue(exr_write_item());
+		}
+		for (std::thread& thread : this->exrWriterThreads) {
+			thread.join();
+		}
+		this->exrWriterThreads.clear();
 		this->isEXREncodingThreadFinished = true;
 		this->cvEXREncodingThreadFinished.notify_all();
 		POST();
 	}
 
-	HRESULT Session::writeVideoFrame(BYTE *pData, size_t length, LONGLONG sampleTime) {
+	void Session::exrWriterThread()
+	{
 		PRE();
-		if (this->isBeingDeleted) {
-			POST();
-			return E_FAIL;
+		exr_write_item item = this->exrWriteQueue.dequeue();
+		while (!item.isEndOfStream) {
+			// A file that fails doesn't stop the others.
+			try {
+				this->writeEXRImage(item);
+			} catch (std::exception& ex) {
+				LOG(LL_ERR, ex.what());
+			}
+			this->releaseEXRImage(item);
+			item = this->exrWriteQueue.dequeue();
 		}
+		POST();
+	}
 
-		// Wait until format context is created
-		{
-			std::unique_lock<std::mutex> lk(this->mxFormatContext);
-			while (!isFormatContextCreated) {
-				this->cvFormatContext.wait_for(lk, std::chrono::milliseconds(1));
+	// Numbers the file and hands it to the writers.
+	void Session::queueEXRImage(FramePool::Buffer rgb, FramePool::Buffer depth, FramePool::Buffer stencil)
+	{
+		// The output folder is created once, before the first file.
+		if (!this->isEXROutputPathChecked) {
+			this->isEXROutputPathChecked = true;
+			this->isEXROutputPathCreated = CreateDirectoryA(this->exrOutputPath.c_str(), NULL) || (ERROR_ALREADY_EXISTS == GetLastError());
+			if (!this->isEXROutputPathCreated) {
+				LOG(LL_ERR, "Could not create the OpenEXR output folder: ", this->exrOutputPath);
+			}
+		}
+
+		exr_write_item item(std::move(rgb), std::move(depth), std::move(stencil), this->exrPTS);
+		if (this->isEXROutputPathCreated) {
+			this->exrPTS++;
+			this->exrWriteQueue.enqueue(std::move(item));
+		} else {
+			this->releaseEXRImage(item);
+		}
+	}
+
+	void Session::releaseEXRImage(exr_write_item& item)
+	{
+		this->exrRGBPool.release(std::move(item.rgb));
+		this->exrDepthPool.release(std::move(item.depth));
+		this->exrStencilPool.release(std::move(item.stencil));
+	}
+
+	// Each of the colours, the depth and the object IDs is left out of the file when its buffer
+	// is null.
+	void Session::writeEXRImage(const exr_write_item& item)
+	{
+		struct RGBA {
+			half R;
+			half G;
+			half B;
+			half A;
+		};
+
+		struct Depth {
+			float depth;
+		};
+
+		Imf::Header header(this->width, this->height);
+		Imf::FrameBuffer framebuffer;
+
+		if (item.rgb != nullptr) {
+			const UINT rgbRowPitch = sizeof(RGBA) * this->width;
+			LOG_CALL(LL_DBG, header.channels().insert("R", Imf::Channel(Imf::HALF)));
+			LOG_CALL(LL_DBG, header.channels().insert("G", Imf::Channel(Imf::HALF)));
+			LOG_CALL(LL_DBG, header.channels().insert("B", Imf::Channel(Imf::HALF)));
+			LOG_CALL(LL_DBG, header.channels().insert("SSS", Imf::Channel(Imf::HALF)));
+			RGBA* mHDRArray = (RGBA*)std::begin(*item.rgb);
+
+			LOG_CALL(LL_DBG, framebuffer.insert("R",
+				Imf::Slice(
+					Imf::HALF,
+					(char*)&mHDRArray[0].R,
+					sizeof(RGBA),
+					rgbRowPitch
+					)));
+
+			LOG_CALL(LL_DBG, framebuffer.insert("G",
+				Imf::Slice(
+					Imf::HALF,
+					(char*)&mHDRArray[0].G,
+					sizeof(RGBA),
+					rgbRowPitch
+					)));
+
+			LOG_CALL(LL_DBG, framebuffer.insert("B",
+				Imf::Slice(
+					Imf::HALF,
+					(char*)&mHDRArray[0].B,
+					sizeof(RGBA),
+					rgbRowPitch
+					)));
+
+			LOG_CALL(LL_DBG, framebuffer.insert("SSS",
+				Imf::Slice(
+					Imf::HALF,
+					(char*)&mHDRArray[0].A,
+					sizeof(RGBA),
+					rgbRowPitch
+					)));
+		}
+		
+		if (item.depth != nullptr) {
+			LOG_CALL(LL_DBG, header.channels().insert("depth.Z", Imf::Channel(Imf::FLOAT)));
+			//header.channels().insert("objectID", Imf::Channel(Imf::UINT));
+			Depth* mDSArray = (Depth*)std::begin(*item.depth);
+
+			LOG_CALL(LL_DBG, framebuffer.insert("depth.Z",
+				Imf::Slice(
+					Imf::FLOAT,
+					(char*)&mDSArray[0].depth,
+					sizeof(Depth),
+					sizeof(Depth) * this->width
+					)));
+		}
+
+		std::vector<uint32_t> stencilBuffer;
+		if (item.stencil != nullptr) {
+			stencilBuffer = std::vector<uint32_t>(this->width * this->height);
+			uint8_t* mSArray = std::begin(*item.stencil);
+
+			for (uint32_t i = 0; i < this->width * this->height; i++) {
+				stencilBuffer[i] = static_cast<uint32_t>(mSArray[i]);
 			}
+
+			LOG_CALL(LL_DBG, header.channels().insert("objectID", Imf::Channel(Imf::UINT)));
+
+			LOG_CALL(LL_DBG, framebuffer.insert("objectID",
+				Imf::Slice(
+					Imf::UINT,
+					(char*)stencilBuffer.data(),
+					sizeof(uint32_t),
+					sizeof(uint32_t) * this->width
+					)));
 		}
 
+		std::stringstream sstream;
+		sstream << std::setw(5) << std::setfill('0') << item.frameNumber;
+		Imf::OutputFile file((this->exrOutputPath + "\\frame" +  sstream.str() + ".exr").c_str(), header);
+		LOG_CALL(LL_DBG, file.setFrameBuffer(framebuffer));
+		LOG_CALL(LL_DBG, file.writePixels(this->height));
+	}
+
+	HRESULT Session::convertVideoFrame(BYTE *pData, size_t length, LONGLONG sampleTime, AVFrame *pOutputFrame) {
+		PRE();
+		if (this->isBeingDeleted) {
+			POST();
+			return E_FAIL;
+		}
 
 		int bufferLength = av_image_get_buffer_size(this->inputPixelFormat, this->width, this->height, 1);
 		if (length != bufferLength) {
@@ -565,54 +1416,152 @@ namespace Encoder {
 			return E_FAIL;
 		}
 
-		AVFrame* inputFrame = av_frame_alloc();
-		RET_IF_NULL(inputFrame, "Could not allocate video frame", E_FAIL);
-		inputFrame->format = this->inputPixelFormat;
-		inputFrame->width = this->width;
-		inputFrame->height = this->height;
+		RET_IF_FAILED(av_image_fill_arrays(this->inputFrame->data, this->inputFrame->linesize, pData, this->inputPixelFormat, this->width, this->height, 1), "Could not fill the frame with data from the buffer", E_FAIL);
+		RET_IF_FAILED(this->getVideoFrameBuffer(pOutputFrame), "Could not get a video frame buffer", E_FAIL);
+
+		this->conversionThreadPool.run((uint32_t)this->conversionBands.size(), [&](uint32_t index) {
+			ConversionBand& band = this->conversionBands[index];
+			uint8_t* src[4];
+			uint8_t* dst[4];
+			offsetPlanes(this->inputPixelFormat, this->inputFrame->data, this->inputFrame->linesize, band.firstRow << this->downsampleLog2, src);
+			offsetPlanes(this->outputPixelFormat, pOutputFrame->data, pOutputFrame->linesize, band.firstRow, dst);
+			if (band.pSwsContext) {
+				sws_scale(band.pSwsContext, src, this->inputFrame->linesize, 0, band.rowCount, dst, pOutputFrame->linesize);
+			} else {
+				this->colorConverter.convert(src[0], this->inputFrame->linesize[0], this->outputWidth, band.rowCount, dst, pOutputFrame->linesize, band.scratch.data());
+			}
+		});
 
-		AVFrame* outputFrame = av_frame_alloc();
-		RET_IF_NULL(outputFrame, "Could not allocate video frame", E_FAIL);
-		outputFrame->format = this->outputPixelFormat;
-		outputFrame->width = this->width;
-		outputFrame->height = this->height;
-		av_frame_get_buffer(outputFrame, 1);
-		//REQUIRE(av_frame_make_writable(inputFrame), "inputFrame is not writable");
+		pOutputFrame->pts = sampleTime;
 
-		RET_IF_FAILED(av_image_fill_arrays(inputFrame->data, inputFrame->linesize, pData, this->inputPixelFormat, this->width, this->height, 1), "Could not fill the frame with data from the buffer", E_FAIL);
+		POST();
+		return S_OK;
+	}
 
-		//RET_IF_FAILED(av_frame_make_writable(outputFrame), "outputFrame is not writable", E_FAIL);
+	HRESULT Session::convertBlurredFrame(const MotionBlur::Sum& sum, LONGLONG sampleTime, AVFrame *pOutputFrame) {
+		PRE();
+		if (this->isBeingDeleted) {
+			POST();
+			return E_FAIL;
+		}
 
-		sws_scale(pSwsContext, inputFrame->data, inputFrame->linesize, 0, this->height, outputFrame->data, outputFrame->linesize);
+		RET_IF_FAILED(this->getVideoFrameBuffer(pOutputFrame), "Could not get a video frame buffer", E_FAIL);
 
-		av_frame_unref(inputFrame);
-		av_frame_free(&inputFrame);
-		//outputFrame->pts = av_rescale_q(sampleTime, this->videoCodecContext->time_base, this->videoStream->time_base);
-		outputFrame->pts = sampleTime;
+		// Every band averages the rows it converts, so the sum is read once and the average is
+		// never stored as a whole frame.
+		this->conversionThreadPool.run((uint32_t)this->conversionBands.size(), [&](uint32_t index) {
+			ConversionBand& band = this->conversionBands[index];
+			uint8_t* dst[4];
+			offsetPlanes(this->outputPixelFormat, pOutputFrame->data, pOutputFrame->linesize, band.firstRow, dst);
+			sum.convert(this->colorConverter, this->outputWidth, band.firstRow, band.rowCount, dst, pOutputFrame->linesize, band.split.data());
+		});
 
-		std::shared_ptr<AVPacket> pPkt(new AVPacket(), av_packet_unref);
+		pOutputFrame->pts = sampleTime;
 
-		av_init_packet(pPkt.get());
-		pPkt->data = NULL;
-		pPkt->size = 0;
+		POST();
+		return S_OK;
+	}
 
-		//int got_packet;
-		//avcodec_encode_video2(this->videoCodecContext, pPkt.get(), outputFrame, &got_packet);
+	HRESULT Session::getVideoFrameBuffer(AVFrame *pOutputFrame) {
+		PRE();
+		// av_frame_unref() resets the frame properties, so they are set again for every frame.
+		pOutputFrame->format = this->outputPixelFormat;
+		pOutputFrame->width = this->outputWidth;
+		pOutputFrame->height = this->outputHeight;
+		pOutputFrame->buf[0] = av_buffer_pool_get(this->videoBufferPool);
+		RET_IF_NULL(pOutputFrame->buf[0], "Could not get a video frame buffer from the pool", E_FAIL);
+		RET_IF_FAILED(av_image_fill_arrays(pOutputFrame->data, pOutputFrame->linesize, pOutputFrame->buf[0]->data, this->outputPixelFormat, this->outputWidth, this->outputHeight, VIDEO_FRAME_ALIGNMENT), "Could not fill the frame with data from the pool buffer", E_FAIL);
+		POST();
+		return S_OK;
+	}
 
-		avcodec_send_frame(this->videoCodecContext, outputFrame);
-		
-		if (SUCCEEDED(avcodec_receive_packet(this->videoCodecContext, pPkt.get()))) {
-			std::lock_guard<std::mutex> guard(this->mxWriteFrame);
-			av_packet_rescale_ts(pPkt.get(), this->videoCodecContext->time_base, this->videoStream->time_base);
-			pPkt->stream_index = this->videoStream->index;
-			av_interleaved_write_frame(this->fmtContext, pPkt.get());
+	HRESULT Session::wrapVideoFrame(FramePool::Buffer buffer, LONGLONG sampleTime, AVFrame *pOutputFrame) {
+		PRE();
+		if (this->isBeingDeleted) {
+			POST();
+			return E_FAIL;
+		}
+
+		// The buffer goes back to the pool once the encoder is done with the frame. Pool buffers
+		// are aligned and padded the way av_malloc() would do it.
+		FramePool::Bytes* pBytes = this->videoFramePool.lend(std::move(buffer));
+		pOutputFrame->buf[0] = av_buffer_create(pBytes->begin(), (int)pBytes->size(), releasePooledBuffer, pBytes, 0);
+		if (pOutputFrame->buf[0] == NULL) {
+			releasePooledBuffer(pBytes, NULL);
+			LOG(LL_WRN, "Could not wrap the captured frame buffer");
+			POST();
+			return E_FAIL;
+		}
+
+		pOutputFrame->format = this->outputPixelFormat;
+		pOutputFrame->width = this->width;
+		pOutputFrame->height = this->height;
+		RET_IF_FAILED(av_image_fill_arrays(pOutputFrame->data, pOutputFrame->linesize, pOutputFrame->buf[0]->data, this->inputPixelFormat, this->width, this->height, 1), "Could not fill the frame with data from the buffer", E_FAIL);
+		pOutputFrame->pts = sampleTime;
+
+		POST();
+		return S_OK;
+	}
+
+	HRESULT Session::encodeVideoFrame(AVFrame *pFrame) {
+		PRE();
+		if (this->isBeingDeleted) {
+			POST();
+			return E_FAIL;
+		}
+
+		int64_t packetCount = 0;
+		HRESULT result = this->encodeFrame(this->videoCodecContext, pFrame, AVMEDIA_TYPE_VIDEO, packetCount);
+
+		// Frames sent minus packets received is what the encoder is holding on to.
+		this->videoPacketsEncoded += packetCount;
+		this->videoFramesInEncoder += (pFrame ? 1 : 0) - packetCount;
+		this->peakVideoFramesInEncoder = (std::max)(this->peakVideoFramesInEncoder, this->videoFramesInEncoder);
+
+		POST();
+		return result;
+	}
+
+	HRESULT Session::encodeFrame(AVCodecContext *pCodecContext, AVFrame *pFrame, AVMediaType type, int64_t& packetCount) {
+		PRE();
+		RET_IF_FAILED_AV(avcodec_send_frame(pCodecContext, pFrame), "Could not send frame to the encoder", E_FAIL);
+
+		// Drain every packet the encoder has ready, not just the first one. When
+		// flushing (pFrame == NULL) this runs until the encoder signals the end.
+		while (true) {
+			AVPacketPtr pPkt(av_packet_alloc());
+			RET_IF_NULL(pPkt, "Could not allocate packet", E_FAIL);
+
+			int ret = avcodec_receive_packet(pCodecContext, pPkt.get());
+			if ((ret == AVERROR(EAGAIN)) || (ret == AVERROR_EOF)) {
+				break;
+			}
+			RET_IF_FAILED_AV(ret, "Could not receive packet from the encoder", E_FAIL);
+
+			packetCount++;
+			auto start = std::chrono::high_resolution_clock::now();
+			this->muxQueue.enqueue(muxQueueItem(type, std::move(pPkt)));
+			this->muxQueueWaitMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
 		}
 
-		//av_frame_unref()
-		av_frame_unref(outputFrame);
-		av_frame_free(&outputFrame);
-		//av_frame_free(&inputFrame);
+		POST();
+		return S_OK;
+	}
 
+	HRESULT Session::muxPacket(AVMediaType type, AVPacket *pPacket) {
+		PRE();
+		AVCodecContext *pCodecContext = type == AVMEDIA_TYPE_VIDEO ? this->videoCodecContext : this->audioCodecContext;
+		AVStream *pStream = type == AVMEDIA_TYPE_VIDEO ? this->videoStream : this->audioStream;
+
+		// The container does not take this kind of stream.
+		if (!pStream) {
+			POST();
+			return S_OK;
+		}
+
+		av_packet_rescale_ts(pPacket, pCodecContext->time_base, pStream->time_base);
+		pPacket->stream_index = pStream->index;
+		RET_IF_FAILED_AV(av_interleaved_write_frame(this->fmtContext, pPacket), "Could not write packet", E_FAIL);
 
 		POST();
 		return S_OK;
@@ -691,21 +1640,11 @@ namespace Encoder {
 		//this->outputAudioFrame->pts = this->audioPTS;
 		this->audioPTS += frameSize;
 
-		std::shared_ptr<AVPacket> pPkt(new AVPacket(), av_packet_unref);
-
-		av_init_packet(pPkt.get());
-		pPkt->data = NULL;
-		pPkt->size = 0;
-
-		avcodec_send_frame(this->audioCodecContext, localFrame);
+		int64_t packetCount = 0;
+		HRESULT result = this->encodeFrame(this->audioCodecContext, localFrame, AVMEDIA_TYPE_AUDIO, packetCount);
 		delete[] localBuffer;
 		av_frame_free(&localFrame);
-		if (SUCCEEDED(avcodec_receive_packet(this->audioCodecContext, pPkt.get()))) {
-			std::lock_guard<std::mutex> guard(this->mxWriteFrame);
-			av_packet_rescale_ts(pPkt.get(), this->audioCodecContext->time_base, this->audioStream->time_base);
-			pPkt->stream_index = this->audioStream->index;
-			av_interleaved_write_frame(this->fmtContext, pPkt.get());
-		}
+		RET_IF_FAILED(result, "Failed to encode audio frame", E_FAIL);
 
 		POST();
 		return S_OK;
@@ -721,6 +1660,8 @@ namespace Encoder {
 			return S_OK;
 		}
 
+		this->flushReadback();
+
 		// Wait until the video encoding thread is finished.
 		{
 			// Write end of the stream object with a nullptr
@@ -742,6 +1683,14 @@ namespace Encoder {
 		}
 
 
+		if (thread_video_blur.joinable()) {
+			thread_video_blur.join();
+		}
+
+		if (thread_video_converter.joinable()) {
+			thread_video_converter.join();
+		}
+
 		if (thread_video_encoder.joinable()) {
 			thread_video_encoder.join();
 		}
@@ -750,31 +1699,38 @@ namespace Encoder {
 			thread_exr_encoder.join();
 		}
 
-		// Write delayed frames
+		// Delayed frames were flushed by the encoding stage, report where the time went.
 		{
-			AVPacket pkt;
-
-			av_init_packet(&pkt);
-			pkt.data = NULL;
-			pkt.size = 0;
-
-			//int got_packet;
-			//avcodec_encode_video2(this->videoCodecContext, &pkt, NULL, &got_packet);
-			avcodec_send_frame(this->videoCodecContext, NULL);
-			while (SUCCEEDED(avcodec_receive_packet(this->videoCodecContext, &pkt))) {
-				std::lock_guard<std::mutex> guard(this->mxWriteFrame);
-				av_packet_rescale_ts(&pkt, this->videoCodecContext->time_base, this->videoStream->time_base);
-				//pkt.dts = outputFrame->pts;
-				pkt.stream_index = this->videoStream->index;
-				av_interleaved_write_frame(this->fmtContext, &pkt);
-				//avcodec_encode_video2(this->videoCodecContext, &pkt, NULL, &got_packet);
+			const StageTimer* stages[] = { &this->blurStageTimer, &this->conversionStageTimer, &this->encodingStageTimer, &this->muxStageTimer };
+			const StageTimer* bottleneck = stages[0];
+			for (const StageTimer* stage : stages) {
+				LOG(LL_NFO, "Video pipeline stage ", stage->name, ": ", stage->frames, " frames, ", stage->getAverageMilliseconds(), " ms/frame");
+				if (stage->getAverageMilliseconds() > bottleneck->getAverageMilliseconds()) {
+					bottleneck = stage;
+				}
+			}
+			LOG(LL_NFO, "Video pipeline bottleneck: ", bottleneck->name);
+			LOG(LL_NFO, "Peak number of frames held by the video encoder: ", this->peakVideoFramesInEncoder);
+			LOG(LL_NFO, "Video frame buffer pool: ", this->getVideoBufferAllocationCount(), " buffers allocated");
+			if (this->adaptiveSampling.isEnabled()) {
+				LOG(LL_NFO, "Adaptive sampling: ", this->renderedSubFrames, " sub-frames rendered out of ", this->subFramePTS);
 			}
-
-			av_packet_unref(&pkt);
 		}
 
 		this->isVideoFinished = true;
 
+		if (this->isVideoPipelineFailed) {
+			LOG(LL_ERR, "A stage of the video pipeline failed, the video file is incomplete.");
+			POST();
+			return E_FAIL;
+		}
+
+		if (this->isMuxFailed) {
+			LOG(LL_ERR, "Packets could not be written, the video file is incomplete.");
+			POST();
+			return E_FAIL;
+		}
+
 		POST();
 		return S_OK;
 	}
@@ -789,29 +1745,15 @@ namespace Encoder {
 			return S_OK;
 		}
 
-		// Write delated frames
+		// Write delayed frames
 		{
-
 			LOG(LL_WRN, "FIXME: Audio samples discarded:", av_audio_fifo_size(this->audioSampleBuffer));
 
-			//AVPacket pkt;
-
-			//av_init_packet(&pkt);
-			//pkt.data = NULL;
-			//pkt.size = 0;
-
-			//int got_packet;
-			//avcodec_encode_audio2(this->audioCodecContext, &pkt, NULL, &got_packet);
-			//while (got_packet != 0) {
-			//	std::lock_guard<std::mutex> guard(this->mxWriteFrame);
-			//	//av_packet_rescale_ts(&pkt, this->audioCodecContext->time_base, this->audioStream->time_base);
-			//	pkt.stream_index = this->audioStream->index;
-			//	av_interleaved_write_frame(this->fmtContext, &pkt);
-			//	avcodec_encode_audio2(this->audioCodecContext, &pkt, NULL, &got_packet);
-			//}
-
-			//av_free_packet(&pkt);
-			//av_packet_unref(&pkt);
+			if (this->isFormatContextCreated) {
+				int64_t packetCount = 0;
+				LOG_IF_FAILED(this->encodeFrame(this->audioCodecContext, NULL, AVMEDIA_TYPE_AUDIO, packetCount), "Failed to flush the audio encoder.");
+			}
+			this->muxQueue.enqueue(muxQueueItem(AVMEDIA_TYPE_AUDIO, nullptr));
 		}
 
 		this->isAudioFinished = true;
@@ -838,13 +1780,27 @@ namespace Encoder {
 		}
 		
 		this->isCapturing = false;
+		renderTimeScale = 1;
 		LOG(LL_NFO, "Ending session...");
 
+		// Both streams sent their end of stream marker, wait until everything is written.
+		if (thread_muxer.joinable()) {
+			thread_muxer.join();
+		}
+		LOG(LL_NFO, "Time spent waiting on the muxer queue: ", this->muxQueueWaitMicroseconds / 1000, " ms");
+		if (this->isMuxFailed) {
+			LOG(LL_ERR, "Packets could not be written, the output file is incomplete.");
+		}
+
 		LOG(LL_NFO, "Closing files...");
-		LOG_IF_FAILED_AV(av_write_trailer(this->fmtContext), "Could not finalize the output file.");
+		if (this->isHeaderWritten) {
+			LOG_IF_FAILED_AV(av_write_trailer(this->fmtContext), "Could not finalize the output file.");
+		}
 		LOG_IF_FAILED_AV(avcodec_close(this->videoCodecContext), "Could not close the video codec.");
 		LOG_IF_FAILED_AV(avcodec_close(this->audioCodecContext), "Could not close the audio codec.");
-		LOG_IF_FAILED_AV(avio_close(this->fmtContext->pb), "Could not close the output file.");
+		if (this->fmtContext) {
+			LOG_IF_FAILED_AV(avio_close(this->fmtContext->pb), "Could not close the output file.");
+		}
 		/*av_free(this->videoCodecContext.get());
 		av_free(this->audioCodecContext.get());*/
 		
@@ -855,7 +1811,16 @@ namespace Encoder {
 		POST();
 		return S_OK;
 	}
-	HRESULT Session::createVideoFrames(uint32_t srcWidth, uint32_t srcHeight, AVPixelFormat srcFmt, uint32_t dstWidth, uint32_t dstHeight, AVPixelFormat dstFmt)
+	uint64_t Session::getVideoBufferAllocationCount() {
+		return this->videoBufferAllocations;
+	}
+
+	AVBufferRef* Session::allocateVideoBuffer(void* opaque, int size) {
+		static_cast<Session*>(opaque)->videoBufferAllocations++;
+		return av_buffer_alloc(size);
+	}
+
+	HRESULT Session::createVideoFrames(uint32_t srcWidth, uint32_t srcHeight, AVPixelFormat srcFmt, uint32_t dstWidth, uint32_t dstHeight, AVPixelFormat dstFmt, int scalerFlags, uint32_t conversionThreads)
 	{
 		PRE();
 		if (this->isBeingDeleted) {
@@ -868,16 +1833,89 @@ namespace Encoder {
 		this->inputFrame->width = srcWidth;
 		this->inputFrame->height = srcHeight;
 
-		this->outputFrame = av_frame_alloc();
-		RET_IF_NULL(this->outputFrame, "Could not allocate video frame", E_FAIL);
-		this->outputFrame->format = dstFmt;
-		this->outputFrame->width = dstWidth;
-		this->outputFrame->height = dstHeight;
-		av_frame_get_buffer(this->outputFrame, 1);
-		//av_image_alloc(outputFrame->data, outputFrame->linesize, dstWidth, dstHeight, dstFmt, 1);
-		//av_alloc_buff
+		// The converted frames live as long as the session: one per encoding queue slot, plus the
+		// ones held by the conversion stage and the encoding stage. Only their buffers change hands.
+		for (int i = 0; i < this->videoFreeFrameQueue.getCapacity(); i++) {
+			AVFramePtr frame(av_frame_alloc());
+			RET_IF_NULL(frame, "Could not allocate video frame", E_FAIL);
+			this->videoFreeFrameQueue.enqueue(encodeQueueItem(std::move(frame)));
+		}
+
+		if (this->isConversionSkipped) {
+			LOG(LL_NFO, "The encoder takes the captured frames without conversion");
+			POST();
+			return S_OK;
+		}
+
+		int bufferSize = av_image_get_buffer_size(dstFmt, dstWidth, dstHeight, VIDEO_FRAME_ALIGNMENT);
+		RET_IF_FAILED_AV(bufferSize, "Could not compute the video frame buffer size", E_FAIL);
+		this->videoBufferPool = av_buffer_pool_init2(bufferSize, this, &Session::allocateVideoBuffer, NULL);
+		RET_IF_NULL(this->videoBufferPool, "Could not create the video frame buffer pool", E_FAIL);
+
+		// The built-in kernels box filter 2x2 and 4x4 blocks, unless the preset asks for a
+		// particular scaler. The scalar kernel is no faster than swscale.
+		const bool isScaling = (srcWidth != dstWidth) || (srcHeight != dstHeight);
+		int downsampleLog2 = getDownsampleLog2(srcWidth, srcHeight, dstWidth, dstHeight);
+		if (isScaling && (scalerFlags != 0)) {
+			downsampleLog2 = -1;
+		}
+		if (scalerFlags == 0) {
+			scalerFlags = SWS_BICUBIC;
+		}
+
+		ColorConversion::OutputFormat kernelFormat;
+		bool isUsingKernels = (downsampleLog2 >= 0) && getConversionFormat(srcFmt, dstFmt, kernelFormat);
+		if (isUsingKernels) {
+			kernelFormat.downsampleLog2 = downsampleLog2;
+			isUsingKernels = this->colorConverter.init(kernelFormat, ColorConversion::detectIsa())
+				&& (this->colorConverter.getIsa() != ColorConversion::ISA_SCALAR);
+		}
+		this->downsampleLog2 = isUsingKernels ? downsampleLog2 : 0;
+		if (isUsingKernels) {
+			LOG(LL_NFO, "Converting video frames with the ", ColorConversion::getIsaName(this->colorConverter.getIsa()), " kernels", isScaling ? ", box filtered" : "");
+		} else {
+			LOG(LL_NFO, "Converting video frames with swscale");
+		}
+
+		this->isMotionBlurFused = (this->motionBlurSamples > 0) && isUsingKernels && this->colorConverter.hasSplitKernel();
+		if (this->isMotionBlurFused) {
+			LOG(LL_NFO, "Averaging motion blurred frames while converting them, at ", kernelFormat.depth, " bits");
+		}
+
+		// Bands split the output rows. swscale only works in bands when rows map one to one,
+		// so scaling through it converts the whole picture at once.
+		if (isScaling && !isUsingKernels) {
+			ConversionBand band;
+			band.firstRow = 0;
+			band.rowCount = srcHeight;
+			band.pSwsContext = sws_getContext(srcWidth, srcHeight, srcFmt, dstWidth, dstHeight, dstFmt, scalerFlags, NULL, NULL, NULL);
+			RET_IF_NULL(band.pSwsContext, "Could not create the scaling context", E_FAIL);
+			this->conversionBands.push_back(band);
+		} else {
+			int bandHeight = dstHeight;
+			if (conversionThreads > 1) {
+				bandHeight = (dstHeight + conversionThreads - 1) / conversionThreads;
+				bandHeight = (bandHeight + CONVERSION_BAND_ALIGNMENT - 1) / CONVERSION_BAND_ALIGNMENT * CONVERSION_BAND_ALIGNMENT;
+			}
+
+			for (int firstRow = 0; firstRow < (int)dstHeight; firstRow += bandHeight) {
+				ConversionBand band;
+				band.firstRow = firstRow;
+				band.rowCount = (std::min)(bandHeight, (int)dstHeight - firstRow);
+				band.pSwsContext = NULL;
+				if (isUsingKernels) {
+					band.scratch.resize(this->colorConverter.getScratchSize((int)dstWidth));
+					band.split.resize(this->isMotionBlurFused ? 4 * (size_t)dstWidth : 0);
+				} else {
+					band.pSwsContext = sws_getContext(srcWidth, band.rowCount, srcFmt, dstWidth, band.rowCount, dstFmt, SWS_POINT, NULL, NULL, NULL);
+					RET_IF_NULL(band.pSwsContext, "Could not create the conversion context", E_FAIL);
+				}
+				this->conversionBands.push_back(band);
+			}
+		}
 
-		this->pSwsContext = sws_getContext(srcWidth, srcHeight, srcFmt, dstWidth, dstHeight, dstFmt, SWS_POINT, NULL, NULL, NULL);
+		this->conversionThreadPool.start((std::min)(conversionThreads, (uint32_t)this->conversionBands.size()));
+		LOG(LL_NFO, "Converting video frames in ", this->conversionBands.size(), " bands on ", this->conversionThreadPool.getThreadCount(), " threads");
 		POST();
 		return S_OK;
 	}
@@ -4,10 +4,24 @@
 #include <mfidl.h>
 #include <mutex>
 #include <future>
+#include <chrono>
+#include <atomic>
 #include <vector>
 #include <valarray>
 #include "SafeQueue.h"
+#include "SpscQueue.h"
+#include "FramePool.h"
+#include "ThreadPool.h"
+#include "ThreadBudget.h"
+#include "color-conversion.h"
+#include "motion-blur.h"
+#include "adaptive-sampling.h"
+#include "optical-flow.h"
+#include "readback.h"
+#include "StagingTextureRing.h"
+#include "GpuConverter.h"
 #include <d3d11.h>
+#include <d3d11_4.h>
 #include <dxgi.h>
 #include <wrl.h>
 
@@ -18,6 +32,7 @@ extern "C" {
 #include <libavcodec\avcodec.h>
 #include <libavformat\avformat.h>
 #include <libavutil\imgutils.h>
+#include <libavutil\pixdesc.h>
 #include <libswresample\swresample.h>
 #include <libswscale\swscale.h>
 }
@@ -26,6 +41,75 @@ extern "C" {
 //using std::shared_ptr = std::shared_ptr<T, std::function<void(T*)>>;
 
 namespace Encoder {
+	struct AVFrameDeleter {
+		void operator()(AVFrame* pFrame) const {
+			av_frame_free(&pFrame);
+		}
+	};
+
+	struct AVPacketDeleter {
+		void operator()(AVPacket* pPacket) const {
+			av_packet_free(&pPacket);
+		}
+	};
+
+	typedef std::unique_ptr<AVFrame, AVFrameDeleter> AVFramePtr;
+	typedef std::unique_ptr<AVPacket, AVPacketDeleter> AVPacketPtr;
+
+	// Time a pipeline stage spends working on frames, not counting the time it
+	// waits on its input or output queue.
+	struct StageTimer {
+		StageTimer(const char* name) :
+			name(name)
+		{}
+
+		void begin() {
+			this->start = std::chrono::high_resolution_clock::now();
+		}
+
+		void end() {
+			this->busy += std::chrono::high_resolution_clock::now() - this->start;
+			this->frames++;
+		}
+
+		double getAverageMilliseconds() const {
+			return this->frames ? std::chrono::duration<double, std::milli>(this->busy).count() / this->frames : 0.0;
+		}
+
+		const char* name;
+		uint64_t frames = 0;
+		std::chrono::high_resolution_clock::duration busy = std::chrono::high_resolution_clock::duration::zero();
+		std::chrono::high_resolution_clock::time_point start;
+	};
+
+	// How the captured frames are processed on their way to the video encoder. script.cpp
+	// fills it from the config, the defaults leave every frame as it was captured.
+	struct VideoOptions {
+		// Sub-frames rendered per frame besides the last one, 0 without motion blur.
+		uint8_t motionBlurSamples = 0;
+		// Part of the frame that passes before the shutter opens, 1 - motion_blur_strength.
+		float shutterPosition = 0.5f;
+		std::string shutterProfile = "box";
+		// Weights of the custom shutter profile.
+		std::vector<float> shutterWeights;
+		bool isMotionBlurLinear = false;
+		// Blurs single frames along their optical flow when there are no sub-frames.
+		bool isMotionBlurFlow = false;
+		uint8_t interpolationFactor = 1;
+		std::string interpolationQuality = "fast";
+		// See AdaptiveSampling::reset(), 0 renders every sub-frame.
+		float adaptiveThreshold = 0.0f;
+		uint8_t adaptiveMinSamples = 0;
+		std::string exrDepthSubFrame = "middle";
+		// Threads of every stage, the audio and OpenEXR ones too.
+		ThreadBudget threadBudget = ThreadBudget::split(0, 0, 0, false, false);
+		// 0 keeps the captured size, or its aspect ratio when the other side is set.
+		uint32_t outputWidth = 0;
+		uint32_t outputHeight = 0;
+		std::string scaler = "auto";
+		bool isGpuConversion = false;
+	};
+
 	class Session {
 	public:
 		AVOutputFormat *oformat = NULL;
@@ -35,12 +119,44 @@ namespace Encoder {
 		AVCodec *videoCodec = NULL;
 		AVCodecContext *videoCodecContext = NULL;
 		AVFrame *inputFrame = NULL;
-		AVFrame *outputFrame = NULL;
+		AVBufferPool *videoBufferPool = NULL;
+		// Number of buffers videoBufferPool ever had to allocate.
+		std::atomic<uint64_t> videoBufferAllocations;
 		AVStream *videoStream = NULL;
-		SwsContext *pSwsContext = NULL;
+		// Horizontal bands of the output picture, each converted by its own task on conversionThreadPool.
+		// Bands without a SwsContext use the built-in kernels of colorConverter, which read
+		// 1 << downsampleLog2 captured rows per output row into the scratch of the band.
+		// Motion blurred frames are averaged into its split rows when isMotionBlurFused is set.
+		struct ConversionBand {
+			SwsContext *pSwsContext;
+			int firstRow;
+			int rowCount;
+			std::vector<uint8_t> scratch;
+			std::vector<uint32_t> split;
+		};
+		std::vector<ConversionBand> conversionBands;
+		ThreadPool conversionThreadPool;
+		ColorConversion::Converter colorConverter;
+		int downsampleLog2 = 0;
+		// Set when the encoder takes the captured pixel format, the captured buffers then go to
+		// the encoder as they are.
+		bool isConversionSkipped = false;
+		// Set when blurred frames go to the conversion stage as sums, which the split kernel
+		// of colorConverter averages and converts in one pass.
+		bool isMotionBlurFused = false;
 		AVDictionary *videoOptions = NULL;
 		uint64_t videoPTS = 0;
-		uint64_t motionBlurPTS = 0;
+		// Index of the next sub-frame the game renders, counted by the capture side whether the
+		// sub-frame is read back or not. With adaptive sampling a rendered sub-frame stands for
+		// subFrameSpan sub-frames of the shutter, and this counts those.
+		uint64_t subFramePTS = 0;
+		std::atomic<uint32_t> subFrameSpan;
+		// subFrameSpan times interpolationFactor of the session that is capturing, 1 while none
+		// is. Read by the game's time step hook, which can't take the session lock for it.
+		static std::atomic<uint32_t> renderTimeScale;
+		uint64_t renderedSubFrames = 0;
+		MotionBlur::ShutterSchedule shutterSchedule;
+		MotionBlur::AdaptiveSampling adaptiveSampling;
 
 		AVCodec *audioCodec = NULL;
 		AVCodecContext *audioCodecContext = NULL;
@@ -71,74 +187,286 @@ namespace Encoder {
 			{
 				
 			}
-			frameQueueItem(std::shared_ptr<std::valarray<uint8_t>> bytes) :
-				data(bytes)
+			frameQueueItem(FramePool::Buffer bytes) :
+				data(std::move(bytes))
+			{}
+
+			frameQueueItem(FramePool::Buffer bytes, int64_t pts, uint32_t span = 1) :
+				data(std::move(bytes)),
+				pts(pts),
+				span(span)
+			{}
+
+			frameQueueItem(std::shared_ptr<MotionBlur::Sum> blurSum, int64_t pts) :
+				data(nullptr),
+				blurSum(std::move(blurSum)),
+				pts(pts)
+			{}
+
+			bool isEndOfStream() const {
+				return (this->data == nullptr) && (this->blurSum == nullptr);
+			}
+
+			FramePool::Buffer data;
+			// Sum of the sub-frames of a blurred frame that is averaged while it is converted.
+			std::shared_ptr<MotionBlur::Sum> blurSum;
+			int64_t pts = 0;
+			// Sub-frames of the shutter a captured sub-frame stands for, see AdaptiveSampling.
+			uint32_t span = 1;
+		};
+
+		// Frames handed from the conversion stage to the encoder stage.
+		// A null frame marks the end of the stream.
+		struct encodeQueueItem {
+			encodeQueueItem() {}
+
+			encodeQueueItem(AVFramePtr frame) :
+				frame(std::move(frame))
 			{}
 
-			std::shared_ptr<std::valarray<uint8_t>> data;
+			AVFramePtr frame;
 		};
 
+		// Packets handed from the video and audio encoders to the muxer thread.
+		// A null packet marks the end of the stream of the given type.
+		struct muxQueueItem {
+			muxQueueItem() {}
+
+			muxQueueItem(AVMediaType type, AVPacketPtr packet) :
+				type(type),
+				packet(std::move(packet))
+			{}
+
+			AVMediaType type = AVMEDIA_TYPE_VIDEO;
+			AVPacketPtr packet;
+		};
+
+		// Packed copies of the staging textures of one capture, null for those that weren't
+		// captured. The textures are unmapped as soon as they are copied.
 		struct exr_queue_item {
 			exr_queue_item() :
-				cRGB(nullptr),
-				pRGBData(nullptr),
-				cDepth(nullptr),
-				pDepthData(nullptr),
 				isEndOfStream(true)
 			{ }
 
-			exr_queue_item(ComPtr<ID3D11Texture2D> cRGB, void *pRGBData, ComPtr<ID3D11Texture2D> cDepth, void *pDepthData, ComPtr<ID3D11Texture2D> cStencil, D3D11_MAPPED_SUBRESOURCE mStencilData) :
-				cRGB(cRGB),
-				pRGBData(pRGBData),
-				cDepth(cDepth),
-				pDepthData(pDepthData),
-				cStencil(cStencil),
-				mStencilData(mStencilData)
+			exr_queue_item(FramePool::Buffer rgb, FramePool::Buffer depth, FramePool::Buffer stencil, uint64_t pts, uint32_t span) :
+				rgb(std::move(rgb)),
+				depth(std::move(depth)),
+				stencil(std::move(stencil)),
+				pts(pts),
+				span(span)
+			{ }
+
+			bool isEndOfStream = false;
+			// R, G, B and SSS halves per pixel.
+			FramePool::Buffer rgb;
+			// A float per pixel.
+			FramePool::Buffer depth;
+			// An object ID byte per pixel.
+			FramePool::Buffer stencil;
+			// Sub-frame the image was captured at.
+			uint64_t pts = 0;
+			uint32_t span = 1;
+		};
+
+		// A whole OpenEXR file for one of the writer threads, which hands the buffers back to
+		// their pools once it is written.
+		struct exr_write_item {
+			exr_write_item() :
+				isEndOfStream(true)
+			{ }
+
+			exr_write_item(FramePool::Buffer rgb, FramePool::Buffer depth, FramePool::Buffer stencil, uint64_t frameNumber) :
+				rgb(std::move(rgb)),
+				depth(std::move(depth)),
+				stencil(std::move(stencil)),
+				frameNumber(frameNumber)
 			{ }
 
 			bool isEndOfStream = false;
+			// Captured or, with motion blur, averaged colours.
+			FramePool::Buffer rgb;
+			FramePool::Buffer depth;
+			FramePool::Buffer stencil;
+			// Number in the file name, given in the order the frames came in.
+			uint64_t frameNumber = 0;
+		};
 
+		// Readback device of the OpenEXR captures. Every slot has a staging texture for the
+		// colours, the depth and the object IDs, and remembers which of them were copied and
+		// at which sub-frame. Reading a slot copies its textures out and queues them for
+		// exrEncodingThread.
+		class EXRReadback : public Readback::Device {
+		public:
+			EXRReadback(Session& session);
+
+			void reset(uint32_t slotCount);
+
+			// Textures of the frame the next copy() takes, null for those that aren't captured.
+			void setSources(ComPtr<ID3D11DeviceContext> pDeviceContext, ComPtr<ID3D11Texture2D> cRGB, ComPtr<ID3D11Texture2D> cDepth, ComPtr<ID3D11Texture2D> cStencil);
+
+			bool copy(uint32_t slot) override;
+			bool isReady(uint32_t slot) override;
+			bool read(uint32_t slot) override;
+
+		private:
+			struct Slot {
+				bool hasRGB = false;
+				bool hasDepth = false;
+				bool hasStencil = false;
+				uint64_t pts = 0;
+				uint32_t span = 1;
+			};
+
+			Session& session;
+			ComPtr<ID3D11DeviceContext> pDeviceContext;
 			ComPtr<ID3D11Texture2D> cRGB;
-			void* pRGBData;
 			ComPtr<ID3D11Texture2D> cDepth;
-			void* pDepthData;
 			ComPtr<ID3D11Texture2D> cStencil;
-			D3D11_MAPPED_SUBRESOURCE mStencilData;
-			//void* pStencilData;
+			StagingTextureRing rgbTextures;
+			StagingTextureRing depthTextures;
+			StagingTextureRing stencilTextures;
+			std::vector<Slot> slots;
+		};
+
+		// Readback device of the video frames, a staging texture of the swap chain buffer per
+		// slot. Reading a slot hands the frame to the video path with the sub-frame it was
+		// captured at. With GPU conversion, the staging textures hold the converted picture.
+		class VideoReadback : public Readback::Device {
+		public:
+			VideoReadback(Session& session);
+
+			void reset(uint32_t slotCount);
+
+			// Converts every frame on the GPU before it is copied, until the next reset().
+			void enableConversion(const GpuConversion::Layout& layout);
+
+			// Texture of the frame the next copy() takes.
+			void setSource(ComPtr<ID3D11DeviceContext> pDeviceContext, ComPtr<ID3D11Texture2D> pTexture);
+
+			bool copy(uint32_t slot) override;
+			bool isReady(uint32_t slot) override;
+			bool read(uint32_t slot) override;
+
+		private:
+			struct Slot {
+				uint64_t pts = 0;
+				uint32_t span = 1;
+			};
+
+			Session& session;
+			ComPtr<ID3D11DeviceContext> pDeviceContext;
+			ComPtr<ID3D11Texture2D> pTexture;
+			StagingTextureRing textures;
+			std::vector<Slot> slots;
+			GpuConverter converter;
+			bool isConverting;
+		};
+
+		// Most frames a capture is read back after. It is read earlier once the GPU is done
+		// copying it.
+		enum {
+			VIDEO_READBACK_LATENCY = 3,
+			EXR_READBACK_LATENCY = 2,
 		};
 
-		SafeQueue<frameQueueItem> videoFrameQueue;
-		SafeQueue<exr_queue_item> exrImageQueue;
+		// Declared before the queues: frames that skip the conversion hand their
+		// captured buffer back to the pool when they are freed.
+		FramePool videoFramePool;
+
+		// The video path is split into three stages, each on its own thread:
+		// videoBlurThread -> videoConversionThread -> videoEncodingThread
+		// Both the video encoding thread and writeAudioFrame hand their packets to
+		// muxThread, which is the only one writing to the format context.
+		SpscQueue<frameQueueItem> videoFrameQueue;
+		SpscQueue<frameQueueItem> videoConversionQueue;
+		SpscQueue<encodeQueueItem> videoEncodingQueue;
+		// Converted frames go back from the encoder stage to the conversion stage
+		// once the encoder has taken its own reference to the picture.
+		SpscQueue<encodeQueueItem> videoFreeFrameQueue;
+		SafeQueue<muxQueueItem> muxQueue;
+		SpscQueue<exr_queue_item> exrImageQueue;
+		// Files are written in parallel, each by one writer thread, with names numbered in order
+		// by exrEncodingThread.
+		SafeQueue<exr_write_item> exrWriteQueue;
+		FramePool exrRGBPool;
+		FramePool exrDepthPool;
+		FramePool exrStencilPool;
+		EXRReadback exrReadback;
+		Readback::Ring exrReadbackRing;
+		VideoReadback videoReadback;
+		Readback::Ring videoReadbackRing;
+		// The last frames of both rings are read back by finishVideo(), which runs on the thread
+		// that finalizes the export rather than on the render thread. The immediate context is
+		// made thread safe for the session, and the reads there hold its lock.
+		ComPtr<ID3D11Multithread> pMultithread;
+		BOOL wasMultithreadProtected = FALSE;
 
 		bool isVideoContextCreated = false;
 		bool isAudioContextCreated = false;
 		bool isFormatContextCreated = false;
+		// Only an output file with a header gets a trailer.
+		bool isHeaderWritten = false;
 		bool isEncodingThreadFinished = false;
 		std::condition_variable cvEncodingThreadFinished;
 		std::mutex mxEncodingThread;
+		std::thread thread_video_blur;
+		std::thread thread_video_converter;
 		std::thread thread_video_encoder;
-		std::valarray<uint16_t> motionBlurAccBuffer;
-		std::valarray<uint16_t> motionBlurTempBuffer;
-		std::valarray<uint8_t> motionBlurDestBuffer;
+		std::thread thread_muxer;
+		StageTimer blurStageTimer = StageTimer("blur");
+		StageTimer conversionStageTimer = StageTimer("convert");
+		StageTimer encodingStageTimer = StageTimer("encode");
+		StageTimer muxStageTimer = StageTimer("mux");
+		// Set once a stage of the video pipeline failed. Every stage then takes the frames off
+		// its queue and drops them up to the end of the stream, so that the stages before it
+		// and the render thread never block on a full queue.
+		std::atomic<bool> isVideoPipelineFailed;
+		int64_t videoFramesInEncoder = 0;
+		int64_t peakVideoFramesInEncoder = 0;
+		std::atomic<int64_t> muxQueueWaitMicroseconds;
+		// Video packets received from the encoder, and the ones the mux thread wrote.
+		int64_t videoPacketsEncoded = 0;
+		std::atomic<int64_t> videoPacketsWritten;
+		// Set once a packet couldn't be written. The mux thread keeps taking packets off
+		// the queue and drops them, so that the encoders never block on a full queue.
+		std::atomic<bool> isMuxFailed;
+		MotionBlur::Accumulator motionBlurAccumulator;
+		// With motion blur, the OpenEXR colours are blurred with the same shutter as the video
+		// while depth and object IDs come from a single sub-frame.
+		MotionBlur::HalfAccumulator exrAccumulator;
+		// Without sub-frames, blurs every frame along the motion since the one before it.
+		OpticalFlow::VectorBlur flowBlur;
+		bool isFlowBlurred = false;
+		// Without sub-frames, the game renders every interpolationFactor-th frame and the frames in
+		// between come from the interpolator.
+		OpticalFlow::Interpolator interpolator;
+		uint32_t interpolationFactor = 1;
+		uint32_t exrReferenceSubFrame = 0;
 
 		bool isEXREncodingThreadFinished = false;
 		std::condition_variable cvEXREncodingThreadFinished;
 		std::mutex mxEXREncodingThread;
 		std::thread thread_exr_encoder;
+		std::vector<std::thread> exrWriterThreads;
+		bool isEXROutputPathChecked = false;
+		bool isEXROutputPathCreated = false;
 
 
 		//std::condition_variable cvFormatContext;
 
 		std::mutex mxFinish;
-		std::mutex mxWriteFrame;
 
 		UINT width;
 		UINT height;
+		// Size of the encoded video, the capture is scaled to it before encoding.
+		UINT outputWidth;
+		UINT outputHeight;
 		UINT framerate;
 		//float audioSampleRateMultiplier;
 		uint32_t motionBlurSamples;
 		UINT audioBlockAlign;
 		AVPixelFormat outputPixelFormat;
+		uint32_t exrThreads = 1;
 		AVPixelFormat inputPixelFormat;
 		AVSampleFormat inputAudioSampleFormat;
 		AVSampleFormat outputAudioSampleFormat;
@@ -149,7 +477,6 @@ namespace Encoder {
 		std::string filename;
 		std::string exrOutputPath;
 		uint64_t exrPTS=0;
-		float shutterPosition;
 		//LPWSTR *outputDir;
 		//LPWSTR *outputFile;
 		//FILE *file;
@@ -168,11 +495,10 @@ namespace Encoder {
 			std::string inputPixelFmt,
 			uint32_t fps_num,
 			uint32_t fps_den,
-			uint8_t motionBlurSamples,
-			float shutterPosition,
 			std::string outputPixelFmt,
 			std::string vcodec,
 			std::string voptions,
+			const VideoOptions& options,
 			uint32_t inputChannels,
 			uint32_t inputSampleRate,
 			uint32_t inputBitsPerSample,
@@ -183,13 +509,43 @@ namespace Encoder {
 			std::string aoptions
 			);
 
-		HRESULT enqueueVideoFrame(BYTE * pData, int length);
+		// Tells whether the next sub-frame goes into the video. When it doesn't, the capture side
+		// skips reading it back and calls skipVideoFrame() instead of enqueueVideoTexture().
+		bool isVideoFrameNeeded();
+		void skipVideoFrame();
+		// Writes a frame that is already in memory right away. The game hook never calls this,
+		// it is the synchronous way in for the test harness, which has no device to read back from.
+		HRESULT enqueueVideoFrame(BYTE *pData, int length, int rowPitch);
+		// Copies the frame on the GPU and reads it back a few frames later, so that the render
+		// thread doesn't wait for the GPU on every frame. The readback then goes through the same
+		// writeVideoFrame() as enqueueVideoFrame().
+		HRESULT enqueueVideoTexture(ComPtr<ID3D11DeviceContext> pDeviceContext, ComPtr<ID3D11Texture2D> pTexture);
+		// Tell which parts of the next sub-frame go into the OpenEXR output, so that the capture
+		// side only copies those.
+		bool isEXRColorNeeded();
+		bool isEXRDepthNeeded();
+		// Takes the game's own textures, null for those that aren't needed, and reads them back
+		// a few frames later.
 		HRESULT enqueueEXRImage(ComPtr<ID3D11DeviceContext> pDeviceContext, ComPtr<ID3D11Texture2D> cRGB, ComPtr<ID3D11Texture2D> cDepth, ComPtr<ID3D11Texture2D> cStencil);
 
+		void videoBlurThread();
+		void videoConversionThread();
 		void videoEncodingThread();
+		void muxThread();
 		void exrEncodingThread();
-
-		HRESULT writeVideoFrame(BYTE *pData, size_t length, LONGLONG sampleTime);
+		void exrWriterThread();
+		HRESULT copyEXRTexture(ComPtr<ID3D11DeviceContext> pDeviceContext, ID3D11Texture2D* pTexture, FramePool& pool, size_t rowSize, FramePool::Buffer& buffer);
+		void queueEXRImage(FramePool::Buffer rgb, FramePool::Buffer depth, FramePool::Buffer stencil);
+		void releaseEXRImage(exr_write_item& item);
+		void writeEXRImage(const exr_write_item& item);
+
+		HRESULT convertVideoFrame(BYTE *pData, size_t length, LONGLONG sampleTime, AVFrame *pOutputFrame);
+		HRESULT convertBlurredFrame(const MotionBlur::Sum& sum, LONGLONG sampleTime, AVFrame *pOutputFrame);
+		HRESULT getVideoFrameBuffer(AVFrame *pOutputFrame);
+		HRESULT wrapVideoFrame(FramePool::Buffer buffer, LONGLONG sampleTime, AVFrame *pOutputFrame);
+		HRESULT encodeVideoFrame(AVFrame *pFrame);
+		HRESULT encodeFrame(AVCodecContext *pCodecContext, AVFrame *pFrame, AVMediaType type, int64_t& packetCount);
+		HRESULT muxPacket(AVMediaType type, AVPacket *pPacket);
 		HRESULT writeAudioFrame(BYTE *pData, size_t length, LONGLONG sampleTime);
 
 		HRESULT finishVideo();
@@ -197,11 +553,35 @@ namespace Encoder {
 
 		HRESULT endSession();
 
+		uint64_t getVideoBufferAllocationCount();
+
 	private:
-		HRESULT createVideoContext(UINT width, UINT height, std::string inputPixelFormatString, UINT fps_num, UINT fps_den, uint8_t motionBlurSamples, float shutterPosition, std::string outputPixelFormatString, std::string vcodec, std::string preset);
-		HRESULT createAudioContext(uint32_t inputChannels, uint32_t inputSampleRate, uint32_t inputBitsPerSample, std::string inputSampleFormat, uint32_t inputAlignment, std::string outputSampleFormatString, std::string acodec, std::string preset);
+		// Last sub-frame of the shutter that the next rendered sub-frame stands for.
+		uint64_t getSubFrame();
+		// Moves on to the next rendered sub-frame, and picks the span of the next frame at the
+		// end of a frame.
+		void nextSubFrame();
+		// Copies a frame captured at sub-frame pts into the video path.
+		HRESULT writeVideoFrame(BYTE *pData, int length, int rowPitch, uint64_t pts, uint32_t span);
+		// Runs a rendered or interpolated frame through the optical flow blur when there is one,
+		// and gives it the next time stamp of the video.
+		frameQueueItem createOutputFrame(FramePool::Buffer frame);
+		// Gives the buffers of a frame that goes no further back to their pools.
+		void dropVideoFrame(frameQueueItem item);
+		// Turns on the thread safety of the game's immediate context once, the first time the
+		// render thread hands a texture over.
+		void protectDeviceContext(ComPtr<ID3D11DeviceContext> pDeviceContext);
+		// Reads the frames left in both readback rings under the lock of the context.
+		void flushReadback();
+		// Allocator of videoBufferPool, counts the allocations of the session passed as opaque.
+		static AVBufferRef* allocateVideoBuffer(void* opaque, int size);
+
+		HRESULT createVideoContext(UINT width, UINT height, std::string inputPixelFormatString, UINT fps_num, UINT fps_den, std::string outputPixelFormatString, std::string vcodec, std::string preset, VideoOptions options);
+		HRESULT createAudioContext(uint32_t inputChannels, uint32_t inputSampleRate, uint32_t inputBitsPerSample, std::string inputSampleFormat, uint32_t inputAlignment, std::string outputSampleFormatString, std::string acodec, std::string preset, uint32_t audioThreads);
 		HRESULT createFormatContext(std::string format, std::string filename, std::string exrOutputPath, std::string fmtOptions);
-		HRESULT createVideoFrames(uint32_t srcWidth, uint32_t srcHeight, AVPixelFormat srcFmt, uint32_t dstWidth, uint32_t dstHeight, AVPixelFormat dstFmt);
+		// Opens the output file and writes its header, for createFormatContext().
+		HRESULT openFormatContext(std::string format, std::string filename, std::string exrOutputPath, std::string fmtOptions);
+		HRESULT createVideoFrames(uint32_t srcWidth, uint32_t srcHeight, AVPixelFormat srcFmt, uint32_t dstWidth, uint32_t dstHeight, AVPixelFormat dstFmt, int scalerFlags, uint32_t conversionThreads);
 		HRESULT createAudioFrames(uint32_t inputChannels, AVSampleFormat inputSampleFmt, uint32_t inputSampleRate, uint32_t outputChannels, AVSampleFormat outputSampleFmt, uint32_t outputSampleRate);
 	};
 }
\ No newline at end of file
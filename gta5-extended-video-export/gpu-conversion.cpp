@@ -0,0 +1,163 @@
+#include "gpu-conversion.h"
+#include "color-conversion.h"
+
+namespace GpuConversion {
+	namespace {
+		void setWeights(int32_t weights[4], const int16_t coefficients[3], int32_t offset, uint32_t shift) {
+			weights[0] = coefficients[0];
+			weights[1] = coefficients[1];
+			weights[2] = coefficients[2];
+			// Same rounding as the ColorConversion kernels.
+			weights[3] = (offset << shift) + (1 << (shift - 1));
+		}
+
+		void loadPixel(const uint8_t* pSrc, int srcStride, uint32_t x, uint32_t y, int32_t bgr[3]) {
+			const uint8_t* p = pSrc + (size_t)y * srcStride + 4 * (size_t)x;
+			bgr[0] += p[0];
+			bgr[1] += p[1];
+			bgr[2] += p[2];
+		}
+	}
+
+	bool getLayout(const std::string& pixelFormat, uint32_t width, uint32_t height, Layout& result) {
+		ColorConversion::OutputFormat format = { 0, 0, false, 8, false, 0 };
+		if (pixelFormat == "nv12") {
+			result.format = FORMAT_NV12;
+			format = { 1, 1, true, 8, false, 0 };
+		} else if (pixelFormat == "p010le") {
+			result.format = FORMAT_P010;
+			format = { 1, 1, true, 10, false, 0 };
+		} else if (pixelFormat == "yuv444p") {
+			result.format = FORMAT_YUV444P;
+		} else {
+			return false;
+		}
+		if ((width == 0) || (height == 0) || (format.chromaShiftX && ((width | height) & 1))) {
+			return false;
+		}
+
+		// There is no CPU kernel for p010, the weights and offsets are there all the same.
+		ColorConversion::Converter converter;
+		converter.init(format, ColorConversion::ISA_SCALAR);
+		const ColorConversion::Coefficients& c = converter.getCoefficients();
+
+		result.width = width;
+		result.height = height;
+		result.rows = format.chromaShiftY ? height + height / 2 : 3 * height;
+		result.bytesPerSample = format.depth > 8 ? 2 : 1;
+
+		Constants& constants = result.constants;
+		constants.width = width;
+		constants.height = height;
+		constants.rows = result.rows;
+		constants.lumaShift = 15 - (format.depth - 8);
+		constants.chromaShift = constants.lumaShift + format.chromaShiftX + format.chromaShiftY;
+		constants.maxValue = c.maxValue;
+		constants.sampleShift = 8 * result.bytesPerSample - format.depth;
+		constants.isInterleaved = format.isInterleaved ? 1 : 0;
+		setWeights(constants.lumaWeights, c.y, c.yOffset, constants.lumaShift);
+		setWeights(constants.uWeights, c.u, c.cOffset, constants.chromaShift);
+		setWeights(constants.vWeights, c.v, c.cOffset, constants.chromaShift);
+		return true;
+	}
+
+	uint32_t convertSample(const Constants& constants, const uint8_t* pSrc, int srcStride, uint32_t x, uint32_t row) {
+		int32_t bgr[3] = { 0, 0, 0 };
+		const int32_t* weights;
+		uint32_t shift;
+		if (row < constants.height) {
+			loadPixel(pSrc, srcStride, x, row, bgr);
+			weights = constants.lumaWeights;
+			shift = constants.lumaShift;
+		} else if (constants.isInterleaved) {
+			// U and V of the same 2x2 block side by side.
+			const uint32_t x0 = x & ~1u;
+			const uint32_t y0 = (row - constants.height) * 2;
+			loadPixel(pSrc, srcStride, x0, y0, bgr);
+			loadPixel(pSrc, srcStride, x0 + 1, y0, bgr);
+			loadPixel(pSrc, srcStride, x0, y0 + 1, bgr);
+			loadPixel(pSrc, srcStride, x0 + 1, y0 + 1, bgr);
+			weights = (x & 1) ? constants.vWeights : constants.uWeights;
+			shift = constants.chromaShift;
+		} else {
+			loadPixel(pSrc, srcStride, x, row % constants.height, bgr);
+			weights = (row < 2 * constants.height) ? constants.uWeights : constants.vWeights;
+			shift = constants.chromaShift;
+		}
+
+		const int32_t value = (weights[0] * bgr[0] + weights[2] * bgr[2] + weights[1] * bgr[1] + weights[3]) >> shift;
+		const int32_t clamped = value < 0 ? 0 : (value > (int32_t)constants.maxValue ? (int32_t)constants.maxValue : value);
+		return (uint32_t)clamped << constants.sampleShift;
+	}
+
+	void pack(const Layout& layout, const uint8_t* pSrc, int srcStride, uint8_t* pDst) {
+		for (uint32_t row = 0; row < layout.rows; row++) {
+			uint8_t* pRow = pDst + (size_t)row * layout.getRowSize();
+			for (uint32_t x = 0; x < layout.width; x++) {
+				const uint32_t sample = convertSample(layout.constants, pSrc, srcStride, x, row);
+				if (layout.bytesPerSample == 2) {
+					pRow[2 * x] = (uint8_t)sample;
+					pRow[2 * x + 1] = (uint8_t)(sample >> 8);
+				} else {
+					pRow[x] = (uint8_t)sample;
+				}
+			}
+		}
+	}
+
+	// Kept in step with convertSample(). UNORM loads of 8 bit channels are exact, so scaling
+	// them back by 255 gives the bytes of the capture, and the rest is integer maths. The
+	// output texture is R8_UINT or R16_UINT, which keeps the low bits of every value.
+	const char* const SHADER_SOURCE = R"(
+Texture2D<float4> source : register(t0);
+RWTexture2D<uint> output : register(u0);
+
+cbuffer Constants : register(b0) {
+	int4 lumaWeights;
+	int4 uWeights;
+	int4 vWeights;
+	uint width;
+	uint height;
+	uint rows;
+	uint lumaShift;
+	uint chromaShift;
+	uint maxValue;
+	uint sampleShift;
+	uint isInterleaved;
+};
+
+int3 load(uint x, uint y) {
+	float4 color = source.Load(int3(x, y, 0));
+	return int3(round(float3(color.b, color.g, color.r) * 255.0));
+}
+
+[numthreads(16, 16, 1)]
+void main(uint3 id : SV_DispatchThreadID) {
+	if ((id.x >= width) || (id.y >= rows)) {
+		return;
+	}
+
+	int3 bgr;
+	int4 weights;
+	uint shift;
+	if (id.y < height) {
+		bgr = load(id.x, id.y);
+		weights = lumaWeights;
+		shift = lumaShift;
+	} else if (isInterleaved) {
+		uint x0 = id.x & ~1u;
+		uint y0 = (id.y - height) * 2;
+		bgr = load(x0, y0) + load(x0 + 1, y0) + load(x0, y0 + 1) + load(x0 + 1, y0 + 1);
+		weights = (id.x & 1) ? vWeights : uWeights;
+		shift = chromaShift;
+	} else {
+		bgr = load(id.x, id.y % height);
+		weights = (id.y < 2 * height) ? uWeights : vWeights;
+		shift = chromaShift;
+	}
+
+	int value = (weights.x * bgr.x + weights.z * bgr.z + weights.y * bgr.y + weights.w) >> shift;
+	output[id.xy] = (uint)clamp(value, 0, (int)maxValue) << sampleShift;
+}
+)";
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Conversion of the captured BGRA frames to YUV on the GPU, before they are read
+// back, so that the CPU only copies finished planes on to the encoder. A compute
+// shader writes one sample per thread into a texture that has a row for every row
+// of every plane. Its rows packed one after the other are the picture in the
+// layout ffmpeg uses without padding, for the formats supported here.
+//
+// The shader only does integer maths, in the same order as pack(), which runs on
+// the CPU and gives exactly the same bytes, so the conversion can be tested
+// without a GPU. The weights come from ColorConversion, the output matches its
+// scalar kernel for the same format.
+namespace GpuConversion {
+	enum Format {
+		// 8 bit Y plane, then interleaved U and V at half size.
+		FORMAT_NV12,
+		// Same with 10 bit samples in the high bits of 16 bit little endian words.
+		FORMAT_P010,
+		// 8 bit Y, U and V planes at full size.
+		FORMAT_YUV444P,
+	};
+
+	enum {
+		// Threads per group in both directions, as in the shader.
+		GROUP_SIZE = 16,
+	};
+
+	// Constant buffer of the shader, laid out like the cbuffer in SHADER_SOURCE. Weights are
+	// in B, G, R order, followed by the rounding term.
+	struct Constants {
+		int32_t lumaWeights[4];
+		int32_t uWeights[4];
+		int32_t vWeights[4];
+		uint32_t width;
+		uint32_t height;
+		uint32_t rows;
+		uint32_t lumaShift;
+		uint32_t chromaShift;
+		uint32_t maxValue;
+		// Moves the samples to the high bits of their word.
+		uint32_t sampleShift;
+		// Interleaved 4:2:0 chroma when set, full size chroma planes otherwise.
+		uint32_t isInterleaved;
+	};
+
+	struct Layout {
+		Format format;
+		uint32_t width;
+		uint32_t height;
+		// Rows of all planes together.
+		uint32_t rows;
+		uint32_t bytesPerSample;
+		Constants constants;
+
+		uint32_t getRowSize() const {
+			return this->width * this->bytesPerSample;
+		}
+
+		size_t getSize() const {
+			return (size_t)this->getRowSize() * this->rows;
+		}
+	};
+
+	// Layout of "nv12", "p010le" or "yuv444p" at the given size. False for other formats and
+	// for odd sizes of the 4:2:0 ones, whose chroma rows would not be as long as the luma rows.
+	bool getLayout(const std::string& pixelFormat, uint32_t width, uint32_t height, Layout& result);
+
+	// One sample of the converted picture, computed like the shader does for the thread at x
+	// and row. pSrc is the BGRA picture, srcStride is in bytes.
+	uint32_t convertSample(const Constants& constants, const uint8_t* pSrc, int srcStride, uint32_t x, uint32_t row);
+
+	// Converts the whole picture into pDst, which holds getSize() bytes.
+	void pack(const Layout& layout, const uint8_t* pSrc, int srcStride, uint8_t* pDst);
+
+	// HLSL of the compute shader, entry point main, for cs_5_0.
+	extern const char* const SHADER_SOURCE;
+}
@@ -0,0 +1,184 @@
+// Built for AVX2, see color-conversion-avx2.cpp for how the target is set.
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__GNUC__)
+#pragma GCC target("avx2,f16c")
+#endif
+
+#include <immintrin.h>
+#include "motion-blur-kernels.h"
+
+namespace MotionBlur {
+	namespace {
+		// Packs 16 averages that already fit in a byte and stores them.
+		void storeBytes(uint8_t* pDst, __m256i low, __m256i high) {
+			__m256i words = _mm256_packus_epi32(low, high);
+			__m256i bytes = _mm256_packus_epi16(words, words);
+			// The packs work per 128 bit half, the first 8 bytes of each half hold the results.
+			bytes = _mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+			_mm_storeu_si128((__m128i*)pDst, _mm256_castsi256_si128(bytes));
+		}
+
+		__m256i divide(__m256i sum, __m256i multiplier) {
+			return _mm256_srli_epi32(_mm256_mullo_epi32(sum, multiplier), Reciprocal::SHIFT);
+		}
+
+		// Splits the averages of 4 pixels, pixels 0 and 1 in first and 2 and 3 in second, into
+		// the (B, R) and (G, A) pairs of a split row.
+		void storeSplit(uint32_t* pBR, uint32_t* pGA, __m256i first, __m256i second) {
+			const __m256i pairs = _mm256_setr_epi8(
+				0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15,
+				0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+			// Pixels 0 and 2 end up in the low half, 1 and 3 in the high half.
+			__m256i words = _mm256_shuffle_epi8(_mm256_packus_epi32(first, second), pairs);
+			words = _mm256_permutevar8x32_epi32(words, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+			_mm_storeu_si128((__m128i*)pBR, _mm256_castsi256_si128(words));
+			_mm_storeu_si128((__m128i*)pGA, _mm256_extracti128_si256(words, 1));
+		}
+
+		template <bool isFirst, bool isWeighted>
+		void accumulate16(uint16_t* pSum, const uint8_t* pFrame, size_t length, uint32_t weight) {
+			const __m256i weights = _mm256_set1_epi16((int16_t)weight);
+			size_t i = 0;
+			for (; i + 16 <= length; i += 16) {
+				__m256i words = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(pFrame + i)));
+				if (isWeighted) {
+					words = _mm256_mullo_epi16(words, weights);
+				}
+				if (!isFirst) {
+					words = _mm256_add_epi16(words, _mm256_loadu_si256((const __m256i*)(pSum + i)));
+				}
+				_mm256_storeu_si256((__m256i*)(pSum + i), words);
+			}
+			accumulateScalar(pSum, pFrame, i, length, weight, isFirst);
+		}
+
+		template <bool isFirst, bool isWeighted>
+		void accumulate32(uint32_t* pSum, const uint8_t* pFrame, size_t length, uint32_t weight) {
+			const __m256i weights = _mm256_set1_epi32((int32_t)weight);
+			size_t i = 0;
+			for (; i + 8 <= length; i += 8) {
+				__m256i values = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(pFrame + i)));
+				if (isWeighted) {
+					values = _mm256_mullo_epi32(values, weights);
+				}
+				if (!isFirst) {
+					values = _mm256_add_epi32(values, _mm256_loadu_si256((const __m256i*)(pSum + i)));
+				}
+				_mm256_storeu_si256((__m256i*)(pSum + i), values);
+			}
+			accumulateScalar(pSum, pFrame, i, length, weight, isFirst);
+		}
+
+		void accumulate16(uint16_t* pSum, const uint8_t* pFrame, size_t length, uint32_t weight, bool isFirst) {
+			if (weight == 1) {
+				isFirst ? accumulate16<true, false>(pSum, pFrame, length, weight) : accumulate16<false, false>(pSum, pFrame, length, weight);
+			} else {
+				isFirst ? accumulate16<true, true>(pSum, pFrame, length, weight) : accumulate16<false, true>(pSum, pFrame, length, weight);
+			}
+		}
+
+		void accumulate32(uint32_t* pSum, const uint8_t* pFrame, size_t length, uint32_t weight, bool isFirst) {
+			if (weight == 1) {
+				isFirst ? accumulate32<true, false>(pSum, pFrame, length, weight) : accumulate32<false, false>(pSum, pFrame, length, weight);
+			} else {
+				isFirst ? accumulate32<true, true>(pSum, pFrame, length, weight) : accumulate32<false, true>(pSum, pFrame, length, weight);
+			}
+		}
+
+		void resolve16(const uint16_t* pSum, size_t length, const Reciprocal& reciprocal, uint8_t* pDst) {
+			size_t i = 0;
+			if (reciprocal.isExact()) {
+				const __m256i multiplier = _mm256_set1_epi32((int32_t)reciprocal.multiplier);
+				for (; i + 16 <= length; i += 16) {
+					__m256i low = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(pSum + i)));
+					__m256i high = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(pSum + i + 8)));
+					storeBytes(pDst + i, divide(low, multiplier), divide(high, multiplier));
+				}
+			}
+			resolveScalar(pSum, i, length, reciprocal, pDst);
+		}
+
+		void resolve32(const uint32_t* pSum, size_t length, const Reciprocal& reciprocal, uint8_t* pDst) {
+			size_t i = 0;
+			if (reciprocal.isExact()) {
+				const __m256i multiplier = _mm256_set1_epi32((int32_t)reciprocal.multiplier);
+				for (; i + 16 <= length; i += 16) {
+					__m256i low = _mm256_loadu_si256((const __m256i*)(pSum + i));
+					__m256i high = _mm256_loadu_si256((const __m256i*)(pSum + i + 8));
+					storeBytes(pDst + i, divide(low, multiplier), divide(high, multiplier));
+				}
+			}
+			resolveScalar(pSum, i, length, reciprocal, pDst);
+		}
+
+		void resolveSplit16(const uint16_t* pSum, size_t pixels, const Reciprocal& reciprocal, int extraBits, uint32_t* pBR, uint32_t* pGA) {
+			size_t x = 0;
+			if (reciprocal.isExact()) {
+				const __m256i multiplier = _mm256_set1_epi32((int32_t)reciprocal.multiplier);
+				const __m128i shift = _mm_cvtsi32_si128(Reciprocal::SHIFT - extraBits);
+				for (; x + 4 <= pixels; x += 4) {
+					__m256i first = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(pSum + 4 * x)));
+					__m256i second = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(pSum + 4 * x + 8)));
+					first = _mm256_srl_epi32(_mm256_mullo_epi32(first, multiplier), shift);
+					second = _mm256_srl_epi32(_mm256_mullo_epi32(second, multiplier), shift);
+					storeSplit(pBR + x, pGA + x, first, second);
+				}
+			}
+			resolveSplitScalar(pSum, x, pixels, reciprocal, extraBits, pBR, pGA);
+		}
+
+		void resolveSplit32(const uint32_t* pSum, size_t pixels, const Reciprocal& reciprocal, int extraBits, uint32_t* pBR, uint32_t* pGA) {
+			size_t x = 0;
+			if (reciprocal.isExact()) {
+				const __m256i multiplier = _mm256_set1_epi32((int32_t)reciprocal.multiplier);
+				const __m128i shift = _mm_cvtsi32_si128(Reciprocal::SHIFT - extraBits);
+				for (; x + 4 <= pixels; x += 4) {
+					__m256i first = _mm256_loadu_si256((const __m256i*)(pSum + 4 * x));
+					__m256i second = _mm256_loadu_si256((const __m256i*)(pSum + 4 * x + 8));
+					first = _mm256_srl_epi32(_mm256_mullo_epi32(first, multiplier), shift);
+					second = _mm256_srl_epi32(_mm256_mullo_epi32(second, multiplier), shift);
+					storeSplit(pBR + x, pGA + x, first, second);
+				}
+			}
+			resolveSplitScalar(pSum, x, pixels, reciprocal, extraBits, pBR, pGA);
+		}
+
+		// detectIsa() only picks AVX2 when F16C is there too.
+		void accumulateHalf(float* pSum, const uint16_t* pHalves, size_t count, float weight, bool isFirst) {
+			const __m256 weights = _mm256_set1_ps(weight);
+			size_t i = 0;
+			for (; i + 8 <= count; i += 8) {
+				__m256 values = _mm256_mul_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(pHalves + i))), weights);
+				if (!isFirst) {
+					values = _mm256_add_ps(values, _mm256_loadu_ps(pSum + i));
+				}
+				_mm256_storeu_ps(pSum + i, values);
+			}
+			accumulateHalfScalar(pSum, pHalves, i, count, weight, isFirst);
+		}
+
+		void resolveHalf(const float* pSum, size_t count, float scale, uint16_t* pHalves) {
+			const __m256 scales = _mm256_set1_ps(scale);
+			size_t i = 0;
+			for (; i + 8 <= count; i += 8) {
+				const __m256 values = _mm256_mul_ps(_mm256_loadu_ps(pSum + i), scales);
+				_mm_storeu_si128((__m128i*)(pHalves + i), _mm256_cvtps_ph(values, _MM_FROUND_TO_NEAREST_INT));
+			}
+			resolveHalfScalar(pSum, i, count, scale, pHalves);
+		}
+	}
+
+	bool getAVX2Kernels(Kernels& kernels) {
+		kernels.accumulate16 = accumulate16;
+		kernels.accumulate32 = accumulate32;
+		kernels.resolve16 = resolve16;
+		kernels.resolve32 = resolve32;
+		kernels.resolveSplit16 = resolveSplit16;
+		kernels.resolveSplit32 = resolveSplit32;
+		kernels.accumulateHalf = accumulateHalf;
+		kernels.resolveHalf = resolveHalf;
+		return true;
+	}
+}
@@ -0,0 +1,339 @@
+// Built for AVX-512 F and BW, see color-conversion-avx512.cpp for how the
+// target is set and why older Visual Studio versions get a stub.
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__GNUC__) || (defined(_MSC_VER) && (_MSC_VER >= 1911))
+#define MOTION_BLUR_AVX512
+#endif
+
+#if defined(__GNUC__)
+#pragma GCC target("avx512f,avx512bw")
+#endif
+
+#include <immintrin.h>
+#include "motion-blur-kernels.h"
+
+namespace MotionBlur {
+#if defined(MOTION_BLUR_AVX512)
+	namespace {
+		__m128i divide(__m512i sum, __m512i multiplier) {
+			return _mm512_cvtepi32_epi8(_mm512_srli_epi32(_mm512_mullo_epi32(sum, multiplier), Reciprocal::SHIFT));
+		}
+
+		// Splits the averages of 8 pixels, pixels 0 to 3 in first and 4 to 7 in second, into
+		// the (B, R) and (G, A) pairs of a split row.
+		void storeSplit(uint32_t* pBR, uint32_t* pGA, __m512i first, __m512i second) {
+			const __m512i pairs = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15));
+			// Every 128 bit lane k holds the pairs of pixels k and k + 4.
+			__m512i words = _mm512_shuffle_epi8(_mm512_packus_epi32(first, second), pairs);
+			words = _mm512_permutexvar_epi32(_mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15), words);
+			_mm256_storeu_si256((__m256i*)pBR, _mm512_castsi512_si256(words));
+			_mm256_storeu_si256((__m256i*)pGA, _mm512_extracti64x4_epi64(words, 1));
+		}
+
+		template <bool isFirst, bool isWeighted>
+		void accumulate16(uint16_t* pSum, const uint8_t* pFrame, size_t length, uint32_t weight) {
+			const __m512i weights = _mm512_set1_epi16((int16_t)weight);
+			size_t i = 0;
+			for (; i + 32 <= length; i += 32) {
+				__m512i words = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(pFrame + i)));
+				if (isWeighted) {
+					words = _mm512_mullo_epi16(words, weights);
+				}
+				if (!isFirst) {
+					words = _mm512_add_epi16(words, _mm512_loadu_si512((const void*)(pSum + i)));
+				}
+				_mm512_storeu_si512((void*)(pSum + i), words);
+			}
+			accumulateScalar(pSum, pFrame, i, length, weight, isFirst);
+		}
+
+		template <bool isFirst, bool isWeighted>
+		void accumulate32(uint32_t* pSum, const uint8_t* pFrame, size_t length, uint32_t weight) {
+			const __m512i weights = _mm512_set1_epi32((int32_t)weight);
+			size_t i = 0;
+			for (; i + 16 <= length; i += 16) {
+				__m512i values = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(pFrame + i)));
+				if (isWeighted) {
+					values = _mm512_mullo_epi32(values, weights);
+				}
+				if (!isFirst) {
+					values = _mm512_add_epi32(values, _mm512_loadu_si512((const void*)(pSum + i)));
+				}
+				_mm512_storeu_si512((void*)(pSum + i), values);
+			}
+			accumulateScalar(pSum, pFrame, i, length, weight, isFirst);
+		}
+
+		void accumulate16(uint16_t* pSum, const uint8_t* pFrame, size_t length, uint32_t weight, bool isFirst) {
+			if (weight == 1) {
+				isFirst ? accumulate16<true, false>(pSum, pFrame, length, weight) : accumulate16<false, false>(pSum, pFrame, length, weight);
+			} else {
+				isFirst ? accumulate16<true, true>(pSum, pFrame, length, weight) : accumulate16<false, true>(pSum, pFrame, length, weight);
+			}
+		}
+
+		void accumulate32(uint32_t* pSum, const uint8_t* pFrame, size_t length, uint32_t weight, bool isFirst) {
+			if (weight == 1) {
+				isFirst ? accumulate32<true, false>(pSum, pFrame, length, weight) : accumulate32<false, false>(pSum, pFrame, length, weight);
+			} else {
+				isFirst ? accumulate32<true, true>(pSum, pFrame, length, weight) : accumulate32<false, true>(pSum, pFrame, length, weight);
+			}
+		}
+
+		// Linear values of bytes, from the 256 words of the table held in 8 registers.
+		class LinearTable {
+		public:
+			explicit LinearTable(const LinearLight& linear) {
+				for (int i = 0; i < 8; i++) {
+					this->table[i] = _mm512_loadu_si512((const void*)(linear.getToLinear() + 32 * i));
+				}
+			}
+
+			// Looks up 64 bytes, the first 32 go to words[0].
+			void lookup(const uint8_t* pBytes, __m512i words[2]) const {
+				words[0] = this->lookup(_mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)pBytes)));
+				words[1] = this->lookup(_mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(pBytes + 32))));
+			}
+
+		private:
+			__m512i lookup(__m512i indices) const {
+				// Every permute covers 64 entries, bits 6 and 7 of the index pick one of them.
+				const __mmask32 bit6 = _mm512_test_epi16_mask(indices, _mm512_set1_epi16(64));
+				const __mmask32 bit7 = _mm512_test_epi16_mask(indices, _mm512_set1_epi16(128));
+				const __m512i low = _mm512_mask_blend_epi16(bit6,
+					_mm512_permutex2var_epi16(this->table[0], indices, this->table[1]),
+					_mm512_permutex2var_epi16(this->table[2], indices, this->table[3]));
+				const __m512i high = _mm512_mask_blend_epi16(bit6,
+					_mm512_permutex2var_epi16(this->table[4], indices, this->table[5]),
+					_mm512_permutex2var_epi16(this->table[6], indices, this->table[7]));
+				return _mm512_mask_blend_epi16(bit7, low, high);
+			}
+
+			__m512i table[8];
+		};
+	}
+
+	// The rest of the linear light kernels may use VBMI. The loops are shared by both tables
+	// but only LinearTableVBMI has VBMI instructions, and it is only picked when the CPU has them.
+#if defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512vbmi")
+#endif
+	namespace {
+		// Same as LinearTable with byte permutes, which cover 128 entries each, on the low and
+		// high bytes of the table.
+		class LinearTableVBMI {
+		public:
+			explicit LinearTableVBMI(const LinearLight& linear) {
+				// Puts bytes 8k to 8k + 7 and 32 + 8k to 32 + 8k + 7 in lane k, so that the unpacks
+				// give the words in order.
+				static const uint8_t order[64] = {
+					0, 1, 2, 3, 4, 5, 6, 7, 32, 33, 34, 35, 36, 37, 38, 39,
+					8, 9, 10, 11, 12, 13, 14, 15, 40, 41, 42, 43, 44, 45, 46, 47,
+					16, 17, 18, 19, 20, 21, 22, 23, 48, 49, 50, 51, 52, 53, 54, 55,
+					24, 25, 26, 27, 28, 29, 30, 31, 56, 57, 58, 59, 60, 61, 62, 63,
+				};
+				this->order = _mm512_loadu_si512((const void*)order);
+				for (int i = 0; i < 4; i++) {
+					this->low[i] = _mm512_loadu_si512((const void*)(linear.getToLinearLow() + 64 * i));
+					this->high[i] = _mm512_loadu_si512((const void*)(linear.getToLinearHigh() + 64 * i));
+				}
+			}
+
+			void lookup(const uint8_t* pBytes, __m512i words[2]) const {
+				const __m512i indices = _mm512_permutexvar_epi8(this->order, _mm512_loadu_si512((const void*)pBytes));
+				const __mmask64 bit7 = _mm512_movepi8_mask(indices);
+				const __m512i low = _mm512_mask_blend_epi8(bit7,
+					_mm512_permutex2var_epi8(this->low[0], indices, this->low[1]),
+					_mm512_permutex2var_epi8(this->low[2], indices, this->low[3]));
+				const __m512i high = _mm512_mask_blend_epi8(bit7,
+					_mm512_permutex2var_epi8(this->high[0], indices, this->high[1]),
+					_mm512_permutex2var_epi8(this->high[2], indices, this->high[3]));
+				words[0] = _mm512_unpacklo_epi8(low, high);
+				words[1] = _mm512_unpackhi_epi8(low, high);
+			}
+
+		private:
+			__m512i order;
+			__m512i low[4];
+			__m512i high[4];
+		};
+
+		template <typename Table, bool isFirst, bool isWeighted>
+		void accumulateLinear16(uint16_t* pSum, const uint8_t* pFrame, size_t length, const LinearLight& linear, uint32_t weight) {
+			const Table table(linear);
+			const __m512i weights = _mm512_set1_epi16((int16_t)weight);
+			size_t i = 0;
+			for (; i + 64 <= length; i += 64) {
+				__m512i words[2];
+				table.lookup(pFrame + i, words);
+				for (int j = 0; j < 2; j++) {
+					if (isWeighted) {
+						words[j] = _mm512_mullo_epi16(words[j], weights);
+					}
+					if (!isFirst) {
+						words[j] = _mm512_add_epi16(words[j], _mm512_loadu_si512((const void*)(pSum + i + 32 * j)));
+					}
+					_mm512_storeu_si512((void*)(pSum + i + 32 * j), words[j]);
+				}
+			}
+			accumulateLinearScalar(pSum, pFrame, i, length, linear, weight, isFirst);
+		}
+
+		template <typename Table, bool isFirst, bool isWeighted>
+		void accumulateLinear32(uint32_t* pSum, const uint8_t* pFrame, size_t length, const LinearLight& linear, uint32_t weight) {
+			const Table table(linear);
+			const __m512i weights = _mm512_set1_epi32((int32_t)weight);
+			size_t i = 0;
+			for (; i + 64 <= length; i += 64) {
+				__m512i words[2];
+				table.lookup(pFrame + i, words);
+				for (int j = 0; j < 4; j++) {
+					const __m256i half = j & 1 ? _mm512_extracti64x4_epi64(words[j >> 1], 1) : _mm512_castsi512_si256(words[j >> 1]);
+					__m512i values = _mm512_cvtepu16_epi32(half);
+					if (isWeighted) {
+						values = _mm512_mullo_epi32(values, weights);
+					}
+					if (!isFirst) {
+						values = _mm512_add_epi32(values, _mm512_loadu_si512((const void*)(pSum + i + 16 * j)));
+					}
+					_mm512_storeu_si512((void*)(pSum + i + 16 * j), values);
+				}
+			}
+			accumulateLinearScalar(pSum, pFrame, i, length, linear, weight, isFirst);
+		}
+
+		template <typename Table>
+		void accumulateLinear16(uint16_t* pSum, const uint8_t* pFrame, size_t length, const LinearLight& linear, uint32_t weight, bool isFirst) {
+			if (weight == 1) {
+				isFirst ? accumulateLinear16<Table, true, false>(pSum, pFrame, length, linear, weight) : accumulateLinear16<Table, false, false>(pSum, pFrame, length, linear, weight);
+			} else {
+				isFirst ? accumulateLinear16<Table, true, true>(pSum, pFrame, length, linear, weight) : accumulateLinear16<Table, false, true>(pSum, pFrame, length, linear, weight);
+			}
+		}
+
+		template <typename Table>
+		void accumulateLinear32(uint32_t* pSum, const uint8_t* pFrame, size_t length, const LinearLight& linear, uint32_t weight, bool isFirst) {
+			if (weight == 1) {
+				isFirst ? accumulateLinear32<Table, true, false>(pSum, pFrame, length, linear, weight) : accumulateLinear32<Table, false, false>(pSum, pFrame, length, linear, weight);
+			} else {
+				isFirst ? accumulateLinear32<Table, true, true>(pSum, pFrame, length, linear, weight) : accumulateLinear32<Table, false, true>(pSum, pFrame, length, linear, weight);
+			}
+		}
+
+		// Picks the table once, so that the functions handed out need no check per call.
+		void setLinearKernels(Kernels& kernels) {
+			if (ColorConversion::hasAVX512VBMI()) {
+				kernels.accumulateLinear16 = accumulateLinear16<LinearTableVBMI>;
+				kernels.accumulateLinear32 = accumulateLinear32<LinearTableVBMI>;
+			} else {
+				kernels.accumulateLinear16 = accumulateLinear16<LinearTable>;
+				kernels.accumulateLinear32 = accumulateLinear32<LinearTable>;
+			}
+		}
+	}
+#if defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+	namespace {
+		void resolve16(const uint16_t* pSum, size_t length, const Reciprocal& reciprocal, uint8_t* pDst) {
+			size_t i = 0;
+			if (reciprocal.isExact()) {
+				const __m512i multiplier = _mm512_set1_epi32((int32_t)reciprocal.multiplier);
+				for (; i + 16 <= length; i += 16) {
+					__m512i values = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(pSum + i)));
+					_mm_storeu_si128((__m128i*)(pDst + i), divide(values, multiplier));
+				}
+			}
+			resolveScalar(pSum, i, length, reciprocal, pDst);
+		}
+
+		void resolve32(const uint32_t* pSum, size_t length, const Reciprocal& reciprocal, uint8_t* pDst) {
+			size_t i = 0;
+			if (reciprocal.isExact()) {
+				const __m512i multiplier = _mm512_set1_epi32((int32_t)reciprocal.multiplier);
+				for (; i + 16 <= length; i += 16) {
+					__m512i values = _mm512_loadu_si512((const void*)(pSum + i));
+					_mm_storeu_si128((__m128i*)(pDst + i), divide(values, multiplier));
+				}
+			}
+			resolveScalar(pSum, i, length, reciprocal, pDst);
+		}
+
+		void resolveSplit16(const uint16_t* pSum, size_t pixels, const Reciprocal& reciprocal, int extraBits, uint32_t* pBR, uint32_t* pGA) {
+			size_t x = 0;
+			if (reciprocal.isExact()) {
+				const __m512i multiplier = _mm512_set1_epi32((int32_t)reciprocal.multiplier);
+				const __m128i shift = _mm_cvtsi32_si128(Reciprocal::SHIFT - extraBits);
+				for (; x + 8 <= pixels; x += 8) {
+					__m512i first = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(pSum + 4 * x)));
+					__m512i second = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(pSum + 4 * x + 16)));
+					first = _mm512_srl_epi32(_mm512_mullo_epi32(first, multiplier), shift);
+					second = _mm512_srl_epi32(_mm512_mullo_epi32(second, multiplier), shift);
+					storeSplit(pBR + x, pGA + x, first, second);
+				}
+			}
+			resolveSplitScalar(pSum, x, pixels, reciprocal, extraBits, pBR, pGA);
+		}
+
+		void resolveSplit32(const uint32_t* pSum, size_t pixels, const Reciprocal& reciprocal, int extraBits, uint32_t* pBR, uint32_t* pGA) {
+			size_t x = 0;
+			if (reciprocal.isExact()) {
+				const __m512i multiplier = _mm512_set1_epi32((int32_t)reciprocal.multiplier);
+				const __m128i shift = _mm_cvtsi32_si128(Reciprocal::SHIFT - extraBits);
+				for (; x + 8 <= pixels; x += 8) {
+					__m512i first = _mm512_loadu_si512((const void*)(pSum + 4 * x));
+					__m512i second = _mm512_loadu_si512((const void*)(pSum + 4 * x + 16));
+					first = _mm512_srl_epi32(_mm512_mullo_epi32(first, multiplier), shift);
+					second = _mm512_srl_epi32(_mm512_mullo_epi32(second, multiplier), shift);
+					storeSplit(pBR + x, pGA + x, first, second);
+				}
+			}
+			resolveSplitScalar(pSum, x, pixels, reciprocal, extraBits, pBR, pGA);
+		}
+
+		void accumulateHalf(float* pSum, const uint16_t* pHalves, size_t count, float weight, bool isFirst) {
+			const __m512 weights = _mm512_set1_ps(weight);
+			size_t i = 0;
+			for (; i + 16 <= count; i += 16) {
+				__m512 values = _mm512_mul_ps(_mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(pHalves + i))), weights);
+				if (!isFirst) {
+					values = _mm512_add_ps(values, _mm512_loadu_ps(pSum + i));
+				}
+				_mm512_storeu_ps(pSum + i, values);
+			}
+			accumulateHalfScalar(pSum, pHalves, i, count, weight, isFirst);
+		}
+
+		void resolveHalf(const float* pSum, size_t count, float scale, uint16_t* pHalves) {
+			const __m512 scales = _mm512_set1_ps(scale);
+			size_t i = 0;
+			for (; i + 16 <= count; i += 16) {
+				const __m512 values = _mm512_mul_ps(_mm512_loadu_ps(pSum + i), scales);
+				_mm256_storeu_si256((__m256i*)(pHalves + i), _mm512_cvtps_ph(values, _MM_FROUND_TO_NEAREST_INT));
+			}
+			resolveHalfScalar(pSum, i, count, scale, pHalves);
+		}
+	}
+
+	bool getAVX512Kernels(Kernels& kernels) {
+		kernels.accumulate16 = accumulate16;
+		kernels.accumulate32 = accumulate32;
+		kernels.resolve16 = resolve16;
+		kernels.resolve32 = resolve32;
+		kernels.resolveSplit16 = resolveSplit16;
+		kernels.resolveSplit32 = resolveSplit32;
+		kernels.accumulateHalf = accumulateHalf;
+		kernels.resolveHalf = resolveHalf;
+		setLinearKernels(kernels);
+		return true;
+	}
+#else
+	bool getAVX512Kernels(Kernels& kernels) {
+		return false;
+	}
+#endif
+}
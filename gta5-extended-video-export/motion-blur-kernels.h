@@ -0,0 +1,138 @@
+#pragma once
+
+// Scalar loops shared by motion-blur.cpp and the translation units of each
+// instruction set, which use them for the bytes left over after the last full
+// vector. Like color-conversion-kernels.h, everything is in an unnamed
+// namespace so that no inline function is shared between units built for
+// different instruction sets.
+
+#include "motion-blur.h"
+#include <cstring>
+
+namespace MotionBlur {
+	namespace {
+		template <typename T>
+		void accumulateScalar(T* pSum, const uint8_t* pFrame, size_t begin, size_t length, uint32_t weight, bool isFirst) {
+			if (isFirst) {
+				for (size_t i = begin; i < length; i++) {
+					pSum[i] = (T)(pFrame[i] * weight);
+				}
+			} else {
+				for (size_t i = begin; i < length; i++) {
+					pSum[i] = (T)(pSum[i] + pFrame[i] * weight);
+				}
+			}
+		}
+
+		template <typename T>
+		void accumulateLinearScalar(T* pSum, const uint8_t* pFrame, size_t begin, size_t length, const LinearLight& linear, uint32_t weight, bool isFirst) {
+			const uint16_t* pToLinear = linear.getToLinear();
+			if (isFirst) {
+				for (size_t i = begin; i < length; i++) {
+					pSum[i] = (T)(pToLinear[pFrame[i]] * weight);
+				}
+			} else {
+				for (size_t i = begin; i < length; i++) {
+					pSum[i] = (T)(pSum[i] + pToLinear[pFrame[i]] * weight);
+				}
+			}
+		}
+
+		float halfToFloat(uint16_t value) {
+			const uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+			const uint32_t exponent = (value >> 10) & 0x1F;
+			const uint32_t mantissa = value & 0x3FF;
+			uint32_t bits;
+			if (exponent == 0) {
+				// Zero or subnormal, mantissa * 2^-24.
+				const float magnitude = mantissa * 5.9604645e-8f;
+				std::memcpy(&bits, &magnitude, sizeof(bits));
+				bits |= sign;
+			} else if (exponent == 31) {
+				bits = sign | 0x7F800000 | (mantissa << 13);
+			} else {
+				bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+			}
+			float result;
+			std::memcpy(&result, &bits, sizeof(result));
+			return result;
+		}
+
+		// Rounds to the nearest even like F16C does.
+		uint16_t floatToHalf(float value) {
+			uint32_t bits;
+			std::memcpy(&bits, &value, sizeof(bits));
+			const uint32_t sign = bits & 0x80000000;
+			bits ^= sign;
+
+			uint32_t result;
+			if (bits >= (127 + 16) << 23) {
+				// Too large, infinite or NaN.
+				result = bits > 0x7F800000 ? 0x7E00 : 0x7C00;
+			} else if (bits < (127 - 14) << 23) {
+				// Subnormal or zero, the addition rounds away the bits that don't fit.
+				const uint32_t magicBits = (127 - 15 + 23 - 10 + 1) << 23;
+				float magic;
+				std::memcpy(&magic, &magicBits, sizeof(magic));
+				float magnitude;
+				std::memcpy(&magnitude, &bits, sizeof(magnitude));
+				magnitude += magic;
+				std::memcpy(&bits, &magnitude, sizeof(bits));
+				result = bits - magicBits;
+			} else {
+				const uint32_t isOdd = (bits >> 13) & 1;
+				bits += ((uint32_t)(15 - 127) << 23) + 0xFFF + isOdd;
+				result = bits >> 13;
+			}
+			return (uint16_t)(result | (sign >> 16));
+		}
+
+		void accumulateHalfScalar(float* pSum, const uint16_t* pHalves, size_t begin, size_t count, float weight, bool isFirst) {
+			if (isFirst) {
+				for (size_t i = begin; i < count; i++) {
+					pSum[i] = halfToFloat(pHalves[i]) * weight;
+				}
+			} else {
+				for (size_t i = begin; i < count; i++) {
+					pSum[i] += halfToFloat(pHalves[i]) * weight;
+				}
+			}
+		}
+
+		void resolveHalfScalar(const float* pSum, size_t begin, size_t count, float scale, uint16_t* pHalves) {
+			for (size_t i = begin; i < count; i++) {
+				pHalves[i] = floatToHalf(pSum[i] * scale);
+			}
+		}
+
+		template <typename T>
+		void resolveScalar(const T* pSum, size_t begin, size_t length, const Reciprocal& reciprocal, uint8_t* pDst) {
+			if (reciprocal.isExact()) {
+				for (size_t i = begin; i < length; i++) {
+					pDst[i] = (uint8_t)(((uint32_t)pSum[i] * reciprocal.multiplier) >> Reciprocal::SHIFT);
+				}
+			} else {
+				for (size_t i = begin; i < length; i++) {
+					pDst[i] = (uint8_t)(pSum[i] / reciprocal.count);
+				}
+			}
+		}
+
+		// Average of one counter with extraBits more bits, rounded down like resolveScalar().
+		uint32_t average(uint32_t sum, const Reciprocal& reciprocal, int extraBits) {
+			if (reciprocal.isExact()) {
+				return (sum * reciprocal.multiplier) >> (Reciprocal::SHIFT - extraBits);
+			}
+			return (sum << extraBits) / reciprocal.count;
+		}
+
+		template <typename T>
+		void resolveSplitScalar(const T* pSum, size_t begin, size_t pixels, const Reciprocal& reciprocal, int extraBits, uint32_t* pBR, uint32_t* pGA) {
+			for (size_t x = begin; x < pixels; x++) {
+				const T* pPixel = pSum + 4 * x;
+				pBR[x] = average(pPixel[0], reciprocal, extraBits) | (average(pPixel[2], reciprocal, extraBits) << 16);
+				pGA[x] = average(pPixel[1], reciprocal, extraBits) | (average(pPixel[3], reciprocal, extraBits) << 16);
+			}
+		}
+	}
+}
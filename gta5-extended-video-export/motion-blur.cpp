@@ -0,0 +1,428 @@
+#include "motion-blur.h"
+#include "motion-blur-kernels.h"
+#include <algorithm>
+#include <cmath>
+
+namespace MotionBlur {
+	namespace {
+		void accumulate16(uint16_t* pSum, const uint8_t* pFrame, size_t length, uint32_t weight, bool isFirst) {
+			accumulateScalar(pSum, pFrame, 0, length, weight, isFirst);
+		}
+
+		void accumulate32(uint32_t* pSum, const uint8_t* pFrame, size_t length, uint32_t weight, bool isFirst) {
+			accumulateScalar(pSum, pFrame, 0, length, weight, isFirst);
+		}
+
+		void accumulateLinear16(uint16_t* pSum, const uint8_t* pFrame, size_t length, const LinearLight& linear, uint32_t weight, bool isFirst) {
+			accumulateLinearScalar(pSum, pFrame, 0, length, linear, weight, isFirst);
+		}
+
+		void accumulateLinear32(uint32_t* pSum, const uint8_t* pFrame, size_t length, const LinearLight& linear, uint32_t weight, bool isFirst) {
+			accumulateLinearScalar(pSum, pFrame, 0, length, linear, weight, isFirst);
+		}
+
+		void accumulateHalf(float* pSum, const uint16_t* pHalves, size_t count, float weight, bool isFirst) {
+			accumulateHalfScalar(pSum, pHalves, 0, count, weight, isFirst);
+		}
+
+		void resolveHalf(const float* pSum, size_t count, float scale, uint16_t* pHalves) {
+			resolveHalfScalar(pSum, 0, count, scale, pHalves);
+		}
+
+		void resolve16(const uint16_t* pSum, size_t length, const Reciprocal& reciprocal, uint8_t* pDst) {
+			resolveScalar(pSum, 0, length, reciprocal, pDst);
+		}
+
+		void resolve32(const uint32_t* pSum, size_t length, const Reciprocal& reciprocal, uint8_t* pDst) {
+			resolveScalar(pSum, 0, length, reciprocal, pDst);
+		}
+
+		void resolveSplit16(const uint16_t* pSum, size_t pixels, const Reciprocal& reciprocal, int extraBits, uint32_t* pBR, uint32_t* pGA) {
+			resolveSplitScalar(pSum, 0, pixels, reciprocal, extraBits, pBR, pGA);
+		}
+
+		void resolveSplit32(const uint32_t* pSum, size_t pixels, const Reciprocal& reciprocal, int extraBits, uint32_t* pBR, uint32_t* pGA) {
+			resolveSplitScalar(pSum, 0, pixels, reciprocal, extraBits, pBR, pGA);
+		}
+	}
+
+	namespace {
+		// Bands start on a cache line of the frame, so that no two threads write the same line
+		// of the sum either.
+		const size_t BAND_ALIGNMENT = 64;
+
+		// First and last byte + 1 of band index out of bandCount.
+		void getBand(size_t length, uint32_t index, uint32_t bandCount, size_t& begin, size_t& end) {
+			const size_t bandLength = (length / bandCount + BAND_ALIGNMENT - 1) / BAND_ALIGNMENT * BAND_ALIGNMENT;
+			begin = (std::min)(length, index * bandLength);
+			end = index + 1 == bandCount ? length : (std::min)(length, begin + bandLength);
+		}
+
+		// Kernels of the given instruction set, or of the best one below it that has them.
+		Kernels selectKernels(ColorConversion::Isa isa, ColorConversion::Isa& selected) {
+			Kernels kernels = getScalarKernels();
+			selected = ColorConversion::ISA_SCALAR;
+			if ((isa >= ColorConversion::ISA_AVX512) && getAVX512Kernels(kernels)) {
+				selected = ColorConversion::ISA_AVX512;
+			} else if ((isa >= ColorConversion::ISA_AVX2) && getAVX2Kernels(kernels)) {
+				selected = ColorConversion::ISA_AVX2;
+			}
+			return kernels;
+		}
+
+		// Linear light of an sRGB value from 0 to 1.
+		double toLinearLight(double value) {
+			return value <= 0.04045 ? value / 12.92 : std::pow((value + 0.055) / 1.055, 2.4);
+		}
+
+		template <typename T>
+		void resolveLinear(const T* pSum, size_t begin, size_t end, const LinearLight& linear, uint32_t weight, uint8_t* pDst) {
+			const uint64_t factor = linear.getFactor(weight);
+			for (size_t i = begin; i < end; i++) {
+				pDst[i] = (uint8_t)linear.average(pSum[i], factor, 0);
+			}
+		}
+
+		template <typename T>
+		void resolveSplitLinear(const T* pSum, size_t pixels, const LinearLight& linear, uint32_t weight, int extraBits, uint32_t* pBR, uint32_t* pGA) {
+			const uint64_t factor = linear.getFactor(weight);
+			for (size_t x = 0; x < pixels; x++) {
+				const T* pPixel = pSum + 4 * x;
+				pBR[x] = linear.average(pPixel[0], factor, extraBits) | (linear.average(pPixel[2], factor, extraBits) << 16);
+				pGA[x] = linear.average(pPixel[1], factor, extraBits) | (linear.average(pPixel[3], factor, extraBits) << 16);
+			}
+		}
+
+		// Shape of the profile at t, from 0 where the shutter opens to 1 where it closes.
+		double getProfileValue(Profile profile, const std::vector<float>& customWeights, double t) {
+			switch (profile) {
+			case PROFILE_TRIANGLE:
+				return 1.0 - std::fabs(2.0 * t - 1.0);
+			case PROFILE_GAUSSIAN: {
+				// Three standard deviations on either side of the middle.
+				const double x = (t - 0.5) * 6.0;
+				return std::exp(-0.5 * x * x);
+			}
+			case PROFILE_CUSTOM: {
+				const double position = t * (customWeights.size() - 1);
+				const size_t i = (std::min)((size_t)position, customWeights.size() - 1);
+				const size_t next = (std::min)(i + 1, customWeights.size() - 1);
+				const double value = customWeights[i] + (customWeights[next] - customWeights[i]) * (position - i);
+				return (std::max)(0.0, value);
+			}
+			default:
+				return 1.0;
+			}
+		}
+	}
+
+	ShutterSchedule::ShutterSchedule() :
+		weights(1, 1),
+		firstOpen(0),
+		openCount(1),
+		totalWeight(1),
+		profile(PROFILE_BOX)
+	{}
+
+	void ShutterSchedule::reset(uint32_t samples, float shutterPosition, Profile profile, const std::vector<float>& customWeights) {
+		// Same test the blur stage always did, in float.
+		uint32_t first = samples;
+		while ((first > 0) && ((float)(first - 1) / ((float)samples + 1) >= shutterPosition)) {
+			first--;
+		}
+		const uint32_t count = samples + 1 - first;
+
+		std::vector<double> values(count, 1.0);
+		double valueSum = 0.0;
+		if ((profile == PROFILE_CUSTOM) && customWeights.empty()) {
+			profile = PROFILE_BOX;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			values[i] = getProfileValue(profile, customWeights, count > 1 ? (i + 0.5) / count : 0.5);
+			valueSum += values[i];
+		}
+		if (!(valueSum > 0.0)) {
+			profile = PROFILE_BOX;
+			values.assign(count, 1.0);
+			valueSum = count;
+		}
+
+		this->weights.assign(samples + 1, 0);
+		this->profile = profile;
+		if (profile == PROFILE_BOX) {
+			std::fill(this->weights.begin() + first, this->weights.end(), 1);
+		} else {
+			// Rounded down first, then the largest remainders get the weight that is left.
+			std::vector<std::pair<double, uint32_t>> remainders;
+			uint32_t left = WEIGHT_SCALE;
+			for (uint32_t i = 0; i < count; i++) {
+				const double weight = values[i] * WEIGHT_SCALE / valueSum;
+				this->weights[first + i] = (uint32_t)weight;
+				left -= this->weights[first + i];
+				remainders.push_back(std::make_pair(weight - std::floor(weight), first + i));
+			}
+			std::stable_sort(remainders.begin(), remainders.end(), [](const std::pair<double, uint32_t>& a, const std::pair<double, uint32_t>& b) {
+				return a.first > b.first;
+			});
+			for (uint32_t i = 0; i < left; i++) {
+				this->weights[remainders[i % remainders.size()].second]++;
+			}
+		}
+
+		this->firstOpen = samples;
+		this->openCount = 0;
+		this->totalWeight = 0;
+		for (uint32_t i = 0; i <= samples; i++) {
+			if (this->isOpen(i)) {
+				this->firstOpen = (std::min)(this->firstOpen, i);
+				this->openCount++;
+			}
+			this->totalWeight += this->weights[i];
+		}
+	}
+
+	LinearLight::LinearLight(uint32_t totalWeight) {
+		// 12 bits are the fewest that still keep every sRGB value apart.
+		const uint32_t minScale = 4095;
+		totalWeight = (std::max)(1u, totalWeight);
+		if ((uint64_t)totalWeight * minScale <= UINT16_MAX) {
+			this->scale = UINT16_MAX / totalWeight;
+			this->tableWeight = totalWeight;
+		} else {
+			this->scale = UINT16_MAX;
+			this->tableWeight = 1;
+		}
+
+		for (uint32_t value = 0; value < 256; value++) {
+			this->toLinear[value] = (uint16_t)std::lround(toLinearLight(value / 255.0) * this->scale);
+			this->toLinearLow[value] = (uint8_t)(this->toLinear[value] & 0xFF);
+			this->toLinearHigh[value] = (uint8_t)(this->toLinear[value] >> 8);
+		}
+
+		const uint32_t steps = 1 << EXTRA_BITS;
+		this->fromLinear.resize((size_t)this->scale * this->tableWeight + 1, (uint16_t)(255 * steps));
+		for (uint32_t value = 0; value < 255; value++) {
+			const uint32_t first = this->toLinear[value] * this->tableWeight;
+			const uint32_t next = this->toLinear[value + 1] * this->tableWeight;
+			for (uint32_t i = first; i < next; i++) {
+				this->fromLinear[i] = (uint16_t)(value * steps + (2 * (i - first) * steps + (next - first)) / (2 * (next - first)));
+			}
+		}
+	}
+
+	// The error of the rounded up reciprocal stays below 1 / count for every sum of count bytes.
+	Reciprocal::Reciprocal(uint32_t count) :
+		count(count),
+		multiplier(count <= MAX_COUNT ? (1u << SHIFT) / count + 1 : 0)
+	{}
+
+	Sum::Sum(size_t length, bool isWide, const Kernels& kernels, std::shared_ptr<const LinearLight> linear) :
+		sum16(isWide ? 0 : length),
+		sum32(isWide ? length : 0),
+		length(length),
+		weight(0),
+		kernels(kernels),
+		linear(std::move(linear))
+	{}
+
+	void Sum::add(const uint8_t* pFrame, uint32_t weight) {
+		if (weight == 0) {
+			return;
+		}
+
+		this->add(pFrame, weight, 0, this->length, this->weight == 0);
+		this->weight += weight;
+	}
+
+	void Sum::add(const uint8_t* pFrame, uint32_t weight, ThreadPool& pool, uint32_t bandCount) {
+		if (weight == 0) {
+			return;
+		}
+
+		const bool isFirst = this->weight == 0;
+		pool.run(bandCount, [&](uint32_t index) {
+			size_t begin, end;
+			getBand(this->length, index, bandCount, begin, end);
+			this->add(pFrame, weight, begin, end, isFirst);
+		});
+		this->weight += weight;
+	}
+
+	void Sum::add(const uint8_t* pFrame, uint32_t weight, size_t begin, size_t end, bool isFirst) {
+		if (this->linear && this->isWide()) {
+			this->kernels.accumulateLinear32(this->sum32.data() + begin, pFrame + begin, end - begin, *this->linear, weight, isFirst);
+		} else if (this->linear) {
+			this->kernels.accumulateLinear16(this->sum16.data() + begin, pFrame + begin, end - begin, *this->linear, weight, isFirst);
+		} else if (this->isWide()) {
+			this->kernels.accumulate32(this->sum32.data() + begin, pFrame + begin, end - begin, weight, isFirst);
+		} else {
+			this->kernels.accumulate16(this->sum16.data() + begin, pFrame + begin, end - begin, weight, isFirst);
+		}
+	}
+
+	void Sum::resolve(uint8_t* pDst) const {
+		if (this->weight == 0) {
+			return;
+		}
+
+		this->resolve(pDst, Reciprocal(this->weight), 0, this->length);
+	}
+
+	void Sum::resolve(uint8_t* pDst, ThreadPool& pool, uint32_t bandCount) const {
+		if (this->weight == 0) {
+			return;
+		}
+
+		Reciprocal reciprocal(this->weight);
+		pool.run(bandCount, [&](uint32_t index) {
+			size_t begin, end;
+			getBand(this->length, index, bandCount, begin, end);
+			this->resolve(pDst, reciprocal, begin, end);
+		});
+	}
+
+	void Sum::resolve(uint8_t* pDst, const Reciprocal& reciprocal, size_t begin, size_t end) const {
+		if (this->linear && this->isWide()) {
+			resolveLinear(this->sum32.data(), begin, end, *this->linear, this->weight, pDst);
+		} else if (this->linear) {
+			resolveLinear(this->sum16.data(), begin, end, *this->linear, this->weight, pDst);
+		} else if (this->isWide()) {
+			this->kernels.resolve32(this->sum32.data() + begin, end - begin, reciprocal, pDst + begin);
+		} else {
+			this->kernels.resolve16(this->sum16.data() + begin, end - begin, reciprocal, pDst + begin);
+		}
+	}
+
+	void Sum::resolveSplit(size_t firstPixel, size_t pixels, int extraBits, uint32_t* pRow) const {
+		if (this->weight == 0) {
+			return;
+		}
+
+		Reciprocal reciprocal(this->weight);
+		if (this->linear && this->isWide()) {
+			resolveSplitLinear(this->sum32.data() + 4 * firstPixel, pixels, *this->linear, this->weight, extraBits, pRow, pRow + pixels);
+		} else if (this->linear) {
+			resolveSplitLinear(this->sum16.data() + 4 * firstPixel, pixels, *this->linear, this->weight, extraBits, pRow, pRow + pixels);
+		} else if (this->isWide()) {
+			this->kernels.resolveSplit32(this->sum32.data() + 4 * firstPixel, pixels, reciprocal, extraBits, pRow, pRow + pixels);
+		} else {
+			this->kernels.resolveSplit16(this->sum16.data() + 4 * firstPixel, pixels, reciprocal, extraBits, pRow, pRow + pixels);
+		}
+	}
+
+	void Sum::convert(const ColorConversion::Converter& converter, int width, int firstRow, int rows, uint8_t* const pDst[3], const int dstStride[3], uint32_t* pSplit) const {
+		const ColorConversion::OutputFormat& format = converter.getFormat();
+		const int extraBits = format.depth - 8;
+		// The two split rows are small enough to stay in the cache between the average and the conversion.
+		for (int y = 0; y < rows; y += 2) {
+			const int pairRows = (std::min)(2, rows - y);
+			for (int i = 0; i < pairRows; i++) {
+				this->resolveSplit((size_t)(firstRow + y + i) * width, width, extraBits, pSplit + 2 * (size_t)i * width);
+			}
+
+			uint8_t* dst[3];
+			dst[0] = pDst[0] + (ptrdiff_t)y * dstStride[0];
+			dst[1] = pDst[1] + (ptrdiff_t)(y >> format.chromaShiftY) * dstStride[1];
+			dst[2] = format.isInterleaved ? NULL : pDst[2] + (ptrdiff_t)(y >> format.chromaShiftY) * dstStride[2];
+			converter.convertSplit(pSplit, 2 * width, width, pairRows, dst, dstStride);
+		}
+	}
+
+	Accumulator::Accumulator() :
+		bandCount(1),
+		length(0),
+		isWideSum(false),
+		kernels(getScalarKernels()),
+		isa(ColorConversion::ISA_SCALAR)
+	{}
+
+	void Accumulator::reset(size_t length, uint32_t maxWeight, ColorConversion::Isa isa, uint32_t threads, bool isLinear) {
+		this->pool.start((std::max)(1u, threads));
+		this->bandCount = this->pool.getThreadCount();
+		this->length = length;
+		this->linear = isLinear ? std::make_shared<LinearLight>(maxWeight) : nullptr;
+		this->isWideSum = isLinear ? this->linear->isWide() : (uint64_t)maxWeight * 255 > UINT16_MAX;
+		this->kernels = selectKernels(isa, this->isa);
+
+		std::lock_guard<std::mutex> lock(this->mxFreeSums);
+		this->freeSums.clear();
+		this->sum = std::make_shared<Sum>(length, this->isWideSum, this->kernels, this->linear);
+	}
+
+	void Accumulator::add(const uint8_t* pFrame, uint32_t weight) {
+		this->sum->add(pFrame, weight, this->pool, this->bandCount);
+	}
+
+	void Accumulator::resolve(uint8_t* pDst) {
+		this->sum->resolve(pDst, this->pool, this->bandCount);
+		this->sum->clear();
+	}
+
+	void Accumulator::stop() {
+		this->pool.stop();
+		this->bandCount = 1;
+	}
+
+	std::shared_ptr<Sum> Accumulator::detach() {
+		std::shared_ptr<Sum> detached = std::move(this->sum);
+		std::lock_guard<std::mutex> lock(this->mxFreeSums);
+		if (!this->freeSums.empty()) {
+			this->sum = std::move(this->freeSums.back());
+			this->freeSums.pop_back();
+		} else {
+			this->sum = std::make_shared<Sum>(this->length, this->isWideSum, this->kernels, this->linear);
+		}
+		return detached;
+	}
+
+	void Accumulator::release(std::shared_ptr<Sum> sum) {
+		if (!sum || (sum->getLength() != this->length) || (sum->isWide() != this->isWideSum) || (sum->getLinearLight() != this->linear.get())) {
+			return;
+		}
+		sum->clear();
+		std::lock_guard<std::mutex> lock(this->mxFreeSums);
+		this->freeSums.push_back(std::move(sum));
+	}
+
+	HalfAccumulator::HalfAccumulator() :
+		width(0),
+		rows(0),
+		weight(0),
+		kernels(getScalarKernels()),
+		isa(ColorConversion::ISA_SCALAR)
+	{}
+
+	void HalfAccumulator::reset(size_t width, size_t rows, ColorConversion::Isa isa) {
+		this->sum.assign(width * rows, 0.0f);
+		this->width = width;
+		this->rows = rows;
+		this->weight = 0;
+		this->kernels = selectKernels(isa, this->isa);
+	}
+
+	void HalfAccumulator::add(const uint16_t* pFrame, size_t rowPitch, uint32_t weight) {
+		if (weight == 0) {
+			return;
+		}
+
+		for (size_t y = 0; y < this->rows; y++) {
+			const uint16_t* pRow = (const uint16_t*)((const uint8_t*)pFrame + y * rowPitch);
+			this->kernels.accumulateHalf(this->sum.data() + y * this->width, pRow, this->width, (float)weight, this->weight == 0);
+		}
+		this->weight += weight;
+	}
+
+	void HalfAccumulator::resolve(uint16_t* pDst) {
+		if (this->weight == 0) {
+			return;
+		}
+
+		this->kernels.resolveHalf(this->sum.data(), this->sum.size(), 1.0f / this->weight, pDst);
+		this->weight = 0;
+	}
+
+	Kernels getScalarKernels() {
+		Kernels kernels = { accumulate16, accumulate32, resolve16, resolve32, resolveSplit16, resolveSplit32, accumulateLinear16, accumulateLinear32, accumulateHalf, resolveHalf };
+		return kernels;
+	}
+}
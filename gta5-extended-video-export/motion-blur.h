@@ -0,0 +1,400 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "color-conversion.h"
+#include "ThreadPool.h"
+
+// Accumulation of the sub-frames that make up a motion blurred frame. Every
+// sub-frame is added with an integer weight that comes from the shutter profile,
+// 1 for all of them with the default box profile. The sum is kept per byte of the
+// captured frames, in 16 bit counters while the total weight can't overflow them
+// and in 32 bit counters beyond that. The average is taken with a fixed point
+// reciprocal of the total weight instead of a division, and rounds down exactly
+// like the integer division it replaces.
+//
+// A finished sum can also be handed to the conversion stage as it is, which
+// averages it row by row into the split layout of ColorConversion::SplitKernel
+// and converts it in the same pass. That way the average never goes through a
+// full 8 bit frame and keeps the bits a 10 bit output has room for.
+//
+// In linear light mode every byte is turned into linear light with a lookup
+// table before it is added, and the average is turned back into sRGB with another
+// one, so that bright parts blend the way light does instead of coming out too
+// dark. See LinearLight for the tables.
+//
+// HalfAccumulator does the same for the half float HDR colours of the OpenEXR
+// output, with float sums.
+//
+// The accumulator can spread every sub-frame over a pool of threads. The counters
+// are split into one band per thread, and a band always goes to the same thread,
+// so the part of the sum a thread works on stays in its cache from one sub-frame
+// to the next.
+//
+// The kernels are picked per instruction set the same way as the colour
+// conversion kernels, using ColorConversion::detectIsa().
+namespace MotionBlur {
+	// How much each sub-frame counts while the shutter is open.
+	enum Profile {
+		PROFILE_BOX,
+		PROFILE_TRIANGLE,
+		PROFILE_GAUSSIAN,
+		PROFILE_CUSTOM,
+	};
+
+	// Which of the samples + 1 sub-frames rendered for every frame go into the blur, and with
+	// which weight. The shutter opens at shutterPosition, a fraction of the frame, and closes
+	// at the end of the frame. The last sub-frame is always read back, it is the one that
+	// flushes the frame. Without motion blur every sub-frame is a frame of its own.
+	//
+	// The box profile gives every open sub-frame a weight of 1. The other profiles are sampled
+	// at the middle of every open sub-frame and rounded to integer weights that add up to
+	// WEIGHT_SCALE, so that a weighted sum costs no more than a plain one. Sub-frames whose
+	// weight rounds to 0 are not read back either. Custom weights are spread evenly over the
+	// open part of the shutter and interpolated linearly in between.
+	class ShutterSchedule {
+	public:
+		// 255 * WEIGHT_SCALE still fits in 16 bits and is exact for Reciprocal.
+		enum { WEIGHT_SCALE = 256 };
+
+		ShutterSchedule();
+
+		// Falls back to the box profile when the custom weights don't add up to anything.
+		void reset(uint32_t samples, float shutterPosition, Profile profile = PROFILE_BOX, const std::vector<float>& customWeights = std::vector<float>());
+
+		uint32_t getWeight(uint64_t subFrame) const {
+			return this->weights[subFrame % this->weights.size()];
+		}
+
+		bool isOpen(uint64_t subFrame) const {
+			return (this->getWeight(subFrame) > 0) || this->isLast(subFrame);
+		}
+
+		// Weight of a sub-frame that stands for the span sub-frames up to and including subFrame,
+		// when adaptive sampling renders fewer of them. span divides the sub-frame count.
+		uint32_t getWeight(uint64_t subFrame, uint32_t span) const {
+			uint32_t weight = 0;
+			for (uint32_t i = 0; i < span; i++) {
+				weight += this->getWeight(subFrame - i);
+			}
+			return weight;
+		}
+
+		bool isOpen(uint64_t subFrame, uint32_t span) const {
+			return (this->getWeight(subFrame, span) > 0) || this->isLast(subFrame);
+		}
+
+		bool isLast(uint64_t subFrame) const {
+			return subFrame % this->weights.size() == this->weights.size() - 1;
+		}
+
+		uint32_t getSubFrameCount() const {
+			return (uint32_t)this->weights.size();
+		}
+
+		// First sub-frame per frame that is read back.
+		uint32_t getFirstOpen() const {
+			return this->firstOpen;
+		}
+
+		// Number of sub-frames per frame that are read back.
+		uint32_t getOpenCount() const {
+			return this->openCount;
+		}
+
+		// Sum of the weights of one frame.
+		uint32_t getTotalWeight() const {
+			return this->totalWeight;
+		}
+
+		Profile getProfile() const {
+			return this->profile;
+		}
+
+	private:
+		std::vector<uint32_t> weights;
+		uint32_t firstOpen;
+		uint32_t openCount;
+		uint32_t totalWeight;
+		Profile profile;
+	};
+
+	// Tables of the linear light mode, built once per session for the total weight of its
+	// frames. Bytes are taken as sRGB and turned into linear values from 0 to getScale(). The
+	// scale is as large as 16 bit sums allow, down to 12 bits, and 16 bits with 32 bit sums
+	// beyond that. The back buffer's alpha isn't used by any output, so it goes through the
+	// same curve as the colours.
+	//
+	// Averages go back through a table indexed by the sum itself when the weight is the one
+	// the tables were built for, and by the sum times a fixed point factor otherwise, so that
+	// no division is needed. Between two sRGB values the
+	// table follows a straight line in linear light, which keeps frames that don't move
+	// exactly as they were captured.
+	class LinearLight {
+	public:
+		// Averages keep 2 more bits than the captured bytes. Indices stay below 2^16, so
+		// sum * factor, about index << FACTOR_SHIFT, fits in 64 bits.
+		enum { EXTRA_BITS = 2, FACTOR_SHIFT = 32 };
+
+		explicit LinearLight(uint32_t totalWeight);
+
+		const uint16_t* getToLinear() const {
+			return this->toLinear;
+		}
+
+		// Low and high bytes of the linear values, for byte permutes.
+		const uint8_t* getToLinearLow() const {
+			return this->toLinearLow;
+		}
+
+		const uint8_t* getToLinearHigh() const {
+			return this->toLinearHigh;
+		}
+
+		uint32_t getScale() const {
+			return this->scale;
+		}
+
+		bool isWide() const {
+			return this->tableWeight == 1;
+		}
+
+		// Factor that turns sums of the given weight into indices of the table, tableWeight /
+		// weight with FACTOR_SHIFT fractional bits. Exactly 1 for the weight of the table.
+		uint64_t getFactor(uint32_t weight) const {
+			return (((uint64_t)this->tableWeight << FACTOR_SHIFT) + weight / 2) / weight;
+		}
+
+		// sRGB value of the average of sum, with extraBits more bits than the captured bytes.
+		// factor comes from getFactor() for the weight of the sum, so that no division is
+		// needed per sum. Indices are at most half an entry off.
+		uint32_t average(uint32_t sum, uint64_t factor, int extraBits) const {
+			const uint32_t index = (uint32_t)((sum * factor + (1ull << (FACTOR_SHIFT - 1))) >> FACTOR_SHIFT);
+			const uint32_t value = this->fromLinear[index < this->fromLinear.size() ? index : this->fromLinear.size() - 1];
+			const int shift = EXTRA_BITS - extraBits;
+			return (value + ((1 << shift) >> 1)) >> shift;
+		}
+
+	private:
+		uint16_t toLinear[256];
+		uint8_t toLinearLow[256];
+		uint8_t toLinearHigh[256];
+		// Entry i holds the average i / tableWeight.
+		std::vector<uint16_t> fromLinear;
+		uint32_t scale;
+		uint32_t tableWeight;
+	};
+
+	// floor(n / count) == (n * multiplier) >> SHIFT for every n up to 255 * count, as long
+	// as count is at most MAX_COUNT. The product stays below 2^32.
+	struct Reciprocal {
+		enum { SHIFT = 24, MAX_COUNT = 256 };
+
+		uint32_t count;
+		uint32_t multiplier;
+
+		explicit Reciprocal(uint32_t count);
+
+		bool isExact() const {
+			return this->count <= MAX_COUNT;
+		}
+	};
+
+	// Adds length bytes of a frame times weight to the sum, or overwrites the sum with them if
+	// isFirst is set.
+	typedef void (*Accumulate16)(uint16_t* pSum, const uint8_t* pFrame, size_t length, uint32_t weight, bool isFirst);
+	typedef void (*Accumulate32)(uint32_t* pSum, const uint8_t* pFrame, size_t length, uint32_t weight, bool isFirst);
+	// Same as Accumulate16 and Accumulate32 with the linear values of the bytes.
+	typedef void (*AccumulateLinear16)(uint16_t* pSum, const uint8_t* pFrame, size_t length, const LinearLight& linear, uint32_t weight, bool isFirst);
+	typedef void (*AccumulateLinear32)(uint32_t* pSum, const uint8_t* pFrame, size_t length, const LinearLight& linear, uint32_t weight, bool isFirst);
+	// Writes the average of length counters to pDst.
+	typedef void (*Resolve16)(const uint16_t* pSum, size_t length, const Reciprocal& reciprocal, uint8_t* pDst);
+	typedef void (*Resolve32)(const uint32_t* pSum, size_t length, const Reciprocal& reciprocal, uint8_t* pDst);
+	// Writes the averages of pixels BGRA counters, with extraBits more bits than the captured
+	// bytes, as pixels values of B | R << 16 to pBR and of G | A << 16 to pGA.
+	typedef void (*ResolveSplit16)(const uint16_t* pSum, size_t pixels, const Reciprocal& reciprocal, int extraBits, uint32_t* pBR, uint32_t* pGA);
+	typedef void (*ResolveSplit32)(const uint32_t* pSum, size_t pixels, const Reciprocal& reciprocal, int extraBits, uint32_t* pBR, uint32_t* pGA);
+
+	// Adds count half floats times weight to the float sum, or overwrites the sum with them if
+	// isFirst is set.
+	typedef void (*AccumulateHalf)(float* pSum, const uint16_t* pHalves, size_t count, float weight, bool isFirst);
+	// Writes count sums times scale as half floats, rounded to the nearest even.
+	typedef void (*ResolveHalf)(const float* pSum, size_t count, float scale, uint16_t* pHalves);
+
+	struct Kernels {
+		Accumulate16 accumulate16;
+		Accumulate32 accumulate32;
+		Resolve16 resolve16;
+		Resolve32 resolve32;
+		ResolveSplit16 resolveSplit16;
+		ResolveSplit32 resolveSplit32;
+		AccumulateLinear16 accumulateLinear16;
+		AccumulateLinear32 accumulateLinear32;
+		AccumulateHalf accumulateHalf;
+		ResolveHalf resolveHalf;
+	};
+
+	// Weighted sum of the sub-frames of one blurred frame.
+	class Sum {
+	public:
+		// Linear light sums are made with a non-null linear.
+		Sum(size_t length, bool isWide, const Kernels& kernels, std::shared_ptr<const LinearLight> linear);
+
+		// Frames with a weight of 0 are left out.
+		void add(const uint8_t* pFrame, uint32_t weight);
+
+		// Same as add(), split into bandCount bands that run as tasks on the pool.
+		void add(const uint8_t* pFrame, uint32_t weight, ThreadPool& pool, uint32_t bandCount);
+
+		// Writes the average of all the bytes. The sum stays as it is.
+		void resolve(uint8_t* pDst) const;
+
+		// Same as resolve(), split into bandCount bands that run as tasks on the pool.
+		void resolve(uint8_t* pDst, ThreadPool& pool, uint32_t bandCount) const;
+
+		// Writes the averages of pixels BGRA pixels starting at firstPixel, extraBits deeper
+		// than the captured bytes, as one row of ColorConversion::SplitKernel. Up to 2 extra
+		// bits are supported. Averages with extra bits are within 1/64 of a step of the exact
+		// ones, without extra bits they are exact.
+		void resolveSplit(size_t firstPixel, size_t pixels, int extraBits, uint32_t* pRow) const;
+
+		// Averages rows firstRow to firstRow + rows - 1 of a picture width pixels wide and
+		// converts them with the split kernel of the converter, two rows at a time, keeping
+		// as many bits as the output format has. pDst holds the planes already offset to
+		// firstRow, which has to be even when the chroma is subsampled vertically. pSplit holds
+		// the two split rows, 4 * width values, and is kept by the caller from frame to frame.
+		void convert(const ColorConversion::Converter& converter, int width, int firstRow, int rows, uint8_t* const pDst[3], const int dstStride[3], uint32_t* pSplit) const;
+
+		// Starts a new sum, the next add() overwrites the counters.
+		void clear() {
+			this->weight = 0;
+		}
+
+		size_t getLength() const {
+			return this->length;
+		}
+
+		// Sum of the weights of the frames added so far.
+		uint32_t getWeight() const {
+			return this->weight;
+		}
+
+		bool isWide() const {
+			return !this->sum32.empty();
+		}
+
+		const LinearLight* getLinearLight() const {
+			return this->linear.get();
+		}
+
+	private:
+		// Works on bytes begin to end - 1.
+		void add(const uint8_t* pFrame, uint32_t weight, size_t begin, size_t end, bool isFirst);
+		void resolve(uint8_t* pDst, const Reciprocal& reciprocal, size_t begin, size_t end) const;
+
+		std::vector<uint16_t> sum16;
+		std::vector<uint32_t> sum32;
+		size_t length;
+		uint32_t weight;
+		Kernels kernels;
+		std::shared_ptr<const LinearLight> linear;
+	};
+
+	class Accumulator {
+	public:
+		Accumulator();
+
+		// Prepares the sum for frames of length bytes, whose weights add up to at most maxWeight
+		// before each resolve() or detach(). Uses the kernels of the given instruction set, or
+		// of the best one below it that has them, on threads threads including the caller.
+		// isLinear averages in linear light.
+		void reset(size_t length, uint32_t maxWeight, ColorConversion::Isa isa, uint32_t threads = 1, bool isLinear = false);
+
+		void add(const uint8_t* pFrame, uint32_t weight = 1);
+
+		// Writes the average of the frames added since the last call and starts a new sum.
+		void resolve(uint8_t* pDst);
+
+		// Hands out the current sum as it is and starts a new one. Sums that are given back
+		// with release() are used again, so that the counters are only allocated for the
+		// first few frames.
+		std::shared_ptr<Sum> detach();
+		void release(std::shared_ptr<Sum> sum);
+
+		uint32_t getWeight() const {
+			return this->sum ? this->sum->getWeight() : 0;
+		}
+
+		bool isWide() const {
+			return this->isWideSum;
+		}
+
+		ColorConversion::Isa getIsa() const {
+			return this->isa;
+		}
+
+		bool isLinear() const {
+			return this->linear != nullptr;
+		}
+
+		uint32_t getThreadCount() {
+			return this->pool.getThreadCount();
+		}
+
+		// Stops the threads, add() and resolve() then run on the calling thread.
+		void stop();
+
+	private:
+		ThreadPool pool;
+		uint32_t bandCount;
+		std::shared_ptr<Sum> sum;
+		std::vector<std::shared_ptr<Sum>> freeSums;
+		std::mutex mxFreeSums;
+		size_t length;
+		bool isWideSum;
+		Kernels kernels;
+		std::shared_ptr<const LinearLight> linear;
+		ColorConversion::Isa isa;
+	};
+
+	// Weighted average of frames of half floats, such as the HDR colours of the OpenEXR output.
+	// The sums are floats, so any total weight works.
+	class HalfAccumulator {
+	public:
+		HalfAccumulator();
+
+		// Prepares the sum for frames of rows rows of width half floats each.
+		void reset(size_t width, size_t rows, ColorConversion::Isa isa);
+
+		// rowPitch is the distance between two rows of the frame in bytes.
+		void add(const uint16_t* pFrame, size_t rowPitch, uint32_t weight = 1);
+
+		// Writes the average of the frames added since the last call as rows of width half
+		// floats and starts a new sum.
+		void resolve(uint16_t* pDst);
+
+		uint32_t getWeight() const {
+			return this->weight;
+		}
+
+		ColorConversion::Isa getIsa() const {
+			return this->isa;
+		}
+
+	private:
+		std::vector<float> sum;
+		size_t width;
+		size_t rows;
+		uint32_t weight;
+		Kernels kernels;
+		ColorConversion::Isa isa;
+	};
+
+	// Kernels of one instruction set. The vector ones return false when the CPU build has none.
+	Kernels getScalarKernels();
+	bool getAVX2Kernels(Kernels& kernels);
+	bool getAVX512Kernels(Kernels& kernels);
+}
@@ -0,0 +1,563 @@
+#include "optical-flow.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+// SSE2 is part of x64, no detection needed.
+#include <emmintrin.h>
+
+namespace OpticalFlow {
+	namespace {
+		// Block matching works on 8x8 blocks of the half and quarter size planes.
+		const int MATCH_SIZE = 8;
+		// Cost of a step of the vector, in sums of absolute differences of a block.
+		const uint32_t LENGTH_PENALTY = 4;
+		// Search around the coarse vector at half size.
+		const int REFINE_RANGE = 2;
+
+		void getBand(uint32_t count, uint32_t index, uint32_t bandCount, uint32_t& begin, uint32_t& end) {
+			begin = (uint32_t)((uint64_t)count * index / bandCount);
+			end = (uint32_t)((uint64_t)count * (index + 1) / bandCount);
+		}
+
+		uint32_t sad8x8(const uint8_t* pFirst, size_t firstPitch, const uint8_t* pSecond, size_t secondPitch) {
+			__m128i sums = _mm_setzero_si128();
+			for (int y = 0; y < MATCH_SIZE; y += 2) {
+				const __m128i first = _mm_unpacklo_epi64(
+					_mm_loadl_epi64((const __m128i*)(pFirst + y * firstPitch)),
+					_mm_loadl_epi64((const __m128i*)(pFirst + (y + 1) * firstPitch)));
+				const __m128i second = _mm_unpacklo_epi64(
+					_mm_loadl_epi64((const __m128i*)(pSecond + y * secondPitch)),
+					_mm_loadl_epi64((const __m128i*)(pSecond + (y + 1) * secondPitch)));
+				sums = _mm_add_epi64(sums, _mm_sad_epu8(first, second));
+			}
+			return (uint32_t)_mm_cvtsi128_si32(sums) + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+		}
+
+		// Displacement of the block at x, y of current to its best match in previous, searched
+		// range steps around center.
+		Vector search(const uint8_t* pCurrent, const uint8_t* pPrevious, uint32_t width, uint32_t height, int x, int y, Vector center, int range) {
+			Vector best = { 0, 0 };
+			uint32_t bestCost = UINT32_MAX;
+			const uint8_t* pBlock = pCurrent + (size_t)y * width + x;
+			for (int dy = center.y - range; dy <= center.y + range; dy++) {
+				if ((y + dy < 0) || (y + dy + MATCH_SIZE > (int)height)) {
+					continue;
+				}
+				for (int dx = center.x - range; dx <= center.x + range; dx++) {
+					if ((x + dx < 0) || (x + dx + MATCH_SIZE > (int)width)) {
+						continue;
+					}
+					const uint32_t cost = sad8x8(pBlock, width, pPrevious + (size_t)(y + dy) * width + x + dx, width) + LENGTH_PENALTY * (std::abs(dx) + std::abs(dy));
+					if (cost < bestCost) {
+						bestCost = cost;
+						best.x = (int16_t)dx;
+						best.y = (int16_t)dy;
+					}
+				}
+			}
+			return best;
+		}
+
+		// Luma (B + 2G + R) / 4 of the 2x2 pixels under each pixel of a half size row.
+		void downsampleRow(const uint8_t* pFirst, const uint8_t* pSecond, uint32_t width, uint8_t* pDst) {
+			const __m128i weights = _mm_setr_epi16(1, 2, 1, 0, 1, 2, 1, 0);
+			const __m128i zero = _mm_setzero_si128();
+			uint32_t x = 0;
+			// 4 half size pixels from 8 pixels of both rows.
+			for (; x + 4 <= width; x += 4) {
+				__m128i sums[4];
+				for (int i = 0; i < 2; i++) {
+					const __m128i first = _mm_loadu_si128((const __m128i*)(pFirst + 8 * x + 16 * i));
+					const __m128i second = _mm_loadu_si128((const __m128i*)(pSecond + 8 * x + 16 * i));
+					const __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(first, zero), _mm_unpacklo_epi8(second, zero));
+					const __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(first, zero), _mm_unpackhi_epi8(second, zero));
+					sums[2 * i] = _mm_madd_epi16(low, weights);
+					sums[2 * i + 1] = _mm_madd_epi16(high, weights);
+				}
+				// Each of sums holds the 4 terms of one half size pixel.
+				const __m128i first = _mm_add_epi32(_mm_unpacklo_epi32(sums[0], sums[1]), _mm_unpackhi_epi32(sums[0], sums[1]));
+				const __m128i second = _mm_add_epi32(_mm_unpacklo_epi32(sums[2], sums[3]), _mm_unpackhi_epi32(sums[2], sums[3]));
+				__m128i luma = _mm_add_epi32(_mm_unpacklo_epi64(first, second), _mm_unpackhi_epi64(first, second));
+				luma = _mm_srli_epi32(_mm_add_epi32(luma, _mm_set1_epi32(8)), 4);
+				luma = _mm_packs_epi32(luma, luma);
+				luma = _mm_packus_epi16(luma, luma);
+				const int bytes = _mm_cvtsi128_si32(luma);
+				std::memcpy(pDst + x, &bytes, 4);
+			}
+			for (; x < width; x++) {
+				uint32_t sum = 0;
+				for (const uint8_t* pRow : { pFirst, pSecond }) {
+					for (int i = 0; i < 2; i++) {
+						const uint8_t* pPixel = pRow + 8 * x + 4 * i;
+						sum += pPixel[0] + 2 * pPixel[1] + pPixel[2];
+					}
+				}
+				pDst[x] = (uint8_t)((sum + 8) >> 4);
+			}
+		}
+
+		// Averages taps rows of 16 pixels at the given offsets from pSrc, all inside the frame.
+		void blurRow(const uint8_t* pSrc, ptrdiff_t rowPitch, const Vector* pOffsets, uint32_t taps, uint8_t* pDst) {
+			const __m128i zero = _mm_setzero_si128();
+			__m128i sums[8];
+			for (int i = 0; i < 8; i++) {
+				sums[i] = zero;
+			}
+			for (uint32_t tap = 0; tap < taps; tap++) {
+				const uint8_t* pTap = pSrc + pOffsets[tap].y * rowPitch + 4 * pOffsets[tap].x;
+				for (int i = 0; i < 4; i++) {
+					const __m128i bytes = _mm_loadu_si128((const __m128i*)(pTap + 16 * i));
+					sums[2 * i] = _mm_add_epi16(sums[2 * i], _mm_unpacklo_epi8(bytes, zero));
+					sums[2 * i + 1] = _mm_add_epi16(sums[2 * i + 1], _mm_unpackhi_epi8(bytes, zero));
+				}
+			}
+			// Exact for up to 16 taps, see the header.
+			const __m128i half = _mm_set1_epi16((int16_t)(taps / 2));
+			const __m128i reciprocal = _mm_set1_epi16((int16_t)((65536 + taps - 1) / taps));
+			for (int i = 0; i < 4; i++) {
+				const __m128i low = _mm_mulhi_epu16(_mm_add_epi16(sums[2 * i], half), reciprocal);
+				const __m128i high = _mm_mulhi_epu16(_mm_add_epi16(sums[2 * i + 1], half), reciprocal);
+				_mm_storeu_si128((__m128i*)(pDst + 16 * i), _mm_packus_epi16(low, high));
+			}
+		}
+
+		// Blends rows of 16 pixels of the previous and the next frame, weights out of 256.
+		void blendRow(const uint8_t* pPrevious, const uint8_t* pNext, uint32_t nextWeight, uint8_t* pDst) {
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i previousWeights = _mm_set1_epi16((int16_t)(256 - nextWeight));
+			const __m128i nextWeights = _mm_set1_epi16((int16_t)nextWeight);
+			const __m128i rounding = _mm_set1_epi16(128);
+			for (int i = 0; i < 4; i++) {
+				const __m128i previous = _mm_loadu_si128((const __m128i*)(pPrevious + 16 * i));
+				const __m128i next = _mm_loadu_si128((const __m128i*)(pNext + 16 * i));
+				// At most 255 * 256 + 128, which fits in unsigned 16 bits.
+				__m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(previous, zero), previousWeights), _mm_mullo_epi16(_mm_unpacklo_epi8(next, zero), nextWeights));
+				__m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(previous, zero), previousWeights), _mm_mullo_epi16(_mm_unpackhi_epi8(next, zero), nextWeights));
+				low = _mm_srli_epi16(_mm_add_epi16(low, rounding), 8);
+				high = _mm_srli_epi16(_mm_add_epi16(high, rounding), 8);
+				_mm_storeu_si128((__m128i*)(pDst + 16 * i), _mm_packus_epi16(low, high));
+			}
+		}
+
+		// Bilinear sample of a BGRA frame at x, y in 1/256 pixels, scaled by 65536. Positions
+		// outside of the frame take its edge.
+		void sampleBilinear(const uint8_t* pFrame, uint32_t width, uint32_t height, int x, int y, uint32_t* pResult) {
+			const int maxX = ((int)width - 1) << 8;
+			const int maxY = ((int)height - 1) << 8;
+			x = (std::min)((std::max)(x, 0), maxX);
+			y = (std::min)((std::max)(y, 0), maxY);
+			const uint32_t fx = x & 255;
+			const uint32_t fy = y & 255;
+			const uint8_t* pTopLeft = pFrame + ((size_t)(y >> 8) * width + (x >> 8)) * 4;
+			const size_t right = x < maxX ? 4 : 0;
+			const size_t below = y < maxY ? (size_t)width * 4 : 0;
+			for (int c = 0; c < 4; c++) {
+				const uint32_t top = pTopLeft[c] * (256 - fx) + pTopLeft[right + c] * fx;
+				const uint32_t bottom = pTopLeft[below + c] * (256 - fx) + pTopLeft[below + right + c] * fx;
+				pResult[c] = top * (256 - fy) + bottom * fy;
+			}
+		}
+
+		int16_t median(int16_t* pValues, size_t count) {
+			std::nth_element(pValues, pValues + count / 2, pValues + count);
+			return pValues[count / 2];
+		}
+
+		// Weight of the next frame at step of factor, out of 256.
+		uint32_t getNextWeight(uint32_t step, uint32_t factor) {
+			return (256 * step + factor / 2) / factor;
+		}
+	}
+
+	MotionEstimator::MotionEstimator() :
+		hasPrevious(false),
+		coarseColumns(0),
+		coarseRows(0),
+		blockColumns(0),
+		blockRows(0),
+		width(0),
+		height(0)
+	{}
+
+	void MotionEstimator::reset(uint32_t width, uint32_t height) {
+		this->width = width;
+		this->height = height;
+		for (Pyramid* pPyramid : { &this->current, &this->previous }) {
+			uint32_t levelWidth = width;
+			uint32_t levelHeight = height;
+			for (Plane& level : pPyramid->levels) {
+				levelWidth /= 2;
+				levelHeight /= 2;
+				level.width = levelWidth;
+				level.height = levelHeight;
+				level.pixels.assign((size_t)levelWidth * levelHeight, 0);
+			}
+		}
+		this->hasPrevious = false;
+		this->coarseColumns = this->current.levels[1].width / MATCH_SIZE;
+		this->coarseRows = this->current.levels[1].height / MATCH_SIZE;
+		this->coarseVectors.assign((size_t)this->coarseColumns * this->coarseRows, Vector());
+		this->blockColumns = width / BLOCK_SIZE;
+		this->blockRows = height / BLOCK_SIZE;
+		this->vectors.assign((size_t)this->blockColumns * this->blockRows, Vector());
+	}
+
+	void MotionEstimator::buildPyramid(const uint8_t* pFrame, Pyramid& pyramid, ThreadPool& pool, uint32_t bandCount) {
+		Plane& half = pyramid.levels[0];
+		Plane& quarter = pyramid.levels[1];
+		const size_t rowPitch = (size_t)this->width * 4;
+		pool.run(bandCount, [&](uint32_t index) {
+			uint32_t begin, end;
+			getBand(half.height, index, bandCount, begin, end);
+			for (uint32_t y = begin; y < end; y++) {
+				downsampleRow(pFrame + 2 * y * rowPitch, pFrame + (2 * y + 1) * rowPitch, half.width, half.pixels.data() + (size_t)y * half.width);
+			}
+		});
+		pool.run(bandCount, [&](uint32_t index) {
+			uint32_t begin, end;
+			getBand(quarter.height, index, bandCount, begin, end);
+			for (uint32_t y = begin; y < end; y++) {
+				const uint8_t* pFirst = half.pixels.data() + (size_t)2 * y * half.width;
+				const uint8_t* pSecond = pFirst + half.width;
+				uint8_t* pDst = quarter.pixels.data() + (size_t)y * quarter.width;
+				for (uint32_t x = 0; x < quarter.width; x++) {
+					pDst[x] = (uint8_t)((pFirst[2 * x] + pFirst[2 * x + 1] + pSecond[2 * x] + pSecond[2 * x + 1] + 2) >> 2);
+				}
+			}
+		});
+	}
+
+	bool MotionEstimator::estimate(const uint8_t* pFrame, ThreadPool& pool, uint32_t bandCount) {
+		this->buildPyramid(pFrame, this->current, pool, bandCount);
+		const bool hasMotion = this->hasPrevious && !this->vectors.empty();
+		if (hasMotion) {
+			const Plane& quarter = this->current.levels[1];
+			pool.run(bandCount, [&](uint32_t index) {
+				uint32_t begin, end;
+				getBand(this->coarseRows, index, bandCount, begin, end);
+				const Vector zero = { 0, 0 };
+				for (uint32_t y = begin; y < end; y++) {
+					for (uint32_t x = 0; x < this->coarseColumns; x++) {
+						this->coarseVectors[(size_t)y * this->coarseColumns + x] = search(quarter.pixels.data(), this->previous.levels[1].pixels.data(), quarter.width, quarter.height,
+							x * MATCH_SIZE, y * MATCH_SIZE, zero, SEARCH_RANGE / 4);
+					}
+				}
+			});
+
+			const Plane& half = this->current.levels[0];
+			pool.run(bandCount, [&](uint32_t index) {
+				uint32_t begin, end;
+				getBand(this->blockRows, index, bandCount, begin, end);
+				for (uint32_t y = begin; y < end; y++) {
+					for (uint32_t x = 0; x < this->blockColumns; x++) {
+						// Blocks of the last odd row or column share the coarse block before them.
+						Vector center = { 0, 0 };
+						int range = 2 * REFINE_RANGE;
+						if ((this->coarseColumns > 0) && (this->coarseRows > 0)) {
+							const Vector& coarse = this->coarseVectors[(size_t)(std::min)(y / 2, this->coarseRows - 1) * this->coarseColumns + (std::min)(x / 2, this->coarseColumns - 1)];
+							center.x = (int16_t)(2 * coarse.x);
+							center.y = (int16_t)(2 * coarse.y);
+							range = REFINE_RANGE;
+						}
+						const Vector displacement = search(half.pixels.data(), this->previous.levels[0].pixels.data(), half.width, half.height,
+							x * MATCH_SIZE, y * MATCH_SIZE, center, range);
+						// The block came from where it matches in the previous frame.
+						Vector& motion = this->vectors[(size_t)y * this->blockColumns + x];
+						motion.x = (int16_t)(-2 * displacement.x);
+						motion.y = (int16_t)(-2 * displacement.y);
+					}
+				}
+			});
+		}
+		std::swap(this->current, this->previous);
+		this->hasPrevious = true;
+		return hasMotion;
+	}
+
+	VectorBlur::VectorBlur() :
+		bandCount(1),
+		width(0),
+		height(0),
+		shutter(0.0f)
+	{}
+
+	void VectorBlur::reset(uint32_t width, uint32_t height, float shutter, uint32_t threads) {
+		this->width = width;
+		this->height = height;
+		this->shutter = (std::min)((std::max)(shutter, 0.0f), 1.0f);
+		this->estimator.reset(width, height);
+		this->pool.start((std::max)(1u, threads));
+		this->bandCount = this->pool.getThreadCount();
+	}
+
+	void VectorBlur::stop() {
+		this->pool.stop();
+	}
+
+	uint32_t VectorBlur::getTaps(Vector motion, float shutter) {
+		const float length = (float)(std::max)(std::abs(motion.x), std::abs(motion.y)) * shutter;
+		return (std::min)((uint32_t)MAX_TAPS, (uint32_t)std::lround(length) + 1);
+	}
+
+	Vector VectorBlur::getTapOffset(Vector motion, float shutter, uint32_t tap, uint32_t taps) {
+		Vector offset = { 0, 0 };
+		if (taps > 1) {
+			// The copies trail the block, back to where it was when the shutter opened.
+			const float position = shutter * tap / (taps - 1);
+			offset.x = (int16_t)-std::lround(motion.x * position);
+			offset.y = (int16_t)-std::lround(motion.y * position);
+		}
+		return offset;
+	}
+
+	void VectorBlur::blur(const uint8_t* pFrame, uint8_t* pDst, uint32_t firstRow, uint32_t endRow) {
+		const ptrdiff_t rowPitch = (ptrdiff_t)this->width * 4;
+		const uint32_t blockColumns = this->estimator.getBlockColumns();
+		const uint32_t blockRows = this->estimator.getBlockRows();
+		Vector offsets[MAX_TAPS];
+		for (uint32_t by = firstRow; by < endRow; by++) {
+			// The last row and column of blocks also take the pixels left over at the edges.
+			const uint32_t top = by * BLOCK_SIZE;
+			const uint32_t bottom = by + 1 == blockRows ? this->height : top + BLOCK_SIZE;
+			for (uint32_t bx = 0; bx < blockColumns; bx++) {
+				const uint32_t left = bx * BLOCK_SIZE;
+				const uint32_t right = bx + 1 == blockColumns ? this->width : left + BLOCK_SIZE;
+				const Vector motion = this->estimator.getVectors()[(size_t)by * blockColumns + bx];
+				const uint32_t taps = getTaps(motion, this->shutter);
+				int minX = 0, maxX = 0, minY = 0, maxY = 0;
+				for (uint32_t tap = 0; tap < taps; tap++) {
+					offsets[tap] = getTapOffset(motion, this->shutter, tap, taps);
+					minX = (std::min)(minX, (int)offsets[tap].x);
+					maxX = (std::max)(maxX, (int)offsets[tap].x);
+					minY = (std::min)(minY, (int)offsets[tap].y);
+					maxY = (std::max)(maxY, (int)offsets[tap].y);
+				}
+				const bool isInside = (right - left == BLOCK_SIZE) && ((int)left + minX >= 0) && ((int)right + maxX <= (int)this->width);
+
+				for (uint32_t y = top; y < bottom; y++) {
+					uint8_t* pRow = pDst + y * rowPitch + 4 * left;
+					const uint8_t* pSrc = pFrame + y * rowPitch + 4 * left;
+					if (taps == 1) {
+						std::memcpy(pRow, pSrc, 4 * (right - left));
+					} else if (isInside && ((int)y + minY >= 0) && ((int)y + maxY < (int)this->height)) {
+						blurRow(pSrc, rowPitch, offsets, taps, pRow);
+					} else {
+						for (uint32_t x = left; x < right; x++) {
+							uint32_t sums[4] = { 0, 0, 0, 0 };
+							for (uint32_t tap = 0; tap < taps; tap++) {
+								const int tapX = (std::min)((std::max)((int)x + offsets[tap].x, 0), (int)this->width - 1);
+								const int tapY = (std::min)((std::max)((int)y + offsets[tap].y, 0), (int)this->height - 1);
+								const uint8_t* pPixel = pFrame + tapY * rowPitch + 4 * tapX;
+								for (int c = 0; c < 4; c++) {
+									sums[c] += pPixel[c];
+								}
+							}
+							for (int c = 0; c < 4; c++) {
+								pRow[4 * (x - left) + c] = (uint8_t)((sums[c] + taps / 2) / taps);
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+
+	void VectorBlur::apply(const uint8_t* pFrame, uint8_t* pDst) {
+		if (!this->estimator.estimate(pFrame, this->pool, this->bandCount)) {
+			std::memcpy(pDst, pFrame, (size_t)this->width * this->height * 4);
+			return;
+		}
+		this->pool.run(this->bandCount, [&](uint32_t index) {
+			uint32_t begin, end;
+			getBand(this->estimator.getBlockRows(), index, this->bandCount, begin, end);
+			this->blur(pFrame, pDst, begin, end);
+		});
+	}
+
+	Interpolator::Interpolator() :
+		bandCount(1),
+		hasPrevious(false),
+		width(0),
+		height(0),
+		factor(1),
+		quality(QUALITY_FAST)
+	{}
+
+	void Interpolator::reset(uint32_t width, uint32_t height, uint32_t factor, Quality quality, uint32_t threads) {
+		this->width = width;
+		this->height = height;
+		this->factor = (std::max)(1u, factor);
+		this->quality = quality;
+		this->estimator.reset(width, height);
+		this->previousFrame.assign((size_t)width * height * 4, 0);
+		this->hasPrevious = false;
+		this->smoothedVectors.assign(this->estimator.getVectors().size(), Vector());
+		this->pool.start((std::max)(1u, threads));
+		this->bandCount = this->pool.getThreadCount();
+	}
+
+	void Interpolator::stop() {
+		this->pool.stop();
+	}
+
+	bool Interpolator::getQuality(const std::string& name, Quality& result) {
+		if (name.empty() || (name == "fast")) {
+			result = QUALITY_FAST;
+			return true;
+		}
+		if (name == "smooth") {
+			result = QUALITY_SMOOTH;
+			return true;
+		}
+		return false;
+	}
+
+	const char* Interpolator::getQualityName(Quality quality) {
+		return quality == QUALITY_SMOOTH ? "smooth" : "fast";
+	}
+
+	void Interpolator::getOffsets(Vector motion, uint32_t step, uint32_t factor, Vector& previousOffset, Vector& nextOffset) {
+		// The block was motion behind where it is in the next frame.
+		previousOffset.x = (int16_t)-std::lround((float)motion.x * step / factor);
+		previousOffset.y = (int16_t)-std::lround((float)motion.y * step / factor);
+		nextOffset.x = (int16_t)(previousOffset.x + motion.x);
+		nextOffset.y = (int16_t)(previousOffset.y + motion.y);
+	}
+
+	void Interpolator::smoothVectors() {
+		const std::vector<Vector>& vectors = this->estimator.getVectors();
+		const int columns = (int)this->estimator.getBlockColumns();
+		const int rows = (int)this->estimator.getBlockRows();
+		this->pool.run(this->bandCount, [&](uint32_t index) {
+			uint32_t begin, end;
+			getBand(rows, index, this->bandCount, begin, end);
+			int16_t xs[9];
+			int16_t ys[9];
+			for (int y = (int)begin; y < (int)end; y++) {
+				for (int x = 0; x < columns; x++) {
+					size_t count = 0;
+					for (int ny = (std::max)(y - 1, 0); ny <= (std::min)(y + 1, rows - 1); ny++) {
+						for (int nx = (std::max)(x - 1, 0); nx <= (std::min)(x + 1, columns - 1); nx++) {
+							xs[count] = vectors[(size_t)ny * columns + nx].x;
+							ys[count] = vectors[(size_t)ny * columns + nx].y;
+							count++;
+						}
+					}
+					Vector& smoothed = this->smoothedVectors[(size_t)y * columns + x];
+					smoothed.x = median(xs, count);
+					smoothed.y = median(ys, count);
+				}
+			}
+		});
+	}
+
+	void Interpolator::interpolateFast(const uint8_t* pNext, uint32_t step, uint8_t* pDst, uint32_t firstRow, uint32_t endRow) {
+		const ptrdiff_t rowPitch = (ptrdiff_t)this->width * 4;
+		const uint32_t blockColumns = this->estimator.getBlockColumns();
+		const uint32_t blockRows = this->estimator.getBlockRows();
+		const uint32_t nextWeight = getNextWeight(step, this->factor);
+		const uint8_t* pPrevious = this->previousFrame.data();
+		for (uint32_t by = firstRow; by < endRow; by++) {
+			// The last row and column of blocks also take the pixels left over at the edges.
+			const uint32_t top = by * BLOCK_SIZE;
+			const uint32_t bottom = by + 1 == blockRows ? this->height : top + BLOCK_SIZE;
+			for (uint32_t bx = 0; bx < blockColumns; bx++) {
+				const uint32_t left = bx * BLOCK_SIZE;
+				const uint32_t right = bx + 1 == blockColumns ? this->width : left + BLOCK_SIZE;
+				Vector previousOffset, nextOffset;
+				getOffsets(this->estimator.getVectors()[(size_t)by * blockColumns + bx], step, this->factor, previousOffset, nextOffset);
+				const int minX = (std::min)(previousOffset.x, nextOffset.x);
+				const int maxX = (std::max)(previousOffset.x, nextOffset.x);
+				const int minY = (std::min)(previousOffset.y, nextOffset.y);
+				const int maxY = (std::max)(previousOffset.y, nextOffset.y);
+				const bool isInside = (right - left == BLOCK_SIZE) && ((int)left + minX >= 0) && ((int)right + maxX <= (int)this->width);
+
+				for (uint32_t y = top; y < bottom; y++) {
+					uint8_t* pRow = pDst + y * rowPitch + 4 * left;
+					if (isInside && ((int)y + minY >= 0) && ((int)y + maxY < (int)this->height)) {
+						blendRow(pPrevious + ((int)y + previousOffset.y) * rowPitch + 4 * ((int)left + previousOffset.x),
+							pNext + ((int)y + nextOffset.y) * rowPitch + 4 * ((int)left + nextOffset.x), nextWeight, pRow);
+						continue;
+					}
+					const int previousY = (std::min)((std::max)((int)y + previousOffset.y, 0), (int)this->height - 1);
+					const int nextY = (std::min)((std::max)((int)y + nextOffset.y, 0), (int)this->height - 1);
+					for (uint32_t x = left; x < right; x++) {
+						const int previousX = (std::min)((std::max)((int)x + previousOffset.x, 0), (int)this->width - 1);
+						const int nextX = (std::min)((std::max)((int)x + nextOffset.x, 0), (int)this->width - 1);
+						const uint8_t* pPreviousPixel = pPrevious + previousY * rowPitch + 4 * previousX;
+						const uint8_t* pNextPixel = pNext + nextY * rowPitch + 4 * nextX;
+						for (int c = 0; c < 4; c++) {
+							pRow[4 * (x - left) + c] = (uint8_t)((pPreviousPixel[c] * (256 - nextWeight) + pNextPixel[c] * nextWeight + 128) >> 8);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	void Interpolator::interpolateSmooth(const uint8_t* pNext, uint32_t step, uint8_t* pDst, uint32_t firstRow, uint32_t endRow) {
+		const uint32_t blockColumns = this->estimator.getBlockColumns();
+		const uint32_t blockRows = this->estimator.getBlockRows();
+		const uint32_t nextWeight = getNextWeight(step, this->factor);
+		// Position of the frame between the two, in 1/256 of the motion.
+		const int position = (int)(256 * step / this->factor);
+		// Vectors belong to the centres of the blocks, in between they are interpolated. Positions
+		// between the centres are in 1/32 of a block, so pixel x is at 2x + 1 - BLOCK_SIZE.
+		const int maxColumn = 32 * ((int)blockColumns - 1);
+		const int maxRow = 32 * ((int)blockRows - 1);
+		for (uint32_t y = firstRow; y < endRow; y++) {
+			const int blockY = (std::min)((std::max)(2 * (int)y + 1 - BLOCK_SIZE, 0), maxRow);
+			const int fy = blockY & 31;
+			const Vector* pTop = this->smoothedVectors.data() + (size_t)(blockY >> 5) * blockColumns;
+			const Vector* pBottom = fy ? pTop + blockColumns : pTop;
+			uint8_t* pRow = pDst + (size_t)y * this->width * 4;
+			for (uint32_t x = 0; x < this->width; x++) {
+				const int blockX = (std::min)((std::max)(2 * (int)x + 1 - BLOCK_SIZE, 0), maxColumn);
+				const int fx = blockX & 31;
+				const int left = blockX >> 5;
+				const int right = fx ? left + 1 : left;
+				// Motion in 1/256 pixels, a quarter of the sum with weights out of 32 * 32.
+				const int motionX = ((pTop[left].x * (32 - fx) + pTop[right].x * fx) * (32 - fy) + (pBottom[left].x * (32 - fx) + pBottom[right].x * fx) * fy) >> 2;
+				const int motionY = ((pTop[left].y * (32 - fx) + pTop[right].y * fx) * (32 - fy) + (pBottom[left].y * (32 - fx) + pBottom[right].y * fx) * fy) >> 2;
+				const int previousX = ((int)x << 8) - ((motionX * position) >> 8);
+				const int previousY = ((int)y << 8) - ((motionY * position) >> 8);
+
+				uint32_t previous[4], next[4];
+				sampleBilinear(this->previousFrame.data(), this->width, this->height, previousX, previousY, previous);
+				sampleBilinear(pNext, this->width, this->height, previousX + motionX, previousY + motionY, next);
+				for (int c = 0; c < 4; c++) {
+					pRow[4 * x + c] = (uint8_t)(((uint64_t)previous[c] * (256 - nextWeight) + (uint64_t)next[c] * nextWeight + (1 << 23)) >> 24);
+				}
+			}
+		}
+	}
+
+	void Interpolator::apply(const uint8_t* pFrame, uint8_t* const* ppFrames) {
+		const size_t length = (size_t)this->width * this->height * 4;
+		if (this->estimator.estimate(pFrame, this->pool, this->bandCount)) {
+			if (this->quality == QUALITY_SMOOTH) {
+				this->smoothVectors();
+			}
+			for (uint32_t step = 1; step < this->factor; step++) {
+				this->pool.run(this->bandCount, [&](uint32_t index) {
+					uint32_t begin, end;
+					if (this->quality == QUALITY_SMOOTH) {
+						getBand(this->height, index, this->bandCount, begin, end);
+						this->interpolateSmooth(pFrame, step, ppFrames[step - 1], begin, end);
+					} else {
+						getBand(this->estimator.getBlockRows(), index, this->bandCount, begin, end);
+						this->interpolateFast(pFrame, step, ppFrames[step - 1], begin, end);
+					}
+				});
+			}
+		} else if (this->hasPrevious) {
+			// Frames too small for a single block don't move.
+			for (uint32_t step = 1; step < this->factor; step++) {
+				std::memcpy(ppFrames[step - 1], this->previousFrame.data(), length);
+			}
+		}
+		std::memcpy(this->previousFrame.data(), pFrame, length);
+		this->hasPrevious = true;
+	}
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "ThreadPool.h"
+
+// Motion between rendered frames, estimated on the CPU, for effects that would
+// otherwise need the game to render more often: motion blur from a single
+// frame, and frames in between two rendered ones.
+//
+// The motion since the previous frame is estimated per block of BLOCK_SIZE
+// pixels by block matching on the luma of a half and a quarter size copy of the
+// frame. A full search at quarter size finds the coarse vectors, and a small
+// search around them at half size refines them, so vectors come out in steps of
+// 2 pixels. Costs are sums of absolute differences on 8x8 blocks plus a penalty
+// for the length of the vector, so that flat areas don't pick up noise.
+//
+// Every step runs in row bands on a thread pool and uses SSE2, which every x64
+// CPU has.
+namespace OpticalFlow {
+	// Motion in pixels.
+	struct Vector {
+		int16_t x;
+		int16_t y;
+	};
+
+	class MotionEstimator {
+	public:
+		enum {
+			BLOCK_SIZE = 16,
+			// Largest motion found between two frames, in pixels.
+			SEARCH_RANGE = 32,
+		};
+
+		MotionEstimator();
+
+		void reset(uint32_t width, uint32_t height);
+
+		// Finds the motion of every block of the BGRA frame pFrame since the frame of the last
+		// call. Returns false for the first frame, which has nothing to be compared with.
+		bool estimate(const uint8_t* pFrame, ThreadPool& pool, uint32_t bandCount);
+
+		// Motion of every block since the previous frame, row by row.
+		const std::vector<Vector>& getVectors() const {
+			return this->vectors;
+		}
+
+		uint32_t getBlockColumns() const {
+			return this->blockColumns;
+		}
+
+		uint32_t getBlockRows() const {
+			return this->blockRows;
+		}
+
+	private:
+		struct Plane {
+			std::vector<uint8_t> pixels;
+			uint32_t width;
+			uint32_t height;
+		};
+
+		struct Pyramid {
+			// Half size, then quarter size.
+			Plane levels[2];
+		};
+
+		void buildPyramid(const uint8_t* pFrame, Pyramid& pyramid, ThreadPool& pool, uint32_t bandCount);
+
+		Pyramid current;
+		Pyramid previous;
+		bool hasPrevious;
+		// Displacements of the quarter size blocks, in quarter size pixels.
+		std::vector<Vector> coarseVectors;
+		uint32_t coarseColumns;
+		uint32_t coarseRows;
+		std::vector<Vector> vectors;
+		uint32_t blockColumns;
+		uint32_t blockRows;
+		uint32_t width;
+		uint32_t height;
+	};
+
+	// Motion blur from a single rendered frame per output frame, as an alternative to
+	// accumulating sub-frames. Every block is averaged from up to MAX_TAPS copies of it,
+	// shifted along the part of its motion vector the shutter is open for. Copies that fall
+	// outside of the frame are clamped to its edge. The sums fit in 16 bits and the average
+	// is rounded with a reciprocal that is exact for up to 16 taps.
+	class VectorBlur {
+	public:
+		enum {
+			BLOCK_SIZE = MotionEstimator::BLOCK_SIZE,
+			MAX_TAPS = 16,
+		};
+
+		VectorBlur();
+
+		// shutter is the part of the frame the shutter is open for, from 0 to 1. It closes at the
+		// end of the frame.
+		void reset(uint32_t width, uint32_t height, float shutter, uint32_t threads = 1);
+
+		// Blurs the BGRA frame pFrame along the motion since the frame of the last call into
+		// pDst. Both are packed rows of 4 * width bytes. The first frame is copied as it is.
+		void apply(const uint8_t* pFrame, uint8_t* pDst);
+
+		const std::vector<Vector>& getVectors() const {
+			return this->estimator.getVectors();
+		}
+
+		uint32_t getBlockColumns() const {
+			return this->estimator.getBlockColumns();
+		}
+
+		uint32_t getBlockRows() const {
+			return this->estimator.getBlockRows();
+		}
+
+		uint32_t getThreadCount() {
+			return this->pool.getThreadCount();
+		}
+
+		// Stops the threads, apply() then runs on the calling thread.
+		void stop();
+
+		// Number of copies a block with the given motion is averaged from, and the shift of
+		// the copy number tap of them.
+		static uint32_t getTaps(Vector motion, float shutter);
+		static Vector getTapOffset(Vector motion, float shutter, uint32_t tap, uint32_t taps);
+
+	private:
+		void blur(const uint8_t* pFrame, uint8_t* pDst, uint32_t firstRow, uint32_t endRow);
+
+		ThreadPool pool;
+		uint32_t bandCount;
+		MotionEstimator estimator;
+		uint32_t width;
+		uint32_t height;
+		float shutter;
+	};
+
+	// Frames in between two rendered ones, so that the game renders only every factor-th
+	// frame of the output. A pixel of the frame at step / factor of the way from the previous
+	// frame to the next one follows the motion vector of its block back into the previous
+	// frame and forward into the next one, and blends both samples by how close the step is
+	// to each of them.
+	class Interpolator {
+	public:
+		enum {
+			BLOCK_SIZE = MotionEstimator::BLOCK_SIZE,
+		};
+
+		enum Quality {
+			// Shifts each block by whole pixels, one vector per block.
+			QUALITY_FAST,
+			// Smooths the vectors with a median over the neighbouring blocks, interpolates them
+			// between the block centres and samples both frames bilinearly. Blocks have no
+			// visible edges, at about eight times the cost.
+			QUALITY_SMOOTH,
+		};
+
+		Interpolator();
+
+		void reset(uint32_t width, uint32_t height, uint32_t factor, Quality quality, uint32_t threads = 1);
+
+		// Set once a frame was added, from then on every frame added has frames before it.
+		bool isReady() const {
+			return this->hasPrevious;
+		}
+
+		// Writes the factor - 1 frames between the frame of the last call and the BGRA frame
+		// pFrame to ppFrames, when there was a last call, and keeps a copy of pFrame for the next
+		// one.
+		void apply(const uint8_t* pFrame, uint8_t* const* ppFrames);
+
+		uint32_t getFactor() const {
+			return this->factor;
+		}
+
+		Quality getQuality() const {
+			return this->quality;
+		}
+
+		// Copy of the frame of the last call.
+		const std::vector<uint8_t>& getLastFrame() const {
+			return this->previousFrame;
+		}
+
+		const std::vector<Vector>& getVectors() const {
+			return this->estimator.getVectors();
+		}
+
+		uint32_t getBlockColumns() const {
+			return this->estimator.getBlockColumns();
+		}
+
+		uint32_t getBlockRows() const {
+			return this->estimator.getBlockRows();
+		}
+
+		uint32_t getThreadCount() {
+			return this->pool.getThreadCount();
+		}
+
+		// Stops the threads, apply() then runs on the calling thread.
+		void stop();
+
+		// "fast" or "smooth".
+		static bool getQuality(const std::string& name, Quality& result);
+		static const char* getQualityName(Quality quality);
+
+		// Shifts of the previous and the next frame for a block with the given motion, at step
+		// of factor. They are rounded so that they are always the motion apart.
+		static void getOffsets(Vector motion, uint32_t step, uint32_t factor, Vector& previousOffset, Vector& nextOffset);
+
+	private:
+		void interpolateFast(const uint8_t* pNext, uint32_t step, uint8_t* pDst, uint32_t firstRow, uint32_t endRow);
+		void interpolateSmooth(const uint8_t* pNext, uint32_t step, uint8_t* pDst, uint32_t firstRow, uint32_t endRow);
+		void smoothVectors();
+
+		ThreadPool pool;
+		uint32_t bandCount;
+		MotionEstimator estimator;
+		std::vector<uint8_t> previousFrame;
+		bool hasPrevious;
+		// Median of the vectors of each block and its neighbours, for QUALITY_SMOOTH.
+		std::vector<Vector> smoothedVectors;
+		uint32_t width;
+		uint32_t height;
+		uint32_t factor;
+		Quality quality;
+	};
+}
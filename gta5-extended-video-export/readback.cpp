@@ -0,0 +1,44 @@
+#include "readback.h"
+
+namespace Readback {
+	Ring::Ring() :
+		latency(0),
+		issued(0),
+		completed(0)
+	{}
+
+	void Ring::reset(uint32_t latency) {
+		this->latency = latency;
+		this->issued = 0;
+		this->completed = 0;
+	}
+
+	bool Ring::issue(Device& device) {
+		// A failed copy leaves its slot free for the next frame.
+		if (!device.copy(this->issued % this->getSlotCount())) {
+			return false;
+		}
+		this->issued++;
+
+		bool isRead = true;
+		while ((this->getPendingCount() > this->latency) || ((this->getPendingCount() > 0) && device.isReady(this->completed % this->getSlotCount()))) {
+			isRead = this->readOldest(device) && isRead;
+		}
+		return isRead;
+	}
+
+	bool Ring::flush(Device& device) {
+		bool isRead = true;
+		while (this->getPendingCount() > 0) {
+			isRead = this->readOldest(device) && isRead;
+		}
+		return isRead;
+	}
+
+	bool Ring::readOldest(Device& device) {
+		// The frame is gone even when it couldn't be read, so its slot is free again.
+		const uint32_t slot = this->completed % this->getSlotCount();
+		this->completed++;
+		return device.read(slot);
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+
+// Reading captured frames back from the GPU without waiting for it. A frame is
+// copied into one of the staging slots of a device and mapped once the device
+// tells that the GPU has finished the copy, or at the latest once latency more
+// frames were issued. Mapping a slot right after copying into it makes the CPU
+// wait for the GPU to catch up on every frame.
+//
+// Ring only schedules the slots, the device does the copies and the reads, so
+// the scheduling can be tested with a device that runs on the CPU.
+namespace Readback {
+	// Staging slots that frames are copied into and read back from.
+	class Device {
+	public:
+		virtual ~Device() {}
+
+		// Queues a copy of the current frame into slot.
+		virtual bool copy(uint32_t slot) = 0;
+
+		// Whether the copy into slot is done, so that reading it doesn't wait.
+		virtual bool isReady(uint32_t slot) = 0;
+
+		// Maps slot, hands its frame on and unmaps it.
+		virtual bool read(uint32_t slot) = 0;
+	};
+
+	// Hands out the slots of a device in turn. The ring uses latency + 1 slots: a frame is
+	// read at the latest right after the one latency frames later was copied, which frees its
+	// slot for the next frame. Frames are always read in the order they were copied.
+	class Ring {
+	public:
+		Ring();
+
+		void reset(uint32_t latency);
+
+		// Copies the current frame into the next slot, then reads the oldest frames that are
+		// ready or have waited for latency frames. False when the device failed.
+		bool issue(Device& device);
+
+		// Reads the frames left, oldest first, at the end of a recording.
+		bool flush(Device& device);
+
+		uint32_t getLatency() const {
+			return this->latency;
+		}
+
+		uint32_t getSlotCount() const {
+			return this->latency + 1;
+		}
+
+		// Frames copied but not read yet.
+		uint32_t getPendingCount() const {
+			return (uint32_t)(this->issued - this->completed);
+		}
+
+	private:
+		bool readOldest(Device& device);
+
+		uint32_t latency;
+		uint64_t issued;
+		uint64_t completed;
+	};
+}
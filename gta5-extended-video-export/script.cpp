@@ -119,8 +119,6 @@ namespace {
 		float far_clip = 0;
 		float near_clip = 0;
 
-		std::shared_ptr<DirectX::ScratchImage> capturedImage = std::make_shared<DirectX::ScratchImage>();
-
 		UINT pts = 0;
 
 		ComPtr<IMFMediaType> videoMediaType;
@@ -475,74 +473,30 @@ static void Hook_OMSetRenderTargets(
 
 			// Time to capture rendered frame
 			try {
-				ComPtr<ID3D11Device> pDevice;
-				pThis->GetDevice(pDevice.GetAddressOf());
-
-				ComPtr<ID3D11Texture2D> pDepthBufferCopy = nullptr;
-				ComPtr<ID3D11Texture2D> pBackBufferCopy = nullptr;
-				ComPtr<ID3D11Texture2D> pStencilBufferCopy = nullptr;
-
-				if (config::export_openexr) {
-					{
-						D3D11_TEXTURE2D_DESC desc;
-						pLinearDepthTexture->GetDesc(&desc);
-
-						desc.CPUAccessFlags = D3D11_CPU_ACCESS_FLAG::D3D11_CPU_ACCESS_READ;
-						desc.BindFlags = 0;
-						desc.MiscFlags = 0;
-						desc.Usage = D3D11_USAGE::D3D11_USAGE_STAGING;
-
-						REQUIRE(pDevice->CreateTexture2D(&desc, NULL, pDepthBufferCopy.GetAddressOf()), "Failed to create depth buffer copy texture");
-
-						pThis->CopyResource(pDepthBufferCopy.Get(), pLinearDepthTexture.Get());
-					}
-					{
-						D3D11_TEXTURE2D_DESC desc;
-						pGameBackBufferResolved->GetDesc(&desc);
-						desc.CPUAccessFlags = D3D11_CPU_ACCESS_FLAG::D3D11_CPU_ACCESS_READ;
-						desc.BindFlags = 0;
-						desc.MiscFlags = 0;
-						desc.Usage = D3D11_USAGE::D3D11_USAGE_STAGING;
-
-						REQUIRE(pDevice->CreateTexture2D(&desc, NULL, pBackBufferCopy.GetAddressOf()), "Failed to create back buffer copy texture");
-
-						pThis->CopyResource(pBackBufferCopy.Get(), pGameBackBufferResolved.Get());
-					}
-					{
-						D3D11_TEXTURE2D_DESC desc;
-						pStencilTexture->GetDesc(&desc);
-						desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
-						desc.BindFlags = 0;
-						desc.MiscFlags = 0;
-						desc.Usage = D3D11_USAGE::D3D11_USAGE_STAGING;
-
-						REQUIRE(pDevice->CreateTexture2D(&desc, NULL, pStencilBufferCopy.GetAddressOf()), "Failed to create stencil buffer copy");
-
-						//pThis->ResolveSubresource(pStencilBufferCopy.Get(), 0, pGameDepthBuffer.Get(), 0, DXGI_FORMAT::DXGI_FORMAT_R32G8X24_TYPELESS);
-						pThis->CopyResource(pStencilBufferCopy.Get(), pGameEdgeCopy.Get());
-					}
-					session->enqueueEXRImage(pThis, pBackBufferCopy, pDepthBufferCopy, pStencilBufferCopy);
+				// With motion blur, only the parts of the sub-frames that end up in the OpenEXR output are copied.
+				// The session copies them into staging textures of its own and reads them back a few frames later.
+				const bool isEXRDepthNeeded = config::export_openexr && session->isEXRDepthNeeded();
+				const bool isEXRColorNeeded = config::export_openexr && session->isEXRColorNeeded();
+				if (isEXRDepthNeeded || isEXRColorNeeded) {
+					REQUIRE(session->enqueueEXRImage(pThis,
+						isEXRColorNeeded ? pGameBackBufferResolved : nullptr,
+						isEXRDepthNeeded ? pLinearDepthTexture : nullptr,
+						isEXRDepthNeeded ? pGameEdgeCopy : nullptr), "Failed to enqueue OpenEXR image");
 				}
 				LOG_CALL(LL_DBG, ::exportContext->pSwapChain->Present(0, DXGI_PRESENT_TEST)); // IMPORTANT: This call makes ENB and ReShade effects to be applied to the render target
 
-				ComPtr<ID3D11Texture2D> pSwapChainBuffer;
-				REQUIRE(::exportContext->pSwapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (void**)pSwapChainBuffer.GetAddressOf()), "Failed to get swap chain's buffer");
-								
-				auto& image_ref = *(::exportContext->capturedImage);
-				LOG_CALL(LL_DBG, DirectX::CaptureTexture(::exportContext->pDevice.Get(), ::exportContext->pDeviceContext.Get(), pSwapChainBuffer.Get(), image_ref));
-				if (::exportContext->capturedImage->GetImageCount() == 0) {
-					LOG(LL_ERR, "There is no image to capture.");
-					throw std::exception();
-				}
-				const DirectX::Image* image = ::exportContext->capturedImage->GetImage(0, 0, 0);
-				NOT_NULL(image, "Could not get current frame.");
-				NOT_NULL(image->pixels, "Could not get current frame.");
+				// Sub-frames before the shutter opens don't go into the video, so they are not read back at all.
+				if (!session->isVideoFrameNeeded()) {
+					session->skipVideoFrame();
+				} else {
+					ComPtr<ID3D11Texture2D> pSwapChainBuffer;
+					REQUIRE(::exportContext->pSwapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (void**)pSwapChainBuffer.GetAddressOf()), "Failed to get swap chain's buffer");
 
-				REQUIRE(session->enqueueVideoFrame(image->pixels, (int)(image->width * image->height * 4)), "Failed to enqueue frame");
-				::exportContext->capturedImage->Release();
+					// Read back a few frames later, once the GPU is done with the copy.
+					REQUIRE(session->enqueueVideoTexture(::exportContext->pDeviceContext, pSwapChainBuffer), "Failed to enqueue frame");
+				}
 			} catch (std::exception&) {
 				LOG(LL_ERR, "Reading video frame from D3D Device failed.");
-				::exportContext->capturedImage->Release();
 				LOG_CALL(LL_DBG, session.reset());
 				LOG_CALL(LL_DBG, ::exportContext.reset());
 			}
@@ -667,6 +621,24 @@ static HRESULT IMFSinkWriter_SetInputMediaType(
 
 				LOG(LL_NFO, "Output file: ", filename);
 
+				Encoder::VideoOptions videoOptions;
+				videoOptions.motionBlurSamples = config::motion_blur_samples;
+				videoOptions.shutterPosition = 1 - config::motion_blur_strength;
+				videoOptions.shutterProfile = config::motion_blur_shutter;
+				videoOptions.shutterWeights = config::motion_blur_weights;
+				videoOptions.isMotionBlurLinear = config::motion_blur_linear_light;
+				videoOptions.isMotionBlurFlow = config::motion_blur_optical_flow;
+				videoOptions.interpolationFactor = config::interpolation_factor;
+				videoOptions.interpolationQuality = config::interpolation_quality;
+				videoOptions.adaptiveThreshold = config::motion_blur_adaptive_threshold;
+				videoOptions.adaptiveMinSamples = config::motion_blur_min_samples;
+				videoOptions.exrDepthSubFrame = config::openexr_depth_sub_frame;
+				videoOptions.threadBudget = ThreadBudget::split(config::export_threads, config::export_reserved_cores, config::video_conversion_threads, config::export_openexr, (config::motion_blur_samples > 0) || config::motion_blur_optical_flow || (config::interpolation_factor > 1));
+				videoOptions.outputWidth = config::video_output_width;
+				videoOptions.outputHeight = config::video_output_height;
+				videoOptions.scaler = config::video_scaler;
+				videoOptions.isGpuConversion = config::video_gpu_conversion;
+
 				REQUIRE(session->createContext(config::container_format,
 					filename.c_str(),
 					exrOutputPath,
@@ -676,11 +648,10 @@ static HRESULT IMFSinkWriter_SetInputMediaType(
 					"bgra",
 					fps_num,
 					fps_den,
-					config::motion_blur_samples,
-					1 - config::motion_blur_strength,
 					config::video_fmt,
 					config::video_enc,
 					config::video_cfg, 
+					videoOptions,
 					numChannels, 
 					sampleRate, 
 					bitsPerSample,
@@ -860,6 +831,10 @@ static HANDLE Detour_CreateThread(void* pFunc, void* pParams, int32_t r8d, int32
 static float Detour_GetRenderTimeBase(int64_t choice) {
 	std::pair<int32_t, int32_t> fps = config::fps;
 	float result = 1000.0f * (float)fps.second / ((float)fps.first * ((float)config::motion_blur_samples + 1));
+	// With adaptive sampling, a rendered sub-frame may stand for several sub-frames of the
+	// shutter. The span only changes once the last sub-frame of a frame was captured. With
+	// interpolation, a rendered frame stands for several frames of the output.
+	result *= Encoder::Session::renderTimeScale;
 	//float result = 1000.0f / 60.0f;
 	LOG(LL_NFO, "Time step: ", result);
 	return result;